@@ -0,0 +1,118 @@
+#ifndef ns_packet_heap_h
+#define ns_packet_heap_h
+
+/*
+ * Packets ordered by hdr_ip::prio(), smaller values first (copy it next to
+ * the schedulers). Packets of the same priority leave in the order they
+ * arrived. It is a binary heap keyed by (priority, arrival number), so Push
+ * and Pop are O(log n) and Head is O(1).
+ */
+
+#include <string.h>
+#include "packet.h"
+#include "ip.h"
+
+/* Initial number of packets a heap can hold. It doubles when it is full */
+#define PACKET_HEAP_INIT_SIZE 64
+
+class PacketHeap
+{
+	public:
+		PacketHeap(): entries_(NULL), size_(0), len_(0), bytes_(0), arrivals_(0) {}
+		~PacketHeap() { delete[] entries_; }
+
+		int length() const { return len_; }
+		int byteLength() const { return bytes_; }
+
+		/* Packet with the smallest priority, NULL if empty */
+		Packet *head() const { return (len_ > 0) ? entries_[0].pkt : NULL; }
+
+		void Push(Packet *p)
+		{
+			if (len_ == size_)
+				Grow();
+
+			int i = len_++;
+			entries_[i].pkt = p;
+			entries_[i].prio = hdr_ip::access(p)->prio();
+			entries_[i].arrival = arrivals_++;
+			bytes_ += hdr_cmn::access(p)->size();
+			SiftUp(i);
+		}
+
+		/* Remove and return the packet with the smallest priority, NULL if empty */
+		Packet *Pop()
+		{
+			if (len_ == 0)
+				return NULL;
+
+			Packet *p = entries_[0].pkt;
+			bytes_ -= hdr_cmn::access(p)->size();
+			entries_[0] = entries_[--len_];
+			if (len_ > 0)
+				SiftDown(0);
+			return p;
+		}
+
+	protected:
+		struct Entry
+		{
+			Packet *pkt;
+			int prio;	//hdr_ip::prio() of pkt
+			unsigned long long arrival;	//arrival number of pkt
+		};
+
+		static bool Before(const Entry &a, const Entry &b)
+		{
+			return a.prio < b.prio || (a.prio == b.prio && a.arrival < b.arrival);
+		}
+
+		void Grow()
+		{
+			int size = (size_ > 0) ? 2 * size_ : PACKET_HEAP_INIT_SIZE;
+			Entry *entries = new Entry[size];
+
+			if (len_ > 0)
+				memcpy(entries, entries_, len_ * sizeof(Entry));
+			delete[] entries_;
+			entries_ = entries;
+			size_ = size;
+		}
+
+		void SiftUp(int i)
+		{
+			Entry e = entries_[i];
+
+			while (i > 0 && Before(e, entries_[(i - 1) / 2]))
+			{
+				entries_[i] = entries_[(i - 1) / 2];
+				i = (i - 1) / 2;
+			}
+			entries_[i] = e;
+		}
+
+		void SiftDown(int i)
+		{
+			Entry e = entries_[i];
+
+			while (2 * i + 1 < len_)
+			{
+				int c = 2 * i + 1;
+				if (c + 1 < len_ && Before(entries_[c + 1], entries_[c]))
+					c++;
+				if (!Before(entries_[c], e))
+					break;
+				entries_[i] = entries_[c];
+				i = c;
+			}
+			entries_[i] = e;
+		}
+
+		Entry *entries_;	//binary min-heap
+		int size_;	//number of entries allocated
+		int len_;	//number of packets
+		int bytes_;	//total size of packets in bytes
+		unsigned long long arrivals_;	//arrival number of the next packet
+};
+
+#endif
@@ -0,0 +1,201 @@
+#ifndef ns_qlen_trace_h
+#define ns_qlen_trace_h
+
+/*
+ * Binary queue length trace shared by the schedulers (copy it next to them).
+ *
+ * A trace file starts with a 16-byte header (8-byte magic, version, record size)
+ * followed by fixed-size records in host byte order. A record is written for a
+ * queue only when its length or mark count changed since its last record, so a
+ * reader gets the full state by carrying the last value of each queue forward.
+ * Records go through a large in-memory buffer which is written to the Tcl
+ * channel when it fills up, every QLEN_TRACE_FLUSH_INTERVAL of simulation time
+ * and when the channel is closed.
+ *
+ * With a sampling interval (in us), queues are only recorded at the first event
+ * of every interval. Use qlen_trace.py to convert a trace to CSV.
+ */
+
+#include <string.h>
+#include <math.h>
+#include <tcl.h>
+
+#define QLEN_TRACE_MAGIC "MQECNQLT"
+#define QLEN_TRACE_VERSION 1
+/* Maximum number of queues of a scheduler (strict priority queues included) */
+#define QLEN_TRACE_MAX_QUEUES 128
+/* Queue id of the records for the whole port */
+#define QLEN_TRACE_TOTAL -1
+/* Size of the in-memory buffer */
+#define QLEN_TRACE_BUFFER_BYTES (1 << 20)
+/* Simulation time (s) between two writes of the buffer to the channel */
+#define QLEN_TRACE_FLUSH_INTERVAL 0.01
+
+struct qlen_trace_record
+{
+	double time;	//simulation time (s)
+	int queue;	//queue id, QLEN_TRACE_TOTAL for the whole port
+	int bytes;	//queue length in bytes
+	unsigned int marks;	//packets marked by this queue so far
+	int reserved;
+};
+
+class QlenTrace
+{
+	public:
+		QlenTrace(): chan_(NULL), buf_(NULL), len_(0), interval_(0), next_sample_(0), next_flush_(0)
+		{
+			memset(marks_, 0, sizeof(marks_));
+			memset(last_marks_, 0, sizeof(last_marks_));
+		}
+
+		~QlenTrace()
+		{
+			if (chan_)
+			{
+				Tcl_DeleteCloseHandler(chan_, closed, this);
+				flush();
+			}
+			delete [] buf_;
+		}
+
+		/* Start tracing to the Tcl channel id. Return TCL_OK or TCL_ERROR */
+		int attach(Tcl_Interp *interp, const char *id, double interval_us)
+		{
+			int mode;
+			char header[16];
+			unsigned int version = QLEN_TRACE_VERSION;
+			unsigned int size = sizeof(struct qlen_trace_record);
+
+			if (chan_)
+				return TCL_ERROR;
+
+			chan_ = Tcl_GetChannel(interp, (char*)id, &mode);
+			if (chan_ == 0 || !(mode & TCL_WRITABLE))
+			{
+				chan_ = NULL;
+				return TCL_ERROR;
+			}
+
+			if (Tcl_SetChannelOption(interp, chan_, "-translation", "binary") != TCL_OK)
+			{
+				chan_ = NULL;
+				return TCL_ERROR;
+			}
+
+			if (!buf_)
+				buf_ = new char[QLEN_TRACE_BUFFER_BYTES];
+			len_ = 0;
+			interval_ = (interval_us > 0) ? interval_us / 1000000 : 0;
+			next_sample_ = 0;
+			next_flush_ = 0;
+			for (int i = 0; i < QLEN_TRACE_MAX_QUEUES + 1; i++)
+				last_bytes_[i] = -1;
+
+			memcpy(header, QLEN_TRACE_MAGIC, 8);
+			memcpy(header + 8, &version, 4);
+			memcpy(header + 12, &size, 4);
+			append(header, sizeof(header));
+
+			Tcl_CreateCloseHandler(chan_, closed, this);
+			return TCL_OK;
+		}
+
+		bool enabled() const { return chan_ != NULL; }
+
+		/* Whether queues are sampled every interval rather than recorded when they change */
+		bool sampled() const { return interval_ > 0; }
+
+		/* Count a packet marked by queue q */
+		void mark(int q)
+		{
+			if (q >= 0 && q < QLEN_TRACE_MAX_QUEUES)
+				marks_[q + 1]++;
+			marks_[0]++;
+		}
+
+		/* Whether queues should be recorded at now */
+		bool due(double now)
+		{
+			if (!chan_)
+				return false;
+
+			/* A run that never closes the channel still gets its records up to the last period */
+			if (now >= next_flush_)
+			{
+				if (next_flush_ > 0)
+				{
+					flush();
+					(void)Tcl_Flush(chan_);
+				}
+				next_flush_ = (floor(now / QLEN_TRACE_FLUSH_INTERVAL) + 1) * QLEN_TRACE_FLUSH_INTERVAL;
+			}
+
+			if (interval_ <= 0)
+				return true;
+			if (now < next_sample_)
+				return false;
+
+			next_sample_ = (floor(now / interval_) + 1) * interval_;
+			return true;
+		}
+
+		/* Record queue q (or QLEN_TRACE_TOTAL) if it changed since its last record */
+		void record(double now, int q, int bytes)
+		{
+			struct qlen_trace_record r;
+			int i = q + 1;
+
+			if (!chan_ || i < 0 || i > QLEN_TRACE_MAX_QUEUES)
+				return;
+			if (bytes == last_bytes_[i] && marks_[i] == last_marks_[i])
+				return;
+
+			last_bytes_[i] = bytes;
+			last_marks_[i] = marks_[i];
+			r.time = now;
+			r.queue = q;
+			r.bytes = bytes;
+			r.marks = marks_[i];
+			r.reserved = 0;
+			append((const char*)&r, sizeof(r));
+		}
+
+		/* Write buffered records to the channel */
+		void flush()
+		{
+			if (chan_ && len_ > 0)
+				(void)Tcl_Write(chan_, buf_, len_);
+			len_ = 0;
+		}
+
+	private:
+		void append(const char *data, int n)
+		{
+			if (len_ + n > QLEN_TRACE_BUFFER_BYTES)
+				flush();
+			memcpy(buf_ + len_, data, n);
+			len_ += n;
+		}
+
+		/* The script closes the trace file: write what is left first */
+		static void closed(ClientData cd)
+		{
+			QlenTrace *t = (QlenTrace*)cd;
+
+			t->flush();
+			t->chan_ = NULL;
+		}
+
+		Tcl_Channel chan_;	//channel of the trace file
+		char *buf_;	//buffered records
+		int len_;	//bytes in buf_
+		double interval_;	//sampling interval (s), 0 to record every event
+		double next_sample_;	//time of the next sample
+		double next_flush_;	//time of the next write of buf_ to the channel
+		unsigned int marks_[QLEN_TRACE_MAX_QUEUES + 1];	//marks of each queue, index 0 for the port
+		unsigned int last_marks_[QLEN_TRACE_MAX_QUEUES + 1];	//marks in the last record of each queue
+		int last_bytes_[QLEN_TRACE_MAX_QUEUES + 1];	//length in the last record of each queue
+};
+
+#endif
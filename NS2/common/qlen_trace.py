@@ -0,0 +1,70 @@
+import sys
+import struct
+import argparse
+
+#Convert a binary qlen trace (attach-qlen-trace, see qlen-trace.h) to CSV
+
+MAGIC = b'MQECNQLT'
+
+#Yield (time, queue, bytes, marks) records of a trace file
+def records(f):
+	header = f.read(16)
+	if len(header) < 16 or header[0:8] != MAGIC:
+		sys.stderr.write('not a qlen trace file\n')
+		sys.exit(1)
+
+	#Records are in host byte order. Detect it from the version field
+	order = '<'
+	(version, size) = struct.unpack(order + 'II', header[8:16])
+	if version != 1:
+		order = '>'
+		(version, size) = struct.unpack(order + 'II', header[8:16])
+	if version != 1 or size < 24:
+		sys.stderr.write('unsupported qlen trace version\n')
+		sys.exit(1)
+
+	fmt = order + 'diiI'
+	while True:
+		buf = f.read(size)
+		if len(buf) < size:
+			break
+		yield struct.unpack(fmt, buf[0:20])
+
+parser = argparse.ArgumentParser()
+parser.add_argument("input", help="binary qlen trace file")
+parser.add_argument("-o", "--output", help="CSV file (default: stdout)")
+parser.add_argument("-w", "--wide", help="one row per time with the length of every queue and of the port, like attach-queue", action="store_true")
+parser.add_argument("-q", "--queue", help="only print records of this queue (-1 for the port)", type=int)
+args = parser.parse_args()
+
+f = open(args.input, 'rb')
+out = sys.stdout
+if args.output:
+	out = open(args.output, 'w')
+
+if not args.wide:
+	out.write('time,queue,bytes,marks\n')
+	for (t, q, b, m) in records(f):
+		if args.queue is None or q == args.queue:
+			out.write('%.9f,%d,%d,%d\n' % (t, q, b, m))
+else:
+	#First pass for the number of queues, then carry the last length of each queue forward
+	n = 0
+	for (t, q, b, m) in records(f):
+		n = max(n, q + 1)
+	f.seek(0)
+
+	out.write('time,' + ','.join(['q%d' % i for i in range(n)]) + ',total\n')
+	qlen = [0] * (n + 1)
+	last = None
+	for (t, q, b, m) in records(f):
+		if last is not None and t != last:
+			out.write('%.9f,%s\n' % (last, ','.join([str(x) for x in qlen[1:]] + [str(qlen[0])])))
+		qlen[q + 1] = b
+		last = t
+	if last is not None:
+		out.write('%.9f,%s\n' % (last, ','.join([str(x) for x in qlen[1:]] + [str(qlen[0])])))
+
+f.close()
+if args.output:
+	out.close()
@@ -0,0 +1,417 @@
+#ifndef ns_sched_core_h
+#define ns_sched_core_h
+
+/*
+ * Code shared by the schedulers (DWRR, WFQ, WRR, Priority, PRIO_DWRR, PRIO_WFQ
+ * and SchedTree). Copy it next to them together with qlen-trace.h.
+ *
+ * SchedCore<S> is instantiated for a scheduler class S. The ECN marking
+ * policies, the PIE-like departure rate estimator, dequeue latency marking and
+ * queue length tracing are static members that work on any S that provides:
+ *
+ *   SchedQueue *GetQueue(int q);	queue q (0 <= q < QueueNum())
+ *   int QueueNum();	number of queues, in trace order
+ *   int QueueByteLength(int q);	length of queue q in bytes, as traced
+ *   int TotalByteLength();	total length of all queues in bytes
+ *
+ * and the members mean_pktsize_, port_thresh_, marking_scheme_, dq_thresh_,
+ * estimate_rate_alpha_, link_capacity_, debug_, total_qlen_tchan_, qlen_tchan_,
+ * qlen_trace_ and thresh_epoch_. S declares SchedCore<S> as a friend.
+ *
+ * A marking policy is a function selected once for the value of
+ * marking_scheme_, not a branch taken for every packet. MQ-ECN marking is a
+ * template on the service share of a queue, so each scheduler only provides the
+ * share its discipline can estimate (quantum or weight over the estimated sum of
+ * active ones, or quantum over round time). Per-queue and MQ-ECN thresholds are
+ * kept in bytes and computed again only after thresh_epoch_ changed, so marking
+ * a packet is an integer compare. Schedulers with strict priority
+ * queues in front (prio_queue_num_ of them) combine two policies with
+ * PrioTierMarking.
+ *
+ * PeriodicEstimate replaces the timers that sampled the sum of quantums or
+ * weights of active queues (estimate_*_enable_timer_).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include "queue.h"
+#include "flags.h"
+#include "qlen-trace.h"
+
+/* Per-queue ECN marking */
+#define PER_QUEUE_MARKING 0
+/* Per-port ECN marking */
+#define PER_PORT_MARKING 1
+/* MQ-ECN for any packet scheduling algorithms */
+#define MQ_MARKING_GENER 2
+/* MQ-ECN for round robin packet scheduling algorithms */
+#define MQ_MARKING_RR 3
+/* Dequeue latency-based ECN marking */
+#define LATENCY_MARKING 4
+/* PIE-like ECN marking */
+#define PIE_MARKING 5
+
+#define DQ_COUNT_INVALID -1
+
+/* A FIFO with its ECN marking threshold and departure rate estimation */
+class SchedQueue : public PacketQueue
+{
+	public:
+		SchedQueue(): thresh(0), thresh_bytes(0), thresh_epoch(0), dq_tstamp(0), dq_count(DQ_COUNT_INVALID), avg_dq_rate(-1) {}
+
+		double thresh;	//per-queue ECN marking threshold (pkts)
+		int thresh_bytes;	//ECN marking threshold of the current policy in bytes
+		unsigned long long thresh_epoch;	//epoch of the scheduler when thresh_bytes was computed
+		double dq_tstamp;	//measurement start time
+		int dq_count;	//measured in bytes
+		double avg_dq_rate;	//average drain rate (bps)
+};
+
+/*
+ * Epoch of the byte thresholds of the queues of a scheduler. A queue computes
+ * its threshold again only when its thresh_epoch differs, so a scheduler calls
+ * Invalidate after any input of the thresholds changed: an estimate (sum of
+ * weights, round time), a quantum or weight, a per-queue threshold or the
+ * marking policy. The epoch is 64 bits wide, so it does not wrap around to
+ * the epoch of a stale threshold even if it changes at every dequeue.
+ *
+ * It also keeps the port threshold in bytes for per-port marking.
+ */
+class ThreshEpoch
+{
+	public:
+		ThreshEpoch(): epoch(1), mean_pktsize(-1), port_thresh(-1), link_capacity(-1), port_bytes(0) {}
+
+		void Invalidate() { epoch++; }
+
+		/* OTcl may change mean_pktsize_, port_thresh_ and link_capacity_ at any time */
+		void Check(int mean_pktsize_, double port_thresh_, double link_capacity_)
+		{
+			if (mean_pktsize_ != mean_pktsize || port_thresh_ != port_thresh || link_capacity_ != link_capacity)
+			{
+				mean_pktsize = mean_pktsize_;
+				port_thresh = port_thresh_;
+				link_capacity = link_capacity_;
+				double bytes = port_thresh * mean_pktsize;
+				port_bytes = (bytes < INT_MAX) ? (int)bytes : INT_MAX;
+				epoch++;
+			}
+		}
+
+		unsigned long long epoch;	//never 0, the epoch of queues that have no threshold yet
+		int mean_pktsize;	//mean_pktsize_ of the thresholds
+		double port_thresh;	//port_thresh_ of the thresholds
+		double link_capacity;	//link_capacity_ of the thresholds
+		int port_bytes;	//port threshold in bytes, truncated
+};
+
+/* Samples applied one by one before the closed form is used for the rest */
+#define PERIODIC_EXACT_SAMPLES 1024
+
+/*
+ * EWMA of a value sampled every interval seconds, like a timer that
+ * rescheduled itself at each sample. Instead of one event per sample, the
+ * samples due by now are applied when the scheduler is touched. The value
+ * must not change between two calls of Update.
+ *
+ * Samples at the same time as a packet come first. They are applied one by
+ * one, so the estimate is the same as with the timer. After
+ * PERIODIC_EXACT_SAMPLES the estimate has converged to the value and the
+ * rest of a long idle period is applied in closed form.
+ */
+class PeriodicEstimate
+{
+	public:
+		PeriodicEstimate(): next(-1) {}
+
+		/* The first sample is taken interval seconds after now */
+		void Start(double now, double interval) { next = now + interval; }
+
+		/* Apply the samples of value due by now to estimate. Return the number of samples */
+		long Update(double *estimate, double value, double alpha, double interval, double now)
+		{
+			long n = 0;
+
+			if (next < 0 || interval <= 0)
+				return 0;
+
+			for (; next <= now && n < PERIODIC_EXACT_SAMPLES; n++)
+			{
+				*estimate = *estimate * alpha + value * (1 - alpha);
+				next += interval;
+			}
+
+			if (next <= now)
+			{
+				long k = (long)((now - next) / interval) + 1;
+				double decay = pow(alpha, (double)k);
+				*estimate = *estimate * decay + value * (1 - decay);
+				next += k * interval;
+				n += k;
+			}
+			return n;
+		}
+
+		double next;	//time of the next sample, -1 before Start
+};
+
+template <class S>
+class SchedCore
+{
+	public:
+		/* ECN marking policy. Return 1 if queue q requires marking */
+		typedef int (*Marking)(S *s, int q);
+		/* Service share of queue q. Return false if it can not be estimated yet */
+		typedef bool (*Share)(S *s, int q, double *share);
+
+		/* Unknown ECN marking scheme */
+		static int UnknownMarking(S *s, int q)
+		{
+			fprintf(stderr, "Unknown ECN marking scheme\n");
+			return 0;
+		}
+
+		/* ECN marking threshold of queue q in packets */
+		typedef double (*Thresh)(S *s, int q);
+
+		/* Mark if queue q is longer than thresh(s, q) packets. The threshold is
+		 * kept in bytes and only computed again in a new epoch. As queue
+		 * lengths are integers, comparing with the truncated threshold gives the
+		 * same result.
+		 */
+		template <Thresh thresh>
+		static int ThreshMarking(S *s, int q)
+		{
+			SchedQueue *queue = s->GetQueue(q);
+
+			if (queue->thresh_epoch != s->thresh_epoch_.epoch)
+			{
+				double bytes = thresh(s, q) * s->mean_pktsize_;
+				queue->thresh_bytes = (bytes < INT_MAX) ? (int)bytes : INT_MAX;
+				queue->thresh_epoch = s->thresh_epoch_.epoch;
+			}
+			return queue->byteLength() > queue->thresh_bytes;
+		}
+
+		/* Per-queue threshold set by set-thresh */
+		static double QueueThresh(S *s, int q)
+		{
+			return s->GetQueue(q)->thresh;
+		}
+
+		/* Per-queue ECN marking */
+		static int PerQueueMarking(S *s, int q)
+		{
+			return ThreshMarking<QueueThresh>(s, q);
+		}
+
+		/* Per-port ECN marking. The caller has called thresh_epoch_.Check */
+		static int PerPortMarking(S *s, int q)
+		{
+			return s->TotalByteLength() > s->thresh_epoch_.port_bytes;
+		}
+
+		/* MQ-ECN threshold: the port threshold scaled by the service share of queue q */
+		template <Share share>
+		static double MQThresh(S *s, int q)
+		{
+			double x = 0;
+
+			if (share(s, q, &x))
+				return ((x < 1) ? x : 1) * s->port_thresh_;
+			else
+				return s->port_thresh_;
+		}
+
+		/* MQ-ECN marking */
+		template <Share share>
+		static int MQMarking(S *s, int q)
+		{
+			return ThreshMarking<MQThresh<share> >(s, q);
+		}
+
+		/* Strict priority queues (q < prio_queue_num_) use upper, the others use lower */
+		template <Marking upper, Marking lower>
+		static int PrioTierMarking(S *s, int q)
+		{
+			if (q < s->prio_queue_num_)
+				return upper(s, q);
+			else
+				return lower(s, q);
+		}
+
+		/* Every queue may use the whole port threshold */
+		static bool FullShare(S *s, int q, double *share)
+		{
+			*share = 1;
+			return true;
+		}
+
+		/* PIE-like: share of the link capacity the queue drains at */
+		static bool DepartureRateShare(S *s, int q, double *share)
+		{
+			SchedQueue *queue = s->GetQueue(q);
+
+			if (queue->avg_dq_rate >= 0.000000001 && s->link_capacity_ > 0)
+			{
+				*share = queue->avg_dq_rate / s->link_capacity_;
+				return true;
+			}
+			return false;
+		}
+
+		/* Dequeue latency-based ECN marking of packet p from queue q. Return 1 if it is marked */
+		static int LatencyMarking(S *s, Packet *p, int q)
+		{
+			hdr_cmn* hc = hdr_cmn::access(p);
+			hdr_flags* hf = hdr_flags::access(p);
+			double sojourn_time = Scheduler::instance().clock() - hc->timestamp();
+			double latency_thresh = 0;
+			int marked = 0;
+
+			if (s->link_capacity_ > 0)
+				latency_thresh = s->port_thresh_ * s->mean_pktsize_ * 8 / s->link_capacity_;
+
+			if (hf->ect() && sojourn_time > latency_thresh)
+			{
+				hf->ce() = 1;
+				s->qlen_trace_.mark(q);
+				marked = 1;
+				if (s->debug_)
+					printf("sojourn time %.9f > threshold %.9f\n", sojourn_time, latency_thresh);
+			}
+			hc->timestamp() = 0;
+			return marked;
+		}
+
+		/* PIE-like departure rate estimation after a packet of pktSize bytes left queue q */
+		static void DepartureRate(S *s, int q, int pktSize)
+		{
+			SchedQueue *queue = s->GetQueue(q);
+
+			/* If current queue is about 10KB or more and dq_count is unset
+			 * we have enough packets to calculate the drain rate. Save
+			 * current time as dq_tstamp and start measurement cycle.
+			 */
+			if (queue->byteLength() >= s->dq_thresh_ && queue->dq_count == DQ_COUNT_INVALID)
+			{
+				queue->dq_tstamp = Scheduler::instance().clock();
+				queue->dq_count = 0;
+			}
+
+			/* Calculate the average drain rate from this value.  If queue length
+			 * has receded to a small value viz., <= dq_thresh_bytes,reset
+			 * the dq_count to -1 as we don't have enough packets to calculate the
+			 * drain rate anymore The following if block is entered only when we
+			 * have a substantial queue built up (dq_thresh_ bytes or more)
+			 * and we calculate the drain rate for the threshold here.*/
+			if (queue->dq_count != DQ_COUNT_INVALID)
+			{
+				queue->dq_count += pktSize;
+				if (queue->dq_count >= s->dq_thresh_)
+				{
+					//take transmission time into account
+					double interval = Scheduler::instance().clock() - queue->dq_tstamp + pktSize * 8 / s->link_capacity_;
+					double rate = queue->dq_count * 8 / interval;
+
+					//initialize avg_dq_rate for this queue
+					if (queue->avg_dq_rate < 0)
+						queue->avg_dq_rate = rate;
+					else
+						queue->avg_dq_rate = queue->avg_dq_rate * s->estimate_rate_alpha_ + rate * (1 - s->estimate_rate_alpha_);
+					/* The PIE-like threshold of this queue has changed */
+					queue->thresh_epoch = s->thresh_epoch_.epoch - 1;
+
+					/* If the queue has receded below the threshold, we hold
+					 * on to the last drain rate calculated, else we reset
+					 * dq_count to 0 to re-enter the if block when the next
+					 * packet is dequeued
+					 */
+					if (queue->byteLength() < s->dq_thresh_)
+						queue->dq_count = DQ_COUNT_INVALID;
+					else
+					{
+						queue->dq_count = 0;
+						//take transmission time into account
+						queue->dq_tstamp = Scheduler::instance().clock() + pktSize * 8 / s->link_capacity_;
+					}
+
+					if (s->debug_ && s->marking_scheme_ == PIE_MARKING)
+						printf("[queue %d] sample departure rate : %.2f average departure rate: %.2f\n", q, rate, queue->avg_dq_rate);
+				}
+			}
+		}
+
+		/* routine to write total qlen records */
+		static void TraceTotalQlen(S *s)
+		{
+			if (s->total_qlen_tchan_)
+			{
+				char wrk[500] = {0};
+				int n;
+				double t = Scheduler::instance().clock();
+				sprintf(wrk, "%g, %d", t, s->TotalByteLength());
+				n = strlen(wrk);
+				wrk[n] = '\n';
+				wrk[n+1] = 0;
+				(void)Tcl_Write(s->total_qlen_tchan_, wrk, n+1);
+			}
+		}
+
+		/* routine to write per-queue qlen records */
+		static void TraceQlen(S *s)
+		{
+			if (s->qlen_tchan_)
+			{
+				char wrk[500] = {0};
+				int n;
+				double t = Scheduler::instance().clock();
+				sprintf(wrk, "%g", t);
+				n = strlen(wrk);
+				wrk[n] = 0;
+				(void)Tcl_Write(s->qlen_tchan_, wrk, n);
+
+				for (int i = 0; i < s->QueueNum(); i++)
+				{
+					sprintf(wrk, ", %d", s->QueueByteLength(i));
+					n = strlen(wrk);
+					wrk[n] = 0;
+					(void)Tcl_Write(s->qlen_tchan_, wrk, n);
+				}
+				(void)Tcl_Write(s->qlen_tchan_, "\n", 1);
+			}
+		}
+
+		/* routine to write binary qlen records. q is the queue that changed,
+		 * QLEN_TRACE_TOTAL if none. With a sampling interval, every queue is
+		 * recorded at the first event of the interval instead.
+		 */
+		static void TraceQlenBin(S *s, int q)
+		{
+			double now = Scheduler::instance().clock();
+
+			if (s->qlen_trace_.due(now))
+			{
+				if (s->qlen_trace_.sampled())
+				{
+					for (int i = 0; i < s->QueueNum(); i++)
+						s->qlen_trace_.record(now, i, s->QueueByteLength(i));
+				}
+				else if (q != QLEN_TRACE_TOTAL)
+					s->qlen_trace_.record(now, q, s->QueueByteLength(q));
+				s->qlen_trace_.record(now, QLEN_TRACE_TOTAL, s->TotalByteLength());
+			}
+		}
+
+		/* All queue length traces after an enqueue or dequeue of queue q (QLEN_TRACE_TOTAL if none) */
+		static void Trace(S *s, int q)
+		{
+			TraceQlen(s);
+			TraceTotalQlen(s);
+			TraceQlenBin(s, q);
+		}
+};
+
+#endif
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "shared-buffer.h"
+
+static class SharedBufferClass : public TclClass
+{
+	public:
+		SharedBufferClass() : TclClass("SharedBuffer") {}
+		TclObject* create(int argc, const char*const* argv)
+		{
+			return (new SharedBuffer);
+		}
+} class_shared_buffer;
+
+SharedBuffer::SharedBuffer()
+{
+	occupied_ = 0;
+	port_num_ = 0;
+	memset(port_bytes_, 0, sizeof(port_bytes_));
+	memset(class_bytes_, 0, sizeof(class_bytes_));
+	for (int i = 0; i < MAX_SHARED_BUFFER_CLASSES; i++)
+		class_alpha_[i] = -1;
+
+	size_ = 9000000;	//9MB
+	alpha_ = 1;
+	port_alpha_ = 0;
+
+	/* bind variables */
+	bind("size_", &size_);
+	bind("alpha_", &alpha_);
+	bind("port_alpha_", &port_alpha_);
+}
+
+/* Port ID of a new queue. Return -1 if there are too many ports */
+int SharedBuffer::Attach()
+{
+	if (port_num_ >= MAX_SHARED_BUFFER_PORTS)
+		return -1;
+
+	return port_num_++;
+}
+
+/*
+ *  entry points from OTcL to set per class state variables
+ *   - $buf set-alpha class_id alpha
+ *   - $buf occupancy (bytes of all ports)
+ *
+ *  NOTE: $buf represents the shared buffer variable in OTcl.
+ */
+int SharedBuffer::command(int argc, const char*const* argv)
+{
+	if (argc == 2 && strcmp(argv[1], "occupancy") == 0)
+	{
+		Tcl::instance().resultf("%d", occupied_);
+		return (TCL_OK);
+	}
+	else if (argc == 4 && strcmp(argv[1], "set-alpha") == 0)
+	{
+		int class_id = atoi(argv[2]);
+		if (class_id < MAX_SHARED_BUFFER_CLASSES && class_id >= 0)
+		{
+			double alpha = atof(argv[3]);
+			if (alpha > 0)
+			{
+				class_alpha_[class_id] = alpha;
+				return (TCL_OK);
+			}
+			else
+			{
+				fprintf(stderr, "illegal alpha value %s for class %s\n", argv[3], argv[2]);
+				exit(1);
+			}
+		}
+		/* Exceed the maximum class number or smaller than 0*/
+		else
+		{
+			fprintf(stderr, "illegal class index value %s\n", argv[2]);
+			exit(1);
+		}
+	}
+	return (TclObject::command(argc, argv));
+}
@@ -0,0 +1,78 @@
+#ifndef ns_shared_buffer_h
+#define ns_shared_buffer_h
+
+/*
+ * Buffer pool shared by the ports of a switch (copy it next to the schedulers
+ * and add shared-buffer.o to OBJ_CC of the ns-2 Makefile).
+ *
+ * Every queue that attaches to a SharedBuffer becomes one of its ports, and the
+ * queues of a port are its classes. A packet is admitted with dynamic thresholds
+ * (DT): the bytes of its class at its port must be below alpha times the free
+ * buffer. With port_alpha_ > 0, the bytes of its port must also be below
+ * port_alpha_ times the free buffer. The qlim_ of each queue still applies.
+ *
+ *   set buf [new SharedBuffer]
+ *   $buf set size_ 9000000	;#bytes
+ *   $buf set alpha_ 1	;#DT alpha of every class
+ *   $buf set-alpha 0 8	;#DT alpha of class 0
+ *   $q attach-buffer $buf
+ *
+ * Occupancy is kept per buffer, port and class, so admission is O(1).
+ */
+
+#include "object.h"
+
+/* Maximum number of ports (queue instances) of a shared buffer */
+#define MAX_SHARED_BUFFER_PORTS 128
+/* Maximum number of classes (queues) of a port */
+#define MAX_SHARED_BUFFER_CLASSES 64
+
+class SharedBuffer : public TclObject
+{
+	public:
+		SharedBuffer();
+		virtual int command(int argc, const char*const* argv);
+
+		int Attach();	//Port ID of a new queue, -1 if there are too many ports
+
+		/* Whether a packet of pktSize bytes of class cls can enter port */
+		bool Admit(int port, int cls, int pktSize)
+		{
+			int free = size_ - occupied_;
+			double alpha = (class_alpha_[cls] >= 0) ? class_alpha_[cls] : alpha_;
+
+			if (pktSize > free || class_bytes_[port][cls] >= alpha * free)
+				return false;
+			if (port_alpha_ > 0 && port_bytes_[port] >= port_alpha_ * free)
+				return false;
+			return true;
+		}
+
+		/* A packet of pktSize bytes of class cls entered port */
+		void Enque(int port, int cls, int pktSize)
+		{
+			occupied_ += pktSize;
+			port_bytes_[port] += pktSize;
+			class_bytes_[port][cls] += pktSize;
+		}
+
+		/* A packet of pktSize bytes of class cls left port */
+		void Deque(int port, int cls, int pktSize)
+		{
+			occupied_ -= pktSize;
+			port_bytes_[port] -= pktSize;
+			class_bytes_[port][cls] -= pktSize;
+		}
+
+	protected:
+		int size_;	//buffer size in bytes
+		double alpha_;	//DT alpha of a class at a port
+		double port_alpha_;	//DT alpha of a port, no per-port threshold if it is not positive
+		double class_alpha_[MAX_SHARED_BUFFER_CLASSES];	//DT alpha of each class, alpha_ if negative
+		int occupied_;	//bytes of all ports
+		int port_num_;	//number of attached queues
+		int port_bytes_[MAX_SHARED_BUFFER_PORTS];	//bytes of each port
+		int class_bytes_[MAX_SHARED_BUFFER_PORTS][MAX_SHARED_BUFFER_CLASSES];	//bytes of each class at each port
+};
+
+#endif
@@ -9,33 +9,21 @@
 #define max(arg1,arg2) (arg1>arg2 ? arg1 : arg2)
 #define min(arg1,arg2) (arg1<arg2 ? arg1 : arg2)
 
+typedef SchedCore<DWRR> DWRRCore;
 
-/* Insert a queue to the tail of an active list. Return true if insert succeeds */
-static void InsertTailList(PacketDWRR* list, PacketDWRR *q)
+/* Insert a queue to the tail of an active list whose tail node is *tail */
+static void InsertTailList(PacketDWRR** tail, PacketDWRR *q)
 {
-	if (q !=NULL && list != NULL)
+	if (q != NULL && tail != NULL && *tail != NULL)
 	{
-		PacketDWRR* tmp = list;
-		while (true)
-		{
-			/* Arrive at the tail of this list */
-			if (tmp->next == NULL)
-			{
-				tmp->next = q;
-				q->next = NULL;
-				return;
-			}
-			/* Move to next node */
-			else
-			{
-				tmp = tmp->next;
-			}
-		}
+		(*tail)->next = q;
+		q->next = NULL;
+		*tail = q;
 	}
 }
 
-/* Remove and return the head node from the active list */
-static PacketDWRR* RemoveHeadList(PacketDWRR* list)
+/* Remove and return the head node from the active list whose tail node is *tail */
+static PacketDWRR* RemoveHeadList(PacketDWRR* list, PacketDWRR** tail)
 {
 	if (list != NULL)
 	{
@@ -43,6 +31,10 @@ static PacketDWRR* RemoveHeadList(PacketDWRR* list)
 		if (tmp != NULL)
 		{
 			list->next = tmp->next;
+			/* The list becomes empty */
+			if (*tail == tmp)
+				*tail = list;
+			tmp->next = NULL;
 			return tmp;
 		}
 		/* This list is empty */
@@ -67,20 +59,27 @@ static class DWRRClass : public TclClass
 		}
 } class_dwrr;
 
-DWRR::DWRR(): timer_(this)
+DWRR::DWRR()
 {
 	queues = new PacketDWRR[MAX_QUEUE_NUM];
 	for (int i = 0; i < MAX_QUEUE_NUM; i++)
 		queues[i].id = i;
 
 	activeList = new PacketDWRR();
+	activeTail = activeList;
+	total_bytes_ = 0;
+	total_pkts_ = 0;
 	round_time = 0;
 	quantum_sum = 0;
 	quantum_sum_estimate = 0;
 	init = 0;
 	last_update_time = 0;
 	last_idle_time = 0;
+	marking_ = DWRRCore::UnknownMarking;
+	marking_of_ = -1;
 
+	buffer_ = NULL;
+	buffer_port_ = -1;
 	total_qlen_tchan_ = NULL;
 	qlen_tchan_ = NULL;
 
@@ -120,47 +119,34 @@ DWRR::~DWRR()
 {
 	delete activeList;
 	delete [] queues;
-	timer_.cancel();
 }
 
-void DWRR::timeout(int)
+/* Apply the samples of quantum_sum_estimate that are due by now.
+ * quantum_sum has not changed since the last call.
+ */
+void DWRR::SampleQuantumSum(double now)
 {
-	/* update quantum_sum_estimate */
-	quantum_sum_estimate = quantum_sum_estimate * estimate_quantum_alpha_ + quantum_sum * (1 - estimate_quantum_alpha_);
-
-	if (debug_ && marking_scheme_ == MQ_MARKING_GENER)
-		printf("%.9f smooth quantum sum: %f, sample quantum sum: %d\n",Scheduler::instance().clock(),quantum_sum_estimate, quantum_sum);
+	long samples = 0;
 
-	/* reschedule timer */
 	if (link_capacity_ > 0)
-		timer_.resched(estimate_quantum_interval_bytes_ * 8 / link_capacity_);
-}
+		samples = quantum_estimate_.Update(&quantum_sum_estimate, quantum_sum, estimate_quantum_alpha_, estimate_quantum_interval_bytes_ * 8 / link_capacity_, now);
+	if (samples > 0)
+		thresh_epoch_.Invalidate();
 
-void DWRR_Timer::expire(Event* e)
-{
-	queue_->timeout(0);
+	if (debug_ && marking_scheme_ == MQ_MARKING_GENER && samples > 0)
+		printf("%.9f smooth quantum sum: %f, sample quantum sum: %d after %ld samples\n", now, quantum_sum_estimate, quantum_sum, samples);
 }
 
 /* Get total length of all queues in bytes */
 int DWRR::TotalByteLength()
 {
-	int result = 0;
-
-	for (int i = 0; i < queue_num_; i++)
-		result+=queues[i].byteLength();
-
-	return result;
+	return total_bytes_;
 }
 
 /* Get total length of all queues in packets */
 int DWRR::TotalLength()
 {
-	int result = 0;
-
-	for (int i = 0; i < queue_num_; i++)
-		result+=queues[i].length();
-
-	return result;
+	return total_pkts_;
 }
 
 
@@ -174,81 +160,68 @@ int DWRR::TotalQuantum()
 	return result;
 }
 
-/* Determine whether we need to mark ECN where q is current queue number. Return 1 if it requires marking */
-int DWRR::MarkingECN(int q)
+/* Share of queue q for MQ-ECN for any packet scheduling algorithms: its quantum over the sum of quantums of active queues */
+bool DWRR::QuantumShare(DWRR *s, int q, double *share)
 {
-	if (q < 0 || q >= queue_num_)
+	if (s->quantum_sum_estimate >= 0.000000001)
 	{
-		fprintf (stderr,"illegal queue number\n");
-		exit (1);
+		*share = s->queues[q].quantum / s->quantum_sum_estimate;
+		return true;
 	}
+	return false;
+}
 
-	/* Per-queue ECN marking */
-	if (marking_scheme_ == PER_QUEUE_MARKING)
+/* Share of queue q for MQ-ECN for round robin packet scheduling algorithms: its quantum per round time */
+bool DWRR::RoundShare(DWRR *s, int q, double *share)
+{
+	if (s->round_time >= 0.000000001 && s->link_capacity_ > 0)
 	{
-		if (queues[q].byteLength() > queues[q].thresh * mean_pktsize_)
-			return 1;
-		else
-			return 0;
+		*share = s->queues[q].quantum * 8 / s->round_time / s->link_capacity_;
+		return true;
 	}
-	/* Per-port ECN marking */
-	else if (marking_scheme_ == PER_PORT_MARKING)
+	return false;
+}
+
+/* Get the marking policy of an ECN marking scheme */
+DWRRCore::Marking DWRR::SelectMarking(int scheme)
+{
+	switch (scheme)
 	{
-		if (TotalByteLength() > port_thresh_ * mean_pktsize_)
-			return 1;
-		else
-			return 0;
+		case PER_QUEUE_MARKING:
+			return DWRRCore::PerQueueMarking;
+		case PER_PORT_MARKING:
+			return DWRRCore::PerPortMarking;
+		case MQ_MARKING_GENER:
+			return DWRRCore::MQMarking<DWRR::QuantumShare>;
+		case MQ_MARKING_RR:
+			return DWRRCore::MQMarking<DWRR::RoundShare>;
+		case PIE_MARKING:
+			return DWRRCore::MQMarking<DWRRCore::DepartureRateShare>;
+		default:
+			return DWRRCore::UnknownMarking;
 	}
-	/* MQ-ECN for any packet scheduling algorithms */
-	else if (marking_scheme_ == MQ_MARKING_GENER)
-	{
-		double thresh = 0;
-		if (quantum_sum_estimate >= 0.000000001)
-			thresh = min(queues[q].quantum / quantum_sum_estimate, 1) * port_thresh_;
-		else
-			thresh = port_thresh_;
-
-		if (queues[q].byteLength() > thresh * mean_pktsize_)
-			return 1;
-		else
-			return 0;
+}
 
-	}
-	/* MQ-ECN for round robin packet scheduling algorithms */
-	else if (marking_scheme_ == MQ_MARKING_RR)
+/* Determine whether we need to mark ECN where q is current queue number. Return 1 if it requires marking */
+int DWRR::MarkingECN(int q)
+{
+	if (q < 0 || q >= queue_num_)
 	{
-		double thresh = 0;
-		if (round_time >= 0.000000001 && link_capacity_ > 0)
-			thresh = min(queues[q].quantum * 8 / round_time / link_capacity_, 1) * port_thresh_;
-		else
-			thresh = port_thresh_;
-			//For debug
-			//printf("round time: %f threshold: %f\n",round_time, thresh);
-		if (queues[q].byteLength() > thresh * mean_pktsize_)
-			return 1;
-		else
-			return 0;
+		fprintf (stderr,"illegal queue number\n");
+		exit (1);
 	}
-	/* PIE-like ECN marking */
-	else if (marking_scheme_ == PIE_MARKING)
-	{
-		double thresh = 0;
-		if (queues[q].avg_dq_rate >= 0.000000001 && link_capacity_ > 0)
-			thresh = min(queues[q].avg_dq_rate / link_capacity_, 1) * port_thresh_;
-		else
-			thresh = port_thresh_;
 
-		if (queues[q].byteLength() > thresh * mean_pktsize_)
-			return 1;
-		else
-			return 0;
-	}
-	/* Unknown ECN marking scheme */
-	else
+	/* Byte thresholds are computed again after OTcl changed mean_pktsize_, port_thresh_ or link_capacity_ */
+	thresh_epoch_.Check(mean_pktsize_, port_thresh_, link_capacity_);
+
+	/* Select the marking policy again only when marking_scheme_ has changed */
+	if (marking_scheme_ != marking_of_)
 	{
-		fprintf (stderr,"Unknown ECN marking scheme\n");
-		return 0;
+		marking_ = SelectMarking(marking_scheme_);
+		marking_of_ = marking_scheme_;
+		thresh_epoch_.Invalidate();
 	}
+	return marking_(this, q);
 }
 
 /*
@@ -257,11 +230,26 @@ int DWRR::MarkingECN(int q)
  *   - $q set-thresh queue_id queue_thresh
  *   - $q attach-total file
  *	  - $q attach-queue file
+ *	  - $q attach-qlen-trace file [interval_us]
+ *	  - $q attach-buffer shared_buffer
  *
  *  NOTE: $q represents the discipline queue variable in OTcl.
  */
 int DWRR::command(int argc, const char*const* argv)
 {
+	// attach a file to write binary qlen records, optionally sampled every interval_us
+	if ((argc == 3 || argc == 4) && strcmp(argv[1], "attach-qlen-trace") == 0)
+	{
+		Tcl& tcl = Tcl::instance();
+		double interval_us = (argc == 4) ? atof(argv[3]) : 0;
+		if (qlen_trace_.attach(tcl.interp(), argv[2], interval_us) != TCL_OK)
+		{
+			tcl.resultf("DWRR: trace: can't attach %s for writing", argv[2]);
+			return (TCL_ERROR);
+		}
+		return (TCL_OK);
+	}
+
 	if (argc == 3)
 	{
 		// attach a file to trace total queue length
@@ -291,6 +279,31 @@ int DWRR::command(int argc, const char*const* argv)
 			}
 			return (TCL_OK);
 		}
+		// attach to the shared buffer of the switch as a new port
+		else if (strcmp(argv[1], "attach-buffer") == 0)
+		{
+			Tcl& tcl = Tcl::instance();
+			//packets queued before would never have been counted by the buffer
+			if (buffer_ != NULL || TotalByteLength() > 0)
+			{
+				tcl.resultf("DWRR: can only attach a shared buffer once, while empty");
+				return (TCL_ERROR);
+			}
+			TclObject *obj = TclObject::lookup(argv[2]);
+			if (obj == NULL)
+			{
+				tcl.resultf("DWRR: no shared buffer named %s", argv[2]);
+				return (TCL_ERROR);
+			}
+			SharedBuffer *buffer = dynamic_cast<SharedBuffer*>(obj);
+			if (buffer == NULL || (buffer_port_ = buffer->Attach()) < 0)
+			{
+				tcl.resultf("DWRR: can't attach shared buffer %s", argv[2]);
+				return (TCL_ERROR);
+			}
+			buffer_ = buffer;
+			return (TCL_OK);
+		}
 	}
 	else if (argc == 4)
 	{
@@ -303,6 +316,7 @@ int DWRR::command(int argc, const char*const* argv)
 				if (quantum > 0)
 				{
 					queues[queue_id].quantum = quantum;
+					thresh_epoch_.Invalidate();
 					return (TCL_OK);
 				}
 				else
@@ -327,6 +341,7 @@ int DWRR::command(int argc, const char*const* argv)
 				if (thresh >= 0)
 				{
 					queues[queue_id].thresh = thresh;
+					thresh_epoch_.Invalidate();
 					return (TCL_OK);
 				}
 				else
@@ -359,12 +374,15 @@ void DWRR::enque(Packet *p)
 
 	if (init == 0)
 	{
-		/* Start timer*/
+		/* Start sampling quantum_sum_estimate */
 		if (marking_scheme_ == MQ_MARKING_GENER && estimate_quantum_enable_timer_ && estimate_quantum_interval_bytes_ > 0 && link_capacity_ > 0)
-			timer_.resched(estimate_quantum_interval_bytes_  *8 / link_capacity_);
+			quantum_estimate_.Start(Scheduler::instance().clock(), estimate_quantum_interval_bytes_ * 8 / link_capacity_);
 		init = 1;
 	}
 
+	/* Samples due before this packet arrived */
+	SampleQuantumSum(Scheduler::instance().clock());
+
 	if (TotalByteLength()==0 && marking_scheme_==MQ_MARKING_GENER && !estimate_quantum_enable_timer_)
 	{
 		double now = Scheduler::instance().clock();
@@ -373,6 +391,7 @@ void DWRR::enque(Packet *p)
 			quantum_sum_estimate = quantum_sum_estimate * pow(estimate_quantum_alpha_, idleTime / (estimate_quantum_interval_bytes_ * 8 / link_capacity_));
 		else
 			quantum_sum_estimate = 0;
+		thresh_epoch_.Invalidate();
 		last_update_time = now;
 
 		if (debug_)
@@ -393,6 +412,7 @@ void DWRR::enque(Packet *p)
 			round_time = 0;
 		}
 
+		thresh_epoch_.Invalidate();
 		last_update_time = now;
 		if(debug_)
 			printf("%.9f smooth round time is reset to %f after %d idle time slots\n", now, round_time, intervalNum);
@@ -409,7 +429,18 @@ void DWRR::enque(Packet *p)
 	if (prio >= queue_num_ || prio < 0)
 		prio = queue_num_-1;
 
+	/* Dynamic threshold of the shared buffer */
+	if (buffer_ && !buffer_->Admit(buffer_port_, prio, pktSize))
+	{
+		drop(p);
+		return;
+	}
+
 	queues[prio].enque(p);
+	total_bytes_ += pktSize;
+	total_pkts_++;
+	if (buffer_)
+		buffer_->Enque(buffer_port_, prio, pktSize);
 	/* if queues[prio] is not in activeList */
 	if (queues[prio].active == false)
 	{
@@ -417,7 +448,7 @@ void DWRR::enque(Packet *p)
 		queues[prio].active = true;
 		queues[prio].current = false;
 		queues[prio].start_time = Scheduler::instance().clock();	//Start time of this round
-		InsertTailList(activeList, &queues[prio]);
+		InsertTailList(&activeTail, &queues[prio]);
 		quantum_sum += queues[prio].quantum;
 	}
 
@@ -426,10 +457,15 @@ void DWRR::enque(Packet *p)
 
 	/* Enqueue ECN/RED marking */
 	if (marking_scheme_ != LATENCY_MARKING && deque_marking_ == 0 && MarkingECN(prio) > 0 && hf->ect())
+	{
 		hf->ce() = 1;
+		qlen_trace_.mark(prio);
+	}
 	/* For dequeue latency ECN marking ,record enqueue timestamp here */
 	else if (marking_scheme_ == LATENCY_MARKING && hf->ect())
 		hc->timestamp() = Scheduler::instance().clock();
+
+	DWRRCore::TraceQlenBin(this, prio);
 }
 
 Packet *DWRR::deque(void)
@@ -437,11 +473,12 @@ Packet *DWRR::deque(void)
 	PacketDWRR *headNode = NULL;
 	Packet *pkt = NULL;
 	hdr_flags* hf = NULL;
-	hdr_cmn* hc = NULL;
 	int pktSize = 0;
+	int queue = QLEN_TRACE_TOTAL;
 	double round_time_sample = 0;
-	double sojourn_time = 0;
-	double latency_thresh = 0;
+
+	/* Samples due before this packet leaves */
+	SampleQuantumSum(Scheduler::instance().clock());
 
 	/*At least one queue is active, activeList is not empty */
 	if (TotalByteLength() > 0)
@@ -468,89 +505,38 @@ Packet *DWRR::deque(void)
 				if (pktSize <= headNode->deficitCounter)
 				{
 					pkt = headNode->deque();
+					queue = headNode->id;
 					headNode->deficitCounter -= pktSize;
+					total_bytes_ -= pktSize;
+					total_pkts_--;
+					if (buffer_)
+						buffer_->Deque(buffer_port_, headNode->id, pktSize);
 
-					hc = hdr_cmn::access(pkt);
 					hf = hdr_flags::access(pkt);
 					/* dequeue ECN/RED marking */
 					if (marking_scheme_ != LATENCY_MARKING && deque_marking_ == 1 && MarkingECN(headNode->id) > 0 && hf->ect())
+					{
 						hf->ce() = 1;
+						qlen_trace_.mark(headNode->id);
+					}
 					/* dequeue latency-based ECN marking */
 					else if (marking_scheme_ == LATENCY_MARKING)
-					{
-						sojourn_time = Scheduler::instance().clock() - hc->timestamp();
-						if (link_capacity_ > 0)
-							latency_thresh = port_thresh_ * mean_pktsize_ * 8 / link_capacity_;
-
-						if (hf->ect() && sojourn_time > latency_thresh)
-						{
-							hf->ce() = 1;
-							if (debug_)
-								printf("sojourn time %.9f > threshold %.9f\n", sojourn_time, latency_thresh);
-						}
-						hc->timestamp() = 0;
-					}
+						DWRRCore::LatencyMarking(this, pkt, headNode->id);
 
-					/* If current queue is about 10KB or more and dq_count is unset
-					 * we have enough packets to calculate the drain rate. Save
-					 * current time as dq_tstamp and start measurement cycle.
-					 */
-					if (headNode->byteLength() >= dq_thresh_ && headNode->dq_count == DQ_COUNT_INVALID)
-					{
-						headNode->dq_tstamp = Scheduler::instance().clock();
-						headNode->dq_count = 0;
-					}
-
-					/* Calculate the average drain rate from this value.  If queue length
-					 * has receded to a small value viz., <= dq_thresh_bytes,reset
-					 * the dq_count to -1 as we don't have enough packets to calculate the
-					 * drain rate anymore The following if block is entered only when we
-					 * have a substantial queue built up (dq_thresh_ bytes or more)
-					 * and we calculate the drain rate for the threshold here.*/
-					if (headNode->dq_count != DQ_COUNT_INVALID)
-					{
-						headNode->dq_count += pktSize;
-						if (headNode->dq_count >= dq_thresh_)
-						{
-							//take transmission time into account
-							double interval = Scheduler::instance().clock() - headNode->dq_tstamp + pktSize * 8 / link_capacity_;
-							double rate = headNode->dq_count * 8 / interval;
-
-							if (headNode->avg_dq_rate < 0)
-								headNode->avg_dq_rate = rate;
-							else
-								headNode->avg_dq_rate = headNode->avg_dq_rate * estimate_rate_alpha_ + rate * (1 - estimate_rate_alpha_);
-
-							/* If the queue has receded below the threshold, we hold
-	 						 * on to the last drain rate calculated, else we reset
-	 					 	 * dq_count to 0 to re-enter the if block when the next
-	 					     * packet is dequeued
-	 					 	 */
-							if (headNode->byteLength() < dq_thresh_)
-								headNode->dq_count = DQ_COUNT_INVALID;
-							else
-							{
-								headNode->dq_count = 0;
-								//take transmission time into account
-								headNode->dq_tstamp = Scheduler::instance().clock() + pktSize * 8 / link_capacity_;
-							}
-
-							if (debug_ && marking_scheme_ == PIE_MARKING)
-								printf("%.9f queue: %d sample departure rate: %.2f average departure rate: %.2f\n", Scheduler::instance().clock(), headNode->id, rate, headNode->avg_dq_rate);
-						}
-					}
+					DWRRCore::DepartureRate(this, headNode->id, pktSize);
 
 					/* After dequeue, headNode becomes empty. In such case, we should delete this queue from activeList. */
 					if (headNode->length() == 0)
 					{
 						round_time_sample = Scheduler::instance().clock() - headNode->start_time + pktSize * 8 / link_capacity_;
 						round_time = round_time * estimate_round_alpha_ + round_time_sample * (1 - estimate_round_alpha_);
+						thresh_epoch_.Invalidate();
 
 						if (debug_ && marking_scheme_ == MQ_MARKING_RR)
 							printf("%.9f queue: %d sample round time: %.9f round time: %.9f\n", Scheduler::instance().clock(), headNode->id, round_time_sample, round_time);
 
 						quantum_sum -= headNode->quantum;
-						headNode = RemoveHeadList(activeList);
+						headNode = RemoveHeadList(activeList, &activeTail);
 						headNode->deficitCounter = 0;
 						headNode->active = false;
 						headNode->current = false;
@@ -560,16 +546,17 @@ Packet *DWRR::deque(void)
 				/* if we don't have enough quantum to dequeue the head packet and the queue is not empty */
 				else
 				{
-					headNode = RemoveHeadList(activeList);
+					headNode = RemoveHeadList(activeList, &activeTail);
 					headNode->current = false;
 					round_time_sample = Scheduler::instance().clock() - headNode->start_time;
 				  	round_time = round_time * estimate_round_alpha_ + round_time_sample * (1-estimate_round_alpha_);
+					thresh_epoch_.Invalidate();
 
 					if (debug_ && marking_scheme_ == MQ_MARKING_RR)
 						printf("%.9f queue: %d sample round time: %.9f round time: %.9f\n", Scheduler::instance().clock(), headNode->id, round_time_sample, round_time);
 
 					headNode->start_time = Scheduler::instance().clock();	//Reset start time
-					InsertTailList(activeList, headNode);
+					InsertTailList(&activeTail, headNode);
 				}
 			}
 		}
@@ -582,6 +569,7 @@ Packet *DWRR::deque(void)
 		if (estimate_quantum_interval_bytes_ > 0 && link_capacity_ > 0 && timeInterval >= 0.995 * estimate_quantum_interval_bytes_ * 8 /link_capacity_)
 		{
 			quantum_sum_estimate = quantum_sum_estimate * estimate_quantum_alpha_ + quantum_sum * (1 - estimate_quantum_alpha_);
+			thresh_epoch_.Invalidate();
 			last_update_time = now;
 			if(debug_)
 				printf("%.9f smooth quantum sum: %f, sample quantum sum: %d\n", now, quantum_sum_estimate, quantum_sum);
@@ -592,48 +580,6 @@ Packet *DWRR::deque(void)
 		last_idle_time = Scheduler::instance().clock();
 
 
-	trace_qlen();
-	trace_total_qlen();
-
+	DWRRCore::Trace(this, queue);
 	return pkt;
 }
-
-/* routine to write total qlen records */
-void DWRR::trace_total_qlen()
-{
-	if (total_qlen_tchan_)
-	{
-		char wrk[500] = {0};
-		int n;
-		double t = Scheduler::instance().clock();
-		sprintf(wrk, "%g, %d", t,TotalByteLength());
-		n = strlen(wrk);
-		wrk[n] = '\n';
-		wrk[n+1] = 0;
-		(void)Tcl_Write(total_qlen_tchan_, wrk, n+1);
-	}
-}
-
-/* routine to write per-queue qlen records */
-void DWRR::trace_qlen()
-{
-	if (qlen_tchan_)
-	{
-		char wrk[500] = {0};
-		int n;
-		double t = Scheduler::instance().clock();
-		sprintf(wrk, "%g", t);
-		n = strlen(wrk);
-		wrk[n] = 0;
-		(void)Tcl_Write(qlen_tchan_, wrk, n);
-
-		for (int i = 0; i < queue_num_; i++)
-		{
-			sprintf(wrk, ", %d",queues[i].byteLength());
-			n = strlen(wrk);
-			wrk[n] = 0;
-			(void)Tcl_Write(qlen_tchan_, wrk, n);
-		}
-		(void)Tcl_Write(qlen_tchan_, "\n", 1);
-	}
-}
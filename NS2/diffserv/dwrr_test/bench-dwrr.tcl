@@ -0,0 +1,96 @@
+#Wall-clock benchmark of the DWRR scheduler with many service classes.
+#Run it with the ns binaries built before and after a DWRR change:
+#	ns bench-dwrr.tcl [classes] [marking_scheme] [simulation_time]
+#and compare the reported wall-clock time. No trace file is written.
+set ns [new Simulator]
+
+set classes 64
+set marking_scheme 1
+set simulationTime 0.1
+if {$argc >= 1} { set classes [lindex $argv 0] }
+if {$argc >= 2} { set marking_scheme [lindex $argv 1] }
+if {$argc >= 3} { set simulationTime [lindex $argv 2] }
+
+set senders_per_class 2
+set K_port 65;	#The per-port ECN marking threshold
+set K 16;	#The per-queue ECN marking threshold
+
+set RTT 0.0001
+set DCTCP_g_ 0.0625
+set ackRatio 1
+set packetSize 1460
+set lineRate 10Gb
+
+Agent/TCP set windowInit_ 10
+Agent/TCP set ecn_ 1
+Agent/TCP set old_ecn_ 1
+Agent/TCP set dctcp_ true
+Agent/TCP set dctcp_g_ $DCTCP_g_
+Agent/TCP set packetSize_ $packetSize
+Agent/TCP set window_ 1256
+Agent/TCP set slow_start_restart_ false
+Agent/TCP set minrto_ 0.01 ; # minRTO = 10ms
+Agent/TCP set windowOption_ 0
+Agent/TCP/FullTcp set segsize_ $packetSize
+Agent/TCP/FullTcp set segsperack_ $ackRatio;
+Agent/TCP/FullTcp set spa_thresh_ 3000;
+Agent/TCP/FullTcp set interval_ 0.04 ; #delayed ACK interval = 40ms
+
+Queue set limit_ 1000
+
+Queue/DWRR set queue_num_ $classes
+Queue/DWRR set mean_pktsize_ [expr $packetSize + 40]
+Queue/DWRR set port_thresh_ $K_port
+Queue/DWRR set marking_scheme_ $marking_scheme
+Queue/DWRR set estimate_round_alpha_ 0.75
+Queue/DWRR set estimate_quantum_alpha_ 0.75
+Queue/DWRR set estimate_round_idle_interval_bytes_ 1500
+Queue/DWRR set estimate_quantum_interval_bytes_ 1500
+Queue/DWRR set estimate_quantum_enable_timer_ false
+Queue/DWRR set dq_thresh_ 10000
+Queue/DWRR set estimate_rate_alpha_ 0.875
+Queue/DWRR set link_capacity_ $lineRate
+Queue/DWRR set deque_marking_ false
+Queue/DWRR set debug_ false
+
+set switch [$ns node]
+set receiver [$ns node]
+
+$ns simplex-link $switch $receiver $lineRate [expr $RTT/4] DWRR
+$ns simplex-link $receiver $switch $lineRate [expr $RTT/4] DropTail
+
+set L [$ns link $switch $receiver]
+set q [$L set queue_]
+for {set i 0} {$i<$classes} {incr i} {
+	$q set-quantum $i [expr 1500*(1+$i%4)]
+	$q set-thresh $i $K
+}
+
+for {set i 0} {$i<$classes*$senders_per_class} {incr i} {
+	set n($i) [$ns node]
+	$ns duplex-link $n($i) $switch $lineRate [expr $RTT/4] DropTail
+	set tcp($i) [new Agent/TCP/FullTcp/Sack]
+	set sink($i) [new Agent/TCP/FullTcp/Sack]
+	$tcp($i) set serviceid_ [expr $i%$classes]
+	$sink($i) listen
+
+	$ns attach-agent $n($i) $tcp($i)
+	$ns attach-agent $receiver $sink($i)
+	$ns connect $tcp($i) $sink($i)
+
+	set ftp($i) [new Application/FTP]
+	$ftp($i) attach-agent $tcp($i)
+	$ftp($i) set type_ FTP
+	$ns at 0.0 "$ftp($i) start"
+}
+
+proc finish {} {
+	global start classes marking_scheme simulationTime
+	set wall [expr [clock milliseconds]-$start]
+	puts "classes $classes marking_scheme $marking_scheme simulated $simulationTime s wall-clock $wall ms"
+	exit 0
+}
+
+set start [clock milliseconds]
+$ns at $simulationTime "finish"
+$ns run
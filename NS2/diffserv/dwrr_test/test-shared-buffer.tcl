@@ -0,0 +1,180 @@
+set ns [new Simulator]
+
+#Two ports of a switch share one buffer. An incast to the first port fills the
+#buffer, then a few flows to the second port start and still get their share
+#of it through dynamic thresholds (DT).
+set incast_senders 16
+set victim_senders 2
+set buffer_size 300000;	#The shared buffer size in bytes
+set alpha 1;	#The DT alpha of every queue of every port
+set W_0 1500; #The quantum (weight) of the first queue
+set W_1 1500; #The quantum (weight) of the second queue
+
+set RTT 0.0001
+set ackRatio 1
+set packetSize 1460
+set lineRate 10Gb
+
+set simulationTime 0.02
+set throughputSamplingInterval 0.0002
+
+#Without ECN, the incast keeps the buffer full
+Agent/TCP set windowInit_ 10
+Agent/TCP set ecn_ 0
+Agent/TCP set packetSize_ $packetSize
+Agent/TCP set window_ 1256
+Agent/TCP set slow_start_restart_ false
+Agent/TCP set minrto_ 0.01 ; # minRTO = 10ms
+Agent/TCP set windowOption_ 0
+Agent/TCP/FullTcp set segsize_ $packetSize
+Agent/TCP/FullTcp set segsperack_ $ackRatio;
+Agent/TCP/FullTcp set spa_thresh_ 3000;
+Agent/TCP/FullTcp set interval_ 0.04 ; #delayed ACK interval = 40ms
+
+#The per-port limit is larger than the shared buffer
+Queue set limit_ 1000
+
+Queue/DWRR set queue_num_ 2
+Queue/DWRR set mean_pktsize_ [expr $packetSize+40]
+Queue/DWRR set port_thresh_ 1000
+Queue/DWRR set marking_scheme_ 1
+Queue/DWRR set link_capacity_ $lineRate
+Queue/DWRR set debug_ false
+
+set buf [new SharedBuffer]
+$buf set size_ $buffer_size
+$buf set alpha_ $alpha
+
+set mytracefile [open mytracefile.tr w]
+$ns trace-all $mytracefile
+set throughputfile [open throughputfile.tr w]
+set bufferfile [open bufferfile.tr w]
+set tot_qlenfile0 [open tot_qlenfile0.tr w]
+set tot_qlenfile1 [open tot_qlenfile1.tr w]
+set tracedir tcp_flows
+
+proc finish {} {
+	global ns mytracefile throughputfile bufferfile tot_qlenfile0 tot_qlenfile1
+	$ns flush-trace
+	close $mytracefile
+	close $throughputfile
+	close $bufferfile
+	close $tot_qlenfile0
+	close $tot_qlenfile1
+	exit 0
+}
+
+set switch [$ns node]
+set receiver0 [$ns node]
+set receiver1 [$ns node]
+
+$ns simplex-link $switch $receiver0 $lineRate [expr $RTT/4] DWRR
+$ns simplex-link $receiver0 $switch $lineRate [expr $RTT/4] DropTail
+$ns simplex-link $switch $receiver1 $lineRate [expr $RTT/4] DWRR
+$ns simplex-link $receiver1 $switch $lineRate [expr $RTT/4] DropTail
+
+#Both egress ports of the switch attach to the same buffer
+set L0 [$ns link $switch $receiver0]
+set q0 [$L0 set queue_]
+$q0 set-quantum 0 $W_0
+$q0 set-quantum 1 $W_1
+$q0 attach-total $tot_qlenfile0
+$q0 attach-buffer $buf
+
+set L1 [$ns link $switch $receiver1]
+set q1 [$L1 set queue_]
+$q1 set-quantum 0 $W_0
+$q1 set-quantum 1 $W_1
+$q1 attach-total $tot_qlenfile1
+$q1 attach-buffer $buf
+
+#Incast senders to the first port
+for {set i 0} {$i<$incast_senders} {incr i} {
+	set n1($i) [$ns node]
+	$ns duplex-link $n1($i) $switch $lineRate [expr $RTT/4] DropTail
+	set tcp1($i) [new Agent/TCP/FullTcp/Sack]
+	set sink1($i) [new Agent/TCP/FullTcp/Sack]
+	$tcp1($i) set serviceid_ 0
+	$sink1($i) listen
+
+	$tcp1($i) attach [open ./$tracedir/$i.tr w]
+	$tcp1($i) set bugFix_ false
+	$tcp1($i) trace cwnd_
+	$tcp1($i) trace ack_
+
+	$ns attach-agent $n1($i) $tcp1($i)
+	$ns attach-agent $receiver0 $sink1($i)
+	$ns connect $tcp1($i) $sink1($i)
+
+	set ftp1($i) [new Application/FTP]
+	$ftp1($i) attach-agent $tcp1($i)
+	$ftp1($i) set type_ FTP
+	$ns at [expr 0.0] "$ftp1($i) start"
+}
+
+#Senders to the second port, after the buffer has filled up
+for {set i 0} {$i<$victim_senders} {incr i} {
+	set n2($i) [$ns node]
+	$ns duplex-link $n2($i) $switch $lineRate [expr $RTT/4] DropTail
+	set tcp2($i) [new Agent/TCP/FullTcp/Sack]
+	set sink2($i) [new Agent/TCP/FullTcp/Sack]
+	$tcp2($i) set serviceid_ 0
+	$sink2($i) listen
+
+	$tcp2($i) attach [open ./$tracedir/[expr $i+$incast_senders].tr w]
+	$tcp2($i) set bugFix_ false
+	$tcp2($i) trace cwnd_
+	$tcp2($i) trace ack_
+
+	$ns attach-agent $n2($i) $tcp2($i)
+	$ns attach-agent $receiver1 $sink2($i)
+	$ns connect $tcp2($i) $sink2($i)
+
+	set ftp2($i) [new Application/FTP]
+	$ftp2($i) attach-agent $tcp2($i)
+	$ftp2($i) set type_ FTP
+	$ns at [expr $simulationTime/2] "$ftp2($i) start"
+}
+
+proc record {} {
+	global ns throughputfile bufferfile throughputSamplingInterval incast_senders victim_senders sink1 sink2 buf
+
+	#Get the current time
+	set now [$ns now]
+
+	#Initialize the output string
+	set str $now
+	append str ", "
+
+	set bw1 0
+	for {set i 0} {$i<$incast_senders} {incr i} {
+		set bytes [$sink1($i) set bytes_]
+		set bw1 [expr $bw1+$bytes]
+		$sink1($i) set bytes_ 0
+	}
+	append str " "
+	append str [expr int($bw1/$throughputSamplingInterval*8/1000000)];	#throughput of the first port in Mbps
+	append str ", "
+
+	set bw2 0
+	for {set i 0} {$i<$victim_senders} {incr i} {
+		set bytes [$sink2($i) set bytes_]
+		set bw2 [expr $bw2+$bytes]
+		$sink2($i) set bytes_ 0
+	}
+	append str " "
+	append str [expr int($bw2/$throughputSamplingInterval*8/1000000)];	#throughput of the second port in Mbps
+
+	puts $throughputfile $str
+
+	#Bytes of the shared buffer in use
+	puts $bufferfile "$now, [$buf occupancy]"
+
+	#Set next callback time
+	$ns at [expr $now+$throughputSamplingInterval] "record"
+
+}
+
+$ns at 0.0 "record"
+$ns at [expr $simulationTime] "finish"
+$ns run
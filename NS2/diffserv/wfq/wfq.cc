@@ -8,6 +8,8 @@
 #define max(arg1,arg2) (arg1>arg2 ? arg1 : arg2)
 #define min(arg1,arg2) (arg1<arg2 ? arg1 : arg2)
 
+typedef SchedCore<WFQ> WFQCore;
+
 static class WFQClass : public TclClass
 {
 	public:
@@ -18,14 +20,18 @@ static class WFQClass : public TclClass
 		}
 } class_wfq;
 
-WFQ::WFQ(): timer_(this)
+WFQ::WFQ()
 {
 	queues = new PacketWFQ[MAX_QUEUE_NUM];
 
+	active_num = 0;
+	total_bytes_ = 0;
 	currTime = 0;
 	weight_sum_estimate = 0;
 	weight_sum = 0;
 	last_update_time = 0;
+	marking_ = WFQCore::UnknownMarking;
+	marking_of_ = -1;
 	last_idle_time = 0;
 	init = 0;
 
@@ -41,6 +47,8 @@ WFQ::WFQ(): timer_(this)
 	link_capacity_ = 10000000000;
 	debug_ = 0;
 
+	buffer_ = NULL;
+	buffer_port_ = -1;
 	total_qlen_tchan_ = NULL;
 	qlen_tchan_ = NULL;
 
@@ -61,96 +69,123 @@ WFQ::WFQ(): timer_(this)
 WFQ::~WFQ()
 {
 	delete [] queues;
-	timer_.cancel();
 }
 
-void WFQ::timeout(int)
+/* Apply the samples of weight_sum_estimate that are due by now.
+ * weight_sum has not changed since the last call.
+ */
+void WFQ::SampleWeightSum(double now)
 {
-	/* update weight_sum_estimate */
-	weight_sum_estimate = weight_sum_estimate * estimate_weight_alpha_ + weight_sum * (1 - estimate_weight_alpha_);
+	long samples = 0;
 
-	if (debug_ && marking_scheme_ == MQ_MARKING_GENER)
-		printf("%.9f smooth weight sum: %f, sample weight sum: %f\n", Scheduler::instance().clock(), weight_sum_estimate, weight_sum);
-
-	/* reschedule timer */
 	if (link_capacity_ > 0)
-		timer_.resched(estimate_weight_interval_bytes_ * 8 / link_capacity_);
-}
+		samples = weight_estimate_.Update(&weight_sum_estimate, weight_sum, estimate_weight_alpha_, estimate_weight_interval_bytes_ * 8 / link_capacity_, now);
+	if (samples > 0)
+		thresh_epoch_.Invalidate();
 
-void WFQ_Timer::expire(Event* e)
-{
-	queue_->timeout(0);
+	if (debug_ && marking_scheme_ == MQ_MARKING_GENER && samples > 0)
+		printf("%.9f smooth weight sum: %f, sample weight sum: %f after %ld samples\n", now, weight_sum_estimate, weight_sum, samples);
 }
 
 /* Get total length of all queues in bytes */
 int WFQ::TotalByteLength()
 {
-	int result = 0;
-	for (int i = 0; i < queue_num_; i++)
-		result += queues[i].byteLength();
+	return total_bytes_;
+}
 
-	return result;
+/* Ties are broken by queue number, like a linear scan from queue 0 */
+int WFQ::EarlierHead(int q1, int q2)
+{
+	if (queues[q1].headFinishTime != queues[q2].headFinishTime)
+		return queues[q1].headFinishTime < queues[q2].headFinishTime;
+	else
+		return q1 < q2;
 }
 
-/* Determine whether we need to mark ECN where q is current queue number. Return 1 if it requires marking */
-int WFQ::MarkingECN(int q)
+void WFQ::HeapPush(int q)
 {
-	if (q < 0 || q >= queue_num_)
+	int i = active_num++;
+
+	while (i > 0 && EarlierHead(q, active[(i - 1) / 2]))
 	{
-		fprintf (stderr,"illegal queue number\n");
-		exit (1);
+		active[i] = active[(i - 1) / 2];
+		i = (i - 1) / 2;
 	}
+	active[i] = q;
+}
+
+void WFQ::HeapPop()
+{
+	active[0] = active[--active_num];
+	HeapSiftDown(0);
+}
 
-	/* Per-queue ECN marking */
-	if (marking_scheme_ == PER_QUEUE_MARKING)
+void WFQ::HeapSiftDown(int i)
+{
+	int q = active[i];
+	int child;
+
+	while ((child = 2 * i + 1) < active_num)
 	{
-		if (queues[q].byteLength() > queues[q].thresh * mean_pktsize_)
-			return 1;
-		else
-			return 0;
+		if (child + 1 < active_num && EarlierHead(active[child + 1], active[child]))
+			child++;
+		if (!EarlierHead(active[child], q))
+			break;
+		active[i] = active[child];
+		i = child;
 	}
-	/* Per-port ECN marking */
-	else if (marking_scheme_ == PER_PORT_MARKING)
+	active[i] = q;
+}
+
+/* Share of queue q for MQ-ECN for any packet scheduling algorithms: its weight over the sum of weights of active queues */
+bool WFQ::WeightShare(WFQ *s, int q, double *share)
+{
+	if (s->weight_sum_estimate >= 0.000000001)
 	{
-		if (TotalByteLength() > port_thresh_ * mean_pktsize_)
-			return 1;
-		else
-			return 0;
+		*share = s->queues[q].weight / s->weight_sum_estimate;
+		return true;
 	}
-	/* MQ-ECN for any packet scheduling algorithms */
-	else if (marking_scheme_ == MQ_MARKING_GENER)
-	{
-		double thresh = 0;
-		if (weight_sum_estimate >= 0.000000001)
-			thresh = min(queues[q].weight / weight_sum_estimate, 1) * port_thresh_;
-		else
-			thresh = port_thresh_;
+	return false;
+}
 
-		if (queues[q].byteLength() > thresh * mean_pktsize_)
-			return 1;
-		else
-			return 0;
-	}
-	/* PIE-like ECN marking */
-	else if (marking_scheme_ == PIE_MARKING)
+/* Get the marking policy of an ECN marking scheme */
+WFQCore::Marking WFQ::SelectMarking(int scheme)
+{
+	switch (scheme)
 	{
-		double thresh = 0;
-		if (queues[q].avg_dq_rate > 0 && link_capacity_ > 0)
-			thresh = min(queues[q].avg_dq_rate / link_capacity_, 1) * port_thresh_;
-		else
-			thresh = port_thresh_;
+		case PER_QUEUE_MARKING:
+			return WFQCore::PerQueueMarking;
+		case PER_PORT_MARKING:
+			return WFQCore::PerPortMarking;
+		case MQ_MARKING_GENER:
+			return WFQCore::MQMarking<WFQ::WeightShare>;
+		case PIE_MARKING:
+			return WFQCore::MQMarking<WFQCore::DepartureRateShare>;
+		default:
+			return WFQCore::UnknownMarking;
+	}
+}
 
-		if (queues[q].byteLength() > thresh * mean_pktsize_)
-			return 1;
-		else
-			return 0;
+/* Determine whether we need to mark ECN where q is current queue number. Return 1 if it requires marking */
+int WFQ::MarkingECN(int q)
+{
+	if (q < 0 || q >= queue_num_)
+	{
+		fprintf (stderr,"illegal queue number\n");
+		exit (1);
 	}
-	/* Unknown ECN marking scheme */
-	else
+
+	/* Byte thresholds are computed again after OTcl changed mean_pktsize_, port_thresh_ or link_capacity_ */
+	thresh_epoch_.Check(mean_pktsize_, port_thresh_, link_capacity_);
+
+	/* Select the marking policy again only when marking_scheme_ has changed */
+	if (marking_scheme_ != marking_of_)
 	{
-		fprintf(stderr,"Unknown ECN marking scheme\n");
-		return 0;
+		marking_ = SelectMarking(marking_scheme_);
+		marking_of_ = marking_scheme_;
+		thresh_epoch_.Invalidate();
 	}
+	return marking_(this, q);
 }
 
 /*
@@ -159,11 +194,26 @@ int WFQ::MarkingECN(int q)
  *   - $q set-thresh queue_id queue_thresh
  *   - $q attach-total file
  *	 - $q attach-queue file
+ *	 - $q attach-qlen-trace file [interval_us]
+ *	 - $q attach-buffer shared_buffer
  *
  *  NOTE: $q represents the discipline queue variable in OTcl.
  */
 int WFQ::command(int argc, const char*const* argv)
 {
+	// attach a file to write binary qlen records, optionally sampled every interval_us
+	if ((argc == 3 || argc == 4) && strcmp(argv[1], "attach-qlen-trace") == 0)
+	{
+		Tcl& tcl = Tcl::instance();
+		double interval_us = (argc == 4) ? atof(argv[3]) : 0;
+		if (qlen_trace_.attach(tcl.interp(), argv[2], interval_us) != TCL_OK)
+		{
+			tcl.resultf("WFQ: trace: can't attach %s for writing", argv[2]);
+			return (TCL_ERROR);
+		}
+		return (TCL_OK);
+	}
+
 	if (argc == 3)
 	{
 		// attach a file to trace total queue length
@@ -193,6 +243,31 @@ int WFQ::command(int argc, const char*const* argv)
 			}
 			return (TCL_OK);
 		}
+		// attach to the shared buffer of the switch as a new port
+		else if (strcmp(argv[1], "attach-buffer") == 0)
+		{
+			Tcl& tcl = Tcl::instance();
+			//packets queued before would never have been counted by the buffer
+			if (buffer_ != NULL || TotalByteLength() > 0)
+			{
+				tcl.resultf("WFQ: can only attach a shared buffer once, while empty");
+				return (TCL_ERROR);
+			}
+			TclObject *obj = TclObject::lookup(argv[2]);
+			if (obj == NULL)
+			{
+				tcl.resultf("WFQ: no shared buffer named %s", argv[2]);
+				return (TCL_ERROR);
+			}
+			SharedBuffer *buffer = dynamic_cast<SharedBuffer*>(obj);
+			if (buffer == NULL || (buffer_port_ = buffer->Attach()) < 0)
+			{
+				tcl.resultf("WFQ: can't attach shared buffer %s", argv[2]);
+				return (TCL_ERROR);
+			}
+			buffer_ = buffer;
+			return (TCL_OK);
+		}
 	}
 	else if (argc == 4)
 	{
@@ -205,6 +280,7 @@ int WFQ::command(int argc, const char*const* argv)
 				if (weight > 0)
 				{
 					queues[queue_id].weight = weight;
+					thresh_epoch_.Invalidate();
 					return (TCL_OK);
 				}
 				else
@@ -229,6 +305,7 @@ int WFQ::command(int argc, const char*const* argv)
 				if (thresh >= 0)
 				{
 					queues[queue_id].thresh = thresh;
+					thresh_epoch_.Invalidate();
 					return (TCL_OK);
 				}
 				else
@@ -261,12 +338,15 @@ void WFQ::enque(Packet *p)
 
 	if (init == 0)
 	{
-		/* Start timer*/
+		/* Start sampling weight_sum_estimate */
 		if (marking_scheme_ == MQ_MARKING_GENER && estimate_weight_enable_timer_ && estimate_weight_interval_bytes_ > 0 && link_capacity_ > 0)
-			timer_.resched(estimate_weight_interval_bytes_ * 8 / link_capacity_);
+			weight_estimate_.Start(Scheduler::instance().clock(), estimate_weight_interval_bytes_ * 8 / link_capacity_);
 		init = 1;
 	}
 
+	/* Samples due before this packet arrived */
+	SampleWeightSum(Scheduler::instance().clock());
+
 	if (TotalByteLength() == 0 && marking_scheme_ == MQ_MARKING_GENER && !estimate_weight_enable_timer_)
 	{
 		double now = Scheduler::instance().clock();
@@ -276,6 +356,7 @@ void WFQ::enque(Packet *p)
 		else
 			weight_sum_estimate = 0;
 
+		thresh_epoch_.Invalidate();
 		last_update_time = now;
 		if(debug_)
 			printf("%.9f smooth weight sum is reset to %f\n", now, weight_sum_estimate);
@@ -292,6 +373,13 @@ void WFQ::enque(Packet *p)
 	if (prio >= queue_num_ || prio < 0)
 		prio = queue_num_ - 1;
 
+	/* Dynamic threshold of the shared buffer */
+	if (buffer_ && !buffer_->Admit(buffer_port_, prio, pktSize))
+	{
+		drop(p);
+		return;
+	}
+
 	/* If queue for the flow is empty, calculate headFinishTime and currTime */
 	if (queues[prio].length() == 0)
 	{
@@ -300,6 +388,7 @@ void WFQ::enque(Packet *p)
 		{
 			queues[prio].headFinishTime = currTime + pktSize / queues[prio].weight ;
 			currTime = queues[prio].headFinishTime;
+			HeapPush(prio);
 		}
 		/* In theory, weight should never be zero or negative */
 		else
@@ -311,42 +400,36 @@ void WFQ::enque(Packet *p)
 
 	/* Enqueue ECN marking */
 	queues[prio].enque(p);
+	total_bytes_ += pktSize;
+	if (buffer_)
+		buffer_->Enque(buffer_port_, prio, pktSize);
 	if (marking_scheme_ != LATENCY_MARKING && MarkingECN(prio) > 0 && hf->ect())
+	{
 		hf->ce() = 1;
+		qlen_trace_.mark(prio);
+	}
 	/* For dequeue latency ECN marking ,record enqueue timestamp here */
 	else if (marking_scheme_ == LATENCY_MARKING && hf->ect())
 		hc->timestamp() = Scheduler::instance().clock();
 
-	trace_qlen();
-	trace_total_qlen();
+	WFQCore::Trace(this, prio);
 }
 
 Packet *WFQ::deque(void)
 {
 	Packet *pkt = NULL, *nextPkt = NULL;
-	hdr_flags* hf = NULL;
-	hdr_cmn* hc = NULL;
-	long double minT = LDBL_MAX ;
 	int queue = -1;
-	double sojourn_time = 0;
-	double latency_thresh = 0;
 	int pktSize = 0;
 
+	/* Samples due before this packet leaves */
+	SampleWeightSum(Scheduler::instance().clock());
+
 	/* Switch port is not empty */
 	if (TotalByteLength() > 0)
 	{
-		/* look for the candidate queue with the earliest virtual finish time */
-		for (int i = 0; i < queue_num_; i++)
-		{
-			if (queues[i].length() == 0)
-				continue;
-
-			if (queues[i].headFinishTime < minT)
-			{
-				queue = i;
-				minT = queues[i].headFinishTime;
-			}
-		}
+		/* the candidate queue with the earliest virtual finish time is at the top of the heap */
+		if (active_num > 0)
+			queue = active[0];
 
 		if (queue == -1 && TotalByteLength() > 0)
 		{
@@ -356,73 +439,15 @@ Packet *WFQ::deque(void)
 
 		pkt = queues[queue].deque();
 		pktSize = hdr_cmn::access(pkt)->size();
+		total_bytes_ -= pktSize;
+		if (buffer_)
+			buffer_->Deque(buffer_port_, queue, pktSize);
 		/* dequeue latency-based ECN marking */
 		if (marking_scheme_ == LATENCY_MARKING)
-		{
-			hc = hdr_cmn::access(pkt);
-			hf = hdr_flags::access(pkt);
-			sojourn_time = Scheduler::instance().clock() - hc->timestamp();
-			if (link_capacity_ > 0)
-				latency_thresh = port_thresh_ * mean_pktsize_ * 8 / link_capacity_;
+			WFQCore::LatencyMarking(this, pkt, queue);
 
-			if (hf->ect() && sojourn_time > latency_thresh)
-			{
-				hf->ce() = 1;
-				if (debug_)
-					printf("sojourn time %.9f > threshold %.9f\n", sojourn_time, latency_thresh);
-			}
-			hc->timestamp() = 0;
-		}
-
-		/* If current queue is about 10KB or more and dq_count is unset
-		 * we have enough packets to calculate the drain rate. Save
-		 * current time as dq_tstamp and start measurement cycle.
-		 */
-		if (queues[queue].byteLength() >= dq_thresh_ && queues[queue].dq_count == DQ_COUNT_INVALID)
-		{
-			queues[queue].dq_tstamp = Scheduler::instance().clock();
-			queues[queue].dq_count = 0;
-		}
-
-		/* Calculate the average drain rate from this value.  If queue length
-		 * has receded to a small value viz., <= dq_thresh_bytes,reset
-		 * the dq_count to -1 as we don't have enough packets to calculate the
-		 * drain rate anymore The following if block is entered only when we
-		 * have a substantial queue built up (dq_thresh_ bytes or more)
-		 * and we calculate the drain rate for the threshold here.*/
-		if (queues[queue].dq_count != DQ_COUNT_INVALID)
-		{
-			queues[queue].dq_count += pktSize;
-			if (queues[queue].dq_count >= dq_thresh_)
-			{
-				//take transmission time into account
-				double interval = Scheduler::instance().clock() - queues[queue].dq_tstamp + pktSize * 8 / link_capacity_;
-				double rate = queues[queue].dq_count * 8 / interval;
-
-				//initialize avg_dq_rate for this queue
-				if (queues[queue].avg_dq_rate < 0)
-					queues[queue].avg_dq_rate = rate;
-				else
-					queues[queue].avg_dq_rate = queues[queue].avg_dq_rate * estimate_rate_alpha_ + rate * (1 - estimate_rate_alpha_);
-
-				/* If the queue has receded below the threshold, we hold
-				 * on to the last drain rate calculated, else we reset
-				 * dq_count to 0 to re-enter the if block when the next
-				 * packet is dequeued
-				 */
-				if (queues[queue].byteLength() < dq_thresh_)
-					queues[queue].dq_count = DQ_COUNT_INVALID;
-				else
-				{
-					queues[queue].dq_count = 0;
-					//take transmission time into account
-					queues[queue].dq_tstamp = Scheduler::instance().clock() + pktSize * 8 / link_capacity_;
-				}
-
-				if (debug_ && marking_scheme_ == PIE_MARKING)
-					printf("[queue %d] sample departure rate : %.2f average departure rate: %.2f\n", queue, rate, queues[queue].avg_dq_rate);
-			}
-		}
+		WFQCore::DepartureRate(this, queue, pktSize);
+		WFQCore::TraceQlenBin(this, queue);
 
 		/* Set the headFinishTime for the remaining head packet in the queue */
 		nextPkt = queues[queue].head();
@@ -433,6 +458,7 @@ Packet *WFQ::deque(void)
 				queues[queue].headFinishTime = queues[queue].headFinishTime + (hdr_cmn::access(nextPkt)->size()) / queues[queue].weight;
 				if (currTime < queues[queue].headFinishTime)
 					currTime = queues[queue].headFinishTime;
+				HeapSiftDown(0);
 			}
 			else
 			{
@@ -445,6 +471,7 @@ Packet *WFQ::deque(void)
 		{
 			weight_sum -= queues[queue].weight;
 			queues[queue].headFinishTime = LDBL_MAX;
+			HeapPop();
 		}
 	}
 
@@ -455,6 +482,7 @@ Packet *WFQ::deque(void)
 		if (estimate_weight_interval_bytes_ > 0 && link_capacity_ > 0 && timeInterval >= 0.995 * estimate_weight_interval_bytes_ * 8 / link_capacity_)
 		{
 			weight_sum_estimate = weight_sum_estimate * estimate_weight_alpha_ + weight_sum * (1 - estimate_weight_alpha_);
+			thresh_epoch_.Invalidate();
 			last_update_time = now;
 			if(debug_)
 				printf("%.9f smooth weight sum: %f, sample weight sum: %f\n", now, weight_sum_estimate, weight_sum);
@@ -466,43 +494,3 @@ Packet *WFQ::deque(void)
 
 	return pkt;
 }
-
-/* routine to write total qlen records */
-void WFQ::trace_total_qlen()
-{
-	if (total_qlen_tchan_)
-	{
-		char wrk[500] = {0};
-		int n;
-		double t = Scheduler::instance().clock();
-		sprintf(wrk, "%g, %d", t, TotalByteLength());
-		n = strlen(wrk);
-		wrk[n] = '\n';
-		wrk[n+1] = 0;
-		(void)Tcl_Write(total_qlen_tchan_, wrk, n+1);
-	}
-}
-
-/* routine to write per-queue qlen records */
-void WFQ::trace_qlen()
-{
-	if (qlen_tchan_)
-	{
-		char wrk[500] = {0};
-		int n;
-		double t = Scheduler::instance().clock();
-		sprintf(wrk, "%g", t);
-		n = strlen(wrk);
-		wrk[n] = 0;
-		(void)Tcl_Write(qlen_tchan_, wrk, n);
-
-		for (int i = 0; i < min(queue_num_, MAX_QUEUE_NUM); i++)
-		{
-			sprintf(wrk, ", %d",queues[i].byteLength());
-			n = strlen(wrk);
-			wrk[n] = 0;
-			(void)Tcl_Write(qlen_tchan_, wrk, n);
-		}
-		(void)Tcl_Write(qlen_tchan_, "\n", 1);
-	}
-}
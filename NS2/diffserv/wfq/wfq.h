@@ -4,7 +4,8 @@
 #include "queue.h"
 #include "config.h"
 #include "trace.h"
-#include "timer-handler.h"
+#include "sched-core.h"
+#include "shared-buffer.h"
 
 #include <iostream>
 #include <queue>
@@ -13,43 +14,16 @@ using namespace std;
 /* Maximum queue number */
 #define MAX_QUEUE_NUM 64
 
-/* Per-queue ECN marking */
-#define PER_QUEUE_MARKING 0
-/* Per-port ECN marking */
-#define PER_PORT_MARKING 1
-/* MQ-ECN for any packet scheduling algorithms */
-#define MQ_MARKING_GENER 2
-/* Dequeue latency-based ECN marking */
-#define LATENCY_MARKING 4
-/* PIE-like ECN marking */
-#define PIE_MARKING 5
-
-#define DQ_COUNT_INVALID -1
-
 class WFQ;
 class PacketWFQ;
 
-class WFQ_Timer : public TimerHandler
-{
-public:
-	WFQ_Timer(WFQ *q) : TimerHandler() { queue_ = q;}
-
-protected:
-	virtual void expire(Event *e);
-	WFQ *queue_;
-};
-
-class PacketWFQ : public PacketQueue
+class PacketWFQ : public SchedQueue
 {
 	public:
-		PacketWFQ(): weight(10000.0), headFinishTime(0), thresh(0), dq_tstamp(0), dq_count(DQ_COUNT_INVALID), avg_dq_rate(-1) {}
+		PacketWFQ(): weight(10000.0), headFinishTime(0) {}
 
 		double weight;	//weight of the service
   		long double headFinishTime;	//finish time of the packet at head of this queue.
-		double thresh;	//per-queue ECN marking threshold (pkts)
-		double dq_tstamp;	//measurement start time
-		int dq_count;	//measured in bytes
-		double avg_dq_rate;	//average drain rate (bps)
 
 		friend class WFQ;
 };
@@ -59,25 +33,40 @@ class WFQ : public Queue
 	public:
 		WFQ();
 		~WFQ();
-		void timeout(int);
 		virtual int command(int argc, const char*const* argv);
 
 	protected:
 		Packet *deque(void);
 		void enque(Packet *pkt);
 
-		int TotalByteLength();	// Get total length of all queues in bytes
+		int TotalByteLength();	// Get total length of all queues in bytes (O(1))
 		int MarkingECN(int q); // Determine whether we need to mark ECN, q is current queue number
+		void SampleWeightSum(double now);	//Apply the samples of weight_sum_estimate due by now
+		static SchedCore<WFQ>::Marking SelectMarking(int scheme);	// Marking policy of an ECN marking scheme
+		static bool WeightShare(WFQ *s, int q, double *share);	// Share of queue q for MQ_MARKING_GENER
+		SchedQueue *GetQueue(int q) { return &queues[q]; }
+		int QueueNum() { return (queue_num_ < MAX_QUEUE_NUM) ? queue_num_ : MAX_QUEUE_NUM; }
+		int QueueByteLength(int q) { return GetQueue(q)->byteLength(); }
+		int EarlierHead(int q1, int q2);	// Whether the head packet of queue q1 should be served before that of q2
+		void HeapPush(int q);	// Add a queue that becomes non-empty to the heap
+		void HeapPop();	// Remove the queue at the top of the heap
+		void HeapSiftDown(int i);	// Restore the heap after the headFinishTime of active[i] increases
 
 		/* Variables */
 		struct PacketWFQ *queues;	// Underlying multi-FIFO (CoS) queues
+		int active[MAX_QUEUE_NUM];	// Binary min-heap of non-empty queues keyed by headFinishTime
+		int active_num;	// Number of queues in the heap
+		int total_bytes_;	// Total length of all queues in bytes
 		long double currTime;	//Finish time assigned to last packet
-		WFQ_Timer timer_;	//Underlying timer for weight_sum_estimate update
+		PeriodicEstimate weight_estimate_;	//samples of weight_sum_estimate every estimate_weight_interval_bytes_ (estimate_weight_enable_timer_)
 		double weight_sum_estimate;	//estimation value for sum of weights of all non-empty  queues
 		double weight_sum;	//sum of weights of all non-empty queues
 		double last_update_time;	//last time when we update quantum_sum_estimate
 		double last_idle_time;	//Last time when link becomes idle
-		int init;	//whether the timer has been started
+		int init;	//whether the estimator has been started
+		SchedCore<WFQ>::Marking marking_;	//marking policy selected for marking_of_
+		int marking_of_;	//marking_scheme_ when marking_ was selected
+		ThreshEpoch thresh_epoch_;	//epoch of the byte thresholds of queues
 
 		int queue_num_;	//number of queues
 		int mean_pktsize_;	//MTU in bytes
@@ -85,7 +74,7 @@ class WFQ : public Queue
 		int marking_scheme_;	//ECN marking policy
 		double estimate_weight_alpha_;	//factor between 0 and 1 for weight estimation
 		double estimate_weight_interval_bytes_;	//time interval is estimate_weight_interval_bytes_/link capacity.
-		int estimate_weight_enable_timer_;	//whether we use real timer (TimerHandler) for weight estimation
+		int estimate_weight_enable_timer_;	//whether weight_sum_estimate is sampled every interval since the first packet, not at dequeue
 		int dq_thresh_;	//threshold for departure rate estimation
 		double estimate_rate_alpha_;	//factor between 0 and 1 for departure rate estimation
 		double link_capacity_;	//Link capacity
@@ -93,8 +82,11 @@ class WFQ : public Queue
 
 		Tcl_Channel total_qlen_tchan_;	// Place to write total_qlen records
 		Tcl_Channel qlen_tchan_;	// Place to write per-queue qlen records
-		void trace_total_qlen();	// Routine to write total qlen records
-		void trace_qlen();	// Routine to write per-queue qlen records
+		QlenTrace qlen_trace_;	// Records of the binary qlen trace
+		SharedBuffer *buffer_;	// Shared buffer of the switch, NULL if we only use qlim_
+		int buffer_port_;	// Our port ID in buffer_
+
+		friend class SchedCore<WFQ>;
 };
 
 #endif
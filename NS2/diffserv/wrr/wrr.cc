@@ -8,6 +8,8 @@
 #define max(arg1,arg2) (arg1>arg2 ? arg1 : arg2)
 #define min(arg1,arg2) (arg1<arg2 ? arg1 : arg2)
 
+typedef SchedCore<WRR> WRRCore;
+
 static class WRRClass : public TclClass
 {
 	public:
@@ -24,8 +26,13 @@ WRR::WRR()
 
 	round_time = 0;
 	last_idle_time = 0;
+	marking_ = WRRCore::UnknownMarking;
+	marking_of_ = -1;
 	init = false;
 	current = 0;
+	active = 0;
+	skip_start = 0;
+	total_bytes_ = 0;
 
 	total_qlen_tchan_ = NULL;
 	qlen_tchan_ = NULL;
@@ -62,12 +69,95 @@ WRR::~WRR()
 /* Get total length of all queues in bytes */
 int WRR::TotalByteLength()
 {
-	int result = 0;
+	return total_bytes_;
+}
+
+/* Mask of queues from, from+1, ..., to-1 (mod queue_num_). All queues if from == to */
+unsigned long long WRR::RangeMask(int from, int to)
+{
+	unsigned long long all = (queue_num_ >= 64) ? ~0ULL : (1ULL << queue_num_) - 1;
+	unsigned long long below_from = (1ULL << from) - 1;
+	unsigned long long below_to = (1ULL << to) - 1;
+
+	if (from < to)
+		return below_to & ~below_from;
+	else
+		return (all & ~below_from) | below_to;
+}
+
+/* First non-empty queue starting from q in round robin order. At least one queue must be active */
+int WRR::NextActive(int q)
+{
+	unsigned long long after = active & ~((1ULL << q) - 1);
+
+	if (after)
+		return __builtin_ctzll(after);
+	else
+		return __builtin_ctzll(active);
+}
+
+/*
+ * The scheduler used to visit empty queues one by one and set their start_time
+ * to the current time. Instead, deque() jumps from an empty queue to the next
+ * active one and only records where the skipped run starts and when. Skip times
+ * along the last round are split into runs: a run starts at each set bit of
+ * skip_start and lasts until the next set bit. The first queue after the skipped
+ * run keeps the skip time it had before.
+ */
+void WRR::SkipEmpty(int from, int to, double now)
+{
+	double old = SkipTime(to);
+
+	skip_start &= ~RangeMask(from, to);
+	skip_start |= (1ULL << from) | (1ULL << to);
+	skip_time[from] = now;
+	skip_time[to] = old;
+}
+
+/* Last time when queue q was skipped while empty, 0 if never */
+double WRR::SkipTime(int q)
+{
+	unsigned long long upto = skip_start & ((q >= 63) ? ~0ULL : (1ULL << (q + 1)) - 1);
 
-	for (int i = 0; i < queue_num_; i++)
-		result += queues[i].byteLength();
+	if (upto)
+		return skip_time[63 - __builtin_clzll(upto)];
+	else if (skip_start)
+		return skip_time[63 - __builtin_clzll(skip_start)];
+	else
+		return 0;
+}
+
+/* Share of queue q for MQ-ECN for round robin packet scheduling algorithms: its quantum per round time */
+bool WRR::RoundShare(WRR *s, int q, double *share)
+{
+	bool valid = s->round_time >= 0.000000001 && s->link_capacity_ > 0;
 
-	return result;
+	if (valid)
+		*share = s->queues[q].quantum * 8 / s->round_time / s->link_capacity_;
+
+	//For debug
+	if (s->debug_)
+		printf("round time: %.9f threshold of queue %d: %f\n", s->round_time, q, valid ? min(*share, 1) * s->port_thresh_ : s->port_thresh_);
+
+	return valid;
+}
+
+/* Get the marking policy of an ECN marking scheme */
+WRRCore::Marking WRR::SelectMarking(int scheme)
+{
+	switch (scheme)
+	{
+		case PER_QUEUE_MARKING:
+			return WRRCore::PerQueueMarking;
+		case PER_PORT_MARKING:
+			return WRRCore::PerPortMarking;
+		case MQ_MARKING_RR:
+			return WRRCore::MQMarking<WRR::RoundShare>;
+		case PIE_MARKING:
+			return WRRCore::MQMarking<WRRCore::DepartureRateShare>;
+		default:
+			return WRRCore::UnknownMarking;
+	}
 }
 
 /* Determine whether we need to mark ECN where q is current queue number. Return 1 if it requires marking */
@@ -79,60 +169,17 @@ int WRR::MarkingECN(int q)
 		exit (1);
 	}
 
-	/* Per-queue ECN marking */
-	if (marking_scheme_ == PER_QUEUE_MARKING)
-	{
-		if (queues[q].byteLength() > queues[q].thresh * mean_pktsize_)
-			return 1;
-		else
-			return 0;
-	}
-	/* Per-port ECN marking */
-	else if (marking_scheme_ == PER_PORT_MARKING)
-	{
-		if (TotalByteLength() > port_thresh_ * mean_pktsize_)
-			return 1;
-		else
-			return 0;
-	}
-	/* MQ-ECN for round robin packet scheduling algorithms */
-	else if (marking_scheme_ == MQ_MARKING_RR)
-	{
-		double thresh = 0;
-		if (round_time >= 0.000000001 && link_capacity_ > 0)
-			thresh = min(queues[q].quantum * 8 / round_time / link_capacity_, 1) * port_thresh_;
-		else
-			thresh=port_thresh_;
-
-		//For debug
-		if(debug_)
-			printf("round time: %.9f threshold of queue %d: %f\n", round_time, q, thresh);
-
-		if (queues[q].byteLength() > thresh * mean_pktsize_)
-			return 1;
-		else
-			return 0;
-	}
-	/* PIE-like ECN marking */
-	else if (marking_scheme_ == PIE_MARKING)
-	{
-		double thresh = 0;
-		if (queues[q].avg_dq_rate > 0 && link_capacity_ > 0)
-			thresh = min(queues[q].avg_dq_rate / link_capacity_, 1) * port_thresh_;
-		else
-			thresh = port_thresh_;
+	/* Byte thresholds are computed again after OTcl changed mean_pktsize_, port_thresh_ or link_capacity_ */
+	thresh_epoch_.Check(mean_pktsize_, port_thresh_, link_capacity_);
 
-		if (queues[q].byteLength() > thresh * mean_pktsize_)
-			return 1;
-		else
-			return 0;
-	}
-	/* Unknown ECN marking scheme */
-	else
+	/* Select the marking policy again only when marking_scheme_ has changed */
+	if (marking_scheme_ != marking_of_)
 	{
-		fprintf (stderr, "Unknown ECN marking scheme\n");
-		return 0;
+		marking_ = SelectMarking(marking_scheme_);
+		marking_of_ = marking_scheme_;
+		thresh_epoch_.Invalidate();
 	}
+	return marking_(this, q);
 }
 
 /*
@@ -141,11 +188,25 @@ int WRR::MarkingECN(int q)
  *   - $q set-thresh queue_id queue_thresh
  *   - $q attach-total file
  *	 - $q attach-queue file
+ *	 - $q attach-qlen-trace file [interval_us]
  *
  *  NOTE: $q represents the discipline queue variable in OTcl.
  */
 int WRR::command(int argc, const char*const* argv)
 {
+	// attach a file to write binary qlen records, optionally sampled every interval_us
+	if ((argc == 3 || argc == 4) && strcmp(argv[1], "attach-qlen-trace") == 0)
+	{
+		Tcl& tcl = Tcl::instance();
+		double interval_us = (argc == 4) ? atof(argv[3]) : 0;
+		if (qlen_trace_.attach(tcl.interp(), argv[2], interval_us) != TCL_OK)
+		{
+			tcl.resultf("WRR: trace: can't attach %s for writing", argv[2]);
+			return (TCL_ERROR);
+		}
+		return (TCL_OK);
+	}
+
 	if (argc == 3)
 	{
 		// attach a file to trace total queue length
@@ -187,6 +248,7 @@ int WRR::command(int argc, const char*const* argv)
 				if (quantum > 0)
 				{
 					queues[queue_id].quantum = quantum;
+					thresh_epoch_.Invalidate();
 					return (TCL_OK);
 				}
 				else
@@ -211,6 +273,7 @@ int WRR::command(int argc, const char*const* argv)
 				if (thresh >= 0)
 				{
 					queues[queue_id].thresh = thresh;
+					thresh_epoch_.Invalidate();
 					return (TCL_OK);
 				}
 				else
@@ -255,10 +318,13 @@ void WRR::enque(Packet *p)
 		{
 			round_time = 0;
 		}
+		thresh_epoch_.Invalidate();
 
-		/* Reset start time for all queues */
-		for(int i = 0; i < queue_num_; i++)
-			queues[i].start_time = now;
+		/* Reset start time for all queues: they all count as skipped now. Only the
+		 * queue served last, just before current, can have a later start_time */
+		skip_start = 1ULL;
+		skip_time[0] = now;
+		queues[(current + queue_num_ - 1) % queue_num_].start_time = now;
 
 		if(debug_)
 			printf("%.9f smooth round time is reset to %f after %d idle time slots\n", now, round_time, intervalNum);
@@ -276,27 +342,33 @@ void WRR::enque(Packet *p)
 	if (prio >= queue_num_ || prio < 0)
 		prio = queue_num_ - 1;
 
+	/* The queue becomes active. If the scheduler has skipped it since it was last served, it waits since then */
+	if (queues[prio].length() == 0)
+	{
+		queues[prio].start_time = max(queues[prio].start_time, SkipTime(prio));
+		active |= 1ULL << prio;
+	}
+
 	queues[prio].enque(p);
+	total_bytes_ += pktSize;
 	/* Enqueue ECN marking */
 	if (marking_scheme_ != LATENCY_MARKING && MarkingECN(prio) > 0 && hf->ect())
+	{
 		hf->ce() = 1;
+		qlen_trace_.mark(prio);
+	}
 	/* For dequeue latency ECN marking ,record enqueue timestamp here */
 	else if (marking_scheme_ == LATENCY_MARKING && hf->ect())
 		hc->timestamp() = Scheduler::instance().clock();
 
-	trace_qlen();
-	trace_total_qlen();
+	WRRCore::Trace(this, prio);
 }
 
 Packet *WRR::deque(void)
 {
 	Packet *pkt = NULL;
-	hdr_flags* hf = NULL;
-	hdr_cmn* hc = NULL;
 	int pktSize = 0;
 	double round_time_sample = 0;
-	double sojourn_time = 0;
-	double latency_thresh = 0;
 
 	/*At least one queue is active*/
 	if (TotalByteLength() > 0)
@@ -320,80 +392,22 @@ Packet *WRR::deque(void)
 				{
 					pkt = queues[current].deque();
 					queues[current].counter -= pktSize;
+					total_bytes_ -= pktSize;
 
 					/* dequeue latency-based ECN marking */
 					if (marking_scheme_ == LATENCY_MARKING)
-					{
-						hc = hdr_cmn::access(pkt);
-						hf = hdr_flags::access(pkt);
-						sojourn_time = Scheduler::instance().clock() - hc->timestamp();
-						if (link_capacity_ > 0)
-							latency_thresh = port_thresh_ * mean_pktsize_ * 8 / link_capacity_;
-
-						if (hf->ect() && sojourn_time > latency_thresh)
-						{
-							hf->ce() = 1;
-							if (debug_)
-								printf("sojourn time %.9f > threshold %.9f\n", sojourn_time, latency_thresh);
-						}
-						hc->timestamp() = 0;
-					}
-
-					/* If current queue is about 10KB or more and dq_count is unset
-					 * we have enough packets to calculate the drain rate. Save
-					 * current time as dq_tstamp and start measurement cycle.
-					 */
-					if (queues[current].byteLength() >= dq_thresh_ && queues[current].dq_count == DQ_COUNT_INVALID)
-					{
-						queues[current].dq_tstamp = Scheduler::instance().clock();
-						queues[current].dq_count = 0;
-					}
+						WRRCore::LatencyMarking(this, pkt, current);
 
-					/* Calculate the average drain rate from this value.  If queue length
-					 * has receded to a small value viz., <= dq_thresh_bytes,reset
-					 * the dq_count to -1 as we don't have enough packets to calculate the
-					 * drain rate anymore The following if block is entered only when we
-					 * have a substantial queue built up (dq_thresh_ bytes or more)
-					 * and we calculate the drain rate for the threshold here.*/
-					if (queues[current].dq_count != DQ_COUNT_INVALID)
-					{
-						queues[current].dq_count += pktSize;
-						if (queues[current].dq_count >= dq_thresh_)
-						{
-							//take transmission time into account
-							double interval = Scheduler::instance().clock() - queues[current].dq_tstamp + pktSize * 8 / link_capacity_;
-							double rate = queues[current].dq_count * 8 / interval;
-
-							//initialize avg_dq_rate for this queue
-							if (queues[current].avg_dq_rate < 0)
-								queues[current].avg_dq_rate = rate;
-							else
-								queues[current].avg_dq_rate = queues[current].avg_dq_rate * estimate_rate_alpha_ + rate * (1 - estimate_rate_alpha_);
-
-							/* If the queue has receded below the threshold, we hold
-							 * on to the last drain rate calculated, else we reset
-							 * dq_count to 0 to re-enter the if block when the next
-							 * packet is dequeued
-							 */
-							if (queues[current].byteLength() < dq_thresh_)
-								queues[current].dq_count = DQ_COUNT_INVALID;
-							else
-							{
-								queues[current].dq_count = 0;
-								//take transmission time into account
-								queues[current].dq_tstamp = Scheduler::instance().clock() + pktSize * 8 / link_capacity_;
-							}
-
-							if (debug_ && marking_scheme_ == PIE_MARKING)
-								printf("[queue %d] sample departure rate : %.2f average departure rate: %.2f\n", current, rate, queues[current].avg_dq_rate);
-						}
-					}
+					WRRCore::DepartureRate(this, current, pktSize);
+					WRRCore::TraceQlenBin(this, current);
 
 					/* After dequeue, current queue becomes empty */
 					if (queues[current].length() == 0)
 					{
+						active &= ~(1ULL << current);
 						round_time_sample = Scheduler::instance().clock() - queues[current].start_time + pktSize * 8 / link_capacity_;
 						round_time = round_time * estimate_round_alpha_ + round_time_sample * (1 - estimate_round_alpha_);
+						thresh_epoch_.Invalidate();
 						if (debug_ && marking_scheme_ == MQ_MARKING_RR)
 							printf("sample round time: %.9f round time: %.9f\n", round_time_sample, round_time);
 
@@ -410,6 +424,7 @@ Packet *WRR::deque(void)
 				{
 					round_time_sample = Scheduler::instance().clock() - queues[current].start_time;
 					round_time = round_time * estimate_round_alpha_ + round_time_sample * (1 - estimate_round_alpha_);
+					thresh_epoch_.Invalidate();
 					if (debug_ && marking_scheme_ == MQ_MARKING_RR)
 						printf("sample round time: %.9f round time: %.9f\n", round_time_sample, round_time);
 
@@ -418,12 +433,12 @@ Packet *WRR::deque(void)
 					current = (current + 1) % queue_num_;
 				}
 			}
-			/* Empty queue! No need to do any sample. Just move to next queue */
+			/* Empty queue! No need to do any sample. Just move to next active queue */
 			else
 			{
-				queues[current].start_time = Scheduler::instance().clock();
-				queues[current].counter_updated = false;
-				current = (current + 1) % queue_num_;
+				int next = NextActive(current);
+				SkipEmpty(current, next, Scheduler::instance().clock());
+				current = next;
 			}
 		}
 	}
@@ -433,43 +448,3 @@ Packet *WRR::deque(void)
 
 	return pkt;
 }
-
-/* routine to write total qlen records */
-void WRR::trace_total_qlen()
-{
-	if (total_qlen_tchan_)
-	{
-		char wrk[500] = {0};
-		int n;
-		double t = Scheduler::instance().clock();
-		sprintf(wrk, "%g, %d", t,TotalByteLength());
-		n = strlen(wrk);
-		wrk[n] = '\n';
-		wrk[n+1] = 0;
-		(void)Tcl_Write(total_qlen_tchan_, wrk, n+1);
-	}
-}
-
-/* routine to write per-queue qlen records */
-void WRR::trace_qlen()
-{
-	if (qlen_tchan_)
-	{
-		char wrk[500] = {0};
-		int n;
-		double t = Scheduler::instance().clock();
-		sprintf(wrk, "%g", t);
-		n = strlen(wrk);
-		wrk[n] = 0;
-		(void)Tcl_Write(qlen_tchan_, wrk, n);
-
-		for (int i = 0; i < queue_num_; i++)
-		{
-			sprintf(wrk, ", %d", queues[i].byteLength());
-			n = strlen(wrk);
-			wrk[n] = 0;
-			(void)Tcl_Write(qlen_tchan_, wrk, n);
-		}
-		(void)Tcl_Write(qlen_tchan_, "\n", 1);
-	}
-}
@@ -4,40 +4,27 @@
 #include "queue.h"
 #include "config.h"
 #include "trace.h"
+#include "sched-core.h"
 
 /*Maximum queue number */
 #define MAX_QUEUE_NUM 64
 
-/* Per-queue ECN marking */
-#define PER_QUEUE_MARKING 0
-/* Per-port ECN marking */
-#define PER_PORT_MARKING 1
-/* MQ-ECN for any packet scheduling algorithms */
-//#define MQ_MARKING_GENER 2
-/* MQ-ECN for round robin packet scheduling algorithms */
-#define MQ_MARKING_RR 3
-/* Dequeue latency-based ECN marking */
-#define LATENCY_MARKING 4
-/* PIE-like ECN marking */
-#define PIE_MARKING 5
-
-#define DQ_COUNT_INVALID -1
+/* Active queues and pass times are kept in 64-bit masks */
+#if MAX_QUEUE_NUM > 64
+#error "MAX_QUEUE_NUM must not exceed 64"
+#endif
 
 class PacketWRR;
 class WRR;
 
-class PacketWRR: public PacketQueue
+class PacketWRR: public SchedQueue
 {
 	public:
-		PacketWRR(): quantum(1500), counter(0), thresh(0), start_time(0), dq_tstamp(0), dq_count(DQ_COUNT_INVALID), avg_dq_rate(-1), counter_updated(false) {}
+		PacketWRR(): quantum(1500), counter(0), start_time(0), counter_updated(false) {}
 
 		int quantum;	//quantum of this queue
 		int counter;	//counter for bytes that can be sent in this round
-		double thresh;	// per-queue ECN marking threshold (pkts)
 		double start_time;	//time when the queue waits for scheduling in this round
-		double dq_tstamp;	//measurement start time
-		int dq_count;	//measured in bytes
-		double avg_dq_rate;	//average drain rate (bps)
 		bool counter_updated; //whether the counter has been updated in this round
 
 		friend class WRR;
@@ -53,8 +40,17 @@ class WRR : public Queue
 	protected:
 		Packet *deque(void);
 		void enque(Packet *pkt);
-		int TotalByteLength();	//Get total length of all queues in bytes
+		int TotalByteLength();	//Get total length of all queues in bytes (O(1))
 		int MarkingECN(int q);	//Determine whether we need to mark ECN, q is current queue number
+		static SchedCore<WRR>::Marking SelectMarking(int scheme);	//marking policy of an ECN marking scheme
+		static bool RoundShare(WRR *s, int q, double *share);	//share of queue q for MQ_MARKING_RR
+		SchedQueue *GetQueue(int q) { return &queues[q]; }
+		int QueueNum() { return queue_num_; }
+		int QueueByteLength(int q) { return GetQueue(q)->byteLength(); }
+		unsigned long long RangeMask(int from, int to);	//Mask of queues from, from+1, ..., to-1 in round robin order
+		int NextActive(int q);	//First non-empty queue starting from q in round robin order
+		void SkipEmpty(int from, int to, double now);	//Record that the scheduler skipped empty queues from ... to-1 at now
+		double SkipTime(int q);	//Last time when the scheduler skipped queue q while it was empty
 
 		/* Variables */
 		PacketWRR *queues;	//underlying multi-FIFO (CoS) queues
@@ -62,6 +58,13 @@ class WRR : public Queue
 		double last_idle_time;	//Last time when link becomes idle
 		bool init;
 		int current;	//current queue ID
+		unsigned long long active;	//bit i is set if queue i is non-empty
+		unsigned long long skip_start;	//bit i is set if queue i starts a run of queues skipped at skip_time[i]
+		double skip_time[MAX_QUEUE_NUM];	//time of the skip starting at queue i
+		int total_bytes_;	//total length of all queues in bytes
+		SchedCore<WRR>::Marking marking_;	//marking policy selected for marking_of_
+		int marking_of_;	//marking_scheme_ when marking_ was selected
+		ThreshEpoch thresh_epoch_;	//epoch of the byte thresholds of queues
 
 		int queue_num_;	//number of queues
 		int mean_pktsize_;	//MTU in bytes
@@ -76,8 +79,9 @@ class WRR : public Queue
 
 		Tcl_Channel total_qlen_tchan_;	//place to write total_qlen records
 		Tcl_Channel qlen_tchan_;	//place to write per-queue qlen records
-		void trace_total_qlen();	//routine to write total qlen records
-		void trace_qlen();	//routine to write per-queue qlen records
+		QlenTrace qlen_trace_;	//records of the binary qlen trace
+
+		friend class SchedCore<WRR>;
 };
 
 #endif
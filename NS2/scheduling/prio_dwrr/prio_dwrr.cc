@@ -9,6 +9,8 @@
 #define max(arg1,arg2) (arg1>arg2 ? arg1 : arg2)
 #define min(arg1,arg2) (arg1<arg2 ? arg1 : arg2)
 
+typedef SchedCore<PRIO_DWRR> PRIO_DWRRCore;
+
 /* Insert a queue to the tail of an active list. Return true if insert succeeds */
 static void InsertTailList(PacketDWRR* list, PacketDWRR *q)
 {
@@ -60,7 +62,7 @@ static class PrioDwrrClass : public TclClass
 		}
 } class_prio_dwrr;
 
-PRIO_DWRR::PRIO_DWRR(): timer_(this)
+PRIO_DWRR::PRIO_DWRR()
 {
 	prio_queues = new PacketPRIO[MAX_PRIO_QUEUE_NUM];
 	dwrr_queues = new PacketDWRR[MAX_DWRR_QUEUE_NUM];
@@ -71,12 +73,16 @@ PRIO_DWRR::PRIO_DWRR(): timer_(this)
 		dwrr_queues[i].id = i;
 
 	activeList = new PacketDWRR();
+	dwrr_bytes_ = 0;
+	prio_bytes_ = 0;
 	round_time = 0;
 	quantum_sum = 0;
 	quantum_sum_estimate = 0;
 	init = 0;
 	last_update_time = 0;
 	last_idle_time = 0;
+	marking_ = PRIO_DWRRCore::UnknownMarking;
+	marking_of_ = -1;
 
 	total_qlen_tchan_ = NULL;
 	qlen_tchan_ = NULL;
@@ -118,47 +124,34 @@ PRIO_DWRR::~PRIO_DWRR()
 	delete activeList;
 	delete [] prio_queues;
 	delete [] dwrr_queues;
-	timer_.cancel();
 }
 
-void PRIO_DWRR::timeout(int)
+/* Apply the samples of quantum_sum_estimate that are due by now.
+ * quantum_sum has not changed since the last call.
+ */
+void PRIO_DWRR::SampleQuantumSum(double now)
 {
-	/* update quantum_sum_estimate */
-	quantum_sum_estimate = quantum_sum_estimate * estimate_quantum_alpha_ + quantum_sum * (1 - estimate_quantum_alpha_);
+	long samples = 0;
 
-	if (debug_ && marking_scheme_ == MQ_MARKING_GENER)
-		printf("%.9f smooth quantum sum: %f, sample quantum sum: %d\n", Scheduler::instance().clock(), quantum_sum_estimate, quantum_sum);
-
-	/* reschedule timer */
 	if (link_capacity_ > 0)
-		timer_.resched(estimate_quantum_interval_bytes_ * 8 / link_capacity_);
-}
+		samples = quantum_estimate_.Update(&quantum_sum_estimate, quantum_sum, estimate_quantum_alpha_, estimate_quantum_interval_bytes_ * 8 / link_capacity_, now);
+	if (samples > 0)
+		thresh_epoch_.Invalidate();
 
-void PRIO_DWRR_Timer::expire(Event* e)
-{
-	queue_->timeout(0);
+	if (debug_ && marking_scheme_ == MQ_MARKING_GENER && samples > 0)
+		printf("%.9f smooth quantum sum: %f, sample quantum sum: %d after %ld samples\n", now, quantum_sum_estimate, quantum_sum, samples);
 }
 
 /* Get total length of all DWRR queues in bytes */
 int PRIO_DWRR::Total_DWRR_ByteLength()
 {
-	int result = 0;
-
-	for (int i = 0; i < MAX_DWRR_QUEUE_NUM; i++)
-		result += dwrr_queues[i].byteLength();
-
-	return result;
+	return dwrr_bytes_;
 }
 
 /* Get total length of all higher priority queues in bytes */
 int PRIO_DWRR::Total_Prio_ByteLength()
 {
-	int result = 0;
-
-	for (int i = 0; i < MAX_PRIO_QUEUE_NUM; i++)
-		result += prio_queues[i].byteLength();
-
-	return result;
+	return prio_bytes_;
 }
 
 /* Get total length of all queues in bytes */
@@ -168,118 +161,79 @@ int PRIO_DWRR::TotalByteLength()
 }
 
 
-/* Determine whether we need to mark ECN.
- * Return 1 if it requires marking
- */
-int PRIO_DWRR::MarkingECN(int queue_index)
+/* Get queue q. Higher priority queues come first, then DWRR queues */
+SchedQueue *PRIO_DWRR::GetQueue(int q)
 {
-	int type = 0;
-	int prio_queue_index = 0;
-	int dwrr_queue_index = 0;
+	if (q < prio_queue_num_)
+		return &prio_queues[q];
+	else
+		return &dwrr_queues[q - prio_queue_num_];
+}
 
-	if (queue_index < 0 || queue_index >= prio_queue_num_ + dwrr_queue_num_)
+/* Share of DWRR queue q for MQ-ECN for any packet scheduling algorithms: its quantum over the sum of quantums of active queues */
+bool PRIO_DWRR::QuantumShare(PRIO_DWRR *s, int q, double *share)
+{
+	if (s->quantum_sum_estimate >= 0.000000001)
 	{
-		fprintf(stderr, "illegal queue index value %d\n", queue_index);
-		exit(1);
+		*share = s->dwrr_queues[q - s->prio_queue_num_].quantum / s->quantum_sum_estimate;
+		return true;
 	}
+	return false;
+}
 
-	if (queue_index < prio_queue_num_)
-	{
-		prio_queue_index = queue_index;
-		type = PRIO_QUEUE;
-	}
-	else
+/* Share of DWRR queue q for MQ-ECN for round robin packet scheduling algorithms: its quantum per round time */
+bool PRIO_DWRR::RoundShare(PRIO_DWRR *s, int q, double *share)
+{
+	if (s->round_time >= 0.000000001 && s->link_capacity_ > 0)
 	{
-		dwrr_queue_index = queue_index - prio_queue_num_;
-		type = DWRR_QUEUE;
+		*share = s->dwrr_queues[q - s->prio_queue_num_].quantum * 8 / s->round_time / s->link_capacity_;
+		return true;
 	}
+	return false;
+}
 
-	/* Per-queue ECN marking */
-	if (marking_scheme_ == PER_QUEUE_MARKING)
+/* Get the marking policy of an ECN marking scheme. MQ-ECN only applies to DWRR queues */
+PRIO_DWRRCore::Marking PRIO_DWRR::SelectMarking(int scheme)
+{
+	switch (scheme)
 	{
-		if (type == PRIO_QUEUE && prio_queues[prio_queue_index].byteLength() > prio_queues[prio_queue_index].thresh * mean_pktsize_)
-			return 1;
-		else if (type == DWRR_QUEUE && dwrr_queues[dwrr_queue_index].byteLength() > dwrr_queues[dwrr_queue_index].thresh * mean_pktsize_)
-			return 1;
-		else
-			return 0;
+		case PER_QUEUE_MARKING:
+			return PRIO_DWRRCore::PerQueueMarking;
+		case PER_PORT_MARKING:
+			return PRIO_DWRRCore::PerPortMarking;
+		case MQ_MARKING_GENER:
+			return PRIO_DWRRCore::PrioTierMarking<PRIO_DWRRCore::PerQueueMarking, PRIO_DWRRCore::MQMarking<PRIO_DWRR::QuantumShare> >;
+		case MQ_MARKING_RR:
+			return PRIO_DWRRCore::PrioTierMarking<PRIO_DWRRCore::PerQueueMarking, PRIO_DWRRCore::MQMarking<PRIO_DWRR::RoundShare> >;
+		case PIE_MARKING:
+			return PRIO_DWRRCore::MQMarking<PRIO_DWRRCore::DepartureRateShare>;
+		default:
+			return PRIO_DWRRCore::UnknownMarking;
 	}
-	/* Per-port ECN marking */
-	else if (marking_scheme_ == PER_PORT_MARKING)
-	{
-		if (TotalByteLength() > port_thresh_ * mean_pktsize_)
-			return 1;
-		else
-			return 0;
-	}
-	/* MQ-ECN for any packet scheduling algorithms */
-	else if (marking_scheme_ == MQ_MARKING_GENER)
-	{
-		if (type == DWRR_QUEUE)
-		{
-			double thresh = 0;
-			if (quantum_sum_estimate >= 0.000000001)
-				thresh = min(dwrr_queues[dwrr_queue_index].quantum / quantum_sum_estimate, 1) * port_thresh_;
-			else
-				thresh = port_thresh_;
+}
 
-			if (dwrr_queues[dwrr_queue_index].byteLength() > thresh * mean_pktsize_)
-				return 1;
-			else
-				return 0;
-		}
-		else if (prio_queues[prio_queue_index].byteLength() > prio_queues[prio_queue_index].thresh * mean_pktsize_)
-			return 1;
-		else
-			return 0;
-	}
-	/* MQ-ECN for round robin packet scheduling algorithms */
-	else if (marking_scheme_ == MQ_MARKING_RR)
+/* Determine whether we need to mark ECN.
+ * Return 1 if it requires marking
+ */
+int PRIO_DWRR::MarkingECN(int queue_index)
+{
+	if (queue_index < 0 || queue_index >= prio_queue_num_ + dwrr_queue_num_)
 	{
-		if (type == DWRR_QUEUE)
-		{
-			double thresh = 0;
-			if (round_time >= 0.000000001 && link_capacity_ > 0)
-				thresh = min(dwrr_queues[dwrr_queue_index].quantum * 8 / round_time / link_capacity_, 1) * port_thresh_;
-			else
-				thresh = port_thresh_;
-			//For debug
-			//printf("round time: %f threshold: %f\n",round_time, thresh);
-			if (dwrr_queues[dwrr_queue_index].byteLength() > thresh * mean_pktsize_)
-				return 1;
-			else
-				return 0;
-		}
-		else if (prio_queues[prio_queue_index].byteLength() > prio_queues[prio_queue_index].thresh * mean_pktsize_)
-			return 1;
-		else
-			return 0;
+		fprintf(stderr, "illegal queue index value %d\n", queue_index);
+		exit(1);
 	}
-	/* PIE-like ECN marking */
-	else if (marking_scheme_ == PIE_MARKING)
-	{
-		double thresh = 0;
 
-		if (type == DWRR_QUEUE && dwrr_queues[dwrr_queue_index].avg_dq_rate >= 0.000000001 && link_capacity_ > 0)
-			thresh = min(dwrr_queues[dwrr_queue_index].avg_dq_rate / link_capacity_, 1) * port_thresh_;
-		else if (type == PRIO_QUEUE && prio_queues[prio_queue_index].avg_dq_rate >= 0.000000001 && link_capacity_ > 0)
-			thresh = min(prio_queues[prio_queue_index].avg_dq_rate / link_capacity_, 1) * port_thresh_;
-		else
-			thresh = port_thresh_;
+	/* Byte thresholds are computed again after OTcl changed mean_pktsize_, port_thresh_ or link_capacity_ */
+	thresh_epoch_.Check(mean_pktsize_, port_thresh_, link_capacity_);
 
-		if (type == DWRR_QUEUE && dwrr_queues[dwrr_queue_index].byteLength() > thresh * mean_pktsize_)
-			return 1;
-		else if (type == PRIO_QUEUE && prio_queues[prio_queue_index].byteLength() > thresh * mean_pktsize_)
-			return 1;
-		else
-			return 0;
-	}
-	/* Unknown ECN marking scheme */
-	else
+	/* Select the marking policy again only when marking_scheme_ has changed */
+	if (marking_scheme_ != marking_of_)
 	{
-		fprintf (stderr,"Unknown ECN marking scheme\n");
-		return 0;
+		marking_ = SelectMarking(marking_scheme_);
+		marking_of_ = marking_scheme_;
+		thresh_epoch_.Invalidate();
 	}
+	return marking_(this, queue_index);
 }
 
 /*
@@ -288,11 +242,25 @@ int PRIO_DWRR::MarkingECN(int queue_index)
  *   - $q set-thresh queue_id queue_thresh
  *   - $q attach-total file
  *	 - $q attach-queue file
+ *	 - $q attach-qlen-trace file [interval_us]
  *
  *  NOTE: $q represents the discipline queue variable in OTcl.
  */
 int PRIO_DWRR::command(int argc, const char*const* argv)
 {
+	// attach a file to write binary qlen records, optionally sampled every interval_us
+	if ((argc == 3 || argc == 4) && strcmp(argv[1], "attach-qlen-trace") == 0)
+	{
+		Tcl& tcl = Tcl::instance();
+		double interval_us = (argc == 4) ? atof(argv[3]) : 0;
+		if (qlen_trace_.attach(tcl.interp(), argv[2], interval_us) != TCL_OK)
+		{
+			tcl.resultf("PRIO_DWRR: trace: can't attach %s for writing", argv[2]);
+			return (TCL_ERROR);
+		}
+		return (TCL_OK);
+	}
+
 	if (argc == 3)
 	{
 		// attach a file to trace total queue length
@@ -334,6 +302,7 @@ int PRIO_DWRR::command(int argc, const char*const* argv)
 				if (quantum > 0)
 				{
 					dwrr_queues[dwrr_queue_index].quantum = quantum;
+					thresh_epoch_.Invalidate();
 					return (TCL_OK);
 				}
 				else
@@ -361,6 +330,7 @@ int PRIO_DWRR::command(int argc, const char*const* argv)
 						prio_queues[queue_index].thresh = thresh;
 					else
 						dwrr_queues[queue_index - prio_queue_num_].thresh = thresh;
+					thresh_epoch_.Invalidate();
 					return (TCL_OK);
 				}
 				else
@@ -395,12 +365,15 @@ void PRIO_DWRR::enque(Packet *p)
 
 	if (init == 0)
 	{
-		/* Start timer*/
+		/* Start sampling quantum_sum_estimate */
 		if (marking_scheme_ == MQ_MARKING_GENER && estimate_quantum_enable_timer_ && estimate_quantum_interval_bytes_ > 0 && link_capacity_ > 0)
-			timer_.resched(estimate_quantum_interval_bytes_  *8 / link_capacity_);
+			quantum_estimate_.Start(Scheduler::instance().clock(), estimate_quantum_interval_bytes_ * 8 / link_capacity_);
 		init = 1;
 	}
 
+	/* Samples due before this packet arrived */
+	SampleQuantumSum(Scheduler::instance().clock());
+
 	if (Total_DWRR_ByteLength() == 0 && marking_scheme_ == MQ_MARKING_GENER && !estimate_quantum_enable_timer_)
 	{
 		double now = Scheduler::instance().clock();
@@ -410,6 +383,7 @@ void PRIO_DWRR::enque(Packet *p)
 			quantum_sum_estimate = quantum_sum_estimate * pow(estimate_quantum_alpha_, idleTime / (estimate_quantum_interval_bytes_ * 8 / link_capacity_));
 		else
 			quantum_sum_estimate = 0;
+		thresh_epoch_.Invalidate();
 		last_update_time = now;
 
 		if (debug_)
@@ -430,6 +404,7 @@ void PRIO_DWRR::enque(Packet *p)
 			round_time = 0;
 		}
 
+		thresh_epoch_.Invalidate();
 		last_update_time = now;
 		if(debug_)
 			printf("%.9f smooth round time is reset to %f after %d idle time slots\n", now, round_time, intervalNum);
@@ -447,11 +422,15 @@ void PRIO_DWRR::enque(Packet *p)
 		prio = queue_num_ - 1;
 
 	if (prio < prio_queue_num_)
+	{
 		prio_queues[prio].enque(p);
+		prio_bytes_ += pktSize;
+	}
 	else
 	{
 		int dwrr_queue_index = prio - prio_queue_num_;
 		dwrr_queues[dwrr_queue_index].enque(p);
+		dwrr_bytes_ += pktSize;
 		/* if queues[dwrr_queue_index] is not in activeList */
 		if (dwrr_queues[dwrr_queue_index].active == false)
 		{
@@ -466,25 +445,26 @@ void PRIO_DWRR::enque(Packet *p)
 
 	/* Enqueue ECN marking */
 	if (marking_scheme_ != LATENCY_MARKING && MarkingECN(prio) > 0 && hf->ect())
+	{
 		hf->ce() = 1;
+		qlen_trace_.mark(prio);
+	}
 	/* For dequeue latency ECN marking ,record enqueue timestamp here */
 	else if (marking_scheme_ == LATENCY_MARKING && hf->ect())
 		hc->timestamp() = Scheduler::instance().clock();
 
-	trace_qlen();
-	trace_total_qlen();
+	PRIO_DWRRCore::Trace(this, prio);
 }
 
 Packet *PRIO_DWRR::deque(void)
 {
 	PacketDWRR *headNode = NULL;
 	Packet *pkt = NULL;
-	hdr_flags* hf = NULL;
-	hdr_cmn* hc = NULL;
 	int pktSize = 0;
 	double round_time_sample = 0;
-	double sojourn_time = 0;
-	double latency_thresh = 0;
+
+	/* Samples due before this packet leaves */
+	SampleQuantumSum(Scheduler::instance().clock());
 
 	if (Total_Prio_ByteLength() > 0)
 	{
@@ -494,73 +474,14 @@ Packet *PRIO_DWRR::deque(void)
 			{
 				pkt = prio_queues[i].deque();
 				pktSize = hdr_cmn::access(pkt)->size();
+				prio_bytes_ -= pktSize;
 
 				/* dequeue latency-based ECN marking */
 				if (marking_scheme_ == LATENCY_MARKING)
-				{
-					hc = hdr_cmn::access(pkt);
-					hf = hdr_flags::access(pkt);
-					sojourn_time = Scheduler::instance().clock() - hc->timestamp();
-					if (link_capacity_ > 0)
-						latency_thresh = port_thresh_ * mean_pktsize_ * 8 / link_capacity_;
-
-					if (hf->ect() && sojourn_time > latency_thresh)
-					{
-						hf->ce() = 1;
-						if (debug_)
-							printf("sojourn time %.9f > threshold %.9f\n", sojourn_time, latency_thresh);
-					}
-					hc->timestamp() = 0;
-				}
+					PRIO_DWRRCore::LatencyMarking(this, pkt, i);
 
-				/* If current queue is about 10KB or more and dq_count is unset
-				 * we have enough packets to calculate the drain rate. Save
-				 * current time as dq_tstamp and start measurement cycle.
-				 */
-				if (prio_queues[i].byteLength() >= dq_thresh_ && prio_queues[i].dq_count == DQ_COUNT_INVALID)
-				{
-					prio_queues[i].dq_tstamp = Scheduler::instance().clock();
-					prio_queues[i].dq_count = 0;
-				}
-
-				/* Calculate the average drain rate from this value.  If queue length
-				 * has receded to a small value viz., <= dq_thresh_bytes,reset
-				 * the dq_count to -1 as we don't have enough packets to calculate the
-				 * drain rate anymore The following if block is entered only when we
-				 * have a substantial queue built up (dq_thresh_ bytes or more)
-				 * and we calculate the drain rate for the threshold here.*/
-				if (prio_queues[i].dq_count != DQ_COUNT_INVALID)
-				{
-					prio_queues[i].dq_count += pktSize;
-					if (prio_queues[i].dq_count >= dq_thresh_)
-					{
-						//take transmission time into account
-						double interval = Scheduler::instance().clock() - prio_queues[i].dq_tstamp + pktSize * 8 / link_capacity_;
-						double rate = prio_queues[i].dq_count * 8 / interval;
-
-						if (prio_queues[i].avg_dq_rate < 0)
-							prio_queues[i].avg_dq_rate = rate;
-						else
-							prio_queues[i].avg_dq_rate = prio_queues[i].avg_dq_rate * estimate_rate_alpha_ + rate * (1 - estimate_rate_alpha_);
-
-						/* If the queue has receded below the threshold, we hold
-						 * on to the last drain rate calculated, else we reset
-						 * dq_count to 0 to re-enter the if block when the next
-						 * packet is dequeued
-						 */
-						if (prio_queues[i].byteLength() < dq_thresh_)
-							prio_queues[i].dq_count = DQ_COUNT_INVALID;
-						else
-						{
-							prio_queues[i].dq_count = 0;
-							//take transmission time into account
-							prio_queues[i].dq_tstamp = Scheduler::instance().clock() + pktSize * 8 / link_capacity_;
-						}
-
-						if (debug_ && marking_scheme_ == PIE_MARKING)
-							printf("[queue %d] sample departure rate : %.2f average departure rate: %.2f\n", prio_queues[i].id, rate, prio_queues[i].avg_dq_rate);
-					}
-				}
+				PRIO_DWRRCore::DepartureRate(this, i, pktSize);
+				PRIO_DWRRCore::TraceQlenBin(this, i);
 				break;
 			}
 		}
@@ -592,79 +513,21 @@ Packet *PRIO_DWRR::deque(void)
 				{
 					pkt = headNode->deque();
 					headNode->deficitCounter -= pktSize;
+					dwrr_bytes_ -= pktSize;
 
 					/* dequeue latency-based ECN marking */
 					if (marking_scheme_ == LATENCY_MARKING)
-					{
-						hc = hdr_cmn::access(pkt);
-						hf = hdr_flags::access(pkt);
-						sojourn_time = Scheduler::instance().clock() - hc->timestamp();
-						if (link_capacity_ > 0)
-							latency_thresh = port_thresh_ * mean_pktsize_ * 8 / link_capacity_;
-
-						if (hf->ect() && sojourn_time > latency_thresh)
-						{
-							hf->ce() = 1;
-							if (debug_)
-								printf("sojourn time %.9f > threshold %.9f\n", sojourn_time, latency_thresh);
-						}
-						hc->timestamp() = 0;
-					}
+						PRIO_DWRRCore::LatencyMarking(this, pkt, headNode->id + prio_queue_num_);
 
-					/* If current queue is about 10KB or more and dq_count is unset
-					 * we have enough packets to calculate the drain rate. Save
-					 * current time as dq_tstamp and start measurement cycle.
-					 */
-					if (headNode->byteLength() >= dq_thresh_ && headNode->dq_count == DQ_COUNT_INVALID)
-					{
-						headNode->dq_tstamp = Scheduler::instance().clock();
-						headNode->dq_count = 0;
-					}
-
-					/* Calculate the average drain rate from this value.  If queue length
-					 * has receded to a small value viz., <= dq_thresh_bytes,reset
-					 * the dq_count to -1 as we don't have enough packets to calculate the
-					 * drain rate anymore The following if block is entered only when we
-					 * have a substantial queue built up (dq_thresh_ bytes or more)
-					 * and we calculate the drain rate for the threshold here.*/
-					if (headNode->dq_count != DQ_COUNT_INVALID)
-					{
-						headNode->dq_count += pktSize;
-						if (headNode->dq_count >= dq_thresh_)
-						{
-							//take transmission time into account
-							double interval = Scheduler::instance().clock() - headNode->dq_tstamp + pktSize * 8 / link_capacity_;
-							double rate = headNode->dq_count * 8 / interval;
-
-							if (headNode->avg_dq_rate < 0)
-								headNode->avg_dq_rate = rate;
-							else
-								headNode->avg_dq_rate = headNode->avg_dq_rate * estimate_rate_alpha_ + rate * (1 - estimate_rate_alpha_);
-
-							/* If the queue has receded below the threshold, we hold
-	 						 * on to the last drain rate calculated, else we reset
-	 					 	 * dq_count to 0 to re-enter the if block when the next
-	 					     * packet is dequeued
-	 					 	 */
-							if (headNode->byteLength() < dq_thresh_)
-								headNode->dq_count = DQ_COUNT_INVALID;
-							else
-							{
-								headNode->dq_count = 0;
-								//take transmission time into account
-								headNode->dq_tstamp = Scheduler::instance().clock() + pktSize * 8 / link_capacity_;
-							}
-
-							if (debug_ && marking_scheme_ == PIE_MARKING)
-								printf("[queue %d] sample departure rate : %.2f average departure rate: %.2f\n", headNode->id + prio_queue_num_, rate, headNode->avg_dq_rate);
-						}
-					}
+					PRIO_DWRRCore::DepartureRate(this, headNode->id + prio_queue_num_, pktSize);
+					PRIO_DWRRCore::TraceQlenBin(this, headNode->id + prio_queue_num_);
 
 					/* After dequeue, headNode becomes empty. In such case, we should delete this queue from activeList. */
 					if (headNode->length() == 0)
 					{
 						round_time_sample = Scheduler::instance().clock() - headNode->start_time + pktSize * 8 / link_capacity_;
 						round_time = round_time * estimate_round_alpha_ + round_time_sample * (1 - estimate_round_alpha_);
+						thresh_epoch_.Invalidate();
 
 						if (debug_ && marking_scheme_ == MQ_MARKING_RR)
 							printf("sample round time: %.9f round time: %.9f\n", round_time_sample, round_time);
@@ -684,6 +547,7 @@ Packet *PRIO_DWRR::deque(void)
 					headNode->current = false;
 					round_time_sample = Scheduler::instance().clock() - headNode->start_time;
 				  	round_time = round_time * estimate_round_alpha_ + round_time_sample * (1-estimate_round_alpha_);
+					thresh_epoch_.Invalidate();
 
 					if (debug_ && marking_scheme_ == MQ_MARKING_RR)
 						printf("sample round time: %.9f round time: %.9f\n",round_time_sample,round_time);
@@ -702,6 +566,7 @@ Packet *PRIO_DWRR::deque(void)
 		if (estimate_quantum_interval_bytes_ > 0 && link_capacity_ > 0 && timeInterval >= 0.995 * estimate_quantum_interval_bytes_ * 8 /link_capacity_)
 		{
 			quantum_sum_estimate = quantum_sum_estimate * estimate_quantum_alpha_ + quantum_sum * (1 - estimate_quantum_alpha_);
+			thresh_epoch_.Invalidate();
 			last_update_time = now;
 			if(debug_)
 				printf("%.9f smooth quantum sum: %f, sample quantum sum: %d\n", now, quantum_sum_estimate, quantum_sum);
@@ -713,52 +578,3 @@ Packet *PRIO_DWRR::deque(void)
 
 	return pkt;
 }
-
-/* routine to write total qlen records */
-void PRIO_DWRR::trace_total_qlen()
-{
-	if (total_qlen_tchan_)
-	{
-		char wrk[500] = {0};
-		int n;
-		double t = Scheduler::instance().clock();
-		sprintf(wrk, "%g, %d", t, TotalByteLength());
-		n = strlen(wrk);
-		wrk[n] = '\n';
-		wrk[n+1] = 0;
-		(void)Tcl_Write(total_qlen_tchan_, wrk, n+1);
-	}
-}
-
-/* routine to write per-queue qlen records */
-void PRIO_DWRR::trace_qlen()
-{
-	if (qlen_tchan_)
-	{
-		char wrk[500] = {0};
-		int n;
-		double t = Scheduler::instance().clock();
-		sprintf(wrk, "%g", t);
-		n = strlen(wrk);
-		wrk[n] = 0;
-		(void)Tcl_Write(qlen_tchan_, wrk, n);
-
-		for (int i = 0; i < prio_queue_num_; i++)
-		{
-			sprintf(wrk, ", %d", prio_queues[i].byteLength());
-			n = strlen(wrk);
-			wrk[n] = 0;
-			(void)Tcl_Write(qlen_tchan_, wrk, n);
-		}
-
-		for (int i = 0; i < dwrr_queue_num_; i++)
-		{
-			sprintf(wrk, ", %d", dwrr_queues[i].byteLength());
-			n = strlen(wrk);
-			wrk[n] = 0;
-			(void)Tcl_Write(qlen_tchan_, wrk, n);
-		}
-
-		(void)Tcl_Write(qlen_tchan_, "\n", 1);
-	}
-}
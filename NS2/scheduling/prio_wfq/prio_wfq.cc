@@ -9,6 +9,8 @@
 #define max(arg1,arg2) (arg1>arg2 ? arg1 : arg2)
 #define min(arg1,arg2) (arg1<arg2 ? arg1 : arg2)
 
+typedef SchedCore<PRIO_WFQ> PRIO_WFQCore;
+
 static class PrioWfqClass : public TclClass
 {
     public:
@@ -19,17 +21,22 @@ static class PrioWfqClass : public TclClass
         }
 } class_prio_wfq;
 
-PRIO_WFQ::PRIO_WFQ(): timer_(this)
+PRIO_WFQ::PRIO_WFQ()
 {
     prio_queues = new PacketPRIO[MAX_PRIO_QUEUE_NUM];
 	wfq_queues = new PacketWFQ[MAX_WFQ_QUEUE_NUM];
 
+	active_num = 0;
+	wfq_bytes_ = 0;
+	prio_bytes_ = 0;
 	currTime = 0;
 	weight_sum_estimate = 0;
 	weight_sum = 0;
 	last_update_time = 0;
 	last_idle_time = 0;
 	init = 0;
+	marking_ = PRIO_WFQCore::UnknownMarking;
+	marking_of_ = -1;
 
     prio_queue_num_ = 1;
 	wfq_queue_num_ = 7;
@@ -66,145 +73,146 @@ PRIO_WFQ::~PRIO_WFQ()
 {
     delete [] prio_queues;
     delete [] wfq_queues;
-    timer_.cancel();
 }
 
-void PRIO_WFQ::timeout(int)
+/* Apply the samples of weight_sum_estimate that are due by now.
+ * weight_sum has not changed since the last call.
+ */
+void PRIO_WFQ::SampleWeightSum(double now)
 {
-	/* update weight_sum_estimate */
-	weight_sum_estimate = weight_sum_estimate * estimate_weight_alpha_ + weight_sum * (1 - estimate_weight_alpha_);
+	long samples = 0;
 
-	if (debug_ && marking_scheme_ == MQ_MARKING_GENER)
-		printf("%.9f smooth weight sum: %f, sample weight sum: %f\n", Scheduler::instance().clock(), weight_sum_estimate, weight_sum);
-
-	/* reschedule timer */
 	if (link_capacity_ > 0)
-		timer_.resched(estimate_weight_interval_bytes_ * 8 / link_capacity_);
-}
+		samples = weight_estimate_.Update(&weight_sum_estimate, weight_sum, estimate_weight_alpha_, estimate_weight_interval_bytes_ * 8 / link_capacity_, now);
+	if (samples > 0)
+		thresh_epoch_.Invalidate();
 
-void PRIO_WFQ_Timer::expire(Event* e)
-{
-	queue_->timeout(0);
+	if (debug_ && marking_scheme_ == MQ_MARKING_GENER && samples > 0)
+		printf("%.9f smooth weight sum: %f, sample weight sum: %f after %ld samples\n", now, weight_sum_estimate, weight_sum, samples);
 }
 
 /* Get total length of all WFQ queues in bytes */
 int PRIO_WFQ::Total_WFQ_ByteLength()
 {
-	int result = 0;
-
-	for (int i = 0; i < MAX_WFQ_QUEUE_NUM; i++)
-		result += wfq_queues[i].byteLength();
-
-	return result;
+	return wfq_bytes_;
 }
 
 /* Get total length of all higher priority queues in bytes */
 int PRIO_WFQ::Total_Prio_ByteLength()
 {
-	int result = 0;
-
-	for (int i = 0; i < MAX_PRIO_QUEUE_NUM; i++)
-		result += prio_queues[i].byteLength();
-
-	return result;
+	return prio_bytes_;
 }
 
-/* Get total length of all queues in bytes */
-int PRIO_WFQ::TotalByteLength()
+/* Ties are broken by queue number, like a linear scan from WFQ queue 0 */
+int PRIO_WFQ::EarlierHead(int q1, int q2)
 {
-	return Total_WFQ_ByteLength() + Total_Prio_ByteLength();
+	if (wfq_queues[q1].headFinishTime != wfq_queues[q2].headFinishTime)
+		return wfq_queues[q1].headFinishTime < wfq_queues[q2].headFinishTime;
+	else
+		return q1 < q2;
 }
 
-/* Determine whether we need to mark ECN.
- * Return 1 if it requires marking
- */
-int PRIO_WFQ::MarkingECN(int queue_index)
+void PRIO_WFQ::HeapPush(int q)
 {
-	int type = 0;
-	int prio_queue_index = 0;
-	int wfq_queue_index = 0;
+	int i = active_num++;
 
-	if (queue_index < 0 || queue_index >= prio_queue_num_ + wfq_queue_num_)
+	while (i > 0 && EarlierHead(q, active[(i - 1) / 2]))
 	{
-		fprintf(stderr, "illegal queue index value %d\n", queue_index);
-		exit(1);
+		active[i] = active[(i - 1) / 2];
+		i = (i - 1) / 2;
 	}
+	active[i] = q;
+}
+
+void PRIO_WFQ::HeapPop()
+{
+	active[0] = active[--active_num];
+	HeapSiftDown(0);
+}
 
-	if (queue_index < prio_queue_num_)
+void PRIO_WFQ::HeapSiftDown(int i)
+{
+	int q = active[i];
+	int child;
+
+	while ((child = 2 * i + 1) < active_num)
 	{
-		prio_queue_index = queue_index;
-		type = PRIO_QUEUE;
+		if (child + 1 < active_num && EarlierHead(active[child + 1], active[child]))
+			child++;
+		if (!EarlierHead(active[child], q))
+			break;
+		active[i] = active[child];
+		i = child;
 	}
+	active[i] = q;
+}
+
+/* Get total length of all queues in bytes */
+int PRIO_WFQ::TotalByteLength()
+{
+	return Total_WFQ_ByteLength() + Total_Prio_ByteLength();
+}
+
+/* Get queue q. Higher priority queues come first, then WFQ queues */
+SchedQueue *PRIO_WFQ::GetQueue(int q)
+{
+	if (q < prio_queue_num_)
+		return &prio_queues[q];
 	else
-	{
-		wfq_queue_index = queue_index - prio_queue_num_;
-		type = WFQ_QUEUE;
-	}
+		return &wfq_queues[q - prio_queue_num_];
+}
 
-	/* Per-queue ECN marking */
-	if (marking_scheme_ == PER_QUEUE_MARKING)
+/* Share of WFQ queue q for MQ-ECN for any packet scheduling algorithms: its weight over the sum of weights of active queues */
+bool PRIO_WFQ::WeightShare(PRIO_WFQ *s, int q, double *share)
+{
+	if (s->weight_sum_estimate >= 0.000000001)
 	{
-		if (type == PRIO_QUEUE && prio_queues[prio_queue_index].byteLength() > prio_queues[prio_queue_index].thresh * mean_pktsize_)
-			return 1;
-		else if (type == WFQ_QUEUE && wfq_queues[wfq_queue_index].byteLength() > wfq_queues[wfq_queue_index].thresh * mean_pktsize_)
-			return 1;
-		else
-			return 0;
+		*share = s->wfq_queues[q - s->prio_queue_num_].weight / s->weight_sum_estimate;
+		return true;
 	}
-	/* Per-port ECN marking */
-	else if (marking_scheme_ == PER_PORT_MARKING)
+	return false;
+}
+
+/* Get the marking policy of an ECN marking scheme. MQ-ECN only applies to WFQ queues */
+PRIO_WFQCore::Marking PRIO_WFQ::SelectMarking(int scheme)
+{
+	switch (scheme)
 	{
-		if (TotalByteLength() > port_thresh_ * mean_pktsize_)
-			return 1;
-		else
-			return 0;
+		case PER_QUEUE_MARKING:
+			return PRIO_WFQCore::PerQueueMarking;
+		case PER_PORT_MARKING:
+			return PRIO_WFQCore::PerPortMarking;
+		case MQ_MARKING_GENER:
+			return PRIO_WFQCore::PrioTierMarking<PRIO_WFQCore::PerQueueMarking, PRIO_WFQCore::MQMarking<PRIO_WFQ::WeightShare> >;
+		case PIE_MARKING:
+			return PRIO_WFQCore::MQMarking<PRIO_WFQCore::DepartureRateShare>;
+		default:
+			return PRIO_WFQCore::UnknownMarking;
 	}
-	/* MQ-ECN for any packet scheduling algorithms */
-	else if (marking_scheme_ == MQ_MARKING_GENER)
-	{
-		if (type == WFQ_QUEUE)
-		{
-			double thresh = 0;
-			if (weight_sum_estimate >= 0.000000001)
-				thresh = min(wfq_queues[wfq_queue_index].weight / weight_sum_estimate, 1) * port_thresh_;
-			else
-				thresh = port_thresh_;
+}
 
-			if (wfq_queues[wfq_queue_index].byteLength() > thresh * mean_pktsize_)
-				return 1;
-			else
-				return 0;
-		}
-		else if (prio_queues[prio_queue_index].byteLength() > prio_queues[prio_queue_index].thresh * mean_pktsize_)
-			return 1;
-		else
-			return 0;
-	}
-	/* PIE-like ECN marking */
-	else if (marking_scheme_ == PIE_MARKING)
+/* Determine whether we need to mark ECN.
+ * Return 1 if it requires marking
+ */
+int PRIO_WFQ::MarkingECN(int queue_index)
+{
+	if (queue_index < 0 || queue_index >= prio_queue_num_ + wfq_queue_num_)
 	{
-		double thresh = 0;
+		fprintf(stderr, "illegal queue index value %d\n", queue_index);
+		exit(1);
+	}
 
-		if (type == WFQ_QUEUE && wfq_queues[wfq_queue_index].avg_dq_rate >= 0.000000001 && link_capacity_ > 0)
-			thresh = min(wfq_queues[wfq_queue_index].avg_dq_rate / link_capacity_, 1) * port_thresh_;
-		else if (type == PRIO_QUEUE && prio_queues[prio_queue_index].avg_dq_rate >= 0.000000001 && link_capacity_ > 0)
-			thresh = min(prio_queues[prio_queue_index].avg_dq_rate / link_capacity_, 1) * port_thresh_;
-		else
-			thresh = port_thresh_;
+	/* Byte thresholds are computed again after OTcl changed mean_pktsize_, port_thresh_ or link_capacity_ */
+	thresh_epoch_.Check(mean_pktsize_, port_thresh_, link_capacity_);
 
-		if (type == WFQ_QUEUE && wfq_queues[wfq_queue_index].byteLength() > thresh * mean_pktsize_)
-			return 1;
-		else if (type == PRIO_QUEUE && prio_queues[prio_queue_index].byteLength() > thresh * mean_pktsize_)
-			return 1;
-		else
-			return 0;
-	}
-	/* Unknown ECN marking scheme */
-	else
+	/* Select the marking policy again only when marking_scheme_ has changed */
+	if (marking_scheme_ != marking_of_)
 	{
-		fprintf (stderr,"Unknown ECN marking scheme\n");
-		return 0;
+		marking_ = SelectMarking(marking_scheme_);
+		marking_of_ = marking_scheme_;
+		thresh_epoch_.Invalidate();
 	}
+	return marking_(this, queue_index);
 }
 
 /*
@@ -213,11 +221,25 @@ int PRIO_WFQ::MarkingECN(int queue_index)
  *  - $q set-thresh queue_id queue_thresh
  *  - $q attach-total file
  *  - $q attach-queue file
+ *  - $q attach-qlen-trace file [interval_us]
  *
  *  NOTE: $q represents the discipline queue variable in OTcl.
  */
 int PRIO_WFQ::command(int argc, const char*const* argv)
 {
+	// attach a file to write binary qlen records, optionally sampled every interval_us
+	if ((argc == 3 || argc == 4) && strcmp(argv[1], "attach-qlen-trace") == 0)
+	{
+		Tcl& tcl = Tcl::instance();
+		double interval_us = (argc == 4) ? atof(argv[3]) : 0;
+		if (qlen_trace_.attach(tcl.interp(), argv[2], interval_us) != TCL_OK)
+		{
+			tcl.resultf("PRIO_WFQ: trace: can't attach %s for writing", argv[2]);
+			return (TCL_ERROR);
+		}
+		return (TCL_OK);
+	}
+
 	if (argc == 3)
 	{
 		// attach a file to trace total queue length
@@ -259,6 +281,7 @@ int PRIO_WFQ::command(int argc, const char*const* argv)
 				if (weight > 0)
 				{
 					wfq_queues[wfq_queue_index].weight = weight;
+					thresh_epoch_.Invalidate();
 					return (TCL_OK);
 				}
 				else
@@ -286,6 +309,7 @@ int PRIO_WFQ::command(int argc, const char*const* argv)
 						prio_queues[queue_index].thresh = thresh;
 					else
 						wfq_queues[queue_index - prio_queue_num_].thresh = thresh;
+					thresh_epoch_.Invalidate();
 					return (TCL_OK);
 				}
 				else
@@ -320,12 +344,15 @@ void PRIO_WFQ::enque(Packet *p)
 
 	if (init == 0)
 	{
-		/* Start timer*/
+		/* Start sampling weight_sum_estimate */
 		if (marking_scheme_ == MQ_MARKING_GENER && estimate_weight_enable_timer_ && estimate_weight_interval_bytes_ > 0 && link_capacity_ > 0)
-			timer_.resched(estimate_weight_interval_bytes_ * 8 / link_capacity_);
+			weight_estimate_.Start(Scheduler::instance().clock(), estimate_weight_interval_bytes_ * 8 / link_capacity_);
 		init = 1;
 	}
 
+	/* Samples due before this packet arrived */
+	SampleWeightSum(Scheduler::instance().clock());
+
 	if (Total_WFQ_ByteLength() == 0 && marking_scheme_ == MQ_MARKING_GENER && !estimate_weight_enable_timer_)
 	{
 		double now = Scheduler::instance().clock();
@@ -335,6 +362,7 @@ void PRIO_WFQ::enque(Packet *p)
 		else
 			weight_sum_estimate = 0;
 
+		thresh_epoch_.Invalidate();
 		last_update_time = now;
 		if(debug_)
 			printf("%.9f smooth weight sum is reset to %f\n", now, weight_sum_estimate);
@@ -352,7 +380,10 @@ void PRIO_WFQ::enque(Packet *p)
 		prio = queue_num_ - 1;
 
     if (prio < prio_queue_num_)
+    {
         prio_queues[prio].enque(p);
+        prio_bytes_ += pktSize;
+    }
     else
     {
         int wfq_queue_index = prio - prio_queue_num_;
@@ -364,6 +395,7 @@ void PRIO_WFQ::enque(Packet *p)
             {
                 wfq_queues[wfq_queue_index].headFinishTime = currTime + pktSize / wfq_queues[wfq_queue_index].weight ;
                 currTime = wfq_queues[wfq_queue_index].headFinishTime;
+                HeapPush(wfq_queue_index);
             }
             /* In theory, weight should never be zero or negative */
             else
@@ -373,30 +405,31 @@ void PRIO_WFQ::enque(Packet *p)
 		    }
         }
         wfq_queues[wfq_queue_index].enque(p);
+        wfq_bytes_ += pktSize;
     }
 
     /* Enqueue ECN marking */
     if (marking_scheme_ != LATENCY_MARKING && MarkingECN(prio) > 0 && hf->ect())
-		hf->ce() = 1;
+    {
+        hf->ce() = 1;
+        qlen_trace_.mark(prio);
+    }
     /* For dequeue latency ECN marking ,record enqueue timestamp here */
     else if (marking_scheme_ == LATENCY_MARKING && hf->ect())
         hc->timestamp() = Scheduler::instance().clock();
 
-    trace_qlen();
-    trace_total_qlen();
+    PRIO_WFQCore::Trace(this, prio);
 }
 
 Packet* PRIO_WFQ::deque(void)
 {
 	Packet *pkt = NULL, *nextPkt = NULL;
-	hdr_flags* hf = NULL;
-	hdr_cmn* hc = NULL;
-	long double minT = LDBL_MAX ;
 	int queue = -1;
-	double sojourn_time = 0;
-	double latency_thresh = 0;
 	int pktSize = 0;
 
+	/* Samples due before this packet leaves */
+	SampleWeightSum(Scheduler::instance().clock());
+
     if (Total_Prio_ByteLength() > 0)
     {
         for (int i = 0; i < prio_queue_num_; i++)
@@ -405,73 +438,14 @@ Packet* PRIO_WFQ::deque(void)
 			{
 				pkt = prio_queues[i].deque();
 				pktSize = hdr_cmn::access(pkt)->size();
+				prio_bytes_ -= pktSize;
 
 				/* dequeue latency-based ECN marking */
 				if (marking_scheme_ == LATENCY_MARKING)
-				{
-					hc = hdr_cmn::access(pkt);
-					hf = hdr_flags::access(pkt);
-					sojourn_time = Scheduler::instance().clock() - hc->timestamp();
-					if (link_capacity_ > 0)
-						latency_thresh = port_thresh_ * mean_pktsize_ * 8 / link_capacity_;
-
-					if (hf->ect() && sojourn_time > latency_thresh)
-					{
-						hf->ce() = 1;
-						if (debug_)
-							printf("sojourn time %.9f > threshold %.9f\n", sojourn_time, latency_thresh);
-					}
-					hc->timestamp() = 0;
-				}
-
-				/* If current queue is about 10KB or more and dq_count is unset
-				 * we have enough packets to calculate the drain rate. Save
-				 * current time as dq_tstamp and start measurement cycle.
-				 */
-				if (prio_queues[i].byteLength() >= dq_thresh_ && prio_queues[i].dq_count == DQ_COUNT_INVALID)
-				{
-					prio_queues[i].dq_tstamp = Scheduler::instance().clock();
-					prio_queues[i].dq_count = 0;
-				}
+					PRIO_WFQCore::LatencyMarking(this, pkt, i);
 
-				/* Calculate the average drain rate from this value.  If queue length
-				 * has receded to a small value viz., <= dq_thresh_bytes,reset
-				 * the dq_count to -1 as we don't have enough packets to calculate the
-				 * drain rate anymore The following if block is entered only when we
-				 * have a substantial queue built up (dq_thresh_ bytes or more)
-				 * and we calculate the drain rate for the threshold here.*/
-				if (prio_queues[i].dq_count != DQ_COUNT_INVALID)
-				{
-					prio_queues[i].dq_count += pktSize;
-					if (prio_queues[i].dq_count >= dq_thresh_)
-					{
-						//take transmission time into account
-						double interval = Scheduler::instance().clock() - prio_queues[i].dq_tstamp + pktSize * 8 / link_capacity_;
-						double rate = prio_queues[i].dq_count * 8 / interval;
-
-						if (prio_queues[i].avg_dq_rate < 0)
-							prio_queues[i].avg_dq_rate = rate;
-						else
-							prio_queues[i].avg_dq_rate = prio_queues[i].avg_dq_rate * estimate_rate_alpha_ + rate * (1 - estimate_rate_alpha_);
-
-						/* If the queue has receded below the threshold, we hold
-						 * on to the last drain rate calculated, else we reset
-						 * dq_count to 0 to re-enter the if block when the next
-						 * packet is dequeued
-						 */
-						if (prio_queues[i].byteLength() < dq_thresh_)
-							prio_queues[i].dq_count = DQ_COUNT_INVALID;
-						else
-						{
-							prio_queues[i].dq_count = 0;
-							//take transmission time into account
-							prio_queues[i].dq_tstamp = Scheduler::instance().clock() + pktSize * 8 / link_capacity_;
-						}
-
-						if (debug_ && marking_scheme_ == PIE_MARKING)
-							printf("[queue %d] sample departure rate : %.2f average departure rate: %.2f\n", i, rate, prio_queues[i].avg_dq_rate);
-					}
-				}
+				PRIO_WFQCore::DepartureRate(this, i, pktSize);
+				PRIO_WFQCore::TraceQlenBin(this, i);
 				break;
 			}
 		}
@@ -479,18 +453,9 @@ Packet* PRIO_WFQ::deque(void)
     }
 	else if (Total_WFQ_ByteLength() > 0)
 	{
-		/* look for the candidate queue with the earliest virtual finish time */
-		for (int i = 0; i < wfq_queue_num_; i++)
-		{
-			if (wfq_queues[i].length() == 0)
-				continue;
-
-			if (wfq_queues[i].headFinishTime < minT)
-			{
-				queue = i;
-				minT = wfq_queues[i].headFinishTime;
-			}
-		}
+		/* the candidate queue with the earliest virtual finish time is at the top of the heap */
+		if (active_num > 0)
+			queue = active[0];
 
 		if (queue == -1 && Total_WFQ_ByteLength() > 0)
 		{
@@ -500,73 +465,13 @@ Packet* PRIO_WFQ::deque(void)
 
 		pkt = wfq_queues[queue].deque();
 		pktSize = hdr_cmn::access(pkt)->size();
+		wfq_bytes_ -= pktSize;
 		/* dequeue latency-based ECN marking */
 		if (marking_scheme_ == LATENCY_MARKING)
-		{
-			hc = hdr_cmn::access(pkt);
-			hf = hdr_flags::access(pkt);
-			sojourn_time = Scheduler::instance().clock() - hc->timestamp();
-			if (link_capacity_ > 0)
-				latency_thresh = port_thresh_ * mean_pktsize_ * 8 / link_capacity_;
+			PRIO_WFQCore::LatencyMarking(this, pkt, queue + prio_queue_num_);
 
-			if (hf->ect() && sojourn_time > latency_thresh)
-			{
-				hf->ce() = 1;
-				if (debug_)
-					printf("sojourn time %.9f > threshold %.9f\n", sojourn_time, latency_thresh);
-			}
-			hc->timestamp() = 0;
-		}
-
-		/* If current queue is about 10KB or more and dq_count is unset
-		 * we have enough packets to calculate the drain rate. Save
-		 * current time as dq_tstamp and start measurement cycle.
-		 */
-		if (wfq_queues[queue].byteLength() >= dq_thresh_ && wfq_queues[queue].dq_count == DQ_COUNT_INVALID)
-		{
-			wfq_queues[queue].dq_tstamp = Scheduler::instance().clock();
-			wfq_queues[queue].dq_count = 0;
-		}
-
-		/* Calculate the average drain rate from this value.  If queue length
-		 * has receded to a small value viz., <= dq_thresh_bytes,reset
-		 * the dq_count to -1 as we don't have enough packets to calculate the
-		 * drain rate anymore The following if block is entered only when we
-		 * have a substantial queue built up (dq_thresh_ bytes or more)
-		 * and we calculate the drain rate for the threshold here.*/
-		if (wfq_queues[queue].dq_count != DQ_COUNT_INVALID)
-		{
-			wfq_queues[queue].dq_count += pktSize;
-			if (wfq_queues[queue].dq_count >= dq_thresh_)
-			{
-				//take transmission time into account
-				double interval = Scheduler::instance().clock() - wfq_queues[queue].dq_tstamp + pktSize * 8 / link_capacity_;
-				double rate = wfq_queues[queue].dq_count * 8 / interval;
-
-				//initialize avg_dq_rate for this queue
-				if (wfq_queues[queue].avg_dq_rate < 0)
-					wfq_queues[queue].avg_dq_rate = rate;
-				else
-					wfq_queues[queue].avg_dq_rate = wfq_queues[queue].avg_dq_rate * estimate_rate_alpha_ + rate * (1 - estimate_rate_alpha_);
-
-				/* If the queue has receded below the threshold, we hold
-				 * on to the last drain rate calculated, else we reset
-				 * dq_count to 0 to re-enter the if block when the next
-				 * packet is dequeued
-				 */
-				if (wfq_queues[queue].byteLength() < dq_thresh_)
-					wfq_queues[queue].dq_count = DQ_COUNT_INVALID;
-				else
-				{
-					wfq_queues[queue].dq_count = 0;
-					//take transmission time into account
-					wfq_queues[queue].dq_tstamp = Scheduler::instance().clock() + pktSize * 8 / link_capacity_;
-				}
-
-				if (debug_ && marking_scheme_ == PIE_MARKING)
-					printf("[queue %d] sample departure rate : %.2f average departure rate: %.2f\n", queue + prio_queue_num_, rate, wfq_queues[queue].avg_dq_rate);
-			}
-		}
+		PRIO_WFQCore::DepartureRate(this, queue + prio_queue_num_, pktSize);
+		PRIO_WFQCore::TraceQlenBin(this, queue + prio_queue_num_);
 
 		/* Set the headFinishTime for the remaining head packet in the queue */
 		nextPkt = wfq_queues[queue].head();
@@ -577,6 +482,7 @@ Packet* PRIO_WFQ::deque(void)
 				wfq_queues[queue].headFinishTime = wfq_queues[queue].headFinishTime + (hdr_cmn::access(nextPkt)->size()) / wfq_queues[queue].weight;
 				if (currTime < wfq_queues[queue].headFinishTime)
 					currTime = wfq_queues[queue].headFinishTime;
+				HeapSiftDown(0);
 			}
 			else
 			{
@@ -589,6 +495,7 @@ Packet* PRIO_WFQ::deque(void)
 		{
 			weight_sum -= wfq_queues[queue].weight;
 			wfq_queues[queue].headFinishTime = LDBL_MAX;
+			HeapPop();
 		}
 	}
 
@@ -599,6 +506,7 @@ Packet* PRIO_WFQ::deque(void)
 		if (estimate_weight_interval_bytes_ > 0 && link_capacity_ > 0 && timeInterval >= 0.995 * estimate_weight_interval_bytes_ * 8 / link_capacity_)
 		{
 			weight_sum_estimate = weight_sum_estimate * estimate_weight_alpha_ + weight_sum * (1 - estimate_weight_alpha_);
+			thresh_epoch_.Invalidate();
 			last_update_time = now;
 			if(debug_)
 				printf("%.9f smooth weight sum: %f, sample weight sum: %f\n", now, weight_sum_estimate, weight_sum);
@@ -610,52 +518,3 @@ Packet* PRIO_WFQ::deque(void)
 
 	return pkt;
 }
-
-/* routine to write total qlen records */
-void PRIO_WFQ::trace_total_qlen()
-{
-	if (total_qlen_tchan_)
-	{
-		char wrk[500] = {0};
-		int n;
-		double t = Scheduler::instance().clock();
-		sprintf(wrk, "%g, %d", t, TotalByteLength());
-		n = strlen(wrk);
-		wrk[n] = '\n';
-		wrk[n+1] = 0;
-		(void)Tcl_Write(total_qlen_tchan_, wrk, n+1);
-	}
-}
-
-/* routine to write per-queue qlen records */
-void PRIO_WFQ::trace_qlen()
-{
-	if (qlen_tchan_)
-	{
-		char wrk[500] = {0};
-		int n;
-		double t = Scheduler::instance().clock();
-		sprintf(wrk, "%g", t);
-		n = strlen(wrk);
-		wrk[n] = 0;
-		(void)Tcl_Write(qlen_tchan_, wrk, n);
-
-		for (int i = 0; i < prio_queue_num_; i++)
-		{
-			sprintf(wrk, ", %d", prio_queues[i].byteLength());
-			n = strlen(wrk);
-			wrk[n] = 0;
-			(void)Tcl_Write(qlen_tchan_, wrk, n);
-		}
-
-		for (int i = 0; i < wfq_queue_num_; i++)
-		{
-			sprintf(wrk, ", %d", wfq_queues[i].byteLength());
-			n = strlen(wrk);
-			wrk[n] = 0;
-			(void)Tcl_Write(qlen_tchan_, wrk, n);
-		}
-
-		(void)Tcl_Write(qlen_tchan_, "\n", 1);
-	}
-}
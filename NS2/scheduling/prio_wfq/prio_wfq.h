@@ -4,7 +4,7 @@
 #include "queue.h"
 #include "config.h"
 #include "trace.h"
-#include "timer-handler.h"
+#include "sched-core.h"
 
 #include <iostream>
 #include <queue>
@@ -15,61 +15,23 @@ using namespace std;
 /* Maximum number of WFQ queues in the lowest priority */
 #define MAX_WFQ_QUEUE_NUM 64
 
-/* Per-queue ECN marking */
-#define PER_QUEUE_MARKING 0
-/* Per-port ECN marking */
-#define PER_PORT_MARKING 1
-/* MQ-ECN for any packet scheduling algorithms */
-#define MQ_MARKING_GENER 2
-/* Dequeue latency-based ECN marking */
-#define LATENCY_MARKING 4
-/* PIE-like ECN marking */
-#define PIE_MARKING 5
-
-#define DQ_COUNT_INVALID -1
-
-/* Types of queues */
-#define PRIO_QUEUE 0
-#define WFQ_QUEUE 1
-
 class PacketPRIO;   //strict higher priority queues
 class PacketWFQ;    //WFQ queues in the lowest priority
 class PRIO_WFQ;
 
-class PRIO_WFQ_Timer : public TimerHandler
-{
-public:
-	PRIO_WFQ_Timer(PRIO_WFQ *q) : TimerHandler() { queue_ = q;}
-
-protected:
-	virtual void expire(Event *e);
-	PRIO_WFQ *queue_;
-};
-
-class PacketPRIO: public PacketQueue
+class PacketPRIO: public SchedQueue
 {
 	public:
-		PacketPRIO(): thresh(0), dq_tstamp(0), dq_count(DQ_COUNT_INVALID), avg_dq_rate(-1) {}
-
-		double thresh;	//per-queue ECN marking threshold (pkts)
-		double dq_tstamp;	//measurement start time
-		int dq_count;	//measured in bytes
-		double avg_dq_rate;	//average drain rate (bps)
-
 		friend class PRIO_WFQ;
 };
 
-class PacketWFQ : public PacketQueue
+class PacketWFQ : public SchedQueue
 {
 	public:
-		PacketWFQ(): weight(10000.0), headFinishTime(0), thresh(0), dq_tstamp(0), dq_count(DQ_COUNT_INVALID), avg_dq_rate(-1) {}
+		PacketWFQ(): weight(10000.0), headFinishTime(0) {}
 
 		double weight;    //weight of the service
   		long double headFinishTime; //finish time of the packet at head of this queue.
-		double thresh;    //per-queue ECN marking threshold (pkts)
-		double dq_tstamp; //measurement start time
-		int dq_count; //measured in bytes
-		double avg_dq_rate;   //average drain rate (bps)
 
 		friend class PRIO_WFQ;
 };
@@ -79,28 +41,44 @@ class PRIO_WFQ : public Queue
 	public:
 		PRIO_WFQ();
 		~PRIO_WFQ();
-		void timeout(int);
 		virtual int command(int argc, const char*const* argv);
 
 	protected:
 		Packet* deque(void);
 		void enque(Packet *pkt);
         int TotalByteLength();  //Get total length of all queues in bytes
-		int Total_WFQ_ByteLength();   //Get total length of WFQ queues in bytes
-		int Total_Prio_ByteLength();  //Get total length of higher priority queues in bytes
+		int Total_WFQ_ByteLength();   //Get total length of WFQ queues in bytes (O(1))
+		int Total_Prio_ByteLength();  //Get total length of higher priority queues in bytes (O(1))
 		int MarkingECN(int q);    //Determine whether we need to mark ECN, q is current queue number
+		void SampleWeightSum(double now);    //Apply the samples of weight_sum_estimate due by now
+		static SchedCore<PRIO_WFQ>::Marking SelectMarking(int scheme);	//marking policy of an ECN marking scheme
+		static bool WeightShare(PRIO_WFQ *s, int q, double *share);	//share of WFQ queue q for MQ_MARKING_GENER
+		SchedQueue *GetQueue(int q);	//queue q: priority queues first, then WFQ queues
+		int QueueNum() { return prio_queue_num_ + wfq_queue_num_; }
+		int QueueByteLength(int q) { return GetQueue(q)->byteLength(); }
+		int EarlierHead(int q1, int q2);	//Whether the head packet of WFQ queue q1 should be served before that of q2
+		void HeapPush(int q);	//Add a WFQ queue that becomes non-empty to the heap
+		void HeapPop();	//Remove the WFQ queue at the top of the heap
+		void HeapSiftDown(int i);	//Restore the heap after the headFinishTime of active[i] increases
 
 		/* Variables */
         PacketPRIO *prio_queues;	//strict higher priority queues
         PacketWFQ *wfq_queues;   //WFQ queues in the lowest priority
+        int active[MAX_WFQ_QUEUE_NUM];	//Binary min-heap of non-empty WFQ queues keyed by headFinishTime
+        int active_num;	//Number of WFQ queues in the heap
+        int wfq_bytes_;	//Total length of WFQ queues in bytes
+        int prio_bytes_;	//Total length of higher priority queues in bytes
 
         long double currTime; //Finish time assigned to last packet
-        PRIO_WFQ_Timer timer_;  //timer for weight_sum_estimate update
+        PeriodicEstimate weight_estimate_;  //samples of weight_sum_estimate every estimate_weight_interval_bytes_ (estimate_weight_enable_timer_)
         double weight_sum_estimate;	//estimation value for sum of weights of all non-empty  queues
         double weight_sum;	//sum of weights of all non-empty queues
         double last_update_time;	//last time when we update quantum_sum_estimate
         double last_idle_time;	//Last time when link becomes idle
-        int init;	//whether the timer has been started
+        int init;	//whether the estimator has been started
+        SchedCore<PRIO_WFQ>::Marking marking_;	//marking policy selected for marking_of_
+        int marking_of_;	//marking_scheme_ when marking_ was selected
+        ThreshEpoch thresh_epoch_;	//epoch of the byte thresholds of queues
 
         int prio_queue_num_;    //number of higher priority queues
         int wfq_queue_num_; //number of WFQ queues
@@ -109,7 +87,7 @@ class PRIO_WFQ : public Queue
         int marking_scheme_;  //ECN marking policy
         double estimate_weight_alpha_;    //factor between 0 and 1 for weight estimation
         double estimate_weight_interval_bytes_;   //time interval is estimate_weight_interval_bytes_/link capacity.
-        int estimate_weight_enable_timer_;    //whether we use real timer (TimerHandler) for weight estimation
+        int estimate_weight_enable_timer_;    //whether weight_sum_estimate is sampled every interval since the first packet, not at dequeue
         int dq_thresh_;   //threshold for departure rate estimation
         double estimate_rate_alpha_;  //factor between 0 and 1 for departure rate estimation
         double link_capacity_;    //Link capacity
@@ -117,8 +95,9 @@ class PRIO_WFQ : public Queue
 
         Tcl_Channel total_qlen_tchan_;  //Place to write total_qlen records
         Tcl_Channel qlen_tchan_;    //Place to write per-queue qlen records
-        void trace_total_qlen();    //Routine to write total qlen records
-        void trace_qlen();  //Routine to write per-queue qlen records
+        QlenTrace qlen_trace_;  //Records of the binary qlen trace
+
+        friend class SchedCore<PRIO_WFQ>;
 };
 
 #endif
@@ -6,6 +6,12 @@
  * thresh_: ECN marking threshold
  * mean_pktsize_: configured mean packet size in bytes
  * marking_scheme_: Per-queue ECN (0), Per-port ECN (1) and Latency ECN marking (4)
+ * per_packet_prio_: serve the packet with the smallest hdr_ip::prio() first
+ *   instead of the queue with the smallest ID (e.g., pFabric or PIAS), FIFO
+ *   among packets of the same priority. Packets then form a single queue, so
+ *   ECN marking only uses the port threshold, there is no departure rate
+ *   estimation (PIE_MARKING behaves like per-port ECN), and traces and marks
+ *   count all packets as queue 0. It takes effect when the queue is empty
  */
 
 #ifndef ns_priority_h
@@ -14,20 +20,11 @@
 /*Maximum queue number */
 #define MAX_QUEUE_NUM 64
 
-/* Per-queue ECN marking */
-#define PER_QUEUE_MARKING 0
-/* Per-port ECN marking */
-#define PER_PORT_MARKING 1
-/* Dequeue latency-based ECN marking */
-#define LATENCY_MARKING 4
-/* PIE-like ECN marking */
-#define PIE_MARKING 5
-
-#define DQ_COUNT_INVALID -1
-
 #include <string.h>
 #include "queue.h"
 #include "config.h"
+#include "sched-core.h"
+#include "packet-heap.h"
 
 class Priority : public Queue
 {
@@ -41,17 +38,26 @@ class Priority : public Queue
 		Packet* deque();	//dequeue function
 
 		int MarkingECN(int q); // Determine whether we need to mark ECN, q is current queue number
-		int TotalByteLength();	//return total queue length (bytes) of all the queues
+		int TotalByteLength();	//return total queue length (bytes) of all the queues (O(1))
+		static SchedCore<Priority>::Marking SelectMarking(int scheme);	//marking policy of an ECN marking scheme
+		SchedQueue *GetQueue(int q) { return &queues[q]; }
+		int QueueNum() { return queue_num_; }
+		int QueueByteLength(int q) { return (per_packet_ && q == 0) ? heap_.byteLength() : queues[q].byteLength(); }	//the heap counts as queue 0
 
-		PacketQueue *queues;	//underlying multi-FIFO (CoS) queues
-		double* dq_tstamps;	//measurement start time
-		int* dq_counts;	//measured in bytes
-		double* avg_dq_rates;	//average drain rate (bps)
+		SchedQueue *queues;	//underlying multi-FIFO (CoS) queues
+		unsigned long long active_;	//bit i is set if queues[i] is not empty
+		PacketHeap heap_;	//packets ordered by priority (per_packet_prio_)
+		int per_packet_;	//per_packet_prio_ since the queue was last empty
+		SchedCore<Priority>::Marking marking_;	//marking policy selected for marking_of_
+		int marking_of_;	//marking_scheme_ when marking_ was selected
+		ThreshEpoch thresh_epoch_;	//epoch of the byte thresholds of queues
+		int total_bytes_;	//total length of all queues in bytes
 
 		int mean_pktsize_;	//configured mean packet size in bytes
-		int thresh_;	//ECN marking threshold
+		int port_thresh_;	//ECN marking threshold (thresh_ in OTcl)
 		int queue_num_;	//number of CoS queues. No more than MAX_QUEUE_NUM
 		int marking_scheme_;	//ECN marking policy
+		int per_packet_prio_;	//serve packets by hdr_ip::prio() rather than by queue (true) or not (false)
 		int dq_thresh_;	//threshold for departure rate estimation
 		double estimate_rate_alpha_;	//factor between 0 and 1 for departure rate estimation
 		double link_capacity_;	//link capacity (bps)
@@ -59,8 +65,9 @@ class Priority : public Queue
 
 		Tcl_Channel total_qlen_tchan_;	//place to write total_qlen records
 		Tcl_Channel qlen_tchan_;	//place to write per-queue qlen records
-		void trace_total_qlen();	//routine to write total qlen records
-		void trace_qlen();	//routine to write per-queue qlen records
+		QlenTrace qlen_trace_;	//records of the binary qlen trace
+
+		friend class SchedCore<Priority>;
 };
 
 #endif
@@ -41,6 +41,7 @@ Queue/Priority set marking_scheme_ $marking_scheme
 Queue/Priority set dq_thresh_ 10000
 Queue/Priority set estimate_rate_alpha_ 0.875
 Queue/Priority set link_capacity_ $lineRate
+Queue/Priority set per_packet_prio_ false
 Queue/Priority set debug_ true
 
 Queue/RED set bytes_ false
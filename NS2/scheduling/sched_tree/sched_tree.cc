@@ -0,0 +1,881 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#include "flags.h"
+#include "sched_tree.h"
+
+#define max(arg1,arg2) (arg1>arg2 ? arg1 : arg2)
+#define min(arg1,arg2) (arg1<arg2 ? arg1 : arg2)
+
+typedef SchedCore<SchedTree> SchedTreeCore;
+
+/* Type of a node from its OTcl name. Return TREE_NONE if it is unknown */
+static int ParseType(const char *name)
+{
+	if (strcmp(name, "sp") == 0)
+		return TREE_SP;
+	else if (strcmp(name, "dwrr") == 0)
+		return TREE_DWRR;
+	else if (strcmp(name, "wfq") == 0)
+		return TREE_WFQ;
+	else if (strcmp(name, "wrr") == 0)
+		return TREE_WRR;
+	else
+		return TREE_NONE;
+}
+
+static class SchedTreeClass : public TclClass
+{
+	public:
+		SchedTreeClass() : TclClass("Queue/SchedTree") {}
+		TclObject* create(int argc, const char*const* argv)
+		{
+			return (new SchedTree);
+		}
+} class_sched_tree;
+
+SchedTree::SchedTree()
+{
+	nodes = new SchedTreeNode[MAX_TREE_NODE_NUM + MAX_TREE_QUEUE_NUM];
+	queues = new SchedQueue[MAX_TREE_QUEUE_NUM];
+
+	for (int i = 0; i < MAX_TREE_QUEUE_NUM; i++)
+	{
+		nodes[TREE_LEAF(i)].type = TREE_FIFO;
+		nodes[TREE_LEAF(i)].queue = i;
+	}
+
+	root = TREE_NONE;
+	queue_num_ = 0;
+	init = false;
+	last_update_time = 0;
+	marking_ = SchedTreeCore::UnknownMarking;
+	marking_of_ = -1;
+
+	total_qlen_tchan_ = NULL;
+	qlen_tchan_ = NULL;
+
+	mean_pktsize_ = 1500;
+	port_thresh_ = 65;
+	marking_scheme_ = 0;
+	estimate_weight_alpha_ = 0.75;
+	estimate_weight_interval_bytes_ = 1500;
+	estimate_round_alpha_ = 0.75;
+	estimate_round_idle_interval_bytes_ = 1500;
+	dq_thresh_ = 10000;
+	estimate_rate_alpha_ = 0.875;
+	link_capacity_ = 10000000000;	//10Gbps
+	debug_ = 0;
+
+	/* bind variables */
+	bind("mean_pktsize_", &mean_pktsize_);
+	bind("port_thresh_", &port_thresh_);
+	bind("marking_scheme_", &marking_scheme_);
+	bind("estimate_weight_alpha_", &estimate_weight_alpha_);
+	bind("estimate_weight_interval_bytes_", &estimate_weight_interval_bytes_);
+	bind("estimate_round_alpha_", &estimate_round_alpha_);
+	bind("estimate_round_idle_interval_bytes_", &estimate_round_idle_interval_bytes_);
+	bind("dq_thresh_", &dq_thresh_);
+	bind("estimate_rate_alpha_", &estimate_rate_alpha_);
+	bind_bw("link_capacity_", &link_capacity_);
+	bind_bool("debug_", &debug_);
+}
+
+SchedTree::~SchedTree()
+{
+	delete [] nodes;
+	delete [] queues;
+}
+
+/* Add node n (internal node ID or TREE_LEAF(queue ID)) as the last child of parent. parent is TREE_NONE for the root */
+void SchedTree::AddNode(int n, int parent, int type, double weight)
+{
+	if (init)
+	{
+		fprintf(stderr, "can't change the tree after the first packet\n");
+		exit(1);
+	}
+
+	if (nodes[n].used)
+	{
+		fprintf(stderr, "node %d is already in the tree\n", n);
+		exit(1);
+	}
+
+	if (weight <= 0)
+	{
+		fprintf(stderr, "illegal weight value %f for node %d\n", weight, n);
+		exit(1);
+	}
+
+	if (parent == TREE_NONE)
+	{
+		if (root != TREE_NONE || type == TREE_FIFO)
+		{
+			fprintf(stderr, "illegal root node %d\n", n);
+			exit(1);
+		}
+		root = n;
+	}
+	/* The parent must be an internal node in the tree, so the tree has no cycles */
+	else if (parent < 0 || parent >= MAX_TREE_NODE_NUM || !nodes[parent].used)
+	{
+		fprintf(stderr, "illegal parent node %d\n", parent);
+		exit(1);
+	}
+	else if (nodes[parent].child_num >= MAX_TREE_CHILD_NUM)
+	{
+		fprintf(stderr, "node %d has too many children\n", parent);
+		exit(1);
+	}
+	else
+	{
+		nodes[n].index = nodes[parent].child_num;
+		nodes[parent].children[nodes[parent].child_num++] = n;
+	}
+
+	nodes[n].used = true;
+	nodes[n].type = type;
+	nodes[n].parent = parent;
+	nodes[n].weight = weight;
+	thresh_epoch_.Invalidate();
+}
+
+/* Check the tree and count the queues before the first packet */
+void SchedTree::Check()
+{
+	if (root == TREE_NONE)
+	{
+		fprintf(stderr, "the tree has no root\n");
+		exit(1);
+	}
+
+	for (int i = 0; i < MAX_TREE_NODE_NUM; i++)
+	{
+		if (nodes[i].used && nodes[i].child_num == 0)
+		{
+			fprintf(stderr, "node %d has no children\n", i);
+			exit(1);
+		}
+	}
+
+	/* Queue IDs must be 0, 1, ..., n-1 */
+	queue_num_ = 0;
+	while (queue_num_ < MAX_TREE_QUEUE_NUM && nodes[TREE_LEAF(queue_num_)].used)
+		queue_num_++;
+
+	for (int i = queue_num_; i < MAX_TREE_QUEUE_NUM; i++)
+	{
+		if (nodes[TREE_LEAF(i)].used)
+		{
+			fprintf(stderr, "queue %d is in the tree but queue %d is not\n", i, queue_num_);
+			exit(1);
+		}
+	}
+
+	if (queue_num_ == 0)
+	{
+		fprintf(stderr, "the tree has no queues\n");
+		exit(1);
+	}
+}
+
+/* Child c of node p becomes non-empty with a packet of pktSize bytes */
+void SchedTree::Activate(int p, int c, int pktSize)
+{
+	SchedTreeNode *parent = &nodes[p];
+	SchedTreeNode *child = &nodes[c];
+
+	switch (parent->type)
+	{
+		case TREE_DWRR:
+			/* Insert child to the tail of the active list */
+			child->deficit = 0;
+			child->counter_updated = false;
+			child->next = TREE_NONE;
+			if (parent->active_tail == TREE_NONE)
+				parent->active_head = c;
+			else
+				nodes[parent->active_tail].next = c;
+			parent->active_tail = c;
+			child->start_time = Scheduler::instance().clock();	//Start time of this round
+			break;
+		case TREE_WFQ:
+			child->finish = parent->curr_time + pktSize / child->weight;
+			parent->curr_time = child->finish;
+			HeapPush(p, c);
+			break;
+		case TREE_WRR:
+			if (child->counter_updated == false)
+				child->start_time = Scheduler::instance().clock();
+			break;
+		default:
+			return;
+	}
+
+	parent->weight_sum += child->weight;
+}
+
+/* Update the round time of node p with a new sample */
+void SchedTree::SampleRound(int p, double sample)
+{
+	nodes[p].round_time = nodes[p].round_time * estimate_round_alpha_ + sample * (1 - estimate_round_alpha_);
+	thresh_epoch_.Invalidate();
+
+	if (debug_ && marking_scheme_ == MQ_MARKING_RR)
+		printf("[node %d] sample round time: %.9f round time: %.9f\n", p, sample, nodes[p].round_time);
+}
+
+/* Size of the next packet that node n sends */
+int SchedTree::HeadSize(int n)
+{
+	if (nodes[n].type == TREE_FIFO)
+		return hdr_cmn::access(queues[nodes[n].queue].head())->size();
+	else
+		return HeadSize(Peek(n));
+}
+
+/* Ties are broken by the order of children, like a linear scan of children */
+bool SchedTree::EarlierFinish(int c1, int c2)
+{
+	if (nodes[c1].finish != nodes[c2].finish)
+		return nodes[c1].finish < nodes[c2].finish;
+	else
+		return nodes[c1].index < nodes[c2].index;
+}
+
+void SchedTree::HeapPush(int p, int c)
+{
+	SchedTreeNode *parent = &nodes[p];
+	int i = parent->heap_num++;
+
+	while (i > 0 && EarlierFinish(c, parent->heap[(i - 1) / 2]))
+	{
+		parent->heap[i] = parent->heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	parent->heap[i] = c;
+}
+
+void SchedTree::HeapPop(int p)
+{
+	SchedTreeNode *parent = &nodes[p];
+
+	parent->heap[0] = parent->heap[--parent->heap_num];
+	HeapSiftDown(p, 0);
+}
+
+void SchedTree::HeapSiftDown(int p, int i)
+{
+	SchedTreeNode *parent = &nodes[p];
+	int c = parent->heap[i];
+	int child;
+
+	while ((child = 2 * i + 1) < parent->heap_num)
+	{
+		if (child + 1 < parent->heap_num && EarlierFinish(parent->heap[child + 1], parent->heap[child]))
+			child++;
+		if (!EarlierFinish(parent->heap[child], c))
+			break;
+		parent->heap[i] = parent->heap[child];
+		i = child;
+	}
+	parent->heap[i] = c;
+}
+
+/* Child of non-empty node p that Select(p) would return. Unlike Select, it
+ * changes no deficits, active lists or round time samples, so a parent may
+ * look at the next packet of a child that is not being served.
+ */
+int SchedTree::Peek(int p)
+{
+	SchedTreeNode *parent = &nodes[p];
+	int c = TREE_NONE;
+
+	switch (parent->type)
+	{
+		case TREE_SP:
+		case TREE_WFQ:
+			return Select(p);
+
+		case TREE_DWRR:
+		{
+			/* A child at the head of the active list gets its quantum once in every round.
+			 * Select serves the first child in list order that has enough deficit in the earliest round.
+			 */
+			int rounds = -1;
+			for (int n = parent->active_head; n != TREE_NONE; n = nodes[n].next)
+			{
+				SchedTreeNode *child = &nodes[n];
+				double deficit = child->counter_updated ? child->deficit : child->deficit + child->weight;
+				int size = HeadSize(n);
+				int k = 0;
+
+				while (size > deficit && (rounds < 0 || k < rounds))
+				{
+					deficit += child->weight;
+					k++;
+				}
+
+				if (size <= deficit && (rounds < 0 || k < rounds))
+				{
+					c = n;
+					rounds = k;
+				}
+			}
+			if (c != TREE_NONE)
+				return c;
+			break;
+		}
+
+		case TREE_WRR:
+			/* A child gets its quantum again every time Select moves to it */
+			for (int i = 0; i <= parent->child_num; i++)
+			{
+				c = parent->children[(parent->current + i) % parent->child_num];
+				SchedTreeNode *child = &nodes[c];
+
+				if (child->bytes == 0)
+					continue;
+
+				if (HeadSize(c) <= ((i == 0 && child->counter_updated) ? child->deficit : child->weight))
+					return c;
+			}
+			break;
+	}
+
+	fprintf(stderr, "no active child of node %d\n", p);
+	exit(1);
+}
+
+/* Child of non-empty node p that sends the next packet.
+ * Calling it again before Charge returns the same child.
+ */
+int SchedTree::Select(int p)
+{
+	SchedTreeNode *parent = &nodes[p];
+	double now = Scheduler::instance().clock();
+	int c = TREE_NONE;
+
+	switch (parent->type)
+	{
+		case TREE_SP:
+			for (int i = 0; i < parent->child_num; i++)
+			{
+				if (nodes[parent->children[i]].bytes > 0)
+					return parent->children[i];
+			}
+			break;
+
+		case TREE_DWRR:
+			/* We must go through all actives children and select one that has enough deficit */
+			while ((c = parent->active_head) != TREE_NONE)
+			{
+				SchedTreeNode *child = &nodes[c];
+
+				/* child has not been served yet in this round */
+				if (child->counter_updated == false)
+				{
+					child->deficit += child->weight;
+					child->counter_updated = true;
+				}
+
+				/* if we have enough quantum to dequeue the head packet */
+				if (HeadSize(c) <= child->deficit)
+					return c;
+
+				/* Move child to the tail of the active list */
+				child->counter_updated = false;
+				SampleRound(p, now - child->start_time);
+				child->start_time = now;	//Reset start time
+				if (child->next != TREE_NONE)
+				{
+					parent->active_head = child->next;
+					nodes[parent->active_tail].next = c;
+					parent->active_tail = c;
+					child->next = TREE_NONE;
+				}
+			}
+			break;
+
+		case TREE_WFQ:
+			/* the child with the earliest virtual finish time */
+			if (parent->heap_num > 0)
+				return parent->heap[0];
+			break;
+
+		case TREE_WRR:
+			while (1)
+			{
+				c = parent->children[parent->current];
+				SchedTreeNode *child = &nodes[c];
+
+				/* Empty child! No need to do any sample. Just move to the next child */
+				if (child->bytes == 0)
+				{
+					parent->current = (parent->current + 1) % parent->child_num;
+					continue;
+				}
+
+				if (child->counter_updated == false)
+				{
+					child->counter_updated = true;
+					child->deficit = child->weight;
+				}
+
+				/* We have enough quantum to dequeue this packet */
+				if (HeadSize(c) <= child->deficit)
+					return c;
+
+				SampleRound(p, now - child->start_time);
+				child->start_time = now;
+				child->counter_updated = false;
+				parent->current = (parent->current + 1) % parent->child_num;
+			}
+			break;
+	}
+
+	fprintf(stderr, "no active child of node %d\n", p);
+	exit(1);
+}
+
+/* Child c of node p sent a packet of pktSize bytes. The bytes of c have been updated */
+void SchedTree::Charge(int p, int c, int pktSize)
+{
+	SchedTreeNode *parent = &nodes[p];
+	SchedTreeNode *child = &nodes[c];
+	double now = Scheduler::instance().clock();
+
+	switch (parent->type)
+	{
+		case TREE_DWRR:
+			child->deficit -= pktSize;
+			/* After dequeue, child becomes empty. In such case, we should delete it from the active list. */
+			if (child->bytes == 0)
+			{
+				SampleRound(p, now - child->start_time + pktSize * 8 / link_capacity_);
+				parent->active_head = child->next;
+				if (parent->active_head == TREE_NONE)
+					parent->active_tail = TREE_NONE;
+				child->next = TREE_NONE;
+				child->deficit = 0;
+				child->counter_updated = false;
+			}
+			break;
+
+		case TREE_WFQ:
+			/* Set the finish time for the next packet of child. child is at the top of the heap */
+			if (child->bytes > 0)
+			{
+				child->finish = child->finish + HeadSize(c) / child->weight;
+				if (parent->curr_time < child->finish)
+					parent->curr_time = child->finish;
+				HeapSiftDown(p, 0);
+			}
+			else
+				HeapPop(p);
+			break;
+
+		case TREE_WRR:
+			child->deficit -= pktSize;
+			/* After dequeue, child becomes empty. Move to the next child */
+			if (child->bytes == 0)
+			{
+				SampleRound(p, now - child->start_time + pktSize * 8 / link_capacity_);
+				child->start_time = now + pktSize * 8 / link_capacity_;
+				child->counter_updated = false;
+				parent->current = (parent->current + 1) % parent->child_num;
+			}
+			break;
+
+		default:
+			return;
+	}
+
+	if (child->bytes == 0)
+		parent->weight_sum -= child->weight;
+}
+
+/* Update weight_sum_estimate of all nodes once every estimate_weight_interval_bytes_/link_capacity_ */
+void SchedTree::UpdateWeightSum(double now)
+{
+	double timeInterval = now - last_update_time;
+
+	if (estimate_weight_interval_bytes_ > 0 && link_capacity_ > 0 && timeInterval >= 0.995 * estimate_weight_interval_bytes_ * 8 / link_capacity_)
+	{
+		for (int i = 0; i < MAX_TREE_NODE_NUM; i++)
+		{
+			if (!nodes[i].used)
+				continue;
+
+			nodes[i].weight_sum_estimate = nodes[i].weight_sum_estimate * estimate_weight_alpha_ + nodes[i].weight_sum * (1 - estimate_weight_alpha_);
+			if (debug_ && nodes[i].type != TREE_SP)
+				printf("%.9f [node %d] smooth weight sum: %f, sample weight sum: %f\n", now, i, nodes[i].weight_sum_estimate, nodes[i].weight_sum);
+		}
+		thresh_epoch_.Invalidate();
+		last_update_time = now;
+	}
+}
+
+/* Age the estimation values of internal node n when it becomes non-empty after it was idle since last_idle_time */
+void SchedTree::DecayIdle(int n, double now)
+{
+	double idleTime = now - nodes[n].last_idle_time;
+
+	/* weight_sum_estimate of every node is updated with a zero sample when the port is busy, so it only ages with the port */
+	if (n == root && marking_scheme_ == MQ_MARKING_GENER)
+	{
+		for (int i = 0; i < MAX_TREE_NODE_NUM; i++)
+		{
+			if (!nodes[i].used)
+				continue;
+
+			if (estimate_weight_interval_bytes_ > 0 && link_capacity_ > 0)
+				nodes[i].weight_sum_estimate = nodes[i].weight_sum_estimate * pow(estimate_weight_alpha_, idleTime / (estimate_weight_interval_bytes_ * 8 / link_capacity_));
+			else
+				nodes[i].weight_sum_estimate = 0;
+		}
+		thresh_epoch_.Invalidate();
+		last_update_time = now;
+
+		if (debug_)
+			printf("%.9f smooth weight sum of root is reset to %f\n", now, nodes[root].weight_sum_estimate);
+	}
+	/* round_time is only sampled when the node is served */
+	else if (marking_scheme_ == MQ_MARKING_RR && (nodes[n].type == TREE_DWRR || nodes[n].type == TREE_WRR))
+	{
+		int intervalNum = 0;
+		if (estimate_round_idle_interval_bytes_ > 0 && link_capacity_ > 0)
+		{
+			intervalNum = (int)(idleTime / (estimate_round_idle_interval_bytes_ * 8 / link_capacity_));
+			nodes[n].round_time = nodes[n].round_time * pow(estimate_round_alpha_, intervalNum);
+		}
+		else
+		{
+			nodes[n].round_time = 0;
+		}
+		thresh_epoch_.Invalidate();
+
+		if (debug_)
+			printf("%.9f [node %d] smooth round time is reset to %f after %d idle time slots\n", now, n, nodes[n].round_time, intervalNum);
+	}
+}
+
+/* Product of the shares of queue q at every level on its path from the root */
+double SchedTree::PathShare(int q, int scheme)
+{
+	int up[MAX_TREE_NODE_NUM + 1];
+	int depth = 0;
+	double share = 1;
+
+	for (int n = TREE_LEAF(q); n != TREE_NONE; n = nodes[n].parent)
+		up[depth++] = n;
+
+	/* From the root to the leaf */
+	for (int i = depth - 1; i > 0; i--)
+	{
+		SchedTreeNode *parent = &nodes[up[i]];
+		double weight = nodes[up[i - 1]].weight;
+		double x = 1;
+
+		if (scheme == MQ_MARKING_GENER && parent->type != TREE_SP && parent->weight_sum_estimate >= 0.000000001)
+			x = weight / parent->weight_sum_estimate;
+		/* The parent is served at share * link_capacity_ at most */
+		else if (scheme == MQ_MARKING_RR && (parent->type == TREE_DWRR || parent->type == TREE_WRR) && parent->round_time >= 0.000000001 && link_capacity_ > 0 && share > 0)
+			x = weight * 8 / parent->round_time / (link_capacity_ * share);
+
+		share = share * min(x, 1);
+	}
+
+	return share;
+}
+
+/* Share of queue q for MQ-ECN for any packet scheduling algorithms: weight over the sum of weights of non-empty children at every level */
+bool SchedTree::WeightShare(SchedTree *s, int q, double *share)
+{
+	*share = s->PathShare(q, MQ_MARKING_GENER);
+	return true;
+}
+
+/* Share of queue q for MQ-ECN for round robin packet scheduling algorithms: quantum per round time at every level */
+bool SchedTree::RoundShare(SchedTree *s, int q, double *share)
+{
+	*share = s->PathShare(q, MQ_MARKING_RR);
+	return true;
+}
+
+/* Queues right under an sp node use per-queue marking, the others use fair */
+template <SchedTreeCore::Marking fair>
+int SchedTree::TierMarking(SchedTree *s, int q)
+{
+	if (s->nodes[s->nodes[TREE_LEAF(q)].parent].type == TREE_SP)
+		return SchedTreeCore::PerQueueMarking(s, q);
+	else
+		return fair(s, q);
+}
+
+/* Get the marking policy of an ECN marking scheme */
+SchedTreeCore::Marking SchedTree::SelectMarking(int scheme)
+{
+	switch (scheme)
+	{
+		case PER_QUEUE_MARKING:
+			return SchedTreeCore::PerQueueMarking;
+		case PER_PORT_MARKING:
+			return SchedTreeCore::PerPortMarking;
+		case MQ_MARKING_GENER:
+			return SchedTree::TierMarking<SchedTreeCore::MQMarking<SchedTree::WeightShare> >;
+		case MQ_MARKING_RR:
+			return SchedTree::TierMarking<SchedTreeCore::MQMarking<SchedTree::RoundShare> >;
+		case PIE_MARKING:
+			return SchedTreeCore::MQMarking<SchedTreeCore::DepartureRateShare>;
+		default:
+			return SchedTreeCore::UnknownMarking;
+	}
+}
+
+/* Determine whether we need to mark ECN.
+ * Return 1 if it requires marking
+ */
+int SchedTree::MarkingECN(int queue_index)
+{
+	if (queue_index < 0 || queue_index >= queue_num_)
+	{
+		fprintf(stderr, "illegal queue index value %d\n", queue_index);
+		exit(1);
+	}
+
+	/* Byte thresholds are computed again after OTcl changed mean_pktsize_, port_thresh_ or link_capacity_ */
+	thresh_epoch_.Check(mean_pktsize_, port_thresh_, link_capacity_);
+
+	/* Select the marking policy again only when marking_scheme_ has changed */
+	if (marking_scheme_ != marking_of_)
+	{
+		marking_ = SelectMarking(marking_scheme_);
+		marking_of_ = marking_scheme_;
+		thresh_epoch_.Invalidate();
+	}
+	return marking_(this, queue_index);
+}
+
+/*
+ *  entry points from OTcL to build the tree and set per queue state variables
+ *   - $q add-node node_id parent_id type [weight] (type is sp, dwrr, wfq or wrr, parent_id is -1 for the root)
+ *   - $q add-queue queue_id parent_id [weight]
+ *   - $q set-thresh queue_id queue_thresh
+ *   - $q attach-total file
+ *	 - $q attach-queue file
+ *	 - $q attach-qlen-trace file [interval_us]
+ *
+ *  NOTE: $q represents the discipline queue variable in OTcl.
+ */
+int SchedTree::command(int argc, const char*const* argv)
+{
+	// add an internal node that schedules its children with type
+	if ((argc == 5 || argc == 6) && strcmp(argv[1], "add-node") == 0)
+	{
+		int node_id = atoi(argv[2]);
+		int type = ParseType(argv[4]);
+		if (node_id < 0 || node_id >= MAX_TREE_NODE_NUM)
+		{
+			fprintf(stderr, "illegal node index value %s\n", argv[2]);
+			exit(1);
+		}
+		if (type == TREE_NONE)
+		{
+			fprintf(stderr, "illegal type %s for node %s\n", argv[4], argv[2]);
+			exit(1);
+		}
+		AddNode(node_id, atoi(argv[3]), type, (argc == 6) ? atof(argv[5]) : 1500);
+		return (TCL_OK);
+	}
+
+	// add a queue as a leaf of the tree
+	if ((argc == 4 || argc == 5) && strcmp(argv[1], "add-queue") == 0)
+	{
+		int queue_id = atoi(argv[2]);
+		if (queue_id < 0 || queue_id >= MAX_TREE_QUEUE_NUM)
+		{
+			fprintf(stderr, "illegal queue index value %s\n", argv[2]);
+			exit(1);
+		}
+		AddNode(TREE_LEAF(queue_id), atoi(argv[3]), TREE_FIFO, (argc == 5) ? atof(argv[4]) : 1500);
+		return (TCL_OK);
+	}
+
+	// attach a file to write binary qlen records, optionally sampled every interval_us
+	if ((argc == 3 || argc == 4) && strcmp(argv[1], "attach-qlen-trace") == 0)
+	{
+		Tcl& tcl = Tcl::instance();
+		double interval_us = (argc == 4) ? atof(argv[3]) : 0;
+		if (qlen_trace_.attach(tcl.interp(), argv[2], interval_us) != TCL_OK)
+		{
+			tcl.resultf("SchedTree: trace: can't attach %s for writing", argv[2]);
+			return (TCL_ERROR);
+		}
+		return (TCL_OK);
+	}
+
+	if (argc == 3)
+	{
+		// attach a file to trace total queue length
+		if (strcmp(argv[1], "attach-total") == 0)
+		{
+			int mode;
+			const char* id = argv[2];
+			Tcl& tcl = Tcl::instance();
+			total_qlen_tchan_ = Tcl_GetChannel(tcl.interp(), (char*)id, &mode);
+			if (total_qlen_tchan_ == 0)
+			{
+				tcl.resultf("SchedTree: trace: can't attach %s for writing", id);
+				return (TCL_ERROR);
+			}
+			return (TCL_OK);
+		}
+		else if (strcmp(argv[1], "attach-queue") == 0)
+		{
+			int mode;
+			const char* id = argv[2];
+			Tcl& tcl = Tcl::instance();
+			qlen_tchan_ = Tcl_GetChannel(tcl.interp(), (char*)id, &mode);
+			if (qlen_tchan_ == 0)
+			{
+				tcl.resultf("SchedTree: trace: can't attach %s for writing", id);
+				return (TCL_ERROR);
+			}
+			return (TCL_OK);
+		}
+	}
+	else if (argc == 4)
+	{
+		if (strcmp(argv[1], "set-thresh") == 0)
+		{
+			int queue_index = atoi(argv[2]);
+			if (queue_index < MAX_TREE_QUEUE_NUM && queue_index >= 0)
+			{
+				double thresh = atof(argv[3]);
+				if (thresh >= 0)
+				{
+					queues[queue_index].thresh = thresh;
+					thresh_epoch_.Invalidate();
+					return (TCL_OK);
+				}
+				else
+				{
+					fprintf(stderr, "illegal thresh value %s for queue %s\n", argv[3], argv[2]);
+					exit(1);
+				}
+			}
+			/* Exceed the maximum queue number or smaller than 0*/
+			else
+			{
+				fprintf(stderr, "illegal queue index value %s\n", argv[2]);
+				exit(1);
+			}
+		}
+	}
+	return (Queue::command(argc, argv));
+}
+
+/* Receive a new packet */
+void SchedTree::enque(Packet *p)
+{
+	hdr_ip *iph = hdr_ip::access(p);
+	int prio = iph->prio();
+	hdr_flags* hf = hdr_flags::access(p);
+	hdr_cmn* hc = hdr_cmn::access(p);
+	int pktSize = hc->size();
+	int qlimBytes = qlim_ * mean_pktsize_;
+	double now = Scheduler::instance().clock();
+
+	if (!init)
+	{
+		Check();
+		init = true;
+	}
+
+	/* The shared buffer is overfilld */
+	if (TotalByteLength() + pktSize > qlimBytes)
+	{
+		drop(p);
+		return;
+	}
+
+	if (prio >= queue_num_ || prio < 0)
+		prio = queue_num_ - 1;
+
+	queues[prio].enque(p);
+
+	/* From the leaf to the root, activate every node that becomes non-empty in its parent */
+	int c = TREE_LEAF(prio);
+	nodes[c].bytes += pktSize;
+	for (int n = nodes[c].parent; n != TREE_NONE; c = n, n = nodes[n].parent)
+	{
+		if (nodes[c].bytes == pktSize)
+			Activate(n, c, pktSize);
+		if (nodes[n].bytes == 0)
+			DecayIdle(n, now);
+		nodes[n].bytes += pktSize;
+	}
+
+	/* Enqueue ECN marking */
+	if (marking_scheme_ != LATENCY_MARKING && MarkingECN(prio) > 0 && hf->ect())
+	{
+		hf->ce() = 1;
+		qlen_trace_.mark(prio);
+	}
+	/* For dequeue latency ECN marking ,record enqueue timestamp here */
+	else if (marking_scheme_ == LATENCY_MARKING && hf->ect())
+		hc->timestamp() = now;
+
+	SchedTreeCore::Trace(this, prio);
+}
+
+Packet *SchedTree::deque(void)
+{
+	Packet *pkt = NULL;
+	int pktSize = 0;
+	int depth = 0;
+	int queue = QLEN_TRACE_TOTAL;
+	double now = Scheduler::instance().clock();
+
+	if (TotalByteLength() > 0)
+	{
+		/* From the root to a leaf, select the child that sends the next packet */
+		path[depth++] = root;
+		while (nodes[path[depth - 1]].type != TREE_FIFO)
+		{
+			path[depth] = Select(path[depth - 1]);
+			depth++;
+		}
+
+		queue = nodes[path[depth - 1]].queue;
+		pkt = queues[queue].deque();
+		pktSize = hdr_cmn::access(pkt)->size();
+
+		for (int i = 0; i < depth; i++)
+		{
+			nodes[path[i]].bytes -= pktSize;
+			if (nodes[path[i]].bytes == 0)
+				nodes[path[i]].last_idle_time = now;
+		}
+
+		/* From the leaf to the root, so a parent sees the next packet of its child */
+		for (int i = depth - 1; i > 0; i--)
+			Charge(path[i - 1], path[i], pktSize);
+
+		/* dequeue latency-based ECN marking */
+		if (marking_scheme_ == LATENCY_MARKING)
+			SchedTreeCore::LatencyMarking(this, pkt, queue);
+
+		SchedTreeCore::DepartureRate(this, queue, pktSize);
+	}
+
+	if (marking_scheme_ == MQ_MARKING_GENER && root != TREE_NONE)
+		UpdateWeightSum(now);
+
+	SchedTreeCore::Trace(this, queue);
+	return pkt;
+}
@@ -0,0 +1,166 @@
+/*
+ * Hierarchical scheduler tree (Queue/SchedTree)
+ *
+ * The tree is built from OTcl. Every internal node schedules its children with
+ * strict priority (sp), DWRR (dwrr), WFQ (wfq) or WRR (wrr). Leaves are FIFO
+ * queues: a packet goes to the queue whose ID is hdr_ip::prio(). For example,
+ * port -> tenant -> class:
+ *
+ *   $q add-node 0 -1 dwrr	;#root: tenants share the port with DWRR
+ *   $q add-node 1 0 wfq 3000	;#tenant 1 with quantum 3000
+ *   $q add-node 2 0 sp 1500	;#tenant 2 with quantum 1500
+ *   $q add-queue 0 1 2	;#queue 0 of tenant 1, weight 2
+ *   $q add-queue 1 1 1	;#queue 1 of tenant 1, weight 1
+ *   $q add-queue 2 2	;#queue 2 of tenant 2, highest priority
+ *   $q add-queue 3 2	;#queue 3 of tenant 2
+ *
+ * Children of an sp node are served in the order they are added. The weight
+ * of a child is a quantum in bytes for dwrr and wrr parents and a weight for
+ * wfq parents. Queue IDs must be 0, 1, ..., n-1.
+ *
+ * ECN marking (marking_scheme_) is the same as in the other schedulers. With
+ * MQ-ECN, queues right under an sp node use their own threshold (set-thresh),
+ * like the strict priority queues of PRIO_DWRR. The threshold of any other
+ * queue is port_thresh_ times its service share, the product of its shares at
+ * every level on the path from the root:
+ *  - a child of an sp node may use the whole share of its parent
+ *  - MQ_MARKING_GENER: weight over the estimated sum of weights of the
+ *    non-empty children (dwrr, wfq and wrr nodes)
+ *  - MQ_MARKING_RR: weight per round time of the parent (dwrr and wrr nodes)
+ * A level whose share can not be estimated keeps the share of its parent.
+ */
+
+#ifndef ns_sched_tree_h
+#define ns_sched_tree_h
+
+#include <string.h>
+#include "queue.h"
+#include "config.h"
+#include "trace.h"
+#include "sched-core.h"
+
+/* Maximum number of internal nodes */
+#define MAX_TREE_NODE_NUM 64
+/* Maximum number of queues (leaves) */
+#define MAX_TREE_QUEUE_NUM 64
+/* Maximum number of children of a node */
+#define MAX_TREE_CHILD_NUM 64
+
+/* Types of nodes */
+#define TREE_SP 0
+#define TREE_DWRR 1
+#define TREE_WFQ 2
+#define TREE_WRR 3
+#define TREE_FIFO 4
+
+#define TREE_NONE -1
+/* Index of the leaf of queue q in the node array */
+#define TREE_LEAF(q) (MAX_TREE_NODE_NUM + (q))
+
+class SchedTreeNode
+{
+	public:
+		SchedTreeNode(): used(false), type(TREE_NONE), parent(TREE_NONE), queue(TREE_NONE), child_num(0), bytes(0),
+			index(0), weight(1500), deficit(0), counter_updated(false), start_time(0), finish(0), next(TREE_NONE),
+			active_head(TREE_NONE), active_tail(TREE_NONE), current(0), curr_time(0), heap_num(0), weight_sum(0), weight_sum_estimate(0),
+			round_time(0), last_idle_time(0) {}
+
+		bool used;	//whether this node is in the tree
+		int type;	//TREE_SP, TREE_DWRR, TREE_WFQ, TREE_WRR or TREE_FIFO
+		int parent;	//index of the parent node, TREE_NONE for the root
+		int queue;	//queue ID of a leaf, TREE_NONE for internal nodes
+		int children[MAX_TREE_CHILD_NUM];	//indexes of children in the order they are added
+		int child_num;	//number of children
+		int bytes;	//total length of the queues below this node in bytes
+
+		/* State kept by the parent for this node */
+		int index;	//index of this node in children of the parent
+		double weight;	//quantum (dwrr, wrr) or weight (wfq) in the parent
+		double deficit;	//deficit counter (dwrr) or counter of this round (wrr)
+		bool counter_updated;	//whether deficit has been updated in this round (dwrr, wrr)
+		double start_time;	//time when this node started to wait in this round (dwrr, wrr)
+		long double finish;	//virtual finish time of the next packet (wfq)
+		int next;	//next node in the active list of the parent (dwrr)
+
+		/* State of this node as a parent */
+		int active_head;	//head of the list of non-empty children (dwrr)
+		int active_tail;	//tail of the list of non-empty children (dwrr)
+		int current;	//index in children of the child being served (wrr)
+		long double curr_time;	//finish time assigned to the last packet (wfq)
+		int heap[MAX_TREE_CHILD_NUM];	//binary min-heap of non-empty children keyed by finish (wfq)
+		int heap_num;	//number of children in heap (wfq)
+		double weight_sum;	//sum of weights of non-empty children
+		double weight_sum_estimate;	//estimation value for weight_sum
+		double round_time;	//estimation value for round time (dwrr, wrr)
+		double last_idle_time;	//last time when this node became empty
+};
+
+class SchedTree : public Queue
+{
+	public:
+		SchedTree();
+		~SchedTree();
+		virtual int command(int argc, const char*const* argv);
+
+	protected:
+		Packet *deque(void);
+		void enque(Packet *pkt);
+		int TotalByteLength() { return (root == TREE_NONE) ? 0 : nodes[root].bytes; }	//Get total length of all queues in bytes (O(1))
+		int MarkingECN(int q);	//Determine whether we need to mark ECN, q is current queue number
+		static SchedCore<SchedTree>::Marking SelectMarking(int scheme);	//marking policy of an ECN marking scheme
+		template <SchedCore<SchedTree>::Marking fair>
+		static int TierMarking(SchedTree *s, int q);	//per-queue marking under sp nodes, fair otherwise
+		static bool WeightShare(SchedTree *s, int q, double *share);	//share of queue q for MQ_MARKING_GENER
+		static bool RoundShare(SchedTree *s, int q, double *share);	//share of queue q for MQ_MARKING_RR
+		double PathShare(int q, int scheme);	//product of the shares of queue q on its path from the root
+		SchedQueue *GetQueue(int q) { return &queues[q]; }
+		int QueueNum() { return queue_num_; }
+		int QueueByteLength(int q) { return GetQueue(q)->byteLength(); }
+
+		void AddNode(int n, int parent, int type, double weight);	//Add node n as the last child of parent
+		void Check();	//Check the tree and count the queues before the first packet
+		void Activate(int p, int c, int pktSize);	//Child c of node p becomes non-empty with a packet of pktSize bytes
+		int Select(int p);	//Child of node p that sends the next packet
+		int Peek(int p);	//Child that Select(p) would return, without changing any state
+		void Charge(int p, int c, int pktSize);	//Child c of node p sent a packet of pktSize bytes
+		int HeadSize(int n);	//Size of the next packet that node n sends
+		bool EarlierFinish(int c1, int c2);	//whether child c1 of a wfq node is served before child c2
+		void HeapPush(int p, int c);	//Add child c of wfq node p that becomes non-empty to the heap of p
+		void HeapPop(int p);	//Remove the child at the top of the heap of wfq node p
+		void HeapSiftDown(int p, int i);	//Restore the heap of p after the finish time of heap[i] increases
+		void SampleRound(int p, double sample);	//Update the round time of node p
+		void UpdateWeightSum(double now);	//Update weight_sum_estimate of all nodes every interval
+		void DecayIdle(int n, double now);	//Age the estimation values of node n after it was idle
+
+		/* Variables */
+		SchedTreeNode *nodes;	//internal nodes, then one leaf for every queue
+		SchedQueue *queues;	//underlying multi-FIFO (CoS) queues
+		int path[MAX_TREE_NODE_NUM + 1];	//nodes from the root to the leaf of the last dequeue
+		int root;	//index of the root node
+		int queue_num_;	//number of queues
+		bool init;	//whether the tree has been checked
+		double last_update_time;	//last time when we update weight_sum_estimate
+		SchedCore<SchedTree>::Marking marking_;	//marking policy selected for marking_of_
+		int marking_of_;	//marking_scheme_ when marking_ was selected
+		ThreshEpoch thresh_epoch_;	//epoch of the byte thresholds of queues
+
+		int mean_pktsize_;	//MTU in bytes
+		double port_thresh_;	//per-port ECN marking threshold (pkts)
+		int marking_scheme_;	//ECN marking policy
+		double estimate_weight_alpha_;	//factor between 0 and 1 for weight sum estimation
+		int estimate_weight_interval_bytes_;	//time interval is estimate_weight_interval_bytes_/link capacity.
+		double estimate_round_alpha_;	//factor between 0 and 1 for round time estimation
+		int estimate_round_idle_interval_bytes_;	//Time interval (divided by link capacity) to update round time when a node is idle.
+		int dq_thresh_;	//threshold for departure rate estimation
+		double estimate_rate_alpha_;	//factor between 0 and 1 for departure rate estimation
+		double link_capacity_;	//Link capacity
+		int debug_;	//debug more(true) or not(false)
+
+		Tcl_Channel total_qlen_tchan_;	//place to write total_qlen records
+		Tcl_Channel qlen_tchan_;	//place to write per-queue qlen records
+		QlenTrace qlen_trace_;	//records of the binary qlen trace
+
+		friend class SchedCore<SchedTree>;
+};
+
+#endif
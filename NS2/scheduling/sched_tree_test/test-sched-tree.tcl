@@ -0,0 +1,167 @@
+set ns [new Simulator]
+
+#Tree: port (sp) -> queue 0 (highest priority) and tenants (dwrr)
+#tenants (dwrr) -> tenant 1 (wfq) -> queues 1 and 2
+#               -> tenant 2 (dwrr) -> queue 3
+set service_num 4
+set service_senders(0) 2;	#highest priority
+set service_senders(1) 4
+set service_senders(2) 4
+set service_senders(3) 4
+set service_start(0) 0
+set service_start(1) 0.005
+set service_start(2) 0.01
+set service_start(3) 0.015
+set service0_rate_mbps 4000
+set K 80;	#ECN marking threshold
+set W_T1 3000;	#quantum of tenant 1
+set W_T2 1500;	#quantum of tenant 2
+set W_1 1;	#weight of queue 1 in tenant 1
+set W_2 2;	#weight of queue 2 in tenant 1
+set marking_scheme 2
+
+set RTT 0.0001
+set DCTCP_g_ 0.0625
+set ackRatio 1
+set packetSize 1460
+set lineRate 10Gb
+
+set simulationTime 0.02
+set throughputSamplingInterval 0.0002
+
+Agent/TCP set windowInit_ 10
+Agent/TCP set ecn_ 1
+Agent/TCP set old_ecn_ 1
+Agent/TCP set dctcp_ false
+Agent/TCP set dctcp_g_ $DCTCP_g_
+Agent/TCP set packetSize_ $packetSize
+Agent/TCP set window_ 1256
+Agent/TCP set slow_start_restart_ false
+Agent/TCP set minrto_ 0.01 ; # minRTO = 10ms
+Agent/TCP set windowOption_ 0
+Agent/TCP/FullTcp set segsize_ $packetSize
+Agent/TCP/FullTcp set segsperack_ $ackRatio;
+Agent/TCP/FullTcp set spa_thresh_ 3000;
+Agent/TCP/FullTcp set interval_ 0.04 ; #delayed ACK interval = 40ms
+Agent/TCP/FullTcp set enable_pias_ false
+
+Queue set limit_ 1000
+
+Queue/SchedTree set mean_pktsize_ [expr $packetSize+40]
+Queue/SchedTree set port_thresh_ $K
+Queue/SchedTree set marking_scheme_ $marking_scheme
+Queue/SchedTree set estimate_weight_alpha_ 0.75
+Queue/SchedTree set estimate_weight_interval_bytes_ 1500
+Queue/SchedTree set estimate_round_alpha_ 0.75
+Queue/SchedTree set estimate_round_idle_interval_bytes_ 1500
+Queue/SchedTree set dq_thresh_ 10000
+Queue/SchedTree set estimate_rate_alpha_ 0.875
+Queue/SchedTree set link_capacity_ $lineRate
+Queue/SchedTree set debug_ false
+
+Queue/RED set bytes_ false
+Queue/RED set queue_in_bytes_ true
+Queue/RED set mean_pktsize_ [expr $packetSize+40]
+Queue/RED set setbit_ true
+Queue/RED set gentle_ false
+Queue/RED set q_weight_ 1.0
+Queue/RED set mark_p_ 1.0
+Queue/RED set thresh_ $K
+Queue/RED set maxthresh_ $K
+
+set mytracefile [open mytracefile.tr w]
+$ns trace-all $mytracefile
+set throughputfile [open throughputfile.tr w]
+set tot_qlenfile [open tot_qlenfile.tr w]
+set qlenfile [open qlenfile.tr w]
+set tracedir tcp_flows
+
+proc finish {} {
+	global ns mytracefile throughputfile qlenfile tot_qlenfile
+	$ns flush-trace
+	close $mytracefile
+	close $throughputfile
+	close $qlenfile
+	exit 0
+}
+
+set switch [$ns node]
+set receiver [$ns node]
+
+$ns simplex-link $switch $receiver $lineRate [expr $RTT/4] SchedTree
+$ns simplex-link $receiver $switch $lineRate [expr $RTT/4] DropTail
+
+set L [$ns link $switch $receiver]
+set q [$L set queue_]
+$q add-node 0 -1 sp
+$q add-queue 0 0
+$q add-node 1 0 dwrr
+$q add-node 2 1 wfq $W_T1
+$q add-queue 1 2 $W_1
+$q add-queue 2 2 $W_2
+$q add-node 3 1 dwrr $W_T2
+$q add-queue 3 3
+$q set-thresh 0 $K
+$q attach-total $tot_qlenfile
+$q attach-queue $qlenfile
+
+for {set s 0} {$s < $service_num} {incr s} {
+	for {set i 0} {$i < $service_senders($s)} {incr i} {
+		set n($s,$i) [$ns node]
+		$ns duplex-link $n($s,$i) $switch $lineRate [expr $RTT/4] RED
+		set tcp($s,$i) [new Agent/TCP/FullTcp/Sack]
+		set sink($s,$i) [new Agent/TCP/FullTcp/Sack]
+		$tcp($s,$i) set serviceid_ $s
+		$sink($s,$i) listen
+
+		$ns attach-agent $n($s,$i) $tcp($s,$i)
+		$ns attach-agent $receiver $sink($s,$i)
+		$ns connect $tcp($s,$i) $sink($s,$i)
+
+		set ftp($s,$i) [new Application/FTP]
+		$ftp($s,$i) attach-agent $tcp($s,$i)
+		$ftp($s,$i) set type_ FTP
+
+		###Add token bucket rate limiter to the highest priority service
+		if {$s == 0} {
+			set tbf($i) [new TBF]
+			$tbf($i) set bucket_ 64000
+			$tbf($i) set rate_ [expr $service0_rate_mbps / $service_senders(0)]Mbit
+			$tbf($i) set qlen_ 1000
+			$ns attach-tbf-agent $n($s,$i) $tcp($s,$i) $tbf($i)
+		}
+
+		$ns at $service_start($s) "$ftp($s,$i) start"
+	}
+}
+
+proc record {} {
+	global ns throughputfile throughputSamplingInterval service_num service_senders sink
+
+	#Get the current time
+	set now [$ns now]
+
+	#Initialize the output string
+	set str $now
+
+	for {set s 0} {$s < $service_num} {incr s} {
+		set bw 0
+		for {set i 0} {$i < $service_senders($s)} {incr i} {
+			set bytes [$sink($s,$i) set bytes_]
+			set bw [expr $bw + $bytes]
+			$sink($s,$i) set bytes_ 0
+		}
+		append str ", "
+		append str [expr int($bw / $throughputSamplingInterval * 8 / 1000000)];	#throughput in Mbps
+	}
+
+	puts $throughputfile $str
+
+	#Set next callback time
+	$ns at [expr $now + $throughputSamplingInterval] "record"
+
+}
+
+$ns at 0.0 "record"
+$ns at [expr $simulationTime] "finish"
+$ns run
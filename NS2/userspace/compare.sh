@@ -0,0 +1,85 @@
+#!/bin/bash
+#
+# Compare NS2 schedulers between two git revisions: build drive_<sched> from
+# both trees and run them over a grid of ECN marking schemes and loads. Every
+# run must give the same packets sent, drops, ECN marks and departure order
+# (and round time estimates for DWRR and WRR). Exit status 1 on a difference.
+#
+# usage: compare.sh [-t] [-c classes] [-n packets] [-m "schemes"] [-l "loads"]
+#                   [-s "schedulers"] OLD [NEW]
+#
+# NEW defaults to the working tree. With -t, both builds sample the MQ-ECN
+# weight (quantum) sum with estimate_*_enable_timer_, and the timers of an old
+# revision fire as events. For example:
+#   compare.sh -s "dwrr" 71dff8e^ 71dff8e	#O(1) DWRR totals and active list
+#   compare.sh -s "wfq prio_wfq" fa73667^ fa73667	#WFQ finish time heap
+#   compare.sh -s "wrr" 002840f^ 002840f	#WRR active mask
+#   compare.sh -t -m 2 -l "0.001 0.3 1.05 1.5" -s "dwrr wfq prio_dwrr prio_wfq" 2cb806e^ 2cb806e
+#						#lazy weight sum sampling vs timers
+# The pFabric patch is checked on its own with "make check".
+
+usage() {
+	sed -n '4,20p' "$0" | sed 's/^# \{0,1\}//'
+	exit 2
+}
+
+here=$(cd "$(dirname "$0")" && pwd)
+classes=8
+npkts=200000
+schemes="0 1 2 3 4 5"
+loads="0.3 0.95 1.2"
+scheds="dwrr wfq wrr priority prio_dwrr prio_wfq sched_tree"
+timer=
+
+while getopts "tc:n:m:l:s:" opt; do
+	case $opt in
+		t) timer=-t ;;
+		c) classes=$OPTARG ;;
+		n) npkts=$OPTARG ;;
+		m) schemes=$OPTARG ;;
+		l) loads=$OPTARG ;;
+		s) scheds=$OPTARG ;;
+		*) usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ $# -ge 1 ] && [ $# -le 2 ] || usage
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# Build the drivers of revision $1 (the working tree if empty) into $tmp/$2
+build() {
+	local tree=$here/.. out=$tmp/$2
+
+	mkdir -p "$out"
+	if [ -n "$1" ]; then
+		mkdir -p "$tmp/$2.src"
+		(cd "$here/.." && git archive "$1" -- . | tar -x -C "$tmp/$2.src") || exit 2
+		tree=$(find "$tmp/$2.src" -type d -name diffserv -printf '%h\n' | head -1)
+	fi
+	for s in $scheds; do
+		make -s -C "$here" NS2="$tree" O="$out" "$out/drive_$s" >/dev/null || exit 2
+	done
+}
+
+build "$1" old
+build "$2" new
+
+status=0
+for s in $scheds; do
+	for m in $schemes; do
+		for l in $loads; do
+			args="$timer -c $classes -n $npkts -m $m -l $l"
+			a=$("$tmp/old/drive_$s" $args 2>/dev/null)
+			b=$("$tmp/new/drive_$s" $args 2>/dev/null)
+			if [ "$a" == "$b" ]; then
+				echo "ok $s scheme $m load $l: $b"
+			else
+				echo "DIFF $s scheme $m load $l: $a | $b"
+				status=1
+			fi
+		done
+	done
+done
+exit $status
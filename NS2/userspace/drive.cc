@@ -0,0 +1,181 @@
+/*
+ * Drive one NS2 scheduler directly: Poisson arrivals of 1500-byte ECN
+ * capable packets over a set of classes (class i gets more traffic than
+ * class i + 1) on a 10Gbps link. Print the packets sent, drops, ECN marks
+ * and a checksum of the departure order (and of the round time estimate for
+ * round robin schedulers), so builds of two revisions can be compared with
+ * compare.sh. The wall-clock time and timer events go to stderr.
+ *
+ * DRIVE_SRC is the scheduler source, DRIVE_CLASS its class and DRIVE_<NAME>
+ * selects its setup.
+ */
+#define protected public
+#include DRIVE_SRC
+#undef protected
+#include <unistd.h>
+#include <time.h>
+
+typedef DRIVE_CLASS Drive;
+
+#if defined(DRIVE_DWRR) || defined(DRIVE_WRR)
+#define DRIVE_ROUND_TIME
+static void Setup(Drive *q, int classes, int timer)
+{
+	q->queue_num_ = classes;
+	for (int i = 0; i < classes; i++)
+	{
+		q->queues[i].quantum = 1500 * (1 + i % 4);
+		q->queues[i].thresh = 20;
+	}
+	q->port_thresh_ = 65;
+#ifdef DRIVE_DWRR
+	q->estimate_quantum_enable_timer_ = timer;
+#endif
+}
+#elif defined(DRIVE_WFQ)
+static void Setup(Drive *q, int classes, int timer)
+{
+	q->queue_num_ = classes;
+	for (int i = 0; i < classes; i++)
+	{
+		q->queues[i].weight = 1 + i % 4;
+		q->queues[i].thresh = 20;
+	}
+	q->port_thresh_ = 65;
+	q->estimate_weight_enable_timer_ = timer;
+}
+#elif defined(DRIVE_PRIORITY)
+static void Setup(Drive *q, int classes, int timer)
+{
+	q->queue_num_ = classes;
+	for (int i = 0; i < classes; i++)
+		q->queues[i].thresh = 20;
+	q->port_thresh_ = 65;
+}
+#elif defined(DRIVE_PRIO_DWRR) || defined(DRIVE_PRIO_WFQ)
+/* 2 strict priority queues above the other classes (at most 6 of them) */
+static void Setup(Drive *q, int classes, int timer)
+{
+	q->prio_queue_num_ = 2;
+	q->prio_queues[0].thresh = 10;
+	q->prio_queues[1].thresh = 15;
+	q->port_thresh_ = 65;
+#ifdef DRIVE_PRIO_DWRR
+	q->dwrr_queue_num_ = 6;
+	for (int i = 0; i < 6; i++)
+		q->dwrr_queues[i].quantum = 1500 * (1 + i % 3);
+	q->estimate_quantum_enable_timer_ = timer;
+#else
+	q->wfq_queue_num_ = 6;
+	for (int i = 0; i < 6; i++)
+		q->wfq_queues[i].weight = 1 + i % 3;
+	q->estimate_weight_enable_timer_ = timer;
+#endif
+}
+#elif defined(DRIVE_SCHED_TREE)
+/* port -> (queue 0 | dwrr -> (wfq -> queues 1, 2 | wrr -> queues 3-7)) */
+static void Setup(Drive *q, int classes, int timer)
+{
+	q->AddNode(0, TREE_NONE, TREE_SP, 1500);
+	q->AddNode(TREE_LEAF(0), 0, TREE_FIFO, 1500);
+	q->AddNode(1, 0, TREE_DWRR, 1500);
+	q->AddNode(2, 1, TREE_WFQ, 3000);
+	q->AddNode(TREE_LEAF(1), 2, TREE_FIFO, 1);
+	q->AddNode(TREE_LEAF(2), 2, TREE_FIFO, 2);
+	q->AddNode(3, 1, TREE_WRR, 1500);
+	for (int i = 3; i < 8; i++)
+		q->AddNode(TREE_LEAF(i), 3, TREE_FIFO, 1500);
+	q->port_thresh_ = 65;
+	q->queues[0].thresh = 12;
+}
+#else
+#error "unknown scheduler"
+#endif
+
+static void Usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-c classes] [-n packets] [-m marking_scheme] [-l load] [-s seed] [-t]\n"
+		"  -t  sample the MQ-ECN weight (quantum) sum with estimate_*_enable_timer_\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int classes = 8, scheme = 1, timer = 0, opt;
+	long npkts = 200000, seed = 1;
+	double load = 1.05, capacity = 10e9;
+
+	while ((opt = getopt(argc, argv, "c:n:m:l:s:t")) != -1)
+	{
+		switch (opt)
+		{
+			case 'c': classes = atoi(optarg); break;
+			case 'n': npkts = atol(optarg); break;
+			case 'm': scheme = atoi(optarg); break;
+			case 'l': load = atof(optarg); break;
+			case 's': seed = atol(optarg); break;
+			case 't': timer = 1; break;
+			default: Usage(argv[0]);
+		}
+	}
+	if (classes < 1 || classes > 64 || npkts < 1 || load <= 0)
+		Usage(argv[0]);
+
+	Drive *q = new Drive();
+	q->marking_scheme_ = scheme;
+	q->link_capacity_ = capacity;
+	q->qlim_ = 1000;
+	Setup(q, classes, timer);
+
+	double now = 0, busy_until = 0;
+	long sent = 0, marks = 0;
+	unsigned long order = 0, round = 0;
+	struct timespec start, end;
+
+	srand48(seed);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long uid = 0; uid < npkts; uid++)
+	{
+		now += -log(1 - drand48()) * 1500 * 8 / (capacity * load);
+
+		/* The link sends packets back to back until the next arrival */
+		while (busy_until <= now)
+		{
+			shim_run_timers(busy_until);
+			Packet *p = q->deque();
+			if (!p)
+			{
+				busy_until = now;
+				break;
+			}
+			marks += p->f.ce_;
+			order = order * 31 + p->c.uid_;
+#ifdef DRIVE_ROUND_TIME
+			round = round * 31 + (unsigned long)(q->round_time * 1e12);
+#endif
+			busy_until += p->c.size_ * 8 / capacity;
+			sent++;
+			delete p;
+		}
+
+		shim_run_timers(now);
+		Packet *p = new Packet();
+		int c = (int)(pow(drand48(), 2) * classes);
+		p->c.size_ = 1500;
+		p->c.uid_ = uid;
+		p->c.ts_ = 0;
+		p->i.src_ = c;
+		p->i.dst_ = 0;
+		p->i.prio_ = c;
+		p->i.fid_ = c * 4 + (int)(drand48() * 4);
+		p->f.ect_ = 1;
+		p->f.ce_ = 0;
+		q->enque(p);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("sent %ld drops %ld marks %ld order %lx round %lx\n", sent, shim_drops, marks, order, round);
+	fprintf(stderr, "timer events %ld wall %.3f s\n", shim_timer_events,
+		(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+	return 0;
+}
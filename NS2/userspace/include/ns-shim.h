@@ -0,0 +1,262 @@
+/*
+ * Minimal stand-ins for the ns-2.34 classes used by the MQ-ECN schedulers.
+ * Only what the schedulers touch is provided, so the unmodified scheduler
+ * sources of any revision can be built and driven without a simulator.
+ * The clock only moves when the driver sets it, and timers fire as events
+ * in due order when the driver reaches their time.
+ */
+#ifndef ns_shim_h
+#define ns_shim_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <tcl.h>
+
+typedef int nsaddr_t;
+
+struct Event {};
+
+struct hdr_cmn
+{
+	int size_;
+	int uid_;
+	double ts_;
+	int &size() { return size_; }
+	int &uid() { return uid_; }
+	double &timestamp() { return ts_; }
+	static hdr_cmn *access(const struct Packet *p);
+};
+
+struct hdr_ip
+{
+	nsaddr_t src_;
+	nsaddr_t dst_;
+	int fid_;
+	int prio_;
+	nsaddr_t &saddr() { return src_; }
+	nsaddr_t &daddr() { return dst_; }
+	int &flowid() { return fid_; }
+	int &prio() { return prio_; }
+	static hdr_ip *access(const struct Packet *p);
+};
+
+struct hdr_flags
+{
+	int ect_;
+	int ce_;
+	int &ect() { return ect_; }
+	int &ce() { return ce_; }
+	static hdr_flags *access(const struct Packet *p);
+};
+
+struct Packet
+{
+	Packet *next_;
+	hdr_cmn c;
+	hdr_ip i;
+	hdr_flags f;
+	static void free(Packet *p) { delete p; }
+};
+
+inline hdr_cmn *hdr_cmn::access(const Packet *p) { return (hdr_cmn *)&p->c; }
+inline hdr_ip *hdr_ip::access(const Packet *p) { return (hdr_ip *)&p->i; }
+inline hdr_flags *hdr_flags::access(const Packet *p) { return (hdr_flags *)&p->f; }
+
+class Scheduler
+{
+	public:
+		static Scheduler &instance();
+		double clock();
+};
+
+/* Set the simulation clock */
+void shim_set_clock(double now);
+/* Fire the timers due by now in time order, then set the clock to now */
+void shim_run_timers(double now);
+/* Number of timer events fired so far */
+extern long shim_timer_events;
+/* Number of packets dropped by Queue::drop() so far */
+extern long shim_drops;
+
+class TclObject
+{
+	public:
+		virtual ~TclObject() {}
+		void bind(const char *, int *) {}
+		void bind(const char *, double *) {}
+		void bind_bool(const char *, int *) {}
+		void bind_bw(const char *, double *) {}
+		virtual int command(int, const char *const *) { return TCL_ERROR; }
+		static TclObject *lookup(const char *) { return NULL; }
+};
+
+class Tcl
+{
+	public:
+		static Tcl &instance();
+		Tcl_Interp *interp() { return NULL; }
+		void resultf(const char *, ...) {}
+		void evalf(const char *, ...) {}
+		const char *result() { return ""; }
+};
+
+class TclClass
+{
+	public:
+		TclClass(const char *) {}
+		virtual ~TclClass() {}
+		virtual TclObject *create(int, const char *const *) = 0;
+};
+
+/* ns-2.34 PacketQueue */
+class PacketQueue : public TclObject
+{
+	public:
+		PacketQueue() : head_(0), tail_(0), len_(0), bytes_(0), iter_(0) {}
+		virtual int length() const { return len_; }
+		virtual int byteLength() const { return bytes_; }
+
+		/* Returns the previous tail */
+		virtual Packet *enque(Packet *p)
+		{
+			Packet *pt = tail_;
+			if (!tail_)
+				head_ = tail_ = p;
+			else
+			{
+				tail_->next_ = p;
+				tail_ = p;
+			}
+			tail_->next_ = 0;
+			len_++;
+			bytes_ += hdr_cmn::access(p)->size();
+			return pt;
+		}
+
+		virtual Packet *deque()
+		{
+			if (!head_)
+				return 0;
+			Packet *p = head_;
+			head_ = p->next_;
+			if (p == tail_)
+				head_ = tail_ = 0;
+			len_--;
+			bytes_ -= hdr_cmn::access(p)->size();
+			return p;
+		}
+
+		virtual void remove(Packet *target)
+		{
+			for (Packet *pp = 0, *p = head_; p; pp = p, p = p->next_)
+			{
+				if (p != target)
+					continue;
+				if (!pp)
+					deque();
+				else
+				{
+					if (p == tail_)
+						tail_ = pp;
+					pp->next_ = p->next_;
+					len_--;
+					bytes_ -= hdr_cmn::access(p)->size();
+				}
+				return;
+			}
+			fprintf(stderr, "PacketQueue:: remove() couldn't find target\n");
+			abort();
+		}
+
+		void enqueHead(Packet *p)
+		{
+			if (!head_)
+				tail_ = p;
+			p->next_ = head_;
+			head_ = p;
+			len_++;
+			bytes_ += hdr_cmn::access(p)->size();
+		}
+
+		Packet *lookup(int n)
+		{
+			for (Packet *p = head_; p != 0; p = p->next_)
+			{
+				if (--n < 0)
+					return p;
+			}
+			return 0;
+		}
+
+		Packet *head() { return head_; }
+		Packet *tail() { return tail_; }
+		void resetIterator() { iter_ = head_; }
+		Packet *getNext()
+		{
+			if (!iter_)
+				return 0;
+			Packet *p = iter_;
+			iter_ = iter_->next_;
+			return p;
+		}
+
+	protected:
+		Packet *head_;
+		Packet *tail_;
+		int len_;
+		int bytes_;
+
+	private:
+		Packet *iter_;
+};
+
+class Queue : public TclObject
+{
+	public:
+		Queue() : qlim_(1000), pq_(0) {}
+		virtual void enque(Packet *) = 0;
+		virtual Packet *deque() = 0;
+		void drop(Packet *p) { shim_drops++; Packet::free(p); }
+		virtual int command(int, const char *const *) { return TCL_OK; }
+
+	protected:
+		int qlim_;
+		PacketQueue *pq_;
+};
+
+class TimerHandler
+{
+	public:
+		TimerHandler();
+		virtual ~TimerHandler();
+		void sched(double delay) { resched(delay); }
+		void resched(double delay);
+		void cancel() { pending_ = false; }
+		int status() { return pending_; }
+
+		double due_;	//time of the next event
+		bool pending_;	//whether an event is scheduled
+		TimerHandler *link_;	//next timer in the list of all timers
+
+		void fire()
+		{
+			Event e;
+			pending_ = false;
+			expire(&e);
+		}
+
+	protected:
+		virtual void expire(Event *e) = 0;
+};
+
+class Random
+{
+	public:
+		static double uniform() { return drand48(); }
+		static double uniform(double x) { return x * drand48(); }
+		static int integer(int n) { return (int)(drand48() * n); }
+};
+
+#endif
@@ -0,0 +1 @@
+#include "ns-shim.h"
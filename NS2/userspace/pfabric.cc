@@ -0,0 +1,176 @@
+/*
+ * Check PrioPacketQueue of the pFabric patch against the queue scans that
+ * the original patch did in DropTail: random enqueues, drops and dequeues
+ * with and without keep_order_ and queue-in-bytes, and with the index
+ * turned on while packets are queued. Every dequeued or dropped packet and
+ * the final FIFO order must be the same. prio-packet-queue.h is extracted
+ * from the patch by the Makefile.
+ */
+#include <vector>
+#include <prio-packet-queue.h>	//extracted to $(O) by the Makefile
+
+/* deque_prio_: the packet with the smallest priority, or with keep_order_ the first packet of its flow */
+static Packet *ScanMin(PacketQueue *q, int keep_order)
+{
+	q->resetIterator();
+	Packet *p = q->getNext();
+	if (p == 0)
+		return 0;
+
+	int highest_prio = hdr_ip::access(p)->prio();
+	for (Packet *pp = q->getNext(); pp != 0; pp = q->getNext())
+	{
+		int prio = hdr_ip::access(pp)->prio();
+		if (prio < highest_prio)
+		{
+			p = pp;
+			highest_prio = prio;
+		}
+	}
+
+	if (keep_order)
+	{
+		hdr_ip *hp = hdr_ip::access(p);
+		q->resetIterator();
+		for (Packet *pp = q->getNext(); pp != p; pp = q->getNext())
+		{
+			hdr_ip *h = hdr_ip::access(pp);
+			if (h->saddr() == hp->saddr() && h->daddr() == hp->daddr() && h->flowid() == hp->flowid())
+			{
+				p = pp;
+				break;
+			}
+		}
+	}
+	return p;
+}
+
+/* drop_prio_: the last packet with the largest priority whose removal brings the queue under the limit */
+static Packet *ScanMax(PacketQueue *q, Packet *p, int qib, int qlim_bytes)
+{
+	Packet *max_pp = p;
+	int max_prio = 0;
+
+	q->resetIterator();
+	for (Packet *pp = q->getNext(); pp != 0; pp = q->getNext())
+	{
+		if (!qib || q->byteLength() - hdr_cmn::access(pp)->size() < qlim_bytes)
+		{
+			int prio = hdr_ip::access(pp)->prio();
+			if (prio >= max_prio)
+			{
+				max_pp = pp;
+				max_prio = prio;
+			}
+		}
+	}
+	return max_pp;
+}
+
+static Packet *NewPacket(const Packet &x)
+{
+	Packet *p = new Packet(x);
+	p->next_ = 0;
+	return p;
+}
+
+int main()
+{
+	long bad = 0, ops = 0;
+
+	srand48(5);
+	for (int trial = 0; trial < 200; trial++)
+	{
+		PacketQueue ref;
+		PrioPacketQueue q;
+		std::vector<Packet *> twin;	//packet of q with the same uid as in ref
+		int qib = trial % 2, keep_order = (trial / 2) % 2;
+		int qlim = 30, qlim_bytes = 20000;
+		int late = (trial % 3 == 0);	//turn the index on with packets queued
+		int indexed = !late;
+
+		if (indexed)
+			q.set_index(1);
+
+		for (int step = 0, uid = 0; step < 3000; step++)
+		{
+			if (late && step == 500)
+			{
+				q.set_index(1);
+				indexed = 1;
+			}
+
+			if (drand48() < 0.55)
+			{
+				Packet x;
+				memset(&x, 0, sizeof(x));
+				x.c.size_ = (drand48() < 0.3) ? 64 : 1500 - (int)(drand48() * 200);
+				x.c.uid_ = uid++;
+				x.i.prio_ = (int)(drand48() * 20) - (trial % 5 == 0);
+				x.i.src_ = lrand48() % 3;
+				x.i.fid_ = lrand48() % 4;
+
+				Packet *p1 = NewPacket(x), *p2 = NewPacket(x);
+				twin.push_back(p2);
+				ref.enque(p1);
+				q.enque(p2);
+
+				/* Drop a packet */
+				if ((!qib && ref.length() >= qlim) || (qib && ref.byteLength() >= qlim_bytes))
+				{
+					Packet *r = ScanMax(&ref, p1, qib, qlim_bytes);
+					Packet *s = indexed ? q.max_prio(qib ? q.byteLength() - qlim_bytes : -1) : twin[r->c.uid_];
+					if (!s)
+						s = p2;
+					ref.remove(r);
+					q.remove(s);
+					if (r->c.uid_ != s->c.uid_)
+						bad++;
+					ops++;
+				}
+			}
+			else
+			{
+				Packet *r = ScanMin(&ref, keep_order);
+				Packet *s = indexed ? q.min_prio(keep_order) : (r ? twin[r->c.uid_] : 0);
+				if (r)
+					ref.remove(r);
+				if (s)
+					q.remove(s);
+				if ((r == 0) != (s == 0) || (r && r->c.uid_ != s->c.uid_))
+					bad++;
+				ops++;
+			}
+
+			if (ref.length() != q.length() || ref.byteLength() != q.byteLength())
+				bad++;
+
+			/* A plain FIFO dequeue now and then */
+			if (drand48() < 0.01)
+			{
+				Packet *r = ref.deque(), *s = q.deque();
+				if ((r == 0) != (s == 0) || (r && r->c.uid_ != s->c.uid_))
+					bad++;
+			}
+		}
+
+		/* The FIFO order must still match */
+		ref.resetIterator();
+		q.resetIterator();
+		while (1)
+		{
+			Packet *r = ref.getNext(), *s = q.getNext();
+			if (!r || !s)
+			{
+				if (r || s)
+					bad++;
+				break;
+			}
+			if (r->c.uid_ != s->c.uid_)
+				bad++;
+		}
+	}
+
+	printf("operations %ld mismatches %ld\n", ops, bad);
+	return bad > 0;
+}
@@ -0,0 +1,64 @@
+#include "ns-shim.h"
+
+static double shim_clock;
+static Scheduler shim_scheduler;
+static Tcl shim_tcl;
+static TimerHandler *shim_timers;
+
+long shim_timer_events;
+long shim_drops;
+
+Scheduler &Scheduler::instance() { return shim_scheduler; }
+double Scheduler::clock() { return shim_clock; }
+Tcl &Tcl::instance() { return shim_tcl; }
+
+void shim_set_clock(double now)
+{
+	shim_clock = now;
+}
+
+TimerHandler::TimerHandler() : due_(0), pending_(false)
+{
+	link_ = shim_timers;
+	shim_timers = this;
+}
+
+TimerHandler::~TimerHandler()
+{
+	for (TimerHandler **t = &shim_timers; *t; t = &(*t)->link_)
+	{
+		if (*t == this)
+		{
+			*t = link_;
+			break;
+		}
+	}
+}
+
+void TimerHandler::resched(double delay)
+{
+	due_ = shim_clock + delay;
+	pending_ = true;
+}
+
+/* Timer events due at the same time as a packet come first */
+void shim_run_timers(double now)
+{
+	while (1)
+	{
+		TimerHandler *next = NULL;
+
+		for (TimerHandler *t = shim_timers; t; t = t->link_)
+		{
+			if (t->pending_ && t->due_ <= now && (!next || t->due_ < next->due_))
+				next = t;
+		}
+		if (!next)
+			break;
+
+		shim_clock = next->due_;
+		shim_timer_events++;
+		next->fire();
+	}
+	shim_clock = now;
+}
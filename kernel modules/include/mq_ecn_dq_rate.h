@@ -0,0 +1,89 @@
+#ifndef __MQ_ECN_DQ_RATE_H__
+#define __MQ_ECN_DQ_RATE_H__
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+
+/*
+ * PIE-like departure rate estimation of a queue (borrowed from
+ * pie_process_dequeue) shared by the prio_ecn, prio_dwrr and prio_wfq qdiscs.
+ *
+ * A measurement starts when the queue holds thresh bytes and ends once that
+ * many bytes have left. The average is an EWMA in fixed point: the sysctl
+ * dq_rate_alpha is the weight of the old average out of
+ * 1 << MQ_ECN_DQ_RATE_SHIFT in all five qdiscs.
+ */
+
+#define MQ_ECN_DQ_RATE_SHIFT 10
+/* Default dq_rate_alpha (7/8) and its range */
+#define MQ_ECN_DQ_RATE_ALPHA ((7 << MQ_ECN_DQ_RATE_SHIFT) / 8)
+#define MQ_ECN_DQ_RATE_ALPHA_MAX (1 << MQ_ECN_DQ_RATE_SHIFT)
+
+struct mq_ecn_dq_rate
+{
+	s64 tstamp;	/* start time of the current measurement */
+	s32 count;	/* bytes dequeued in the current measurement (-1 if none) */
+	u64 avg_bps;	/* smooth departure rate in bps (0 if unknown) */
+};
+
+static inline void mq_ecn_dq_rate_init(struct mq_ecn_dq_rate *r)
+{
+	r->tstamp = 0;
+	r->count = -1;
+	r->avg_bps = 0;
+}
+
+/*
+ * A packet of len bytes leaves a queue of qlen bytes (including the packet)
+ * at time now and is on the wire for tx_ns. Return true if avg_bps changed.
+ */
+static inline bool mq_ecn_dq_rate_update(struct mq_ecn_dq_rate *r,
+					 u32 qlen, unsigned int len, s64 now,
+					 s64 tx_ns, u32 thresh, int alpha)
+{
+	s64 interval_ns;
+	u64 sample_bps;
+	bool updated = false;
+
+	if (qlen >= thresh && r->count < 0)
+	{
+		r->tstamp = now;
+		r->count = 0;
+	}
+
+	if (r->count < 0)
+		return false;
+
+	r->count += len;
+	if ((u32)r->count < thresh)
+		return false;
+
+	interval_ns = now + tx_ns - r->tstamp;
+	if (interval_ns > 0)
+	{
+		sample_bps = div64_u64((u64)r->count * 8 * NSEC_PER_SEC,
+				       (u64)interval_ns);
+		if (r->avg_bps == 0)
+			r->avg_bps = sample_bps;
+		else
+			r->avg_bps = (r->avg_bps * alpha + sample_bps *
+				      ((1 << MQ_ECN_DQ_RATE_SHIFT) - alpha)) >>
+				     MQ_ECN_DQ_RATE_SHIFT;
+		updated = true;
+	}
+
+	/* Measure again only if enough bytes are left in the queue */
+	if (qlen - len < thresh)
+	{
+		r->count = -1;
+	}
+	else
+	{
+		r->count = 0;
+		r->tstamp = now + tx_ns;
+	}
+
+	return updated;
+}
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef __PKT_SCHED_MQ_ECN_H__
+#define __PKT_SCHED_MQ_ECN_H__
+
+#include <linux/types.h>
+
+/*
+ * Netlink options shared by the dwrr, wfq, prio_ecn, prio_dwrr and prio_wfq
+ * qdiscs (TCA_OPTIONS) and their tc option parsers in ../iproute2.
+ *
+ * TCA_MQ_ECN_PARAMS carries module parameters by their sysctl name, e.g.
+ * "ecn_scheme" or "queue_quantum_3". The kernel applies either all of them
+ * or, if any name or value is invalid, none. A dump returns every parameter.
+ */
+enum
+{
+	TCA_MQ_ECN_UNSPEC,
+	TCA_MQ_ECN_RATE,	/* u64, link rate in bytes/s */
+	TCA_MQ_ECN_PARAMS,	/* nested TCA_MQ_ECN_PARAM attributes */
+	__TCA_MQ_ECN_MAX,
+};
+
+#define TCA_MQ_ECN_MAX (__TCA_MQ_ECN_MAX - 1)
+
+enum
+{
+	TCA_MQ_ECN_PARAM_UNSPEC,
+	TCA_MQ_ECN_PARAM,	/* struct tc_mq_ecn_param */
+	__TCA_MQ_ECN_PARAM_MAX,
+};
+
+#define TCA_MQ_ECN_PARAM_MAX (__TCA_MQ_ECN_PARAM_MAX - 1)
+
+#define TC_MQ_ECN_NAMSIZ 32
+
+struct tc_mq_ecn_param
+{
+	char	name[TC_MQ_ECN_NAMSIZ];
+	__s32	value;
+};
+
+#endif
@@ -0,0 +1,28 @@
+/*
+ * q_dwrr.c	tc options of the dwrr qdisc (sch_dwrr)
+ */
+#include "q_mq_ecn.h"
+
+static const char *const dwrr_schemes[] = {
+	"disable", "queue", "port", "mq_ecn", "tcn", "codel", "pie",
+	"mq_tcn",
+};
+
+static int dwrr_parse_opt(struct qdisc_util *qu, int argc, char **argv,
+			  struct nlmsghdr *n)
+{
+	return mq_ecn_parse_opt(qu, argc, argv, n, dwrr_schemes,
+				ARRAY_SIZE(dwrr_schemes));
+}
+
+static int dwrr_print_opt(struct qdisc_util *qu, FILE *f, struct rtattr *opt)
+{
+	return mq_ecn_print_opt(qu, f, opt, dwrr_schemes,
+				ARRAY_SIZE(dwrr_schemes));
+}
+
+struct qdisc_util dwrr_qdisc_util = {
+	.id		= "dwrr",
+	.parse_qopt	= dwrr_parse_opt,
+	.print_qopt	= dwrr_print_opt,
+};
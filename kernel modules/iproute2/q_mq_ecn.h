@@ -0,0 +1,177 @@
+/*
+ * q_mq_ecn.h	Option parsing and printing shared by the tc plugins of the
+ *		dwrr, wfq, prio_ecn, prio_dwrr and prio_wfq qdiscs.
+ *
+ *		tc qdisc { add | change } dev DEV root KIND rate RATE
+ *			[ ecn_scheme SCHEME ] [ NAME VALUE ]...
+ *
+ *		NAME is any parameter the module exposes under /proc/sys/,
+ *		e.g. "queue_quantum_3". Values are checked by the kernel
+ *		against the same ranges as the sysctls.
+ *
+ *		The parameters are module-wide, not per qdisc: every port
+ *		of a KIND uses and shows the same values. Only the rate is
+ *		per port. While more than one qdisc of the KIND exists, the
+ *		kernel refuses new values with EBUSY, so change them for all
+ *		ports through /proc/sys/ instead.
+ */
+#ifndef __Q_MQ_ECN_H__
+#define __Q_MQ_ECN_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "tc_util.h"
+#include "pkt_sched_mq_ecn.h"
+
+#define MQ_ECN_MAX_PARAMS 256
+
+static void mq_ecn_explain(const char *kind, const char *const *schemes,
+			   int nr_schemes)
+{
+	int i;
+
+	fprintf(stderr,
+		"Usage: ... %s rate RATE [ ecn_scheme SCHEME ] [ NAME VALUE ]...\n"
+		"SCHEME := {", kind);
+	for (i = 0; i < nr_schemes; i++)
+		if (schemes[i])
+			fprintf(stderr, " %s |", schemes[i]);
+	fprintf(stderr,
+		" NUMBER }\n"
+		"NAME is a parameter of the module, as found in /proc/sys/.\n"
+		"It is shared by every %s qdisc and can only change through tc\n"
+		"while there is one such qdisc.\n", kind);
+}
+
+static int mq_ecn_get_scheme(__s32 *value, const char *arg,
+			     const char *const *schemes, int nr_schemes)
+{
+	int i, v;
+
+	for (i = 0; i < nr_schemes; i++) {
+		if (schemes[i] && strcmp(arg, schemes[i]) == 0) {
+			*value = i;
+			return 0;
+		}
+	}
+
+	if (get_integer(&v, arg, 0))
+		return -1;
+	*value = v;
+	return 0;
+}
+
+static int mq_ecn_parse_opt(struct qdisc_util *qu, int argc, char **argv,
+			    struct nlmsghdr *n, const char *const *schemes,
+			    int nr_schemes)
+{
+	static struct tc_mq_ecn_param params[MQ_ECN_MAX_PARAMS];
+	struct rtattr *tail, *nest;
+	__u64 rate = 0;
+	int nr_params = 0, i, v;
+
+	memset(params, 0, sizeof(params));
+	while (argc > 0) {
+		if (strcmp(*argv, "rate") == 0) {
+			NEXT_ARG();
+			if (get_rate64(&rate, *argv)) {
+				fprintf(stderr, "Illegal \"rate\"\n");
+				return -1;
+			}
+		} else if (strcmp(*argv, "help") == 0) {
+			mq_ecn_explain(qu->id, schemes, nr_schemes);
+			return -1;
+		} else {
+			struct tc_mq_ecn_param *p = &params[nr_params];
+
+			if (nr_params == MQ_ECN_MAX_PARAMS ||
+			    strlen(*argv) >= TC_MQ_ECN_NAMSIZ) {
+				fprintf(stderr, "What is \"%s\"?\n", *argv);
+				mq_ecn_explain(qu->id, schemes, nr_schemes);
+				return -1;
+			}
+			strcpy(p->name, *argv);
+			NEXT_ARG();
+			if (strcmp(p->name, "ecn_scheme") == 0) {
+				if (mq_ecn_get_scheme(&p->value, *argv, schemes,
+						      nr_schemes)) {
+					fprintf(stderr, "Illegal \"ecn_scheme\"\n");
+					return -1;
+				}
+			} else {
+				if (get_integer(&v, *argv, 0)) {
+					fprintf(stderr, "Illegal \"%s\"\n", p->name);
+					return -1;
+				}
+				p->value = v;
+			}
+			nr_params++;
+		}
+		argc--; argv++;
+	}
+
+	tail = NLMSG_TAIL(n);
+	addattr_l(n, TCA_BUF_MAX, TCA_OPTIONS, NULL, 0);
+	if (rate)
+		addattr64(n, TCA_BUF_MAX, TCA_MQ_ECN_RATE, rate);
+	if (nr_params) {
+		nest = NLMSG_TAIL(n);
+		addattr_l(n, TCA_BUF_MAX, TCA_MQ_ECN_PARAMS, NULL, 0);
+		for (i = 0; i < nr_params; i++)
+			addattr_l(n, TCA_BUF_MAX, TCA_MQ_ECN_PARAM, &params[i],
+				  sizeof(params[i]));
+		nest->rta_len = (void *) NLMSG_TAIL(n) - (void *) nest;
+	}
+	tail->rta_len = (void *) NLMSG_TAIL(n) - (void *) tail;
+	return 0;
+}
+
+/* The rate and ECN scheme always, every other parameter with -details */
+static int mq_ecn_print_opt(struct qdisc_util *qu, FILE *f, struct rtattr *opt,
+			    const char *const *schemes, int nr_schemes)
+{
+	struct rtattr *tb[TCA_MQ_ECN_MAX + 1], *pos;
+	const struct tc_mq_ecn_param *p;
+	int rem;
+	SPRINT_BUF(b1);
+
+	if (opt == NULL)
+		return 0;
+
+	parse_rtattr_nested(tb, TCA_MQ_ECN_MAX, opt);
+
+	if (tb[TCA_MQ_ECN_RATE] &&
+	    RTA_PAYLOAD(tb[TCA_MQ_ECN_RATE]) >= sizeof(__u64))
+		fprintf(f, "rate %s ",
+			sprint_rate(rta_getattr_u64(tb[TCA_MQ_ECN_RATE]), b1));
+
+	if (!tb[TCA_MQ_ECN_PARAMS])
+		return 0;
+
+	rem = RTA_PAYLOAD(tb[TCA_MQ_ECN_PARAMS]);
+	for (pos = RTA_DATA(tb[TCA_MQ_ECN_PARAMS]); RTA_OK(pos, rem);
+	     pos = RTA_NEXT(pos, rem)) {
+		if (pos->rta_type != TCA_MQ_ECN_PARAM ||
+		    RTA_PAYLOAD(pos) < sizeof(*p))
+			continue;
+
+		p = RTA_DATA(pos);
+		if (strncmp(p->name, "ecn_scheme", TC_MQ_ECN_NAMSIZ) == 0) {
+			if (p->value >= 0 && p->value < nr_schemes &&
+			    schemes[p->value])
+				fprintf(f, "ecn_scheme %s ", schemes[p->value]);
+			else
+				fprintf(f, "ecn_scheme %d ", p->value);
+		} else if (show_details) {
+			fprintf(f, "%.*s %d ", TC_MQ_ECN_NAMSIZ, p->name,
+				p->value);
+		}
+	}
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,29 @@
+/*
+ * q_prio_dwrr.c	tc options of the prio_dwrr qdisc (sch_prio_dwrr)
+ */
+#include "q_mq_ecn.h"
+
+static const char *const prio_dwrr_schemes[] = {
+	"disable", "queue", "port", "mq_ecn_gener", "mq_ecn_rr", "dequeue",
+	"pie",
+};
+
+static int prio_dwrr_parse_opt(struct qdisc_util *qu, int argc, char **argv,
+			       struct nlmsghdr *n)
+{
+	return mq_ecn_parse_opt(qu, argc, argv, n, prio_dwrr_schemes,
+				ARRAY_SIZE(prio_dwrr_schemes));
+}
+
+static int prio_dwrr_print_opt(struct qdisc_util *qu, FILE *f,
+			       struct rtattr *opt)
+{
+	return mq_ecn_print_opt(qu, f, opt, prio_dwrr_schemes,
+				ARRAY_SIZE(prio_dwrr_schemes));
+}
+
+struct qdisc_util prio_dwrr_qdisc_util = {
+	.id		= "prio_dwrr",
+	.parse_qopt	= prio_dwrr_parse_opt,
+	.print_qopt	= prio_dwrr_print_opt,
+};
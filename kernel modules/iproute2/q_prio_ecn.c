@@ -0,0 +1,28 @@
+/*
+ * q_prio_ecn.c	tc options of the prio_ecn qdisc (sch_prio)
+ */
+#include "q_mq_ecn.h"
+
+static const char *const prio_ecn_schemes[] = {
+	"disable", "queue", "port", "dequeue", "pie",
+};
+
+static int prio_ecn_parse_opt(struct qdisc_util *qu, int argc, char **argv,
+			      struct nlmsghdr *n)
+{
+	return mq_ecn_parse_opt(qu, argc, argv, n, prio_ecn_schemes,
+				ARRAY_SIZE(prio_ecn_schemes));
+}
+
+static int prio_ecn_print_opt(struct qdisc_util *qu, FILE *f,
+			      struct rtattr *opt)
+{
+	return mq_ecn_print_opt(qu, f, opt, prio_ecn_schemes,
+				ARRAY_SIZE(prio_ecn_schemes));
+}
+
+struct qdisc_util prio_ecn_qdisc_util = {
+	.id		= "prio_ecn",
+	.parse_qopt	= prio_ecn_parse_opt,
+	.print_qopt	= prio_ecn_print_opt,
+};
@@ -0,0 +1,28 @@
+/*
+ * q_prio_wfq.c	tc options of the prio_wfq qdisc (sch_prio_wfq)
+ */
+#include "q_mq_ecn.h"
+
+static const char *const prio_wfq_schemes[] = {
+	"disable", "queue", "port", NULL, NULL, "dequeue", "pie",
+};
+
+static int prio_wfq_parse_opt(struct qdisc_util *qu, int argc, char **argv,
+			      struct nlmsghdr *n)
+{
+	return mq_ecn_parse_opt(qu, argc, argv, n, prio_wfq_schemes,
+				ARRAY_SIZE(prio_wfq_schemes));
+}
+
+static int prio_wfq_print_opt(struct qdisc_util *qu, FILE *f,
+			      struct rtattr *opt)
+{
+	return mq_ecn_print_opt(qu, f, opt, prio_wfq_schemes,
+				ARRAY_SIZE(prio_wfq_schemes));
+}
+
+struct qdisc_util prio_wfq_qdisc_util = {
+	.id		= "prio_wfq",
+	.parse_qopt	= prio_wfq_parse_opt,
+	.print_qopt	= prio_wfq_print_opt,
+};
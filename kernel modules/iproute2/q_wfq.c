@@ -0,0 +1,27 @@
+/*
+ * q_wfq.c	tc options of the wfq qdisc (sch_wfq)
+ */
+#include "q_mq_ecn.h"
+
+static const char *const wfq_schemes[] = {
+	"disable", "queue", "port", "mq_ecn", "tcn", "codel", "pie",
+};
+
+static int wfq_parse_opt(struct qdisc_util *qu, int argc, char **argv,
+			 struct nlmsghdr *n)
+{
+	return mq_ecn_parse_opt(qu, argc, argv, n, wfq_schemes,
+				ARRAY_SIZE(wfq_schemes));
+}
+
+static int wfq_print_opt(struct qdisc_util *qu, FILE *f, struct rtattr *opt)
+{
+	return mq_ecn_print_opt(qu, f, opt, wfq_schemes,
+				ARRAY_SIZE(wfq_schemes));
+}
+
+struct qdisc_util wfq_qdisc_util = {
+	.id		= "wfq",
+	.parse_qopt	= wfq_parse_opt,
+	.print_qopt	= wfq_print_opt,
+};
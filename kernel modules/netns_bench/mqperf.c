@@ -0,0 +1,391 @@
+/*
+ * Multi-class UDP traffic generator and sink for the netns benchmark.
+ *
+ * The sender runs one socket per class, each with its own DSCP and ECT(0),
+ * and stamps every datagram with its class, sequence number and send time.
+ * The sink reports per-class throughput, one-way delay percentiles and the
+ * number of CE marked packets. Both ends must share CLOCK_MONOTONIC, which
+ * holds for network namespaces on the same host.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <arpa/inet.h>
+
+#define MQPERF_MAGIC 0x4d514543
+#define MQPERF_MAX_CLASSES 8
+#define MQPERF_MAX_BYTES 9000
+/* Delay samples kept per class; reservoir sampling beyond that */
+#define MQPERF_MAX_SAMPLES (1 << 20)
+#define MQPERF_ECT0 0x02
+#define MQPERF_CE 0x03
+
+struct mqperf_hdr
+{
+	uint32_t magic;
+	uint32_t class;
+	uint64_t seq;
+	uint64_t tx_ns;
+};
+
+struct mqperf_class
+{
+	uint64_t pkts;
+	uint64_t bytes;
+	uint64_t marks;
+	uint64_t drops;
+	/* highest sequence number received + 1, for losses */
+	uint64_t next_seq;
+	uint64_t seen;
+	unsigned int dscp;
+	unsigned int nr_samples;
+	uint64_t *samples;
+	uint64_t first_ns;
+	uint64_t last_ns;
+};
+
+static struct mqperf_class classes[MQPERF_MAX_CLASSES];
+
+static uint64_t mqperf_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int mqperf_parse_dscps(const char *list, unsigned int nr_classes)
+{
+	char *copy = strdup(list), *tok, *save = NULL;
+	unsigned int i = 0;
+
+	for (tok = strtok_r(copy, ",", &save); tok && i < nr_classes;
+	     tok = strtok_r(NULL, ",", &save))
+		classes[i++].dscp = strtoul(tok, NULL, 0) & 0x3f;
+
+	free(copy);
+	return i == nr_classes ? 0 : -1;
+}
+
+static int mqperf_send(const char *dst, int port, unsigned int nr_classes,
+		       double rate_mbps, unsigned int size, double secs)
+{
+	int fds[MQPERF_MAX_CLASSES];
+	char buf[MQPERF_MAX_BYTES];
+	struct mqperf_hdr *hdr = (struct mqperf_hdr *)buf;
+	struct sockaddr_in addr;
+	uint64_t start, end, now, next, gap_ns = 0;
+	unsigned int i, c = 0;
+	int tos;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, dst, &addr.sin_addr) != 1)
+	{
+		fprintf(stderr, "bad destination %s\n", dst);
+		return 1;
+	}
+
+	for (i = 0; i < nr_classes; i++)
+	{
+		fds[i] = socket(AF_INET, SOCK_DGRAM, 0);
+		tos = (classes[i].dscp << 2) | MQPERF_ECT0;
+		if (fds[i] < 0 ||
+		    setsockopt(fds[i], IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) < 0 ||
+		    connect(fds[i], (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		{
+			perror("socket");
+			return 1;
+		}
+	}
+
+	/* Paced round-robin over the classes, or as fast as possible at rate 0 */
+	if (rate_mbps > 0)
+		gap_ns = (uint64_t)(size * 8 * 1000.0 / rate_mbps);
+
+	memset(buf, 0, sizeof(buf));
+	hdr->magic = MQPERF_MAGIC;
+	start = next = mqperf_now_ns();
+	end = start + (uint64_t)(secs * 1e9);
+
+	while ((now = mqperf_now_ns()) < end)
+	{
+		if (gap_ns && now < next)
+			continue;
+
+		hdr->class = c;
+		hdr->seq = classes[c].pkts;
+		hdr->tx_ns = now;
+		if (send(fds[c], buf, size, 0) < 0)
+		{
+			/* ENOBUFS: the qdisc dropped the packet */
+			if (errno != ENOBUFS && errno != EAGAIN)
+			{
+				perror("send");
+				return 1;
+			}
+			classes[c].drops++;
+		}
+		else
+		{
+			classes[c].bytes += size;
+		}
+
+		classes[c].pkts++;
+		c = (c + 1) % nr_classes;
+		next += gap_ns;
+	}
+
+	for (i = 0; i < nr_classes; i++)
+	{
+		printf("sent class %u dscp %u pkts %llu local_drops %llu\n", i,
+		       classes[i].dscp, (unsigned long long)classes[i].pkts,
+		       (unsigned long long)classes[i].drops);
+		close(fds[i]);
+	}
+
+	return 0;
+}
+
+static void mqperf_sample(struct mqperf_class *cl, uint64_t delay_ns)
+{
+	uint64_t slot;
+
+	cl->seen++;
+	if (cl->nr_samples < MQPERF_MAX_SAMPLES)
+	{
+		cl->samples[cl->nr_samples++] = delay_ns;
+		return;
+	}
+
+	slot = ((uint64_t)random() << 31 | random()) % cl->seen;
+	if (slot < MQPERF_MAX_SAMPLES)
+		cl->samples[slot] = delay_ns;
+}
+
+static int mqperf_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double mqperf_pct_us(const struct mqperf_class *cl, double pct)
+{
+	unsigned int idx;
+
+	if (!cl->nr_samples)
+		return 0;
+
+	idx = (unsigned int)(pct / 100 * (cl->nr_samples - 1) + 0.5);
+	return cl->samples[idx] / 1000.0;
+}
+
+static int mqperf_recv(int port, double secs, bool csv)
+{
+	char buf[MQPERF_MAX_BYTES], ctrl[CMSG_SPACE(sizeof(int))];
+	struct mqperf_hdr *hdr = (struct mqperf_hdr *)buf;
+	struct sockaddr_in addr;
+	struct timeval tv = { .tv_sec = 1 };
+	struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	struct cmsghdr *cmsg;
+	struct mqperf_class *cl;
+	uint64_t now, deadline = 0;
+	unsigned int i;
+	int fd, one = 1, tos;
+	ssize_t len;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (fd < 0 ||
+	    setsockopt(fd, IPPROTO_IP, IP_RECVTOS, &one, sizeof(one)) < 0 ||
+	    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+	    bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		perror("socket");
+		return 1;
+	}
+
+	for (i = 0; i < MQPERF_MAX_CLASSES; i++)
+	{
+		classes[i].samples = malloc(sizeof(uint64_t) * MQPERF_MAX_SAMPLES);
+		if (!classes[i].samples)
+		{
+			perror("malloc");
+			return 1;
+		}
+	}
+
+	/* Run until secs after the first packet, or 1s of silence after it */
+	for (;;)
+	{
+		msg.msg_control = ctrl;
+		msg.msg_controllen = sizeof(ctrl);
+		len = recvmsg(fd, &msg, 0);
+		now = mqperf_now_ns();
+		if (len < 0)
+		{
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) && deadline)
+				break;
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				continue;
+			perror("recvmsg");
+			return 1;
+		}
+
+		if (len < (ssize_t)sizeof(*hdr) || hdr->magic != MQPERF_MAGIC ||
+		    hdr->class >= MQPERF_MAX_CLASSES)
+			continue;
+
+		if (!deadline)
+			deadline = now + (uint64_t)(secs * 1e9);
+
+		tos = 0;
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		{
+			if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_TOS)
+				tos = *(unsigned char *)CMSG_DATA(cmsg);
+		}
+
+		cl = &classes[hdr->class];
+		if (!cl->pkts)
+			cl->first_ns = now;
+		cl->last_ns = now;
+		cl->pkts++;
+		cl->bytes += len;
+		cl->dscp = tos >> 2;
+		if (hdr->seq >= cl->next_seq)
+			cl->next_seq = hdr->seq + 1;
+		if ((tos & MQPERF_CE) == MQPERF_CE)
+			cl->marks++;
+		mqperf_sample(cl, now - hdr->tx_ns);
+
+		if (now >= deadline)
+			break;
+	}
+
+	if (csv)
+		printf("class,dscp,pkts,lost,mbps,pps,marks,p50_us,p99_us,p999_us,max_us\n");
+	else
+		printf("%5s %5s %10s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+		       "class", "dscp", "pkts", "lost", "mbps", "pps", "marks",
+		       "p50_us", "p99_us", "p999_us", "max_us");
+
+	for (i = 0; i < MQPERF_MAX_CLASSES; i++)
+	{
+		double secs_active, mbps = 0, pps = 0;
+
+		cl = &classes[i];
+		if (!cl->pkts)
+			continue;
+
+		secs_active = (cl->last_ns - cl->first_ns) / 1e9;
+		if (secs_active > 0)
+		{
+			mbps = cl->bytes * 8 / secs_active / 1e6;
+			pps = cl->pkts / secs_active;
+		}
+
+		qsort(cl->samples, cl->nr_samples, sizeof(uint64_t), mqperf_cmp);
+		printf(csv ? "%u,%u,%llu,%llu,%.1f,%.0f,%llu,%.1f,%.1f,%.1f,%.1f\n" :
+			     "%5u %5u %10llu %10llu %10.1f %10.0f %10llu %10.1f %10.1f %10.1f %10.1f\n",
+		       i, cl->dscp, (unsigned long long)cl->pkts,
+		       (unsigned long long)(cl->next_seq - cl->pkts), mbps, pps,
+		       (unsigned long long)cl->marks, mqperf_pct_us(cl, 50),
+		       mqperf_pct_us(cl, 99), mqperf_pct_us(cl, 99.9),
+		       mqperf_pct_us(cl, 100));
+	}
+
+	close(fd);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s send [options] <dst-ip>\n"
+		"       %s recv [options]\n"
+		"  -p port     UDP port (default 5001)\n"
+		"  -t secs     duration (default 10)\n"
+		"  -c classes  number of classes (default 4, max %d)\n"
+		"  -d list     comma separated DSCP of each class (default 0,1,2,...)\n"
+		"  -r mbps     total sending rate, 0 for unpaced (default 0)\n"
+		"  -s bytes    UDP payload size (default 1400)\n"
+		"  -C          print the sink report as CSV\n",
+		prog, prog, MQPERF_MAX_CLASSES);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nr_classes = 4, size = 1400, i;
+	double secs = 10, rate_mbps = 0;
+	const char *dscps = NULL;
+	bool send_mode, csv = false;
+	int port = 5001, opt;
+
+	if (argc < 2 || (strcmp(argv[1], "send") && strcmp(argv[1], "recv")))
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	send_mode = !strcmp(argv[1], "send");
+	argv[1] = argv[0];
+
+	while ((opt = getopt(argc - 1, argv + 1, "p:t:c:d:r:s:C")) != -1)
+	{
+		switch (opt)
+		{
+		case 'p': port = atoi(optarg); break;
+		case 't': secs = atof(optarg); break;
+		case 'c': nr_classes = atoi(optarg); break;
+		case 'd': dscps = optarg; break;
+		case 'r': rate_mbps = atof(optarg); break;
+		case 's': size = atoi(optarg); break;
+		case 'C': csv = true; break;
+		default: usage(argv[0]); return 1;
+		}
+	}
+
+	if (nr_classes < 1 || nr_classes > MQPERF_MAX_CLASSES ||
+	    size < sizeof(struct mqperf_hdr) || size > MQPERF_MAX_BYTES)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	for (i = 0; i < nr_classes; i++)
+		classes[i].dscp = i;
+	if (dscps && mqperf_parse_dscps(dscps, nr_classes) < 0)
+	{
+		fprintf(stderr, "need %u DSCP values in -d\n", nr_classes);
+		return 1;
+	}
+
+	if (send_mode)
+	{
+		if (optind + 1 >= argc)
+		{
+			usage(argv[0]);
+			return 1;
+		}
+		return mqperf_send(argv[optind + 1], port, nr_classes, rate_mbps,
+				   size, secs);
+	}
+
+	return mqperf_recv(port, secs, csv);
+}
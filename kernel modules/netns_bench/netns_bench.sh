@@ -0,0 +1,213 @@
+#!/bin/bash
+#
+# End-to-end benchmark of the qdisc modules over a veth pair between two
+# network namespaces. For every module and ECN scheme, the module is loaded
+# on the sender side veth, mqperf drives multi-class DSCP traffic through it
+# and the sink reports per-class throughput, delay percentiles and marks.
+# CPU cycles per packet come from "perf stat" when available, otherwise the
+# busy CPU time per packet is taken from /proc/stat.
+#
+# Run as root. tc needs the plugins of ../iproute2, either installed or
+# built in place (they are then found through TC_LIB_DIR).
+
+set -u
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+MODULES="dwrr wfq prio prio_dwrr prio_wfq"
+SCHEMES=""
+RATE=1000
+LOAD=0
+SECS=10
+CLASSES=4
+DSCPS=""
+SIZE=1400
+OUT=""
+PARAMS=""
+
+NS_TX=mqbench_tx
+NS_RX=mqbench_rx
+DEV_TX=mqb0
+DEV_RX=mqb1
+IP_TX=10.201.0.1
+IP_RX=10.201.0.2
+PORT=5001
+
+usage()
+{
+	cat >&2 <<EOF
+usage: $0 [options]
+  -m "modules"  modules to test (default "$MODULES")
+  -e "schemes"  ECN schemes to test (default: every scheme the module accepts)
+  -r mbit       bottleneck rate given to the qdisc (default $RATE)
+  -l mbit       total offered load, 0 for unpaced (default $LOAD)
+  -t secs       duration of each run (default $SECS)
+  -c classes    traffic classes (default $CLASSES)
+  -d list       comma separated DSCP of each class (default 0,1,2,...)
+  -s bytes      UDP payload size (default $SIZE)
+  -o name=val   extra module parameter, may be repeated
+  -f file       also write all results to a CSV file
+EOF
+	exit 1
+}
+
+while getopts "m:e:r:l:t:c:d:s:o:f:h" opt; do
+	case $opt in
+	m) MODULES=$OPTARG ;;
+	e) SCHEMES=$OPTARG ;;
+	r) RATE=$OPTARG ;;
+	l) LOAD=$OPTARG ;;
+	t) SECS=$OPTARG ;;
+	c) CLASSES=$OPTARG ;;
+	d) DSCPS=$OPTARG ;;
+	s) SIZE=$OPTARG ;;
+	o) PARAMS="$PARAMS $OPTARG" ;;
+	f) OUT=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+
+if [ "$(id -u)" -ne 0 ]; then
+	echo "must run as root" >&2
+	exit 1
+fi
+
+for tool in ip tc insmod rmmod make; do
+	if ! command -v $tool > /dev/null; then
+		echo "$tool not found" >&2
+		exit 1
+	fi
+done
+
+if [ -z "${TC_LIB_DIR:-}" ] && ls "$DIR"/../iproute2/q_*.so > /dev/null 2>&1; then
+	export TC_LIB_DIR="$DIR/../iproute2"
+fi
+
+HAVE_PERF=0
+command -v perf > /dev/null && HAVE_PERF=1
+
+LOADED=""
+TMP=$(mktemp -d)
+
+cleanup()
+{
+	ip netns del $NS_TX 2> /dev/null
+	ip netns del $NS_RX 2> /dev/null
+	[ -n "$LOADED" ] && rmmod "$LOADED" 2> /dev/null
+	rm -rf "$TMP"
+}
+trap cleanup EXIT INT TERM
+
+setup_netns()
+{
+	ip netns add $NS_TX || return 1
+	ip netns add $NS_RX || return 1
+	ip link add $DEV_TX netns $NS_TX type veth peer name $DEV_RX netns $NS_RX || return 1
+	ip -n $NS_TX addr add $IP_TX/24 dev $DEV_TX
+	ip -n $NS_RX addr add $IP_RX/24 dev $DEV_RX
+	ip -n $NS_TX link set $DEV_TX up
+	ip -n $NS_RX link set $DEV_RX up
+	ip -n $NS_TX link set lo up
+	ip -n $NS_RX link set lo up
+	# Large socket buffers so the qdisc, not the sink, is the bottleneck
+	ip netns exec $NS_RX sysctl -qw net.core.rmem_max=67108864
+	ip netns exec $NS_RX sysctl -qw net.core.rmem_default=67108864
+}
+
+# Busy and total jiffies over all CPUs
+cpu_jiffies()
+{
+	awk '/^cpu / { print $2 + $3 + $4 + $7 + $8, $2 + $3 + $4 + $5 + $6 + $7 + $8 }' /proc/stat
+}
+
+# qdisc kind of each module
+qdisc_kind()
+{
+	case $1 in
+	prio) echo prio_ecn ;;
+	*) echo "$1" ;;
+	esac
+}
+
+# Run one module/scheme combination and append its rows to $TMP/results
+run_one()
+{
+	local m=$1 scheme=$2 label p
+	local busy0 total0 busy1 total1 cycles="" pkts cost
+	local opts="rate ${RATE}mbit ecn_scheme $scheme"
+
+	for p in $PARAMS; do
+		opts="$opts ${p%%=*} ${p#*=}"
+	done
+
+	tc -n $NS_TX qdisc del dev $DEV_TX root 2> /dev/null
+	# Schemes a module does not implement are rejected by the kernel
+	tc -n $NS_TX qdisc add dev $DEV_TX root "$(qdisc_kind "$m")" $opts \
+		2> /dev/null || return 1
+
+	ip netns exec $NS_RX "$DIR/mqperf" recv -C -p $PORT -t $((SECS + 2)) \
+		> "$TMP/sink" &
+	local sink=$!
+	sleep 0.5
+
+	read busy0 total0 < <(cpu_jiffies)
+	if [ $HAVE_PERF -eq 1 ]; then
+		perf stat -a -x, -e cycles -o "$TMP/perf" -- sleep "$SECS" &
+	fi
+	ip netns exec $NS_TX "$DIR/mqperf" send -p $PORT -t "$SECS" \
+		-c "$CLASSES" ${DSCPS:+-d "$DSCPS"} -r "$LOAD" -s "$SIZE" \
+		$IP_RX > "$TMP/source"
+	wait $sink
+	wait
+	read busy1 total1 < <(cpu_jiffies)
+
+	pkts=$(awk -F, 'NR > 1 { n += $3 } END { print n + 0 }' "$TMP/sink")
+	if [ $HAVE_PERF -eq 1 ]; then
+		cycles=$(awk -F, '/cycles/ { print $1 }' "$TMP/perf")
+	fi
+	if [ -n "$cycles" ] && [ "$pkts" -gt 0 ] 2> /dev/null; then
+		cost=$(awk -v c="$cycles" -v p="$pkts" 'BEGIN { printf "%.0f cycles", c / p }')
+	else
+		cost=$(awk -v b=$((busy1 - busy0)) -v p="$pkts" -v hz="$(getconf CLK_TCK)" \
+			'BEGIN { printf "%.0f ns", p ? b * 1e9 / hz / p : 0 }')
+	fi
+
+	label="$m/ecn_scheme=$scheme"
+	echo "== $label: $pkts packets received, $cost of CPU per packet"
+	column -t -s, "$TMP/sink"
+	awk -F, -v l="$m,$scheme" -v c="$cost" 'NR > 1 { print l "," $0 "," c }' \
+		"$TMP/sink" >> "$TMP/results"
+}
+
+run_module()
+{
+	local m=$1 kmod=sch_$(qdisc_kind "$1") schemes=$SCHEMES
+
+	if ! make -s -C "$DIR/../sch_$m" > /dev/null; then
+		echo "$m: build failed" >&2
+		return 1
+	fi
+
+	insmod "$DIR/../sch_$m/$kmod.ko" || return 1
+	LOADED=$kmod
+
+	[ -z "$schemes" ] && schemes="0 1 2 3 4 5 6 7"
+	for scheme in $schemes; do
+		run_one "$m" "$scheme"
+	done
+
+	tc -n $NS_TX qdisc del dev $DEV_TX root 2> /dev/null
+	rmmod $kmod
+	LOADED=""
+}
+
+make -s -C "$DIR" || exit 1
+setup_netns || exit 1
+
+for m in $MODULES; do
+	run_module "$m"
+done
+
+if [ -n "$OUT" ]; then
+	echo "module,ecn_scheme,class,dscp,pkts,lost,mbps,pps,marks,p50_us,p99_us,p999_us,max_us,cpu_per_pkt" > "$OUT"
+	cat "$TMP/results" >> "$OUT" 2> /dev/null
+fi
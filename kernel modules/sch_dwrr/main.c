@@ -1,13 +1,17 @@
 #include <linux/module.h>
 #include <linux/types.h>
 #include <linux/kernel.h>
+#include <linux/percpu.h>
 #include <net/netlink.h>
 #include <linux/pkt_sched.h>
 #include <net/sch_generic.h>
 #include <net/pkt_sched.h>
 #include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/if_vlan.h>
 #include <net/dsfield.h>
 #include <net/inet_ecn.h>
+#include <net/sock.h>
 
 #include "params.h"
 
@@ -18,11 +22,33 @@ struct dwrr_rate_cfg
 	u32	shift;
 };
 
+/* Token bucket to enforce the ceiling or floor rate of a queue */
+struct dwrr_class_tb
+{
+	struct dwrr_rate_cfg	rate;
+	s64	tokens;
+	s64	time_ns;
+};
+
+/* A count-min sketch counter: decayed bytes and the round of its last decay */
+struct dwrr_hh_cell
+{
+	u32	bytes;
+	u32	round;
+};
+
+/* Per-CPU sojourn time histograms of all queues */
+struct dwrr_hist
+{
+	u64	bins[dwrr_max_queues][dwrr_hist_buckets];
+};
+
 /**
  *	struct dwrr_class - a Class of Service (CoS) queue
  *	@id: queue ID
  *	@prio: queue priority (0 is the highest)
  *	@len_bytes: queue length in bytes
+ *	@bp_bytes: bytes of the queue admitted over the buffer limit (backpressure)
  *	@qdisc: FIFO queue to store sk_buff
  *
  *	For DWRR scheduling
@@ -30,8 +56,24 @@ struct dwrr_rate_cfg
  *	@start_time: time when this queue is inserted to active list
  *	@last_pkt_time: time when this queue transmits the last packet
  *	@quantum: quantum in bytes of this queue
+ *	@round: the last DWRR round in which this queue got its quantum
  *	@alist: active linked list
  *
+ *	For heavy hitter detection
+ *	@hh: count-min sketch of the bytes of each flow (dwrr_hh_rows rows)
+ *	@hh_total: bytes of all flows, decayed like the sketch
+ *	@hh_round: number of quanta this queue got, the clock of decay
+ *
+ *	For PIE-like marking
+ *	@dq_tstamp: start time of the current departure rate measurement
+ *	@dq_count: bytes dequeued in the current measurement, -1 if none
+ *	@avg_dq_rate: smooth departure rate (bps), 0 if unknown
+ *
+ *	For per-queue rate limiting
+ *	@ceil: token bucket to enforce the ceiling rate of this queue
+ *	@floor: token bucket to enforce the floor (minimum guaranteed) rate of
+ *	this queue
+ *
  *	For CoDel
  *	@count: how many marks since the last time we entered marking state
  *	@lastcount: count at entry to marking/dropping state
@@ -47,14 +89,27 @@ struct dwrr_class
 	u8		id;
 	u8		prio;
 	u32		len_bytes;
+	u32		bp_bytes;
 	struct Qdisc	*qdisc;
 
 	u32		deficit;
 	s64		start_time;
 	s64		last_pkt_time;
 	u32		quantum;
+	u32		round;
 	struct list_head	alist;
 
+	struct dwrr_hh_cell	*hh;
+	struct dwrr_hh_cell	hh_total;
+	u32		hh_round;
+
+	s64		dq_tstamp;
+	s32		dq_count;
+	u64		avg_dq_rate;
+
+	struct dwrr_class_tb	ceil;
+	struct dwrr_class_tb	floor;
+
 	u32		count;
 	u32		lastcount;
 	bool		marking;
@@ -78,6 +133,19 @@ struct dwrr_class
  *	@round_time: smooth round time (in ns) for different priorities
  *	@last_idle_time: last time (in ns) when the buffer becomes empty for
  *	different priorities
+ *
+ *	@round: current DWRR round for different priorities
+ *
+ *	@cfg: the configuration snapshot in use
+ *	@key_queue: queue that packets of each classifier key currently go to
+ *	@key_backlog: packets of each classifier key in the queues
+ *
+ *	@hh_width: counters in each row of the heavy hitter sketches
+ *	@sch: the qdisc this is the private data of
+ *	@node: entry in dwrr_qdiscs
+ *
+ *	@hist: per-CPU sojourn time histograms of all queues
+ *	@xstats: sojourn time histograms summed over all CPUs for dump
  */
 struct dwrr_sched_data
 {
@@ -92,8 +160,25 @@ struct dwrr_sched_data
 	u32	prio_len_bytes[dwrr_max_prio];
 	s64	round_time[dwrr_max_prio];
 	s64	last_idle_time[dwrr_max_prio];
+	u32	round[dwrr_max_prio];
+
+	struct dwrr_config	cfg;
+	u8	key_queue[dwrr_max_keys];
+	u32	key_backlog[dwrr_max_keys];
+
+	u32	hh_width;
+	struct Qdisc	*sch;
+	struct list_head	node;
+
+	struct dwrr_hist __percpu	*hist;
+	struct tc_dwrr_xstats		xstats;
 };
 
+/* All DWRR qdiscs, so that a new hh_width reaches their sketches */
+static LIST_HEAD(dwrr_qdiscs);
+/* Protects dwrr_qdiscs and the sketch width of every qdisc */
+static DEFINE_MUTEX(dwrr_qdiscs_lock);
+
 static inline void print_dwrr_sched_data(struct Qdisc *sch)
 {
         int i;
@@ -128,6 +213,55 @@ static inline codel_time_t ns_to_codel_time(s64 ns)
 	return ns >> dwrr_codel_shift;
 }
 
+/*
+ * Per-packet state kept in the private area of qdisc_skb_cb. We don't touch
+ * skb->tstamp since it may carry the departure time set by the sender.
+ */
+struct dwrr_skb_cb
+{
+	u64	enqueue_time;	/* enqueue timestamp (ns), 0 if not recorded */
+	u8	key;		/* classifier key, dwrr_no_key if none */
+	bool	heavy;		/* the flow is a heavy hitter of its queue */
+	bool	throttled;	/* admitted over the buffer limit (backpressure) */
+};
+
+static inline struct dwrr_skb_cb *dwrr_skb_cb(const struct sk_buff *skb)
+{
+	qdisc_cb_private_validate(skb, sizeof(struct dwrr_skb_cb));
+	return (struct dwrr_skb_cb *)qdisc_skb_cb(skb)->data;
+}
+
+/* Do we need the enqueue timestamp of packets? */
+static inline bool dwrr_need_tstamp(void)
+{
+	return dwrr_ecn_scheme == dwrr_tcn ||
+	       dwrr_ecn_scheme == dwrr_mq_tcn ||
+	       dwrr_ecn_scheme == dwrr_codel ||
+	       dwrr_enable_hist == dwrr_enable;
+}
+
+/* Account the sojourn time of a dequeued packet to its queue's histogram */
+static inline void dwrr_hist_update(struct dwrr_sched_data *q,
+				    struct dwrr_class *cl,
+				    struct sk_buff *skb,
+				    s64 now)
+{
+	u64 enqueue_time = dwrr_skb_cb(skb)->enqueue_time;
+	s64 sojourn = now - enqueue_time;
+	int bucket = 0;
+
+	/* The packet was enqueued before histograms were enabled */
+	if (unlikely(enqueue_time == 0))
+		return;
+
+	if (likely(sojourn > 0))
+		bucket = min_t(int,
+			       fls64((u64)sojourn >> dwrr_hist_shift),
+			       dwrr_hist_buckets - 1);
+
+	this_cpu_inc(q->hist->bins[cl->id][bucket]);
+}
+
 /* Exponential Weighted Moving Average (EWMA) for s64 */
 static inline s64 s64_ewma(s64 smooth, s64 sample, int weight, int shift)
 {
@@ -179,9 +313,15 @@ static inline void print_round(s64 smooth, s64 sample)
  * 20 = frame check sequence(8B)+Interpacket gap(12B)
  * 4 = Frame check sequence (4B)
  * dwrr_min_pkt_bytes = Minimum Ethernet frame size (64B)
+ *
+ * A GSO packet is sent as gso_segs frames. qdisc_pkt_len() already counts
+ * the replicated headers of all segments.
  */
 static inline unsigned int skb_size(struct sk_buff *skb)
 {
+	if (skb_is_gso(skb))
+		return qdisc_pkt_len(skb) + skb_shinfo(skb)->gso_segs * 24;
+
 	return max_t(unsigned int, skb->len + 4, dwrr_min_pkt_bytes) + 20;
 }
 
@@ -205,6 +345,78 @@ static inline u64 l2t_ns(struct dwrr_rate_cfg *r, unsigned int len_bytes)
 	return ((u64)len_bytes * r->mult) >> r->shift;
 }
 
+/*
+ * Decay a sketch counter by half every dwrr_hh_half_life rounds of its
+ * queue. Counters are only decayed when they are read or updated.
+ */
+static inline u32 dwrr_hh_decay(struct dwrr_hh_cell *c, u32 round)
+{
+	u32 periods = (round - c->round) / dwrr_hh_half_life;
+
+	if (periods > 0)
+	{
+		c->bytes = periods < 32 ? c->bytes >> periods : 0;
+		c->round += periods * dwrr_hh_half_life;
+	}
+
+	return c->bytes;
+}
+
+/*
+ * Count the packet in the sketch of its queue. Return true if its flow sent
+ * at least dwrr_hh_share percent of the recent bytes of the queue, i.e., it
+ * is responsible for the backlog. Row i indexes counters with bits from
+ * (i * 16) of the flow hash.
+ */
+static bool dwrr_hh_update(struct dwrr_sched_data *q,
+			   struct dwrr_class *cl,
+			   struct sk_buff *skb,
+			   unsigned int len)
+{
+	u32 hash = skb_get_hash(skb), est = U32_MAX;
+	struct dwrr_hh_cell *c;
+	u64 total;
+	int i;
+
+	for (i = 0; i < dwrr_hh_rows; i++)
+	{
+		c = &cl->hh[i * q->hh_width +
+			    ((hash >> (i * 16)) & (q->hh_width - 1))];
+		dwrr_hh_decay(c, cl->hh_round);
+		c->bytes += len;
+		est = min_t(u32, est, c->bytes);
+	}
+
+	dwrr_hh_decay(&cl->hh_total, cl->hh_round);
+	cl->hh_total.bytes += len;
+	total = cl->hh_total.bytes;
+
+	return (u64)est * 100 >= total * dwrr_hh_share;
+}
+
+/*
+ * Mark a packet when the congestion signal (queue length or sojourn time) is
+ * above the threshold.
+ */
+static inline void dwrr_ecn_mark(struct sk_buff *skb, u64 val, u64 thresh)
+{
+	if (val > thresh)
+		INET_ECN_set_ce(skb);
+}
+
+/*
+ * Mark a packet when the backlog of its queue is above the threshold of the
+ * queue. With heavy hitter detection, packets of other flows are only marked
+ * above dwrr_hh_mark_factor times the threshold, so that short flows stuck
+ * behind a heavy hitter of the same queue keep their windows.
+ */
+static inline void dwrr_class_ecn_mark(struct sk_buff *skb, u64 qlen, u64 thresh)
+{
+	if (qlen > thresh &&
+	    (dwrr_skb_cb(skb)->heavy || qlen > thresh * dwrr_hh_mark_factor))
+		INET_ECN_set_ce(skb);
+}
+
 /* MQ-ECN marking */
 static void mq_ecn_marking(struct sk_buff *skb,
 		      	   struct dwrr_sched_data *q,
@@ -223,8 +435,7 @@ static void mq_ecn_marking(struct sk_buff *skb,
 	ecn_thresh_bytes = div64_u64(estimate_rate_bps * dwrr_port_thresh_bytes,
 				     q->rate.rate_bps);
 
-	if (cl->len_bytes > ecn_thresh_bytes)
-		INET_ECN_set_ce(skb);
+	dwrr_class_ecn_mark(skb, cl->len_bytes, ecn_thresh_bytes);
 
 	if (dwrr_enable_debug == dwrr_enable)
 		printk(KERN_INFO "queue %d quantum %u ECN threshold %llu\n",
@@ -233,8 +444,85 @@ static void mq_ecn_marking(struct sk_buff *skb,
 		       ecn_thresh_bytes);
 }
 
+/*
+ * Measure the departure rate of a queue before it sends a packet of len bytes.
+ * Borrow from pie_process_dequeue in Linux kernel: a measurement starts once
+ * the queue holds dwrr_dq_thresh_bytes and ends after that many bytes left.
+ */
+static void dwrr_dq_rate_update(struct dwrr_sched_data *q,
+				struct dwrr_class *cl,
+				unsigned int len,
+				s64 now)
+{
+	s64 interval;
+	u64 sample;
+
+	if (cl->len_bytes >= dwrr_dq_thresh_bytes && cl->dq_count < 0)
+	{
+		cl->dq_tstamp = now;
+		cl->dq_count = 0;
+	}
+
+	if (cl->dq_count < 0)
+		return;
+
+	cl->dq_count += len;
+	if (cl->dq_count < dwrr_dq_thresh_bytes)
+		return;
+
+	/* The measurement ends when this packet leaves the wire */
+	interval = now + (s64)l2t_ns(&q->rate, len) - cl->dq_tstamp;
+	if (likely(interval > 0))
+	{
+		sample = div64_u64((u64)cl->dq_count * 8 * NSEC_PER_SEC,
+				   interval);
+		if (cl->avg_dq_rate == 0)
+			cl->avg_dq_rate = sample;
+		else
+			cl->avg_dq_rate = s64_ewma(cl->avg_dq_rate, sample,
+						   dwrr_dq_rate_alpha,
+						   dwrr_dq_rate_shift);
+
+		if (dwrr_enable_debug == dwrr_enable)
+			printk(KERN_INFO "queue %d departure rate sample %llu "
+			       "average %llu\n",
+			       cl->id, sample, cl->avg_dq_rate);
+	}
+
+	/* Start the next measurement only if enough bytes are left */
+	if (cl->len_bytes - len < dwrr_dq_thresh_bytes)
+	{
+		cl->dq_count = -1;
+	}
+	else
+	{
+		cl->dq_count = 0;
+		cl->dq_tstamp = now + l2t_ns(&q->rate, len);
+	}
+}
+
+/*
+ * PIE-like marking: scale the port threshold by the measured departure rate
+ * of the queue. Before the first measurement, use the port threshold.
+ */
+static void pie_marking(struct sk_buff *skb,
+			struct dwrr_sched_data *q,
+			struct dwrr_class *cl)
+{
+	u64 ecn_thresh_bytes = dwrr_port_thresh_bytes;
+	u64 rate_bps;
+
+	if (cl->avg_dq_rate > 0)
+	{
+		rate_bps = min_t(u64, cl->avg_dq_rate, q->rate.rate_bps);
+		ecn_thresh_bytes = div64_u64(rate_bps * dwrr_port_thresh_bytes,
+					     q->rate.rate_bps);
+	}
+
+	dwrr_class_ecn_mark(skb, cl->len_bytes, ecn_thresh_bytes);
+}
 
-/* Queue length based ECN marking: per-queue, per-port and MQ-ECN */
+/* Queue length based ECN marking: per-queue, per-port, MQ-ECN and PIE */
 void dwrr_qlen_marking(struct sk_buff *skb,
 		       struct dwrr_sched_data *q,
 		       struct dwrr_class *cl)
@@ -244,15 +532,14 @@ void dwrr_qlen_marking(struct sk_buff *skb,
 		/* Per-queue ECN marking */
 		case dwrr_queue_ecn:
 		{
-			if (cl->len_bytes > dwrr_queue_thresh_bytes[cl->id])
-				INET_ECN_set_ce(skb);
+			dwrr_class_ecn_mark(skb, cl->len_bytes,
+					    dwrr_queue_thresh_bytes[cl->id]);
 			break;
 		}
 		/* Per-port ECN marking */
 		case dwrr_port_ecn:
 		{
-			if (q->sum_len_bytes > dwrr_port_thresh_bytes)
-				INET_ECN_set_ce(skb);
+			dwrr_ecn_mark(skb, q->sum_len_bytes, dwrr_port_thresh_bytes);
 			break;
 		}
 		/* MQ-ECN */
@@ -261,6 +548,12 @@ void dwrr_qlen_marking(struct sk_buff *skb,
 			mq_ecn_marking(skb, q, cl);
 			break;
 		}
+		/* PIE-like marking */
+		case dwrr_pie:
+		{
+			pie_marking(skb, q, cl);
+			break;
+		}
 		default:
 		{
 			break;
@@ -272,10 +565,49 @@ void dwrr_qlen_marking(struct sk_buff *skb,
 static inline void tcn_marking(struct sk_buff *skb)
 {
 	codel_time_t delay;
-	delay = ns_to_codel_time(ktime_get_ns() - skb->tstamp.tv64);
 
-	if (codel_time_after(delay, (codel_time_t)dwrr_tcn_thresh))
-		INET_ECN_set_ce(skb);
+	/* The packet was enqueued before TCN was enabled */
+	if (unlikely(dwrr_skb_cb(skb)->enqueue_time == 0))
+		return;
+
+	delay = ns_to_codel_time(ktime_get_ns() - dwrr_skb_cb(skb)->enqueue_time);
+
+	dwrr_ecn_mark(skb, delay, dwrr_tcn_thresh);
+}
+
+/*
+ * MQ-TCN marking scheme: TCN with the threshold scaled up by the inverse of
+ * the service share of the queue, i.e., round time / transmission time of its
+ * quantum. A queue with a small quantum drains slower, so its packets wait
+ * longer for the same backlog and should not be marked for that alone.
+ */
+static void mq_tcn_marking(struct sk_buff *skb,
+			   struct dwrr_sched_data *q,
+			   struct dwrr_class *cl,
+			   s64 now)
+{
+	s64 round_time = q->round_time[cl->prio];
+	u64 quantum_ns = l2t_ns(&q->rate, cl->quantum);
+	u64 thresh = dwrr_tcn_thresh;
+	codel_time_t delay;
+
+	/* The packet was enqueued before MQ-TCN was enabled */
+	if (unlikely(dwrr_skb_cb(skb)->enqueue_time == 0))
+		return;
+
+	delay = ns_to_codel_time(now - dwrr_skb_cb(skb)->enqueue_time);
+
+	/* The queue gets quantum_ns of link time in each round */
+	if (quantum_ns > 0 && round_time > (s64)quantum_ns)
+		thresh = div64_u64(thresh * round_time, quantum_ns);
+
+	dwrr_ecn_mark(skb, delay, thresh);
+
+	if (dwrr_enable_debug == dwrr_enable)
+		printk(KERN_INFO "queue %d round time %lld MQ-TCN threshold %llu\n",
+		       cl->id,
+		       round_time,
+		       thresh);
 }
 
 /* Borrow from codel_should_drop in Linux kernel */
@@ -286,7 +618,11 @@ static bool codel_should_mark(const struct sk_buff *skb,
 	bool ok_to_mark;
 	codel_time_t now = ns_to_codel_time(now_ns);
 
-	cl->ldelay = ns_to_codel_time(now_ns - skb->tstamp.tv64);
+	/* The packet was enqueued before CoDel was enabled */
+	if (unlikely(dwrr_skb_cb(skb)->enqueue_time == 0))
+		return false;
+
+	cl->ldelay = ns_to_codel_time(now_ns - dwrr_skb_cb(skb)->enqueue_time);
 
 	if (codel_time_before(cl->ldelay, (codel_time_t)dwrr_codel_target) ||
 	    cl->len_bytes <= dwrr_max_pkt_bytes)
@@ -405,28 +741,72 @@ static void codel_marking(struct sk_buff *skb, struct dwrr_class *cl)
 	}
 }
 
+/* Return the classifier key (DSCP or VLAN PCP) of a packet, or -1 if none */
+static int dwrr_classify_field(struct sk_buff *skb)
+{
+	u16 vlan_tci;
+
+	if (dwrr_classify_key == dwrr_classify_pcp)
+	{
+		if (vlan_get_tag(skb, &vlan_tci) < 0)
+			return -1;
+		return (vlan_tci & VLAN_PRIO_MASK) >> VLAN_PRIO_SHIFT;
+	}
+
+	switch (tc_skb_protocol(skb))
+	{
+	case htons(ETH_P_IP):
+		if (!pskb_network_may_pull(skb, sizeof(struct iphdr)))
+			return -1;
+		return ipv4_get_dsfield(ip_hdr(skb)) >> 2;
+	case htons(ETH_P_IPV6):
+		if (!pskb_network_may_pull(skb, sizeof(struct ipv6hdr)))
+			return -1;
+		return ipv6_get_dsfield(ipv6_hdr(skb)) >> 2;
+	default:
+		return -1;
+	}
+}
+
+/* Pick up the latest configuration snapshot if it has changed */
+static inline void dwrr_update_config(struct dwrr_sched_data *q)
+{
+	const struct dwrr_config_rcu *c;
+
+	rcu_read_lock();
+	c = rcu_dereference(dwrr_config);
+	if (unlikely(c->cfg.version != q->cfg.version))
+		q->cfg = c->cfg;
+	rcu_read_unlock();
+}
+
+/*
+ * A key remapped to another queue keeps going to its old queue until its
+ * packets there have left, so that remaps never reorder a flow.
+ */
 static struct dwrr_class *dwrr_classify(struct sk_buff *skb, struct Qdisc *sch)
 {
 	struct dwrr_sched_data *q = qdisc_priv(sch);
-	struct iphdr* iph = ip_hdr(skb);
-	int i, dscp;
+	int key;
 
 	if (unlikely(!(q->queues)))
 		return NULL;
 
-	/* Return queue[0] by default*/
-	if (unlikely(!iph))
-		return &(q->queues[0]);
-
-	dscp = iph->tos >> 2;
+	key = dwrr_classify_field(skb);
 
-	for (i = 0; i < dwrr_max_queues; i++)
+	/* Return queue[0] by default*/
+	if (unlikely(key < 0))
 	{
-		if (dscp == dwrr_queue_dscp[i])
-			return &(q->queues[i]);
+		dwrr_skb_cb(skb)->key = dwrr_no_key;
+		return &(q->queues[0]);
 	}
 
-	return &(q->queues[0]);
+	if (q->key_queue[key] != q->cfg.key_queue[key] &&
+	    q->key_backlog[key] == 0)
+		q->key_queue[key] = q->cfg.key_queue[key];
+
+	dwrr_skb_cb(skb)->key = key;
+	return &(q->queues[q->key_queue[key]]);
 }
 
 /* We don't need this */
@@ -441,8 +821,10 @@ static s64 tbf_schedule(unsigned int len, struct dwrr_sched_data *q, s64 now)
 {
 	s64 pkt_ns, toks;
 
+	/* A GSO packet larger than the bucket must still be able to go */
 	toks = now - q->time_ns;
-	toks = min_t(s64, toks, (s64)l2t_ns(&q->rate, dwrr_bucket_bytes));
+	toks = min_t(s64, toks,
+		     (s64)l2t_ns(&q->rate, max_t(unsigned int, dwrr_bucket_bytes, len)));
 	toks += q->tokens;
 
 	pkt_ns = (s64)l2t_ns(&q->rate, len);
@@ -450,18 +832,239 @@ static s64 tbf_schedule(unsigned int len, struct dwrr_sched_data *q, s64 now)
 	return toks - pkt_ns;
 }
 
-/* Find the highest priority that is non-empty */
-int prio_schedule(struct dwrr_sched_data *q)
+/* Update the rate (Mbps) of a per-queue token bucket. Return true if enabled */
+static inline bool dwrr_class_tb_enabled(struct dwrr_class_tb *tb,
+					 int rate_mbps,
+					 s64 now)
 {
-	int i;
+	u64 rate_bps = (u64)rate_mbps * 1000000;
 
-	for (i = 0; i < dwrr_max_prio; i++)
+	if (unlikely(tb->rate.rate_bps != rate_bps))
 	{
-		if (!list_empty(&q->active[i]))
-			return i;
+		tb->rate.rate_bps = rate_bps;
+		precompute_ratedata(&tb->rate);
+		/* Start with a full bucket */
+		tb->tokens = (s64)l2t_ns(&tb->rate, dwrr_bucket_bytes);
+		tb->time_ns = now;
 	}
 
-	return -1;
+	return rate_bps > 0;
+}
+
+/* Decide whether a queue can transmit the packet according to its bucket */
+static s64 dwrr_class_tb_schedule(unsigned int len,
+				  struct dwrr_class_tb *tb,
+				  s64 now)
+{
+	s64 pkt_ns, toks;
+
+	toks = now - tb->time_ns;
+	toks = min_t(s64, toks,
+		     (s64)l2t_ns(&tb->rate, max_t(unsigned int, dwrr_bucket_bytes, len)));
+	toks += tb->tokens;
+
+	pkt_ns = (s64)l2t_ns(&tb->rate, len);
+
+	return toks - pkt_ns;
+}
+
+/* Charge a transmitted packet to a per-queue token bucket */
+static void dwrr_class_tb_charge(unsigned int len,
+				 struct dwrr_class_tb *tb,
+				 s64 now)
+{
+	s64 bucket_ns = (s64)l2t_ns(&tb->rate, dwrr_bucket_bytes);
+	s64 result = dwrr_class_tb_schedule(len, tb, now);
+
+	tb->time_ns = now;
+	/* A queue can borrow beyond its floor rate, but the debt is bounded */
+	tb->tokens = clamp_t(s64, result, -bucket_ns, bucket_ns);
+}
+
+/*
+ * Return true if the queue can transmit len bytes under its ceiling rate.
+ * Otherwise, keep the earliest time (ns) when a throttled queue can transmit.
+ */
+static bool dwrr_class_under_ceil(struct dwrr_class *cl,
+				  unsigned int len,
+				  s64 now,
+				  s64 *next_time)
+{
+	s64 result;
+
+	if (!dwrr_class_tb_enabled(&cl->ceil, dwrr_queue_ceil_rate[cl->id], now))
+		return true;
+
+	result = dwrr_class_tb_schedule(len, &cl->ceil, now);
+	if (result >= 0)
+		return true;
+
+	if (*next_time == 0 || now - result < *next_time)
+		*next_time = now - result;
+
+	return false;
+}
+
+/*
+ * Find an active queue sending below its floor rate. Such queues are served
+ * regardless of their priorities and DWRR deficit counters.
+ */
+static struct dwrr_class *dwrr_floor_schedule(struct dwrr_sched_data *q,
+					      s64 now,
+					      s64 *next_time,
+					      unsigned int *len)
+{
+	struct dwrr_class *cl;
+	struct sk_buff *skb;
+	int prio;
+
+	/* Floor rates are off by default */
+	if (likely(!q->cfg.floor_queues))
+		return NULL;
+
+	for (prio = 0; prio < dwrr_max_prio; prio++)
+	{
+		list_for_each_entry(cl, &q->active[prio], alist)
+		{
+			if (!(q->cfg.floor_queues & (1U << cl->id)) ||
+			    !dwrr_class_tb_enabled(&cl->floor,
+						   dwrr_queue_floor_rate[cl->id],
+						   now))
+				continue;
+
+			skb = cl->qdisc->ops->peek(cl->qdisc);
+			if (unlikely(!skb))
+				continue;
+
+			*len = skb_size(skb);
+			if (dwrr_class_tb_schedule(*len, &cl->floor, now) >= 0 &&
+			    dwrr_class_under_ceil(cl, *len, now, next_time))
+				return cl;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * The minimum number of DWRR rounds before any queue in an active list can
+ * send its head packet. Return 0 if some queue can send it now.
+ */
+static u32 dwrr_min_rounds(struct list_head *active)
+{
+	struct dwrr_class *cl;
+	struct sk_buff *skb;
+	unsigned int len;
+	u32 rounds, min_rounds = 0;
+
+	list_for_each_entry(cl, active, alist)
+	{
+		skb = cl->qdisc->ops->peek(cl->qdisc);
+		if (unlikely(!skb))
+			return 0;
+
+		len = skb_size(skb);
+		if (len <= cl->deficit)
+			return 0;
+
+		rounds = DIV_ROUND_UP(len - cl->deficit, cl->quantum);
+		if (min_rounds == 0 || rounds < min_rounds)
+			min_rounds = rounds;
+	}
+
+	return min_rounds;
+}
+
+/* The number of queues in an active list */
+static unsigned int dwrr_list_len(struct list_head *active)
+{
+	struct dwrr_class *cl;
+	unsigned int len = 0;
+
+	list_for_each_entry(cl, active, alist)
+		len++;
+
+	return len;
+}
+
+/*
+ * Dequeue the head packet of a queue. result is the number of tokens (ns) left
+ * in the port bucket after this packet. Packets sent below the floor rate of
+ * the queue are not charged to its deficit counter.
+ */
+static struct sk_buff *dwrr_dequeue_class(struct Qdisc *sch,
+					  struct dwrr_class *cl,
+					  unsigned int len,
+					  s64 result,
+					  s64 now,
+					  bool charge_deficit)
+{
+	struct dwrr_sched_data *q = qdisc_priv(sch);
+	s64 bucket_ns = (s64)l2t_ns(&q->rate, dwrr_bucket_bytes);
+	int prio = cl->prio;
+	struct sk_buff *skb;
+	s64 sample;
+
+	skb = qdisc_dequeue_peeked(cl->qdisc);
+	if (unlikely(!skb))
+		return NULL;
+
+	if (dwrr_skb_cb(skb)->key != dwrr_no_key)
+		q->key_backlog[dwrr_skb_cb(skb)->key]--;
+
+	q->prio_len_bytes[prio] -= len;
+	if (q->prio_len_bytes[prio] == 0)
+		q->last_idle_time[prio] = now;
+
+	if (dwrr_ecn_scheme == dwrr_pie)
+		dwrr_dq_rate_update(q, cl, len, now);
+
+	q->sum_len_bytes -= len;
+	sch->q.qlen--;
+	cl->len_bytes -= len;
+	if (dwrr_skb_cb(skb)->throttled)
+		cl->bp_bytes -= len;
+	if (charge_deficit)
+		cl->deficit -= len;
+	cl->last_pkt_time = now + l2t_ns(&q->rate, len);
+
+	if (cl->qdisc->q.qlen == 0)
+	{
+		list_del(&cl->alist);
+		sample = cl->last_pkt_time - cl->start_time;
+		q->round_time[prio] = ewma_round(q->round_time[prio], sample);
+		print_round(q->round_time[prio], sample);
+	}
+
+	/* Bucket */
+	q->time_ns = now;
+	q->tokens = min_t(s64, result, bucket_ns);
+	qdisc_unthrottled(sch);
+	qdisc_bstats_update(sch, skb);
+
+	/* Per-queue ceiling and floor rates */
+	if (dwrr_class_tb_enabled(&cl->ceil, dwrr_queue_ceil_rate[cl->id], now))
+		dwrr_class_tb_charge(len, &cl->ceil, now);
+	if (dwrr_class_tb_enabled(&cl->floor, dwrr_queue_floor_rate[cl->id], now))
+		dwrr_class_tb_charge(len, &cl->floor, now);
+
+	if (dwrr_enable_hist == dwrr_enable)
+		dwrr_hist_update(q, cl, skb, now);
+
+	/* TCN */
+	if (dwrr_ecn_scheme == dwrr_tcn)
+		tcn_marking(skb);
+	/* MQ-TCN */
+	else if (dwrr_ecn_scheme == dwrr_mq_tcn)
+		mq_tcn_marking(skb, q, cl, now);
+	/* CoDel */
+	else if (dwrr_ecn_scheme == dwrr_codel)
+		codel_marking(skb, cl);
+	/* dequeu equeue length based ECN marking */
+	else if (dwrr_enable_dequeue_ecn == dwrr_enable)
+		dwrr_qlen_marking(skb, q, cl);
+
+	return skb;
 }
 
 static struct sk_buff *dwrr_dequeue(struct Qdisc *sch)
@@ -471,100 +1074,148 @@ static struct sk_buff *dwrr_dequeue(struct Qdisc *sch)
 	struct sk_buff *skb = NULL;
 	s64 sample, result;
 	s64 now = ktime_get_ns();
-	s64 bucket_ns = (s64)l2t_ns(&q->rate, dwrr_bucket_bytes);
-	unsigned int len;
+	/* The earliest time when a queue throttled by its ceiling can send */
+	s64 next_time = 0;
+	unsigned int len, nr_active, throttled;
 	struct list_head *active = NULL;
-	int prio = prio_schedule(q);
+	struct dwrr_class *pos;
+	u32 rounds;
+	int prio;
 
-	if (prio < 0)
-		return NULL;
-	else
-		active = &q->active[prio];
+	dwrr_update_config(q);
 
-	while (1)
+	/* Queues below their floor rates are served first */
+	cl = dwrr_floor_schedule(q, now, &next_time, &len);
+	if (cl)
 	{
-		cl = list_first_entry(active, struct dwrr_class, alist);
-		if (unlikely(!cl))
+		result = tbf_schedule(len, q, now);
+		/* If we don't have enough tokens */
+		if (result < 0)
+		{
+			/* For hrtimer absolute mode, we use now + t */
+			qdisc_watchdog_schedule_ns(&q->watchdog,
+						   now - result,
+						   true);
+			qdisc_qstats_overlimit(sch);
 			return NULL;
+		}
 
-		/* get head packet */
-		skb = cl->qdisc->ops->peek(cl->qdisc);
-		if (unlikely(!skb))
-			return NULL;
+		return dwrr_dequeue_class(sch, cl, len, result, now, false);
+	}
 
-		len = skb_size(skb);
+	/* Strict priority, then DWRR among queues of the same priority */
+	for (prio = 0; prio < dwrr_max_prio; prio++)
+	{
+		active = &q->active[prio];
+		if (list_empty(active))
+			continue;
 
-		/* If this packet can be scheduled by DWRR */
-		if (len <= cl->deficit)
+		nr_active = 0;
+		throttled = 0;
+
+		while (1)
 		{
-			result = tbf_schedule(len, q, now);
-			/* If we don't have enough tokens */
-			if (result < 0)
-			{
-				/* For hrtimer absolute mode, we use now + t */
-				qdisc_watchdog_schedule_ns(&q->watchdog,
-							   now - result,
-							   true);
-				qdisc_qstats_overlimit(sch);
+			cl = list_first_entry(active, struct dwrr_class, alist);
+			if (unlikely(!cl))
 				return NULL;
-			}
 
-			skb = qdisc_dequeue_peeked(cl->qdisc);
+			/* get head packet */
+			skb = cl->qdisc->ops->peek(cl->qdisc);
 			if (unlikely(!skb))
 				return NULL;
 
-			q->prio_len_bytes[prio] -= len;
-			if (q->prio_len_bytes[prio] == 0)
-				q->last_idle_time[prio] = now;
+			len = skb_size(skb);
 
-			q->sum_len_bytes -= len;
-			sch->q.qlen--;
-			cl->len_bytes -= len;
-			cl->deficit -= len;
-			cl->last_pkt_time = now + l2t_ns(&q->rate, len);
-
-			if (cl->qdisc->q.qlen == 0)
+			/* If this packet can be scheduled by DWRR */
+			if (len <= cl->deficit)
 			{
-				list_del(&cl->alist);
-				sample = cl->last_pkt_time - cl->start_time;
-				q->round_time[prio] = ewma_round(q->round_time[prio], sample);
-				print_round(q->round_time[prio], sample);
+				/*
+				 * Skip the queue over its ceiling rate. If all
+				 * queues of this priority are throttled, we
+				 * move to the next priority.
+				 */
+				if (!dwrr_class_under_ceil(cl, len, now, &next_time))
+				{
+					list_move_tail(&cl->alist, active);
+					if (nr_active == 0)
+						nr_active = dwrr_list_len(active);
+					if (++throttled >= nr_active)
+						break;
+					continue;
+				}
+
+				result = tbf_schedule(len, q, now);
+				/* If we don't have enough tokens */
+				if (result < 0)
+				{
+					/* For hrtimer absolute mode, we use now + t */
+					qdisc_watchdog_schedule_ns(&q->watchdog,
+								   now - result,
+								   true);
+					qdisc_qstats_overlimit(sch);
+					return NULL;
+				}
+
+				return dwrr_dequeue_class(sch, cl, len, result,
+							  now, true);
 			}
 
-			/* Bucket */
-			q->time_ns = now;
-			q->tokens = min_t(s64, result, bucket_ns);
-			qdisc_unthrottled(sch);
-			qdisc_bstats_update(sch, skb);
-
-
-			/* TCN */
-			if (dwrr_ecn_scheme == dwrr_tcn)
-				tcn_marking(skb);
-			/* CoDel */
-			else if (dwrr_ecn_scheme == dwrr_codel)
-				codel_marking(skb, cl);
-			/* dequeu equeue length based ECN marking */
-			else if (dwrr_enable_dequeue_ecn == dwrr_enable)
-				dwrr_qlen_marking(skb, q, cl);
+			/*
+			 * An oversized (e.g., GSO) packet needs several quanta.
+			 * Instead of looping over rounds in which no queue can
+			 * send, we top up all deficit counters in a single step.
+			 */
+			if (dwrr_enable_wrr == dwrr_disable &&
+			    len > cl->deficit + cl->quantum)
+			{
+				rounds = dwrr_min_rounds(active);
+				if (rounds > 1)
+				{
+					list_for_each_entry(pos, active, alist)
+					{
+						pos->deficit += (rounds - 1) *
+								pos->quantum;
+						pos->hh_round += rounds - 1;
+					}
+				}
+			}
 
-			return skb;
+			/*
+			 * A queue that already got its quantum in this round is
+			 * back at the head: a new round starts, with the quanta
+			 * of the latest configuration for all queues.
+			 */
+			if (cl->round == q->round[prio])
+			{
+				q->round[prio]++;
+				list_for_each_entry(pos, active, alist)
+					pos->quantum = q->cfg.queue_quantum[pos->id];
+			}
+			cl->round = q->round[prio];
+
+			/* This packet can not be scheduled by DWRR */
+			sample = cl->last_pkt_time - cl->start_time;
+			q->round_time[prio] = ewma_round(q->round_time[prio], sample);
+			cl->start_time = cl->last_pkt_time;
+			list_move_tail(&cl->alist, active);
+			throttled = 0;
+			cl->hh_round++;
+
+			/* WRR. A packet larger than the quantum takes a round. */
+			if (dwrr_enable_wrr == dwrr_enable)
+				cl->deficit = max_t(u32, cl->quantum, len);
+			else
+				cl->deficit += cl->quantum;
+
+			print_round(q->round_time[prio], sample);
 		}
+	}
 
-		/* This packet can not be scheduled by DWRR */
-		sample = cl->last_pkt_time - cl->start_time;
-		q->round_time[prio] = ewma_round(q->round_time[prio], sample);
-		cl->start_time = cl->last_pkt_time;
-		cl->quantum = dwrr_queue_quantum[cl->id];
-		list_move_tail(&cl->alist, active);
-
-		/* WRR */
-		if (dwrr_enable_wrr == dwrr_enable)
-			cl->deficit = cl->quantum;
-		else
-			cl->deficit += cl->quantum;
-
-		print_round(q->round_time[prio], sample);
+	/* All backlogged queues are over their ceiling rates */
+	if (next_time > 0)
+	{
+		qdisc_watchdog_schedule_ns(&q->watchdog, next_time, true);
+		qdisc_qstats_overlimit(sch);
 	}
 
 	return NULL;
@@ -586,31 +1237,67 @@ static bool dwrr_buffer_overfill(unsigned int len,
 		return false;
 }
 
+/*
+ * Keep a packet that overfills the buffer and throttle its sender instead?
+ * Only local TCP senders can be throttled: NET_XMIT_CN makes TCP reduce its
+ * window and TSQ stops the socket until its packets leave the qdisc, while
+ * UDP and raw sockets take it as success. Each queue holds at most
+ * dwrr_bp_headroom_bytes over its limit, so one class can not take the
+ * headroom of the others, and the port never holds more than
+ * dwrr_max_buffer_bytes.
+ */
+static inline bool dwrr_backpressure(struct sk_buff *skb,
+				     unsigned int len,
+				     struct dwrr_class *cl,
+				     struct dwrr_sched_data *q)
+{
+	return dwrr_enable_backpressure == dwrr_enable &&
+	       skb->sk && sk_fullsock(skb->sk) &&
+	       skb->sk->sk_protocol == IPPROTO_TCP &&
+	       cl->bp_bytes + len <= dwrr_bp_headroom_bytes &&
+	       q->sum_len_bytes + len <= dwrr_max_buffer_bytes;
+}
 
-static int dwrr_enqueue(struct sk_buff *skb, struct Qdisc *sch)
+static int dwrr_enqueue_skb(struct sk_buff *skb, struct Qdisc *sch)
 {
 	struct dwrr_class *cl = NULL;
 	unsigned int len = skb_size(skb);
 	struct dwrr_sched_data *q = qdisc_priv(sch);
 	int ret, prio;
+	bool throttle = false;
 
+	dwrr_update_config(q);
 	cl = dwrr_classify(skb, sch);
 	if (likely(cl))
 	{
-		prio = dwrr_queue_prio[cl->id];
+		prio = q->cfg.queue_prio[cl->id];
 		if (q->prio_len_bytes[prio] == 0)
 			reset_round(q, prio);
 	}
 
-	/* No appropriate queue or the switch buffer is overfilled */
-	if (unlikely(!cl) || dwrr_buffer_overfill(len, cl, q))
+	/* No appropriate queue */
+	if (unlikely(!cl))
 	{
 		qdisc_qstats_drop(sch);
-		qdisc_qstats_drop(cl->qdisc);
 		kfree_skb(skb);
 		return NET_XMIT_DROP;
 	}
 
+	/* The switch buffer is overfilled */
+	if (dwrr_buffer_overfill(len, cl, q))
+	{
+		if (!dwrr_backpressure(skb, len, cl, q))
+		{
+			qdisc_qstats_drop(sch);
+			qdisc_qstats_drop(cl->qdisc);
+			kfree_skb(skb);
+			return NET_XMIT_DROP;
+		}
+
+		qdisc_qstats_overlimit(sch);
+		throttle = true;
+	}
+
 	ret = qdisc_enqueue(skb, cl->qdisc);
 	if (unlikely(ret != NET_XMIT_SUCCESS))
 	{
@@ -626,26 +1313,84 @@ static int dwrr_enqueue(struct sk_buff *skb, struct Qdisc *sch)
 	if (cl->qdisc->q.qlen == 1)
 	{
 		cl->start_time = ktime_get_ns();
-		cl->quantum = dwrr_queue_quantum[cl->id];
+		cl->quantum = q->cfg.queue_quantum[cl->id];
 		cl->prio = prio;
 		cl->deficit = cl->quantum;
+		cl->round = q->round[prio];
 		list_add_tail(&cl->alist, &(q->active[cl->prio]));
 	}
 
-	/* Update queue sizes (per port/priority/queue) */
+	/* Heavy hitter detection for ECN marking */
+	dwrr_skb_cb(skb)->heavy = q->hh_width > 0 ?
+				  dwrr_hh_update(q, cl, skb, len) : true;
+
+	/* Update queue sizes (per port/priority/queue/key) */
+	if (dwrr_skb_cb(skb)->key != dwrr_no_key)
+		q->key_backlog[dwrr_skb_cb(skb)->key]++;
 	sch->q.qlen++;
 	q->sum_len_bytes += len;
 	q->prio_len_bytes[cl->prio] += len;
 	cl->len_bytes += len;
+	dwrr_skb_cb(skb)->throttled = throttle;
+	if (throttle)
+		cl->bp_bytes += len;
+
+	/* sojourn time based ECN marking (TCN, MQ-TCN and CoDel), histograms */
+	dwrr_skb_cb(skb)->enqueue_time = dwrr_need_tstamp() ? ktime_get_ns() : 0;
 
-	/* sojourn time based ECN marking: TCN and CoDel */
-	if (dwrr_ecn_scheme == dwrr_tcn || dwrr_ecn_scheme == dwrr_codel)
-		skb->tstamp = ktime_get();
 	/* enqueue queue length based ECN marking */
-	else if (dwrr_enable_dequeue_ecn == dwrr_disable)
+	if (dwrr_ecn_scheme != dwrr_tcn &&
+	    dwrr_ecn_scheme != dwrr_mq_tcn &&
+	    dwrr_ecn_scheme != dwrr_codel &&
+	    dwrr_enable_dequeue_ecn == dwrr_disable)
 		dwrr_qlen_marking(skb, q, cl);
 
-	return ret;
+	return throttle ? NET_XMIT_CN : ret;
+}
+
+/* Borrow from tbf_segment: segment a GSO packet and enqueue all segments */
+static int dwrr_segment(struct sk_buff *skb, struct Qdisc *sch)
+{
+	struct sk_buff *segs, *nskb;
+	netdev_features_t features = netif_skb_features(skb);
+	unsigned int len = 0, prev_len = qdisc_pkt_len(skb);
+	int ret, nb;
+	bool throttle = false;
+
+	segs = skb_gso_segment(skb, features & ~NETIF_F_GSO_MASK);
+	if (IS_ERR_OR_NULL(segs))
+		return qdisc_reshape_fail(skb, sch);
+
+	nb = 0;
+	while (segs)
+	{
+		nskb = segs->next;
+		segs->next = NULL;
+		qdisc_skb_cb(segs)->pkt_len = segs->len;
+		len += segs->len;
+		ret = dwrr_enqueue_skb(segs, sch);
+		if (ret == NET_XMIT_SUCCESS || ret == NET_XMIT_CN)
+			nb++;
+		if (ret == NET_XMIT_CN)
+			throttle = true;
+		segs = nskb;
+	}
+
+	if (nb > 1)
+		qdisc_tree_reduce_backlog(sch, 1 - nb, prev_len - len);
+	consume_skb(skb);
+
+	if (nb == 0)
+		return NET_XMIT_DROP;
+	return throttle ? NET_XMIT_CN : NET_XMIT_SUCCESS;
+}
+
+static int dwrr_enqueue(struct sk_buff *skb, struct Qdisc *sch)
+{
+	if (dwrr_enable_gso_segment == dwrr_enable && skb_is_gso(skb))
+		return dwrr_segment(skb, sch);
+
+	return dwrr_enqueue_skb(skb, sch);
 }
 
 /* We don't need this */
@@ -654,10 +1399,48 @@ static unsigned int dwrr_drop(struct Qdisc *sch)
 	return 0;
 }
 
-/* We don't need this */
+/* Report the rate and all module parameters */
 static int dwrr_dump(struct Qdisc *sch, struct sk_buff *skb)
 {
-	return 0;
+	struct dwrr_sched_data *q = qdisc_priv(sch);
+	struct nlattr *opts = nla_nest_start(skb, TCA_OPTIONS);
+
+	if (!opts)
+		goto nla_put_failure;
+
+	if (nla_put_u64(skb, TCA_MQ_ECN_RATE, q->rate.rate_bps >> 3) ||
+	    dwrr_params_dump(skb) < 0)
+		goto nla_put_failure;
+
+	return nla_nest_end(skb, opts);
+
+nla_put_failure:
+	nla_nest_cancel(skb, opts);
+	return -1;
+}
+
+/* Export per-queue sojourn time histograms */
+static int dwrr_dump_stats(struct Qdisc *sch, struct gnet_dump *d)
+{
+	struct dwrr_sched_data *q = qdisc_priv(sch);
+	int cpu, i, j;
+
+	memset(&q->xstats, 0, sizeof(q->xstats));
+
+	if (likely(q->hist))
+	{
+		for_each_possible_cpu(cpu)
+		{
+			const struct dwrr_hist *h = per_cpu_ptr(q->hist, cpu);
+
+			for (i = 0; i < dwrr_max_queues; i++)
+				for (j = 0; j < dwrr_hist_buckets; j++)
+					q->xstats.sojourn_hist[i][j] +=
+						h->bins[i][j];
+		}
+	}
+
+	return gnet_stats_copy_app(d, &q->xstats, sizeof(q->xstats));
 }
 
 /* Release Qdisc resources */
@@ -672,37 +1455,148 @@ static void dwrr_destroy(struct Qdisc *sch)
 			qdisc_destroy((q->queues[i]).qdisc);
 	}
 	qdisc_watchdog_cancel(&q->watchdog);
+	free_percpu(q->hist);
+	q->hist = NULL;
+	mutex_lock(&dwrr_qdiscs_lock);
+	list_del_init(&q->node);
+	mutex_unlock(&dwrr_qdiscs_lock);
+	for (i = 0; i < dwrr_max_queues; i++)
+	{
+		kfree((q->queues[i]).hh);
+		(q->queues[i]).hh = NULL;
+	}
+	q->hh_width = 0;
 	printk(KERN_INFO "destroy sch_dwrr on %s\n", sch->dev_queue->dev->name);
 	print_dwrr_sched_data(sch);
 }
 
-static const struct nla_policy dwrr_policy[TCA_TBF_MAX + 1] = {
-	[TCA_TBF_PARMS] = { .len = sizeof(struct tc_tbf_qopt) },
-	[TCA_TBF_RTAB]	= { .type = NLA_BINARY, .len = TC_RTAB_SIZE },
-	[TCA_TBF_PTAB]	= { .type = NLA_BINARY, .len = TC_RTAB_SIZE },
+static const struct nla_policy dwrr_policy[TCA_MQ_ECN_MAX + 1] = {
+	[TCA_MQ_ECN_RATE]	= { .type = NLA_U64 },
+	[TCA_MQ_ECN_PARAMS]	= { .type = NLA_NESTED },
 };
 
-/* We only leverage TC netlink interface to configure rate */
+/*
+ * (Re)allocate the heavy hitter sketches of a qdisc with width counters per
+ * row. A width is rounded down to a power of 2 and 0 frees the sketches.
+ * The caller holds dwrr_qdiscs_lock.
+ */
+static int dwrr_hh_resize(struct dwrr_sched_data *q, int width)
+{
+	struct dwrr_hh_cell *hh[dwrr_max_queues] = { NULL };
+	u32 w = width > 0 ? rounddown_pow_of_two(width) : 0;
+	int i;
+
+	if (w == q->hh_width)
+		return 0;
+
+	for (i = 0; i < dwrr_max_queues && w > 0; i++)
+	{
+		hh[i] = kcalloc(dwrr_hh_rows * w, sizeof(struct dwrr_hh_cell),
+				GFP_KERNEL);
+		if (unlikely(!hh[i]))
+			goto err;
+	}
+
+	sch_tree_lock(q->sch);
+	for (i = 0; i < dwrr_max_queues; i++)
+	{
+		swap(hh[i], (q->queues[i]).hh);
+		(q->queues[i]).hh_total.bytes = 0;
+		(q->queues[i]).hh_total.round = (q->queues[i]).hh_round;
+	}
+	q->hh_width = w;
+	sch_tree_unlock(q->sch);
+
+err:
+	for (i = 0; i < dwrr_max_queues; i++)
+		kfree(hh[i]);
+
+	return q->hh_width == w ? 0 : -ENOMEM;
+}
+
+/*
+ * Make width the new hh_width and resize the sketches of all DWRR qdiscs.
+ * Called from the sysctl handler and dwrr_params_set() before any other
+ * parameter changes. On failure, hh_width does not change and the qdiscs
+ * go back to the old width.
+ */
+int dwrr_hh_set_width(int width)
+{
+	struct dwrr_sched_data *q;
+	int err = 0;
+
+	if (width < 0 || width > dwrr_hh_max_width)
+		return -EINVAL;
+
+	mutex_lock(&dwrr_qdiscs_lock);
+	list_for_each_entry(q, &dwrr_qdiscs, node)
+	{
+		err = dwrr_hh_resize(q, width);
+		if (unlikely(err))
+			break;
+	}
+
+	if (likely(!err))
+		dwrr_hh_width = width;
+	else
+		list_for_each_entry(q, &dwrr_qdiscs, node)
+			dwrr_hh_resize(q, dwrr_hh_width);
+	mutex_unlock(&dwrr_qdiscs_lock);
+
+	return err;
+}
+
+/* Whether a DWRR qdisc other than q exists */
+static bool dwrr_other_qdiscs(struct dwrr_sched_data *q)
+{
+	struct dwrr_sched_data *other;
+	bool found = false;
+
+	mutex_lock(&dwrr_qdiscs_lock);
+	list_for_each_entry(other, &dwrr_qdiscs, node)
+	{
+		if (other != q)
+		{
+			found = true;
+			break;
+		}
+	}
+	mutex_unlock(&dwrr_qdiscs_lock);
+
+	return found;
+}
+
+/*
+ * Configure the rate and, optionally, module parameters through TC netlink.
+ * The parameters are module-wide, so they can only change while this is the
+ * only DWRR qdisc. Use the sysctls to change them for all ports.
+ */
 static int dwrr_change(struct Qdisc *sch, struct nlattr *opt)
 {
 	int err;
 	struct dwrr_sched_data *q = qdisc_priv(sch);
-	struct nlattr *tb[TCA_TBF_PTAB + 1];
-	struct tc_tbf_qopt *qopt;
-	__u32 rate;
+	struct nlattr *tb[TCA_MQ_ECN_MAX + 1];
 
-	err = nla_parse_nested(tb, TCA_TBF_PTAB, opt, dwrr_policy);
+	err = nla_parse_nested(tb, TCA_MQ_ECN_MAX, opt, dwrr_policy);
 	if(err < 0)
 		return err;
 
+	/* The rate is mandatory when the qdisc is created */
 	err = -EINVAL;
-	if (!tb[TCA_TBF_PARMS])
+	if (!tb[TCA_MQ_ECN_RATE] && !q->rate.rate_bps)
 		goto done;
 
-	qopt = nla_data(tb[TCA_TBF_PARMS]);
-	rate = qopt->rate.rate;
+	if (tb[TCA_MQ_ECN_PARAMS])
+	{
+		err = dwrr_params_set(tb[TCA_MQ_ECN_PARAMS],
+				      dwrr_other_qdiscs(q));
+		if (err < 0)
+			goto done;
+	}
+
 	/* convert from bytes/s to b/s */
-	q->rate.rate_bps = (u64)rate << 3;
+	if (tb[TCA_MQ_ECN_RATE])
+		q->rate.rate_bps = nla_get_u64(tb[TCA_MQ_ECN_RATE]) << 3;
 	precompute_ratedata(&q->rate);
 	err = 0;
 
@@ -715,7 +1609,7 @@ static int dwrr_change(struct Qdisc *sch, struct nlattr *opt)
 /* Initialize Qdisc */
 static int dwrr_init(struct Qdisc *sch, struct nlattr *opt)
 {
-	int i;
+	int i, err = -ENOMEM;
 	struct dwrr_sched_data *q = qdisc_priv(sch);
 	struct Qdisc *child;
 	s64 now_ns = ktime_get_ns();
@@ -726,8 +1620,14 @@ static int dwrr_init(struct Qdisc *sch, struct nlattr *opt)
 	q->tokens = 0;
 	q->time_ns = now_ns;
 	q->sum_len_bytes = 0;
+	q->sch = sch;
+	INIT_LIST_HEAD(&q->node);
 	qdisc_watchdog_init(&q->watchdog, sch);
 
+	q->hist = alloc_percpu(struct dwrr_hist);
+	if (unlikely(!q->hist))
+		goto err;
+
 	/* Initialize per-priority variables */
 	for (i = 0; i < dwrr_max_prio; i++)
 	{
@@ -735,6 +1635,16 @@ static int dwrr_init(struct Qdisc *sch, struct nlattr *opt)
 		q->prio_len_bytes[i] = 0;
 		q->round_time[i] = 0;
 		q->last_idle_time[i] = now_ns;
+		q->round[i] = 0;
+	}
+
+	/* Initialize the configuration and the classifier */
+	q->cfg.version = 0;
+	dwrr_update_config(q);
+	for (i = 0; i < dwrr_max_keys; i++)
+	{
+		q->key_queue[i] = q->cfg.key_queue[i];
+		q->key_backlog[i] = 0;
 	}
 
 	/* Initialize per-queue variables */
@@ -752,11 +1662,19 @@ static int dwrr_init(struct Qdisc *sch, struct nlattr *opt)
 		INIT_LIST_HEAD(&(q->queues[i]).alist);
 		(q->queues[i]).id = i;
 		(q->queues[i]).len_bytes = 0;
+		(q->queues[i]).bp_bytes = 0;
 		(q->queues[i]).prio = 0;
 		(q->queues[i]).deficit = 0;
 		(q->queues[i]).start_time = now_ns;
 		(q->queues[i]).last_pkt_time = now_ns;
 		(q->queues[i]).quantum = 0;
+		(q->queues[i]).round = 0;
+		(q->queues[i]).ceil.rate.rate_bps = 0;
+		(q->queues[i]).ceil.tokens = 0;
+		(q->queues[i]).ceil.time_ns = now_ns;
+		(q->queues[i]).floor.rate.rate_bps = 0;
+		(q->queues[i]).floor.tokens = 0;
+		(q->queues[i]).floor.time_ns = now_ns;
 		(q->queues[i]).count = 0;
 		(q->queues[i]).lastcount = 0;
 		(q->queues[i]).marking = false;
@@ -764,17 +1682,32 @@ static int dwrr_init(struct Qdisc *sch, struct nlattr *opt)
 		(q->queues[i]).first_above_time = 0;
 		(q->queues[i]).mark_next = 0;
 		(q->queues[i]).ldelay = 0;
+		(q->queues[i]).dq_tstamp = now_ns;
+		(q->queues[i]).dq_count = -1;
+		(q->queues[i]).avg_dq_rate = 0;
 	}
-	return dwrr_change(sch,opt);
+
+	err = dwrr_change(sch, opt);
+	if (err)
+		goto err;
+
+	/* Size the sketches and follow later hh_width changes */
+	mutex_lock(&dwrr_qdiscs_lock);
+	err = dwrr_hh_resize(q, dwrr_hh_width);
+	if (likely(!err))
+		list_add_tail(&q->node, &dwrr_qdiscs);
+	mutex_unlock(&dwrr_qdiscs_lock);
+	if (likely(!err))
+		return 0;
 err:
 	dwrr_destroy(sch);
-	return -ENOMEM;
+	return err;
 }
 
 static struct Qdisc_ops dwrr_ops __read_mostly = {
 	.next		=	NULL,
 	.cl_ops		=	NULL,
-	.id		=	"tbf",
+	.id		=	"dwrr",
 	.priv_size	=	sizeof(struct dwrr_sched_data),
 	.init		=	dwrr_init,
 	.destroy	=	dwrr_destroy,
@@ -784,6 +1717,7 @@ static struct Qdisc_ops dwrr_ops __read_mostly = {
 	.drop		=	dwrr_drop,
 	.change		=	dwrr_change,
 	.dump		=	dwrr_dump,
+	.dump_stats	=	dwrr_dump_stats,
 	.owner 		= 	THIS_MODULE,
 };
 
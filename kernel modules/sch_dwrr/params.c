@@ -1,6 +1,8 @@
 #include "params.h"
 #include <linux/sysctl.h>
 #include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
 
 
 /* Enable debug mode or not. By default, we disable debug mode. */
@@ -35,6 +37,26 @@ int dwrr_tcn_thresh = 250;
 int dwrr_codel_target = 100;
 /* CoDel interval (1024 nanoseconds) */
 int dwrr_codel_interval = 2000;
+/* By default, we disable per-queue sojourn time histograms */
+int dwrr_enable_hist = dwrr_disable;
+/* By default, we classify packets by DSCP */
+int dwrr_classify_key = dwrr_classify_dscp;
+/* By default, we keep GSO packets and account their segments on the wire */
+int dwrr_enable_gso_segment = dwrr_disable;
+/* By default, we disable heavy hitter detection */
+int dwrr_hh_width = 0;
+/* A flow sending at least 10% of the bytes of its queue is a heavy hitter */
+int dwrr_hh_share = 10;
+/* Packets of other flows are only marked above twice the ECN threshold */
+int dwrr_hh_mark_factor = 2;
+/* Heavy hitter counters decay by half every 8 rounds */
+int dwrr_hh_half_life = 8;
+/* Measure the departure rate every 10KB, like PIE */
+int dwrr_dq_thresh_bytes = 10000;
+/* Alpha for departure rate estimation. It is 0.875 by default. */
+int dwrr_dq_rate_alpha = MQ_ECN_DQ_RATE_ALPHA;
+/* By default, we drop packets of local senders when the buffer is full */
+int dwrr_enable_backpressure = dwrr_disable;
 
 int dwrr_enable_min = dwrr_disable;
 int dwrr_enable_max = dwrr_enable;
@@ -43,13 +65,29 @@ int dwrr_prio_max = dwrr_max_prio - 1;
 int dwrr_buffer_mode_min = dwrr_shared_buffer;
 int dwrr_buffer_mode_max = dwrr_static_buffer;
 int dwrr_ecn_scheme_min = dwrr_disable_ecn;
-int dwrr_ecn_scheme_max = dwrr_codel;
+int dwrr_ecn_scheme_max = dwrr_mq_tcn;
 int dwrr_round_alpha_min = 0;
 int dwrr_round_alpha_max = 1 << dwrr_round_shift;
+int dwrr_classify_key_min = dwrr_classify_dscp;
+int dwrr_classify_key_max = dwrr_classify_pcp;
 int dwrr_dscp_min = 0;
 int dwrr_dscp_max = (1 << 6) - 1;
 int dwrr_quantum_min = dwrr_max_pkt_bytes;
 int dwrr_quantum_max = 200 << 10;
+int dwrr_rate_min = 0;
+int dwrr_rate_max = 1000000;
+int dwrr_hh_width_min = 0;
+int dwrr_hh_width_max = dwrr_hh_max_width;
+int dwrr_hh_share_min = 1;
+int dwrr_hh_share_max = 100;
+int dwrr_hh_mark_factor_min = 1;
+int dwrr_hh_mark_factor_max = 64;
+int dwrr_hh_half_life_min = 1;
+int dwrr_hh_half_life_max = 1024;
+int dwrr_dq_thresh_bytes_min = dwrr_max_pkt_bytes;
+int dwrr_dq_thresh_bytes_max = dwrr_max_buffer_bytes;
+int dwrr_dq_rate_alpha_min = 0;
+int dwrr_dq_rate_alpha_max = MQ_ECN_DQ_RATE_ALPHA_MAX;
 
 /* Per queue ECN marking threshold (bytes) */
 int dwrr_queue_thresh_bytes[dwrr_max_queues];
@@ -61,6 +99,10 @@ int dwrr_queue_quantum[dwrr_max_queues];
 int dwrr_queue_buffer_bytes[dwrr_max_queues];
 /* Per queue priority (0 to dwrr_max_prio - 1) */
 int dwrr_queue_prio[dwrr_max_queues];
+/* Per queue ceiling rate (Mbps). 0 means no ceiling */
+int dwrr_queue_ceil_rate[dwrr_max_queues];
+/* Per queue floor (minimum guaranteed) rate (Mbps). 0 means no guarantee */
+int dwrr_queue_floor_rate[dwrr_max_queues];
 
 
 /* All parameters that can be configured through sysctl */
@@ -80,6 +122,16 @@ struct dwrr_param dwrr_params[dwrr_total_params + 1] =
 	{"tcn_thresh",		&dwrr_tcn_thresh},
 	{"codel_target",	&dwrr_codel_target},
 	{"codel_interval",	&dwrr_codel_interval},
+	{"enable_hist",		&dwrr_enable_hist},
+	{"classify_key",	&dwrr_classify_key},
+	{"enable_gso_segment",	&dwrr_enable_gso_segment},
+	{"hh_width",		&dwrr_hh_width},
+	{"hh_share",		&dwrr_hh_share},
+	{"hh_mark_factor",	&dwrr_hh_mark_factor},
+	{"hh_half_life",	&dwrr_hh_half_life},
+	{"dq_thresh",		&dwrr_dq_thresh_bytes},
+	{"dq_rate_alpha",	&dwrr_dq_rate_alpha},
+	{"enable_backpressure",	&dwrr_enable_backpressure},
 };
 
 struct ctl_table dwrr_params_table[dwrr_total_params + 1];
@@ -92,6 +144,72 @@ struct ctl_path dwrr_params_path[] =
 
 struct ctl_table_header *dwrr_sysctl = NULL;
 
+/* Current configuration snapshot, replaced under dwrr_config_lock */
+struct dwrr_config_rcu __rcu *dwrr_config = NULL;
+static DEFINE_MUTEX(dwrr_config_lock);
+
+/*
+ * Publish a new snapshot of the per-queue DSCP, quantum and priority, and of
+ * the queues with floor rates
+ */
+static int dwrr_config_publish(void)
+{
+	struct dwrr_config_rcu *new, *old;
+	int i;
+
+	new = kzalloc(sizeof(*new), GFP_KERNEL);
+	if (unlikely(!new))
+		return -ENOMEM;
+
+	mutex_lock(&dwrr_config_lock);
+	old = rcu_dereference_protected(dwrr_config,
+					lockdep_is_held(&dwrr_config_lock));
+	new->cfg.version = old ? old->cfg.version + 1 : 1;
+
+	/* The first queue with a matching key wins, queue 0 by default */
+	for (i = dwrr_max_queues - 1; i >= 0; i--)
+	{
+		new->cfg.key_queue[dwrr_queue_dscp[i]] = i;
+		new->cfg.queue_quantum[i] = dwrr_queue_quantum[i];
+		new->cfg.queue_prio[i] = dwrr_queue_prio[i];
+		if (dwrr_queue_floor_rate[i] > 0)
+			new->cfg.floor_queues |= 1U << i;
+	}
+
+	rcu_assign_pointer(dwrr_config, new);
+	mutex_unlock(&dwrr_config_lock);
+
+	if (old)
+		kfree_rcu(old, rcu);
+	return 0;
+}
+
+/* sysctl handler of the per-queue DSCP, quantum, priority and floor rate */
+static int dwrr_proc_config(struct ctl_table *table, int write,
+			    void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+	int ret = proc_dointvec_minmax(table, write, buffer, lenp, ppos);
+
+	if (write && ret == 0)
+		ret = dwrr_config_publish();
+	return ret;
+}
+
+/* sysctl handler of hh_width: resize the sketches before it takes effect */
+static int dwrr_proc_hh_width(struct ctl_table *table, int write,
+			      void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+	struct ctl_table tmp = *table;
+	int width = dwrr_hh_width;
+	int ret;
+
+	tmp.data = &width;
+	ret = proc_dointvec_minmax(&tmp, write, buffer, lenp, ppos);
+	if (write && ret == 0)
+		ret = dwrr_hh_set_width(width);
+	return ret;
+}
+
 bool dwrr_params_init(void)
 {
 	int i, index;
@@ -128,6 +246,18 @@ bool dwrr_params_init(void)
 		snprintf(dwrr_params[index].name, 63, "queue_prio_%d", i);
 		dwrr_params[index].ptr = &dwrr_queue_prio[i];
 		dwrr_queue_prio[i] = 0;
+
+		/* Per-queue ceiling rate */
+		index = dwrr_global_params + i + 5 * dwrr_max_queues;
+		snprintf(dwrr_params[index].name, 63, "queue_ceil_rate_%d", i);
+		dwrr_params[index].ptr = &dwrr_queue_ceil_rate[i];
+		dwrr_queue_ceil_rate[i] = 0;
+
+		/* Per-queue floor rate */
+		index = dwrr_global_params + i + 6 * dwrr_max_queues;
+		snprintf(dwrr_params[index].name, 63, "queue_floor_rate_%d", i);
+		dwrr_params[index].ptr = &dwrr_queue_floor_rate[i];
+		dwrr_queue_floor_rate[i] = 0;
 	}
 
 	/* End of the parameters */
@@ -142,8 +272,11 @@ bool dwrr_params_init(void)
 		entry->data = dwrr_params[i].ptr;
 		entry->mode = 0644;
 
-		/* enable_debug, enable_wrr and enable_dequeue_ecn */
-		if (i == 0 || i == 8 || i == 9)
+		/*
+		 * enable_debug, enable_wrr, enable_dequeue_ecn, enable_hist,
+		 * enable_gso_segment and enable_backpressure
+		 */
+		if (i == 0 || i == 8 || i == 9 || i == 13 || i == 15 || i == 22)
 		{
 			entry->proc_handler = &proc_dointvec_minmax;
 			entry->extra1 = &dwrr_enable_min;
@@ -170,11 +303,60 @@ bool dwrr_params_init(void)
 			entry->extra1 = &dwrr_round_alpha_min;
 			entry->extra2 = &dwrr_round_alpha_max;
 		}
+		/* classify_key */
+		else if (i == 14)
+		{
+			entry->proc_handler = &proc_dointvec_minmax;
+			entry->extra1 = &dwrr_classify_key_min;
+			entry->extra2 = &dwrr_classify_key_max;
+		}
+		/* hh_width */
+		else if (i == 16)
+		{
+			entry->proc_handler = &dwrr_proc_hh_width;
+			entry->extra1 = &dwrr_hh_width_min;
+			entry->extra2 = &dwrr_hh_width_max;
+		}
+		/* hh_share */
+		else if (i == 17)
+		{
+			entry->proc_handler = &proc_dointvec_minmax;
+			entry->extra1 = &dwrr_hh_share_min;
+			entry->extra2 = &dwrr_hh_share_max;
+		}
+		/* hh_mark_factor */
+		else if (i == 18)
+		{
+			entry->proc_handler = &proc_dointvec_minmax;
+			entry->extra1 = &dwrr_hh_mark_factor_min;
+			entry->extra2 = &dwrr_hh_mark_factor_max;
+		}
+		/* hh_half_life */
+		else if (i == 19)
+		{
+			entry->proc_handler = &proc_dointvec_minmax;
+			entry->extra1 = &dwrr_hh_half_life_min;
+			entry->extra2 = &dwrr_hh_half_life_max;
+		}
+		/* dq_thresh */
+		else if (i == 20)
+		{
+			entry->proc_handler = &proc_dointvec_minmax;
+			entry->extra1 = &dwrr_dq_thresh_bytes_min;
+			entry->extra2 = &dwrr_dq_thresh_bytes_max;
+		}
+		/* dq_rate_alpha */
+		else if (i == 21)
+		{
+			entry->proc_handler = &proc_dointvec_minmax;
+			entry->extra1 = &dwrr_dq_rate_alpha_min;
+			entry->extra2 = &dwrr_dq_rate_alpha_max;
+		}
 		/* Per-queue DSCP */
 		else if (i >= dwrr_global_params + dwrr_max_queues &&
 			 i < dwrr_global_params + 2 * dwrr_max_queues)
 		{
-			entry->proc_handler = &proc_dointvec_minmax;
+			entry->proc_handler = &dwrr_proc_config;
 			entry->extra1 = &dwrr_dscp_min;
 			entry->extra2 = &dwrr_dscp_max;
 		}
@@ -182,17 +364,33 @@ bool dwrr_params_init(void)
 		else if (i >= dwrr_global_params + 2 * dwrr_max_queues &&
 			 i < dwrr_global_params + 3 * dwrr_max_queues)
 		{
-			entry->proc_handler = &proc_dointvec_minmax;
+			entry->proc_handler = &dwrr_proc_config;
 			entry->extra1 = &dwrr_quantum_min;
 			entry->extra2 = &dwrr_quantum_max;
 		}
 		/* Per-queue priority */
-		else if (i >= dwrr_global_params + 4 * dwrr_max_queues)
+		else if (i >= dwrr_global_params + 4 * dwrr_max_queues &&
+			 i < dwrr_global_params + 5 * dwrr_max_queues)
 		{
-			entry->proc_handler = &proc_dointvec_minmax;
+			entry->proc_handler = &dwrr_proc_config;
 			entry->extra1 = &dwrr_prio_min;
 			entry->extra2 = &dwrr_prio_max;
 		}
+		/* Per-queue ceiling rate */
+		else if (i >= dwrr_global_params + 5 * dwrr_max_queues &&
+			 i < dwrr_global_params + 6 * dwrr_max_queues)
+		{
+			entry->proc_handler = &proc_dointvec_minmax;
+			entry->extra1 = &dwrr_rate_min;
+			entry->extra2 = &dwrr_rate_max;
+		}
+		/* Per-queue floor rate */
+		else if (i >= dwrr_global_params + 6 * dwrr_max_queues)
+		{
+			entry->proc_handler = &dwrr_proc_config;
+			entry->extra1 = &dwrr_rate_min;
+			entry->extra2 = &dwrr_rate_max;
+		}
 		else
 		{
 			entry->proc_handler = &proc_dointvec;
@@ -200,6 +398,9 @@ bool dwrr_params_init(void)
 		entry->maxlen=sizeof(int);
 	}
 
+	if (dwrr_config_publish() < 0)
+		return false;
+
 	dwrr_sysctl = register_sysctl_paths(dwrr_params_path,
 					    dwrr_params_table);
 
@@ -214,4 +415,105 @@ void dwrr_params_exit()
 {
 	if (likely(dwrr_sysctl))
 		unregister_sysctl_table(dwrr_sysctl);
+
+	/* All qdiscs are gone, so nobody reads the snapshot any more */
+	kfree(rcu_dereference_protected(dwrr_config, 1));
+	dwrr_config = NULL;
+}
+
+/* Look up a parameter and check the value against the range of its sysctl */
+static int dwrr_param_find(const struct tc_mq_ecn_param *p)
+{
+	struct ctl_table *entry;
+	int i;
+
+	if (strnlen(p->name, TC_MQ_ECN_NAMSIZ) == TC_MQ_ECN_NAMSIZ)
+		return -EINVAL;
+
+	for (i = 0; dwrr_params_table[i].procname; i++)
+	{
+		entry = &dwrr_params_table[i];
+		if (strcmp(entry->procname, p->name))
+			continue;
+
+		if (entry->extra1 && p->value < *(int *)entry->extra1)
+			return -EINVAL;
+		if (entry->extra2 && p->value > *(int *)entry->extra2)
+			return -EINVAL;
+		return i;
+	}
+
+	return -EINVAL;
+}
+
+int dwrr_params_set(const struct nlattr *nla, bool shared)
+{
+	const struct nlattr *attr;
+	const struct tc_mq_ecn_param *p;
+	int hh_width = dwrr_hh_width;
+	int rem, i, err;
+
+	/* Validate every parameter before changing any */
+	nla_for_each_nested(attr, nla, rem)
+	{
+		if (nla_type(attr) != TCA_MQ_ECN_PARAM ||
+		    nla_len(attr) < (int)sizeof(*p))
+			return -EINVAL;
+
+		p = nla_data(attr);
+		i = dwrr_param_find(p);
+		if (i < 0)
+			return -EINVAL;
+		/* Do not reconfigure the other qdiscs behind their back */
+		if (shared && p->value != *(dwrr_params[i].ptr))
+		{
+			printk(KERN_INFO "sch_dwrr: %s is shared by all dwrr "
+			       "qdiscs, set it in /proc/sys/dwrr\n", p->name);
+			return -EBUSY;
+		}
+		if (dwrr_params[i].ptr == &dwrr_hh_width)
+			hh_width = p->value;
+	}
+
+	/* Resizing the sketches can fail, so do it first */
+	if (hh_width != dwrr_hh_width)
+	{
+		err = dwrr_hh_set_width(hh_width);
+		if (err < 0)
+			return err;
+	}
+
+	nla_for_each_nested(attr, nla, rem)
+	{
+		p = nla_data(attr);
+		i = dwrr_param_find(p);
+		if (dwrr_params[i].ptr != &dwrr_hh_width)
+			*(dwrr_params[i].ptr) = p->value;
+	}
+
+	return dwrr_config_publish();
+}
+
+int dwrr_params_dump(struct sk_buff *skb)
+{
+	struct nlattr *nest = nla_nest_start(skb, TCA_MQ_ECN_PARAMS);
+	struct tc_mq_ecn_param p;
+	int i;
+
+	if (!nest)
+		return -EMSGSIZE;
+
+	for (i = 0; dwrr_params[i].ptr; i++)
+	{
+		memset(&p, 0, sizeof(p));
+		strlcpy(p.name, dwrr_params[i].name, sizeof(p.name));
+		p.value = *(dwrr_params[i].ptr);
+		if (nla_put(skb, TCA_MQ_ECN_PARAM, sizeof(p), &p))
+		{
+			nla_nest_cancel(skb, nest);
+			return -EMSGSIZE;
+		}
+	}
+
+	return nla_nest_end(skb, nest);
 }
@@ -2,6 +2,11 @@
 #define __PARAMS_H__
 
 #include <linux/types.h>
+#include <net/netlink.h>
+#include <linux/rcupdate.h>
+
+#include "../include/pkt_sched_mq_ecn.h"
+#include "../include/mq_ecn_dq_rate.h"
 
 /*
  * CoDel uses a 1024 nsec clock, encoded in u32
@@ -44,6 +49,8 @@ typedef s32 codel_tdiff_t;
 #define dwrr_min_pkt_bytes 64
 /* Maximum (per queue/per port shared) buffer size (2MB) */
 #define dwrr_max_buffer_bytes 2000000
+/* Bytes a queue may hold over its buffer limit to throttle local TCP senders */
+#define dwrr_bp_headroom_bytes (dwrr_max_buffer_bytes / dwrr_max_queues)
 /* Per port shared buffer management policy */
 #define	dwrr_shared_buffer 0
 /* Per port static buffer management policy */
@@ -61,6 +68,10 @@ typedef s32 codel_tdiff_t;
 #define dwrr_tcn 4
 /* CoDel */
 #define dwrr_codel 5
+/* PIE-like marking on the measured departure rate of each queue */
+#define dwrr_pie 6
+/* TCN with the threshold scaled by the service share of each queue */
+#define dwrr_mq_tcn 7
 
 #define dwrr_max_iteration 10
 
@@ -68,14 +79,35 @@ typedef s32 codel_tdiff_t;
 #define dwrr_round_shift 10
 /* For CoDel timestamp */
 #define dwrr_codel_shift 10
+/* For departure rate estimation Alpha parameter: dwrr_dq_rate_alpha */
+#define dwrr_dq_rate_shift MQ_ECN_DQ_RATE_SHIFT
+
+/* Sojourn time histogram: log2 buckets in units of (1 << dwrr_hist_shift) ns */
+#define dwrr_hist_buckets 16
+#define dwrr_hist_shift 10
+
+/* Rows of the per-queue count-min sketch of heavy hitter flows */
+#define dwrr_hh_rows 2
+/* Maximum number of counters in each row of the sketch */
+#define dwrr_hh_max_width 4096
+
+/* Classifier keys (DSCP or VLAN PCP) are below this value */
+#define dwrr_max_keys 64
+/* A packet without a classifier key */
+#define dwrr_no_key 0xff
+
+/* Classify packets by DSCP (IPv4 TOS or IPv6 traffic class) */
+#define dwrr_classify_dscp 0
+/* Classify packets by VLAN priority code point (PCP) */
+#define dwrr_classify_pcp 1
 
 #define dwrr_disable 0
 #define dwrr_enable 1
 
 /* The number of global (rather than 'per-queue') parameters */
-#define dwrr_global_params 13
+#define dwrr_global_params 23
 /* The number of parameters for each queue */
-#define dwrr_queue_params 5
+#define dwrr_queue_params 7
 /* The total number of parameters (per-queue and global parameters) */
 #define dwrr_total_params (dwrr_global_params + dwrr_queue_params * \
 	                   dwrr_max_queues)
@@ -101,12 +133,32 @@ extern int dwrr_idle_interval_ns;
 extern int dwrr_enable_wrr;
 /* Enable dequeue ECN marking or not */
 extern int dwrr_enable_dequeue_ecn;
-/* TCN threshold (1024 nanoseconds) */
+/* TCN (and MQ-TCN base) threshold (1024 nanoseconds) */
 extern int dwrr_tcn_thresh;
 /* CoDel target (1024 nanoseconds) */
 extern int dwrr_codel_target;
 /* CoDel interval (1024 nanoseconds) */
 extern int dwrr_codel_interval;
+/* Enable per-queue sojourn time histograms or not */
+extern int dwrr_enable_hist;
+/* Classifier key: DSCP (0) or VLAN PCP (1) */
+extern int dwrr_classify_key;
+/* Segment GSO packets at enqueue or not */
+extern int dwrr_enable_gso_segment;
+/* Counters per sketch row for heavy hitter detection. 0 disables it */
+extern int dwrr_hh_width;
+/* Share (%) of the bytes of a queue that makes a flow a heavy hitter */
+extern int dwrr_hh_share;
+/* Other flows of a queue are marked above this many times its threshold */
+extern int dwrr_hh_mark_factor;
+/* DWRR rounds for heavy hitter counters to decay by half */
+extern int dwrr_hh_half_life;
+/* Bytes dequeued in each departure rate measurement */
+extern int dwrr_dq_thresh_bytes;
+/* Alpha for departure rate estimation */
+extern int dwrr_dq_rate_alpha;
+/* Throttle local senders (NET_XMIT_CN) instead of dropping or not */
+extern int dwrr_enable_backpressure;
 
 /* Per-queue parameters */
 /* Per queue ECN marking threshold (bytes) */
@@ -119,6 +171,46 @@ extern int dwrr_queue_quantum[dwrr_max_queues];
 extern int dwrr_queue_buffer_bytes[dwrr_max_queues];
 /* Per queue priority (0 to dwrr_max_prio - 1) */
 extern int dwrr_queue_prio[dwrr_max_queues];
+/* Per queue ceiling rate (Mbps). 0 means no ceiling */
+extern int dwrr_queue_ceil_rate[dwrr_max_queues];
+/* Per queue floor (minimum guaranteed) rate (Mbps). 0 means no guarantee */
+extern int dwrr_queue_floor_rate[dwrr_max_queues];
+
+/*
+ * Per-queue sojourn time histograms exported through the qdisc statistics
+ * dump (TCA_STATS_APP). Bucket 0 counts packets that stayed less than
+ * (1 << dwrr_hist_shift) ns and bucket i (i > 0) counts packets that stayed
+ * in [2^(i - 1), 2^i) of that unit. The last bucket also absorbs all larger
+ * sojourn times.
+ */
+struct tc_dwrr_xstats
+{
+	__u64 sojourn_hist[dwrr_max_queues][dwrr_hist_buckets];
+};
+
+/*
+ * A consistent snapshot of the parameters that define the scheduling
+ * classes. A sysctl or netlink write publishes a new snapshot under RCU and
+ * each qdisc picks it up at its next enqueue or dequeue: new quanta take
+ * effect at DWRR round boundaries and a classifier key only moves to its new
+ * queue once its packets in the old queue have drained.
+ */
+struct dwrr_config
+{
+	u32	version;
+	u8	key_queue[dwrr_max_keys];
+	u32	queue_quantum[dwrr_max_queues];
+	u8	queue_prio[dwrr_max_queues];
+	u32	floor_queues;	/* bit i is set if queue i has a floor rate */
+};
+
+struct dwrr_config_rcu
+{
+	struct dwrr_config	cfg;
+	struct rcu_head		rcu;
+};
+
+extern struct dwrr_config_rcu __rcu *dwrr_config;
 
 struct dwrr_param
 {
@@ -132,5 +224,15 @@ extern struct dwrr_param dwrr_params[dwrr_total_params + 1];
 bool dwrr_params_init(void);
 /* Unregister sysctl */
 void dwrr_params_exit(void);
+/*
+ * Apply nested TCA_MQ_ECN_PARAM attributes, all or nothing. The parameters
+ * are module-wide: if shared (other qdiscs of the module exist), a value
+ * that differs from the current one fails with -EBUSY.
+ */
+int dwrr_params_set(const struct nlattr *nla, bool shared);
+/* Put every parameter in a TCA_MQ_ECN_PARAMS attribute */
+int dwrr_params_dump(struct sk_buff *skb);
+/* Change hh_width and resize the sketches of all qdiscs (main.c) */
+int dwrr_hh_set_width(int width);
 
 #endif
@@ -6,6 +6,8 @@
 #include <net/sch_generic.h>
 #include <net/pkt_sched.h>
 #include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/if_vlan.h>
 #include <net/dsfield.h>
 #include <net/inet_ecn.h>
 
@@ -18,16 +20,24 @@ struct prio_rate_cfg
 	u32 shift;
 };
 
+/* A priority queue */
+struct prio_class
+{
+	struct sk_buff_head skbs;	/* FIFO of packets */
+	u32 len_bytes;	/* Queue length in bytes */
+	struct mq_ecn_dq_rate dq_rate;	/* Departure rate */
+};
+
 struct prio_sched_data
 {
 /* Parameters */
-	struct Qdisc **queues; /* Priority queues where queues[0] has the highest priority*/
+	struct prio_class queues[PRIO_QDISC_MAX_QUEUES];	/* Priority queues where queues[0] has the highest priority*/
 	struct prio_rate_cfg rate;
 
 /* Variables */
 	s64 tokens;	/* Tokens in nanoseconds */
 	u32 sum_len_bytes;	/* The sum of queue length in bytes */
-	u32 *queue_len_bytes;	/* per-queue length in bytes */
+	unsigned long active;	/* Bit i is set if queues[i] is not empty */
 
 	s64	time_ns;	/* Time check-point */
 	struct Qdisc *sch;
@@ -64,92 +74,141 @@ static inline u64 l2t_ns(struct prio_rate_cfg *r, unsigned int len_bytes)
 	return ((u64)len_bytes * r->mult) >> r->shift;
 }
 
+/*
+ * Enqueue timestamp for dequeue latency-based ECN marking. It is kept in the
+ * private area of qdisc_skb_cb rather than skb->tstamp, which may carry the
+ * departure time set by the sender.
+ */
+struct prio_qdisc_skb_cb
+{
+	u64 enqueue_time_ns;	//enqueue time stamp (0 if not recorded)
+};
+
+static inline struct prio_qdisc_skb_cb *prio_qdisc_skb_cb(const struct sk_buff *skb)
+{
+	qdisc_cb_private_validate(skb, sizeof(struct prio_qdisc_skb_cb));
+	return (struct prio_qdisc_skb_cb *)qdisc_skb_cb(skb)->data;
+}
+
 /* ECN marking */
 static inline void prio_qdisc_ecn(struct sk_buff *skb)
 {
-	if (skb_make_writable(skb, sizeof(struct iphdr))&&ip_hdr(skb))
-		IP_ECN_set_ce(ip_hdr(skb));
+	unsigned int len;
+
+	if (skb->protocol == htons(ETH_P_IP))
+		len = sizeof(struct iphdr);
+	else if (skb->protocol == htons(ETH_P_IPV6))
+		len = sizeof(struct ipv6hdr);
+	else
+		return;
+
+	if (skb_make_writable(skb, skb_network_offset(skb) + len))
+		INET_ECN_set_ce(skb);
+}
+
+/*
+ * Measure the departure rate of a queue. qlen is the queue length before
+ * this packet of len bytes leaves at time now.
+ */
+static void prio_qdisc_dq_rate_update(struct mq_ecn_dq_rate *r, struct prio_rate_cfg *rate, u32 qlen, unsigned int len, s64 now)
+{
+	if (mq_ecn_dq_rate_update(r, qlen, len, now, (s64)l2t_ns(rate, len), PRIO_QDISC_DQ_THRESH_BYTES, PRIO_QDISC_DQ_RATE_ALPHA) && PRIO_QDISC_DEBUG_MODE)
+		printk(KERN_INFO "average departure rate %llu\n", r->avg_bps);
+}
+
+/* PIE-like ECN marking threshold: port threshold * departure rate / link rate */
+static u64 prio_qdisc_pie_thresh(struct mq_ecn_dq_rate *r, struct prio_rate_cfg *rate)
+{
+	if (r->avg_bps == 0 || rate->rate_bps == 0)
+		return PRIO_QDISC_PORT_THRESH_BYTES;
+
+	return div64_u64(min_t(u64, r->avg_bps, rate->rate_bps) * PRIO_QDISC_PORT_THRESH_BYTES, rate->rate_bps);
+}
+
+/* Return the classifier key (DSCP or VLAN PCP) of a packet, or -1 if none */
+static int prio_qdisc_classify_field(struct sk_buff *skb)
+{
+	u16 vlan_tci;
+
+	if (PRIO_QDISC_CLASSIFY_KEY == PRIO_QDISC_CLASSIFY_PCP)
+	{
+		if (vlan_get_tag(skb, &vlan_tci) < 0)
+			return -1;
+		return (vlan_tci & VLAN_PRIO_MASK) >> VLAN_PRIO_SHIFT;
+	}
+
+	switch (tc_skb_protocol(skb))
+	{
+	case htons(ETH_P_IP):
+		if (!pskb_network_may_pull(skb, sizeof(struct iphdr)))
+			return -1;
+		return ipv4_get_dsfield(ip_hdr(skb)) >> 2;
+	case htons(ETH_P_IPV6):
+		if (!pskb_network_may_pull(skb, sizeof(struct ipv6hdr)))
+			return -1;
+		return ipv6_get_dsfield(ipv6_hdr(skb)) >> 2;
+	default:
+		return -1;
+	}
 }
 
 /* Classify packets and return queue ID */
 static int prio_qdisc_classify(struct sk_buff *skb, struct Qdisc *sch)
 {
 	int i = 0;
-	struct prio_sched_data *q = qdisc_priv(sch);
-	struct iphdr* iph = ip_hdr(skb);
-	int dscp;
+	int key = prio_qdisc_classify_field(skb);
 
 	/* Return queue[0] by default*/
-	if (unlikely(!iph || !(q->queues)))
+	if (unlikely(key < 0))
 		return 0;
 
-	dscp = (const int)(iph->tos >> 2);
-
 	for (i = 0; i < PRIO_QDISC_MAX_QUEUES; i++)
 	{
-		if(dscp == PRIO_QDISC_QUEUE_DSCP[i])
+		if(key == PRIO_QDISC_QUEUE_DSCP[i])
 			return i;
 	}
 
 	return 0;
 }
 
-static struct sk_buff* prio_qdisc_dequeue_peeked(struct Qdisc *sch)
+/* The highest priority non-empty queue, or NULL if all queues are empty */
+static inline struct prio_class* prio_qdisc_head_class(struct prio_sched_data *q)
 {
-	struct prio_sched_data *q = qdisc_priv(sch);
-	struct Qdisc *qdisc;
-	struct sk_buff *skb;
-	int i;
-
-	for (i = 0; i < PRIO_QDISC_MAX_QUEUES && q->queues[i]; i++)
-	{
-		qdisc = q->queues[i];
-		skb = qdisc_dequeue_peeked(qdisc);
-		if (skb)
-		{
-			q->queue_len_bytes[i] -= skb_size(skb);	//update per-queue buffer occupancy
-			return skb;
-		}
-	}
-	return NULL;
+	if (!q->active)
+		return NULL;
+	return &q->queues[__ffs(q->active)];
 }
 
 static struct sk_buff* prio_qdisc_peek(struct Qdisc *sch)
 {
-	struct prio_sched_data *q = qdisc_priv(sch);
-	struct Qdisc *qdisc;
-	struct sk_buff *skb;
-	int i;
+	struct prio_class *cl = prio_qdisc_head_class(qdisc_priv(sch));
 
-	for (i = 0; i < PRIO_QDISC_MAX_QUEUES && q->queues[i]; i++)
-	{
-		qdisc = q->queues[i];
-		skb = qdisc->ops->peek(qdisc);
-		if (skb)
-			return skb;
-	}
-	return NULL;
+	return cl ? skb_peek(&cl->skbs) : NULL;
 }
 
 static struct sk_buff* prio_qdisc_dequeue(struct Qdisc *sch)
 {
 	struct prio_sched_data *q = qdisc_priv(sch);
+	struct prio_class *cl = prio_qdisc_head_class(q);
 	struct sk_buff *skb = NULL;
 
-	skb = prio_qdisc_peek(sch);
-	if(skb)
+	if (cl)
 	{
 		s64 now = ktime_get_ns();
 		s64 toks = min_t(s64, now - q->time_ns, PRIO_QDISC_BUCKET_NS) + q->tokens;
-		unsigned int len = skb_size(skb);
+		unsigned int len = skb_size(skb_peek(&cl->skbs));
 		toks -= (s64)l2t_ns(&q->rate, len);
 
 		//If we have enough tokens to release this packet
 		if (toks >= 0)
 		{
-			skb = prio_qdisc_dequeue_peeked(sch);
-			if (unlikely(!skb))
-				return NULL;
+			if (PRIO_QDISC_ECN_SCHEME == PRIO_QDISC_PIE_ECN)
+				prio_qdisc_dq_rate_update(&cl->dq_rate, &q->rate, cl->len_bytes, len, now);
+
+			skb = __skb_dequeue(&cl->skbs);
+			cl->len_bytes -= len;	//update per-queue buffer occupancy
+			if (skb_queue_empty(&cl->skbs))
+				q->active &= ~(1UL << (cl - q->queues));
 
 			q->time_ns = now;
 			q->sum_len_bytes -= len;
@@ -160,9 +219,9 @@ static struct sk_buff* prio_qdisc_dequeue(struct Qdisc *sch)
 			if (q->tokens > PRIO_QDISC_BUCKET_NS)
 				q->tokens = PRIO_QDISC_BUCKET_NS;
 
-			if (PRIO_QDISC_ECN_SCHEME == PRIO_QDISC_DEQUE_ECN && skb->tstamp.tv64 > 0)
+			if (PRIO_QDISC_ECN_SCHEME == PRIO_QDISC_DEQUE_ECN && prio_qdisc_skb_cb(skb)->enqueue_time_ns > 0)
 			{
-				s64 sojourn_ns = now - skb->tstamp.tv64;
+				s64 sojourn_ns = now - prio_qdisc_skb_cb(skb)->enqueue_time_ns;
 				s64 thresh_ns = (s64)l2t_ns(&q->rate, PRIO_QDISC_PORT_THRESH_BYTES);
 
 				if (sojourn_ns > thresh_ns)
@@ -191,17 +250,18 @@ static struct sk_buff* prio_qdisc_dequeue(struct Qdisc *sch)
 
 static int prio_qdisc_enqueue(struct sk_buff *skb, struct Qdisc *sch)
 {
-	struct Qdisc *qdisc;
 	unsigned int len = skb_size(skb);
-	int ret;
 	struct prio_sched_data *q = qdisc_priv(sch);
 	int id = prio_qdisc_classify(skb, sch);
+	struct prio_class *cl = &q->queues[id];
 
-	qdisc = q->queues[id];
-	/* No appropriate queue or per port shared buffer is overfilled or per queue static buffer is overfilled */
-	if (!qdisc
+	/* No enqueue time stamp unless dequeue latency-based ECN marking needs it */
+	prio_qdisc_skb_cb(skb)->enqueue_time_ns = 0;
+
+	/* The queue is full or per port shared buffer is overfilled or per queue static buffer is overfilled */
+	if (cl->len_bytes + len > PRIO_QDISC_MAX_BUFFER_BYTES
 	|| (PRIO_QDISC_BUFFER_MODE == PRIO_QDISC_SHARED_BUFFER && q->sum_len_bytes + len > PRIO_QDISC_SHARED_BUFFER_BYTES)
-	|| (PRIO_QDISC_BUFFER_MODE == PRIO_QDISC_STATIC_BUFFER && q->queue_len_bytes[id] + len > PRIO_QDISC_QUEUE_BUFFER_BYTES[id]))
+	|| (PRIO_QDISC_BUFFER_MODE == PRIO_QDISC_STATIC_BUFFER && cl->len_bytes + len > PRIO_QDISC_QUEUE_BUFFER_BYTES[id]))
 	{
 		//printk(KERN_INFO "sch_prio: packet drop\n");
 		qdisc_qstats_drop(sch);
@@ -211,29 +271,25 @@ static int prio_qdisc_enqueue(struct sk_buff *skb, struct Qdisc *sch)
 
 	/* ECN marking here */
 	/* Per-queue ECN marking */
-	if (PRIO_QDISC_ECN_SCHEME == PRIO_QDISC_QUEUE_ECN && q->queue_len_bytes[id] + len > PRIO_QDISC_QUEUE_THRESH_BYTES[id])
+	if (PRIO_QDISC_ECN_SCHEME == PRIO_QDISC_QUEUE_ECN && cl->len_bytes + len > PRIO_QDISC_QUEUE_THRESH_BYTES[id])
 		prio_qdisc_ecn(skb);
 	/* Per-port ECN marking */
 	else if (PRIO_QDISC_ECN_SCHEME == PRIO_QDISC_PORT_ECN && q->sum_len_bytes + len > PRIO_QDISC_PORT_THRESH_BYTES)
 		prio_qdisc_ecn(skb);
 	/* Dequeue latency-based ECN marking */
 	else if (PRIO_QDISC_ECN_SCHEME == PRIO_QDISC_DEQUE_ECN)
-		skb->tstamp = ktime_get();
+		prio_qdisc_skb_cb(skb)->enqueue_time_ns = ktime_get_ns();
+	/* PIE-like ECN marking */
+	else if (PRIO_QDISC_ECN_SCHEME == PRIO_QDISC_PIE_ECN && cl->len_bytes + len > prio_qdisc_pie_thresh(&cl->dq_rate, &q->rate))
+		prio_qdisc_ecn(skb);
 
-	ret = qdisc_enqueue(skb, qdisc);
-	if (ret == NET_XMIT_SUCCESS)
-	{
-		sch->q.qlen++;
-		q->sum_len_bytes += len;
-		q->queue_len_bytes[id] += len;
-	}
-	else if (net_xmit_drop_count(ret))
-	{
-		qdisc_qstats_drop(sch);
-		qdisc_qstats_drop(qdisc);
-	}
+	__skb_queue_tail(&cl->skbs, skb);
+	q->active |= 1UL << id;
+	sch->q.qlen++;
+	q->sum_len_bytes += len;
+	cl->len_bytes += len;
 
-	return ret;
+	return NET_XMIT_SUCCESS;
 }
 
 /* We don't need this */
@@ -242,55 +298,91 @@ static unsigned int prio_qdisc_drop(struct Qdisc *sch)
 	return 0;
 }
 
-/* We don't need this */
+/* Report the rate and all module parameters */
 static int prio_qdisc_dump(struct Qdisc *sch, struct sk_buff *skb)
 {
-	return 0;
+	struct prio_sched_data *q = qdisc_priv(sch);
+	struct nlattr *opts = nla_nest_start(skb, TCA_OPTIONS);
+
+	if (!opts)
+		goto nla_put_failure;
+
+	if (nla_put_u64(skb, TCA_MQ_ECN_RATE, q->rate.rate_bps >> 3) ||
+	    prio_qdisc_params_dump(skb) < 0)
+		goto nla_put_failure;
+
+	return nla_nest_end(skb, opts);
+
+nla_put_failure:
+	nla_nest_cancel(skb, opts);
+	return -1;
 }
 
-/* Release Qdisc resources */
-static void prio_qdisc_destroy(struct Qdisc *sch)
+/* Drop all packets */
+static void prio_qdisc_reset(struct Qdisc *sch)
 {
 	struct prio_sched_data *q = qdisc_priv(sch);
 	int i;
 
-	if (q->queues)
+	for (i = 0; i < PRIO_QDISC_MAX_QUEUES; i++)
 	{
-		for (i = 0; i < PRIO_QDISC_MAX_QUEUES && q->queues[i]; i++)
-			qdisc_destroy(q->queues[i]);
-
-		kfree(q->queues);
+		__skb_queue_purge(&q->queues[i].skbs);
+		q->queues[i].len_bytes = 0;
 	}
+	q->active = 0;
+	q->sum_len_bytes = 0;
+	sch->q.qlen = 0;
+}
+
+/* Number of prio_ecn qdiscs, changed under RTNL. The parameters are module-wide */
+static unsigned int prio_qdisc_nr_qdiscs;
+
+/* Release Qdisc resources */
+static void prio_qdisc_destroy(struct Qdisc *sch)
+{
+	struct prio_sched_data *q = qdisc_priv(sch);
+
+	prio_qdisc_reset(sch);
 	qdisc_watchdog_cancel(&q->watchdog);
+	prio_qdisc_nr_qdiscs--;
 }
 
-static const struct nla_policy prio_qdisc_policy[TCA_TBF_MAX + 1] = {
-	[TCA_TBF_PARMS] = { .len = sizeof(struct tc_tbf_qopt) },
-	[TCA_TBF_RTAB]	= { .type = NLA_BINARY, .len = TC_RTAB_SIZE },
-	[TCA_TBF_PTAB]	= { .type = NLA_BINARY, .len = TC_RTAB_SIZE },
+static const struct nla_policy prio_qdisc_policy[TCA_MQ_ECN_MAX + 1] = {
+	[TCA_MQ_ECN_RATE]	= { .type = NLA_U64 },
+	[TCA_MQ_ECN_PARAMS]	= { .type = NLA_NESTED },
 };
 
-/* We only leverage TC netlink interface to configure rate */
+/*
+ * Configure the rate and, optionally, module parameters through TC netlink.
+ * The parameters are module-wide, so they can only change while this is the
+ * only prio_ecn qdisc. Use the sysctls to change them for all ports.
+ */
 static int prio_qdisc_change(struct Qdisc *sch, struct nlattr *opt)
 {
 	int err;
 	struct prio_sched_data *q = qdisc_priv(sch);
-	struct nlattr *tb[TCA_TBF_PTAB + 1];
-	struct tc_tbf_qopt *qopt;
-	__u32 rate;
+	struct nlattr *tb[TCA_MQ_ECN_MAX + 1];
 
-	err = nla_parse_nested(tb, TCA_TBF_PTAB, opt, prio_qdisc_policy);
+	err = nla_parse_nested(tb, TCA_MQ_ECN_MAX, opt, prio_qdisc_policy);
 	if(err < 0)
 		return err;
 
+	/* The rate is mandatory when the qdisc is created */
 	err = -EINVAL;
-	if (tb[TCA_TBF_PARMS] == NULL)
+	if (!tb[TCA_MQ_ECN_RATE] && !q->rate.rate_bps)
 		goto done;
 
-	qopt = nla_data(tb[TCA_TBF_PARMS]);
-	rate = qopt->rate.rate;
+	if (tb[TCA_MQ_ECN_PARAMS])
+	{
+		err = prio_qdisc_params_set(tb[TCA_MQ_ECN_PARAMS],
+					    prio_qdisc_nr_qdiscs > 1);
+		if (err < 0)
+			goto done;
+	}
+
 	/* convert from bytes/s to b/s */
-	q->rate.rate_bps = (u64)rate << 3;
+	if (tb[TCA_MQ_ECN_RATE])
+		q->rate.rate_bps = nla_get_u64(tb[TCA_MQ_ECN_RATE]) << 3;
 	prio_qdisc_precompute_ratedata(&q->rate);
 	err = 0;
 	printk(KERN_INFO "sch_prio: rate %llu Mbps\n", q->rate.rate_bps/1000000);
@@ -302,45 +394,44 @@ static int prio_qdisc_change(struct Qdisc *sch, struct nlattr *opt)
 /* Initialize Qdisc */
 static int prio_qdisc_init(struct Qdisc *sch, struct nlattr *opt)
 {
-	int i;
+	int i, err;
 	struct prio_sched_data *q = qdisc_priv(sch);
-	struct Qdisc *child;
+
+	/* The non-empty queue bitmap has a bit for each queue */
+	BUILD_BUG_ON(PRIO_QDISC_MAX_QUEUES > BITS_PER_LONG);
 
 	if(sch->parent != TC_H_ROOT)
 		return -EOPNOTSUPP;
 
-	q->queues = kcalloc(PRIO_QDISC_MAX_QUEUES, sizeof(struct Qdisc *), GFP_KERNEL);
-	q->queue_len_bytes = kcalloc(PRIO_QDISC_MAX_QUEUES, sizeof(u32), GFP_KERNEL);	//init per-queue buffer occupancy to 0
-	if (q->queues == NULL || q->queue_len_bytes == NULL)
-		return -ENOMEM;
-
+	/* From here on, prio_qdisc_destroy() undoes a failed init */
+	prio_qdisc_nr_qdiscs++;
 	q->tokens = 0;
 	q->time_ns = ktime_get_ns();
 	q->sum_len_bytes = 0;	//init total buffer occupancy to 0
+	q->active = 0;
 	q->sch = sch;
 	qdisc_watchdog_init(&q->watchdog, sch);
 
-	for (i = 0;i < PRIO_QDISC_MAX_QUEUES; i++)
+	for (i = 0; i < PRIO_QDISC_MAX_QUEUES; i++)
 	{
-		/* bfifo is in bytes */
-		child = fifo_create_dflt(sch, &bfifo_qdisc_ops, PRIO_QDISC_MAX_BUFFER_BYTES);
-		if (child)
-			q->queues[i] = child;
-		else
-			goto err;
+		__skb_queue_head_init(&q->queues[i].skbs);
+		q->queues[i].len_bytes = 0;	//init per-queue buffer occupancy to 0
+		mq_ecn_dq_rate_init(&q->queues[i].dq_rate);
 	}
-	return prio_qdisc_change(sch,opt);
-err:
-	prio_qdisc_destroy(sch);
-	return -ENOMEM;
+
+	err = prio_qdisc_change(sch, opt);
+	if (err)
+		prio_qdisc_destroy(sch);
+	return err;
 }
 
 static struct Qdisc_ops prio_qdisc_ops __read_mostly = {
 	.next = NULL,
 	.cl_ops = NULL,
-	.id = "tbf",
+	.id = "prio_ecn",
 	.priv_size = sizeof(struct prio_sched_data),
 	.init = prio_qdisc_init,
+	.reset = prio_qdisc_reset,
 	.destroy = prio_qdisc_destroy,
 	.enqueue = prio_qdisc_enqueue,
 	.dequeue = prio_qdisc_dequeue,
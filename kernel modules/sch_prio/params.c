@@ -14,6 +14,12 @@ int PRIO_QDISC_BUCKET_NS = 20000;
 int PRIO_QDISC_PORT_THRESH_BYTES = 30000;
 /* ECN marking scheme. By default, we use per queue ECN. */
 int PRIO_QDISC_ECN_SCHEME = PRIO_QDISC_QUEUE_ECN;
+/* Classifier key. By default, we classify packets by DSCP. */
+int PRIO_QDISC_CLASSIFY_KEY = PRIO_QDISC_CLASSIFY_DSCP;
+/* Queue length to start a departure rate measurement. It is 10KB by default. */
+int PRIO_QDISC_DQ_THRESH_BYTES = 10000;
+/* Alpha for departure rate estimation. It is 0.875 by default. */
+int PRIO_QDISC_DQ_RATE_ALPHA = MQ_ECN_DQ_RATE_ALPHA;
 
 
 int PRIO_QDISC_DEBUG_MODE_MIN = PRIO_QDISC_DEBUG_OFF;
@@ -21,9 +27,15 @@ int PRIO_QDISC_DEBUG_MODE_MAX = PRIO_QDISC_DEBUG_ON;
 int PRIO_QDISC_BUFFER_MODE_MIN = PRIO_QDISC_SHARED_BUFFER;
 int PRIO_QDISC_BUFFER_MODE_MAX = PRIO_QDISC_STATIC_BUFFER;
 int PRIO_QDISC_ECN_SCHEME_MIN = PRIO_QDISC_DISABLE_ECN;
-int PRIO_QDISC_ECN_SCHEME_MAX = PRIO_QDISC_DEQUE_ECN;
+int PRIO_QDISC_ECN_SCHEME_MAX = PRIO_QDISC_PIE_ECN;
+int PRIO_QDISC_CLASSIFY_KEY_MIN = PRIO_QDISC_CLASSIFY_DSCP;
+int PRIO_QDISC_CLASSIFY_KEY_MAX = PRIO_QDISC_CLASSIFY_PCP;
 int PRIO_QDISC_DSCP_MIN = 0;
 int PRIO_QDISC_DSCP_MAX = 63;
+int PRIO_QDISC_DQ_THRESH_BYTES_MIN = 1;
+int PRIO_QDISC_DQ_THRESH_BYTES_MAX = PRIO_QDISC_MAX_BUFFER_BYTES;
+int PRIO_QDISC_DQ_RATE_ALPHA_MIN = 0;
+int PRIO_QDISC_DQ_RATE_ALPHA_MAX = MQ_ECN_DQ_RATE_ALPHA_MAX;
 
 /* Per queue ECN marking threshold (bytes) */
 int PRIO_QDISC_QUEUE_THRESH_BYTES[PRIO_QDISC_MAX_QUEUES];
@@ -32,8 +44,8 @@ int PRIO_QDISC_QUEUE_DSCP[PRIO_QDISC_MAX_QUEUES];
 /* Per queue minimum guarantee buffer (bytes) */
 int PRIO_QDISC_QUEUE_BUFFER_BYTES[PRIO_QDISC_MAX_QUEUES];
 
-/* All parameters that can be configured through sysctl. We have 6 + 3 * PRIO_QDISC_MAX_QUEUES parameters in total. */
-struct PRIO_QDISC_Param PRIO_QDISC_Params[6 + 3 * PRIO_QDISC_MAX_QUEUES + 1] =
+/* All parameters that can be configured through sysctl. We have 9 + 3 * PRIO_QDISC_MAX_QUEUES parameters in total. */
+struct PRIO_QDISC_Param PRIO_QDISC_Params[9 + 3 * PRIO_QDISC_MAX_QUEUES + 1] =
 {
 	{"debug_mode", &PRIO_QDISC_DEBUG_MODE},
 	{"buffer_mode",&PRIO_QDISC_BUFFER_MODE},
@@ -41,9 +53,12 @@ struct PRIO_QDISC_Param PRIO_QDISC_Params[6 + 3 * PRIO_QDISC_MAX_QUEUES + 1] =
 	{"bucket_ns", &PRIO_QDISC_BUCKET_NS},
 	{"port_thresh_bytes", &PRIO_QDISC_PORT_THRESH_BYTES},
 	{"ecn_scheme",&PRIO_QDISC_ECN_SCHEME},
+	{"classify_key", &PRIO_QDISC_CLASSIFY_KEY},
+	{"dq_thresh_bytes", &PRIO_QDISC_DQ_THRESH_BYTES},
+	{"dq_rate_alpha", &PRIO_QDISC_DQ_RATE_ALPHA},
 };
 
-struct ctl_table PRIO_QDISC_Params_table[6 + 3 * PRIO_QDISC_MAX_QUEUES + 1];
+struct ctl_table PRIO_QDISC_Params_table[9 + 3 * PRIO_QDISC_MAX_QUEUES + 1];
 
 struct ctl_path PRIO_QDISC_Params_path[] =
 {
@@ -61,25 +76,25 @@ int prio_qdisc_params_init()
 	for (i = 0; i < PRIO_QDISC_MAX_QUEUES; i++)
 	{
 		/* Initialize PRIO_QDISC_QUEUE_THRESH_BYTES[PRIO_QDISC_MAX_QUEUES]*/
-		snprintf(PRIO_QDISC_Params[6 + i].name, 63, "queue_thresh_bytes_%d", i);
-		PRIO_QDISC_Params[6 + i].ptr = &PRIO_QDISC_QUEUE_THRESH_BYTES[i];
+		snprintf(PRIO_QDISC_Params[9 + i].name, 63, "queue_thresh_bytes_%d", i);
+		PRIO_QDISC_Params[9 + i].ptr = &PRIO_QDISC_QUEUE_THRESH_BYTES[i];
 		PRIO_QDISC_QUEUE_THRESH_BYTES[i] = PRIO_QDISC_PORT_THRESH_BYTES;
 
 		/* Initialize PRIO_QDISC_QUEUE_DSCP[PRIO_QDISC_MAX_QUEUES] */
-		snprintf(PRIO_QDISC_Params[6 + i + PRIO_QDISC_MAX_QUEUES].name, 63, "queue_dscp_%d", i);
-		PRIO_QDISC_Params[6 + i + PRIO_QDISC_MAX_QUEUES].ptr = &PRIO_QDISC_QUEUE_DSCP[i];
+		snprintf(PRIO_QDISC_Params[9 + i + PRIO_QDISC_MAX_QUEUES].name, 63, "queue_dscp_%d", i);
+		PRIO_QDISC_Params[9 + i + PRIO_QDISC_MAX_QUEUES].ptr = &PRIO_QDISC_QUEUE_DSCP[i];
 		PRIO_QDISC_QUEUE_DSCP[i] = i;
 
 		/* Initialize PRIO_QDISC_QUEUE_BUFFER_BYTES[PRIO_QDISC_MAX_QUEUES] */
-		snprintf(PRIO_QDISC_Params[6 + i + 2 * PRIO_QDISC_MAX_QUEUES].name, 63, "queue_buffer_bytes_%d", i);
-		PRIO_QDISC_Params[6 + i + 2 * PRIO_QDISC_MAX_QUEUES].ptr = &PRIO_QDISC_QUEUE_BUFFER_BYTES[i];
+		snprintf(PRIO_QDISC_Params[9 + i + 2 * PRIO_QDISC_MAX_QUEUES].name, 63, "queue_buffer_bytes_%d", i);
+		PRIO_QDISC_Params[9 + i + 2 * PRIO_QDISC_MAX_QUEUES].ptr = &PRIO_QDISC_QUEUE_BUFFER_BYTES[i];
 		PRIO_QDISC_QUEUE_BUFFER_BYTES[i] = PRIO_QDISC_MAX_BUFFER_BYTES;
 	}
 
 	/* End of the parameters */
-	PRIO_QDISC_Params[6 + 3 * PRIO_QDISC_MAX_QUEUES].ptr = NULL;
+	PRIO_QDISC_Params[9 + 3 * PRIO_QDISC_MAX_QUEUES].ptr = NULL;
 
-	for (i = 0; i < 6 + 3 * PRIO_QDISC_MAX_QUEUES + 1; i++)
+	for (i = 0; i < 9 + 3 * PRIO_QDISC_MAX_QUEUES + 1; i++)
 	{
 		struct ctl_table *entry = &PRIO_QDISC_Params_table[i];
 
@@ -113,8 +128,29 @@ int prio_qdisc_params_init()
 			entry->extra1 = &PRIO_QDISC_ECN_SCHEME_MIN;
 			entry->extra2 = &PRIO_QDISC_ECN_SCHEME_MAX;
 		}
+		/* classifier key */
+		else if (i == 6)
+		{
+			entry->proc_handler = &proc_dointvec_minmax;
+			entry->extra1 = &PRIO_QDISC_CLASSIFY_KEY_MIN;
+			entry->extra2 = &PRIO_QDISC_CLASSIFY_KEY_MAX;
+		}
+		/* departure rate measurement threshold */
+		else if (i == 7)
+		{
+			entry->proc_handler = &proc_dointvec_minmax;
+			entry->extra1 = &PRIO_QDISC_DQ_THRESH_BYTES_MIN;
+			entry->extra2 = &PRIO_QDISC_DQ_THRESH_BYTES_MAX;
+		}
+		/* departure rate alpha */
+		else if (i == 8)
+		{
+			entry->proc_handler = &proc_dointvec_minmax;
+			entry->extra1 = &PRIO_QDISC_DQ_RATE_ALPHA_MIN;
+			entry->extra2 = &PRIO_QDISC_DQ_RATE_ALPHA_MAX;
+		}
 		/* PRIO_QDISC_QUEUE_DSCP[] */
-		else if (i >= 6 + PRIO_QDISC_MAX_QUEUES && i < 6 + 2 * PRIO_QDISC_MAX_QUEUES)
+		else if (i >= 9 + PRIO_QDISC_MAX_QUEUES && i < 9 + 2 * PRIO_QDISC_MAX_QUEUES)
 		{
 			entry->proc_handler = &proc_dointvec_minmax;
 			entry->extra1 = &PRIO_QDISC_DSCP_MIN;
@@ -140,3 +176,88 @@ void prio_qdisc_params_exit()
 	if (likely(PRIO_QDISC_Sysctl))
 		unregister_sysctl_table(PRIO_QDISC_Sysctl);
 }
+
+/* Look up a parameter and check the value against the range of its sysctl */
+static int prio_qdisc_param_find(const struct tc_mq_ecn_param *p)
+{
+	struct ctl_table *entry;
+	int i;
+
+	if (strnlen(p->name, TC_MQ_ECN_NAMSIZ) == TC_MQ_ECN_NAMSIZ)
+		return -EINVAL;
+
+	for (i = 0; PRIO_QDISC_Params_table[i].procname; i++)
+	{
+		entry = &PRIO_QDISC_Params_table[i];
+		if (strcmp(entry->procname, p->name))
+			continue;
+
+		if (entry->extra1 && p->value < *(int *)entry->extra1)
+			return -EINVAL;
+		if (entry->extra2 && p->value > *(int *)entry->extra2)
+			return -EINVAL;
+		return i;
+	}
+
+	return -EINVAL;
+}
+
+int prio_qdisc_params_set(const struct nlattr *nla, bool shared)
+{
+	const struct nlattr *attr;
+	const struct tc_mq_ecn_param *p;
+	int rem, i;
+
+	/* Validate every parameter before changing any */
+	nla_for_each_nested(attr, nla, rem)
+	{
+		if (nla_type(attr) != TCA_MQ_ECN_PARAM ||
+		    nla_len(attr) < (int)sizeof(*p))
+			return -EINVAL;
+
+		p = nla_data(attr);
+		i = prio_qdisc_param_find(p);
+		if (i < 0)
+			return -EINVAL;
+		/* Do not reconfigure the other qdiscs behind their back */
+		if (shared && p->value != *(PRIO_QDISC_Params[i].ptr))
+		{
+			printk(KERN_INFO "sch_prio: %s is shared by all prio_ecn "
+			       "qdiscs, set it in /proc/sys/prio\n", p->name);
+			return -EBUSY;
+		}
+	}
+
+	nla_for_each_nested(attr, nla, rem)
+	{
+		p = nla_data(attr);
+		i = prio_qdisc_param_find(p);
+		*(PRIO_QDISC_Params[i].ptr) = p->value;
+	}
+
+	return 0;
+}
+
+int prio_qdisc_params_dump(struct sk_buff *skb)
+{
+	struct nlattr *nest = nla_nest_start(skb, TCA_MQ_ECN_PARAMS);
+	struct tc_mq_ecn_param p;
+	int i;
+
+	if (!nest)
+		return -EMSGSIZE;
+
+	for (i = 0; PRIO_QDISC_Params[i].ptr; i++)
+	{
+		memset(&p, 0, sizeof(p));
+		strlcpy(p.name, PRIO_QDISC_Params[i].name, sizeof(p.name));
+		p.value = *(PRIO_QDISC_Params[i].ptr);
+		if (nla_put(skb, TCA_MQ_ECN_PARAM, sizeof(p), &p))
+		{
+			nla_nest_cancel(skb, nest);
+			return -EMSGSIZE;
+		}
+	}
+
+	return nla_nest_end(skb, nest);
+}
@@ -6,6 +6,8 @@
 #include <net/sch_generic.h>
 #include <net/pkt_sched.h>
 #include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/if_vlan.h>
 #include <net/dsfield.h>
 #include <net/inet_ecn.h>
 
@@ -24,6 +26,7 @@ struct prio_class
 	int id;	//id of this queue
 	struct Qdisc *qdisc;	//inner FIFO queue
 	u32 len_bytes;	//queue length in bytes
+	struct mq_ecn_dq_rate dq_rate;	//departure rate
 };
 
 /* struct of DWRR queue */
@@ -40,6 +43,7 @@ struct dwrr_class
 	s64 last_pkt_len_ns;	//length of last packet/rate
 	u32 quantum;	//quantum of this queue
 	struct list_head alist;	//structure of active link list
+	struct mq_ecn_dq_rate dq_rate;	//departure rate
 };
 
 struct prio_dwrr_sched_data
@@ -93,10 +97,81 @@ static inline u64 l2t_ns(struct prio_dwrr_rate_cfg *r, unsigned int len_bytes)
 	return ((u64)len_bytes * r->mult) >> r->shift;
 }
 
+/*
+ * Enqueue timestamp for dequeue latency-based ECN marking. It is kept in the
+ * private area of qdisc_skb_cb rather than skb->tstamp, which may carry the
+ * departure time set by the sender.
+ */
+struct prio_dwrr_qdisc_skb_cb
+{
+	u64 enqueue_time_ns;	//enqueue time stamp (0 if not recorded)
+};
+
+static inline struct prio_dwrr_qdisc_skb_cb *prio_dwrr_qdisc_skb_cb(const struct sk_buff *skb)
+{
+	qdisc_cb_private_validate(skb, sizeof(struct prio_dwrr_qdisc_skb_cb));
+	return (struct prio_dwrr_qdisc_skb_cb *)qdisc_skb_cb(skb)->data;
+}
+
 static inline void prio_dwrr_qdisc_ecn(struct sk_buff *skb)
 {
-	if (skb_make_writable(skb, sizeof(struct iphdr))&&ip_hdr(skb))
-		IP_ECN_set_ce(ip_hdr(skb));
+	unsigned int len;
+
+	if (skb->protocol == htons(ETH_P_IP))
+		len = sizeof(struct iphdr);
+	else if (skb->protocol == htons(ETH_P_IPV6))
+		len = sizeof(struct ipv6hdr);
+	else
+		return;
+
+	if (skb_make_writable(skb, skb_network_offset(skb) + len))
+		INET_ECN_set_ce(skb);
+}
+
+/*
+ * Measure the departure rate of a queue. qlen is the queue length before
+ * this packet of len bytes leaves at time now.
+ */
+static void prio_dwrr_qdisc_dq_rate_update(struct mq_ecn_dq_rate *r, struct prio_dwrr_rate_cfg *rate, u32 qlen, unsigned int len, s64 now)
+{
+	if (mq_ecn_dq_rate_update(r, qlen, len, now, (s64)l2t_ns(rate, len), PRIO_DWRR_QDISC_DQ_THRESH_BYTES, PRIO_DWRR_QDISC_DQ_RATE_ALPHA) && PRIO_DWRR_QDISC_DEBUG_MODE)
+		printk(KERN_INFO "average departure rate %llu\n", r->avg_bps);
+}
+
+/* PIE-like ECN marking threshold: port threshold * departure rate / link rate */
+static u64 prio_dwrr_qdisc_pie_thresh(struct mq_ecn_dq_rate *r, struct prio_dwrr_rate_cfg *rate)
+{
+	if (r->avg_bps == 0 || rate->rate_bps == 0)
+		return PRIO_DWRR_QDISC_PORT_THRESH_BYTES;
+
+	return div64_u64(min_t(u64, r->avg_bps, rate->rate_bps) * PRIO_DWRR_QDISC_PORT_THRESH_BYTES, rate->rate_bps);
+}
+
+/* Return the classifier key (DSCP or VLAN PCP) of a packet, or -1 if none */
+static int prio_dwrr_qdisc_classify_field(struct sk_buff *skb)
+{
+	u16 vlan_tci;
+
+	if (PRIO_DWRR_QDISC_CLASSIFY_KEY == PRIO_DWRR_QDISC_CLASSIFY_PCP)
+	{
+		if (vlan_get_tag(skb, &vlan_tci) < 0)
+			return -1;
+		return (vlan_tci & VLAN_PRIO_MASK) >> VLAN_PRIO_SHIFT;
+	}
+
+	switch (tc_skb_protocol(skb))
+	{
+	case htons(ETH_P_IP):
+		if (!pskb_network_may_pull(skb, sizeof(struct iphdr)))
+			return -1;
+		return ipv4_get_dsfield(ip_hdr(skb)) >> 2;
+	case htons(ETH_P_IPV6):
+		if (!pskb_network_may_pull(skb, sizeof(struct ipv6hdr)))
+			return -1;
+		return ipv6_get_dsfield(ipv6_hdr(skb)) >> 2;
+	default:
+		return -1;
+	}
 }
 
 /* return queue ID (-1 if no matched queue) */
@@ -104,21 +179,20 @@ static int prio_dwrr_qdisc_classify(struct sk_buff *skb, struct Qdisc *sch)
 {
 	int i = 0;
 	struct prio_dwrr_sched_data *q = qdisc_priv(sch);
-	struct iphdr* iph = ip_hdr(skb);
-	int dscp;
+	int key;
 
 	if (unlikely(!(q->dwrr_queues) && !(q->prio_queues)))
 		return -1;
 
+	key = prio_dwrr_qdisc_classify_field(skb);
+
 	/* Return 0 by default*/
-	if (unlikely(!iph))
+	if (unlikely(key < 0))
 		return 0;
 
-	dscp = (const int)(iph->tos >> 2);
-
 	for (i = 0; i < PRIO_DWRR_QDISC_MAX_QUEUES; i++)
 	{
-		if (dscp == PRIO_DWRR_QDISC_QUEUE_DSCP[i])
+		if (key == PRIO_DWRR_QDISC_QUEUE_DSCP[i])
 			return i;
 	}
 
@@ -154,7 +228,7 @@ static struct sk_buff* prio_queues_peek(struct Qdisc *sch)
 	return NULL;
 }
 
-static struct sk_buff* prio_queues_dequeue_peeked(struct Qdisc *sch)
+static struct sk_buff* prio_queues_dequeue_peeked(struct Qdisc *sch, s64 now)
 {
 	struct prio_dwrr_sched_data *q = qdisc_priv(sch);
 	struct Qdisc *qdisc = NULL;
@@ -170,6 +244,8 @@ static struct sk_buff* prio_queues_dequeue_peeked(struct Qdisc *sch)
 			skb = qdisc_dequeue_peeked(qdisc);
 			if (skb)
 			{
+				if (PRIO_DWRR_QDISC_ECN_SCHEME == PRIO_DWRR_QDISC_PIE_ECN)
+					prio_dwrr_qdisc_dq_rate_update(&q->prio_queues[i].dq_rate, &q->rate, q->prio_queues[i].len_bytes, skb_size(skb), now);
 				q->prio_queues[i].len_bytes -= skb_size(skb);	//update per-queue buffer occupancy
 				return skb;
 			}
@@ -197,7 +273,7 @@ static struct sk_buff* prio_queues_dequeue(struct Qdisc *sch)
 		//If we have enough tokens to release this packet
 		if (toks >= 0)
 		{
-			skb = prio_queues_dequeue_peeked(sch);
+			skb = prio_queues_dequeue_peeked(sch, now);
 			if (unlikely(!skb))
 				return NULL;
 
@@ -211,9 +287,9 @@ static struct sk_buff* prio_queues_dequeue(struct Qdisc *sch)
 			if (q->tokens > PRIO_DWRR_QDISC_BUCKET_NS)
 				q->tokens = PRIO_DWRR_QDISC_BUCKET_NS;
 
-			if (PRIO_DWRR_QDISC_ECN_SCHEME == PRIO_DWRR_QDISC_DEQUE_ECN && skb->tstamp.tv64 > 0)
+			if (PRIO_DWRR_QDISC_ECN_SCHEME == PRIO_DWRR_QDISC_DEQUE_ECN && prio_dwrr_qdisc_skb_cb(skb)->enqueue_time_ns > 0)
 			{
-				s64 sojourn_ns = now - skb->tstamp.tv64;
+				s64 sojourn_ns = now - prio_dwrr_qdisc_skb_cb(skb)->enqueue_time_ns;
 				s64 thresh_ns = (s64)l2t_ns(&q->rate, PRIO_DWRR_QDISC_PORT_THRESH_BYTES);
 
 				if (sojourn_ns > thresh_ns)
@@ -299,6 +375,9 @@ static struct sk_buff* dwrr_queues_dequeue(struct Qdisc *sch)
 					printk(KERN_INFO "total buffer occupancy %u\n", q->sum_len_bytes);
 					printk(KERN_INFO "queue %d buffer occupancy %u\n", cl->id, cl->len_bytes);
 				}*/
+				if (PRIO_DWRR_QDISC_ECN_SCHEME == PRIO_DWRR_QDISC_PIE_ECN)
+					prio_dwrr_qdisc_dq_rate_update(&cl->dq_rate, &q->rate, cl->len_bytes, len, now);
+
 				q->sum_len_bytes -= len;
 				sch->q.qlen--;
 				cl->len_bytes -= len;
@@ -337,9 +416,9 @@ static struct sk_buff* dwrr_queues_dequeue(struct Qdisc *sch)
 				}
 
 				/* Dequeue latency-based ECN marking */
-				if (PRIO_DWRR_QDISC_ECN_SCHEME == PRIO_DWRR_QDISC_DEQUE_ECN && skb->tstamp.tv64 > 0)
+				if (PRIO_DWRR_QDISC_ECN_SCHEME == PRIO_DWRR_QDISC_DEQUE_ECN && prio_dwrr_qdisc_skb_cb(skb)->enqueue_time_ns > 0)
 				{
-					s64 sojourn_ns = ktime_get().tv64 - skb->tstamp.tv64;
+					s64 sojourn_ns = ktime_get_ns() - prio_dwrr_qdisc_skb_cb(skb)->enqueue_time_ns;
 					s64 thresh_ns = (s64)l2t_ns(&q->rate, PRIO_DWRR_QDISC_PORT_THRESH_BYTES);
 
 					if (sojourn_ns > thresh_ns)
@@ -450,6 +529,9 @@ static int prio_dwrr_qdisc_enqueue(struct sk_buff *skb, struct Qdisc *sch)
 		}
 	}
 
+	/* No enqueue time stamp unless dequeue latency-based ECN marking needs it */
+	prio_dwrr_qdisc_skb_cb(skb)->enqueue_time_ns = 0;
+
 	id = prio_dwrr_qdisc_classify(skb, sch);
 	if (id >= 0)
 	{
@@ -501,7 +583,10 @@ static int prio_dwrr_qdisc_enqueue(struct sk_buff *skb, struct Qdisc *sch)
 				prio_dwrr_qdisc_ecn(skb);
 			/* Dequeue latency-based ECN marking */
 			else if (PRIO_DWRR_QDISC_ECN_SCHEME == PRIO_DWRR_QDISC_DEQUE_ECN)
-				skb->tstamp = ktime_get();
+				prio_dwrr_qdisc_skb_cb(skb)->enqueue_time_ns = ktime_get_ns();
+			/* PIE-like ECN marking */
+			else if (PRIO_DWRR_QDISC_ECN_SCHEME == PRIO_DWRR_QDISC_PIE_ECN && prio_queue->len_bytes > prio_dwrr_qdisc_pie_thresh(&prio_queue->dq_rate, &q->rate))
+				prio_dwrr_qdisc_ecn(skb);
 		}
 		else if (net_xmit_drop_count(ret))
 		{
@@ -571,7 +656,10 @@ static int prio_dwrr_qdisc_enqueue(struct sk_buff *skb, struct Qdisc *sch)
 			/* Dequeue latency-based ECN marking */
 			else if (PRIO_DWRR_QDISC_ECN_SCHEME == PRIO_DWRR_QDISC_DEQUE_ECN)
 				//Get enqueue time stamp
-				skb->tstamp = ktime_get();
+				prio_dwrr_qdisc_skb_cb(skb)->enqueue_time_ns = ktime_get_ns();
+			/* PIE-like ECN marking */
+			else if (PRIO_DWRR_QDISC_ECN_SCHEME == PRIO_DWRR_QDISC_PIE_ECN && dwrr_queue->len_bytes > prio_dwrr_qdisc_pie_thresh(&dwrr_queue->dq_rate, &q->rate))
+				prio_dwrr_qdisc_ecn(skb);
 		}
 		else
 		{
@@ -591,12 +679,29 @@ static unsigned int prio_dwrr_qdisc_drop(struct Qdisc *sch)
 	return 0;
 }
 
-/* We don't need this */
+/* Report the rate and all module parameters */
 static int prio_dwrr_qdisc_dump(struct Qdisc *sch, struct sk_buff *skb)
 {
-	return 0;
+	struct prio_dwrr_sched_data *q = qdisc_priv(sch);
+	struct nlattr *opts = nla_nest_start(skb, TCA_OPTIONS);
+
+	if (!opts)
+		goto nla_put_failure;
+
+	if (nla_put_u64(skb, TCA_MQ_ECN_RATE, q->rate.rate_bps >> 3) ||
+	    prio_dwrr_qdisc_params_dump(skb) < 0)
+		goto nla_put_failure;
+
+	return nla_nest_end(skb, opts);
+
+nla_put_failure:
+	nla_nest_cancel(skb, opts);
+	return -1;
 }
 
+/* Number of prio_dwrr qdiscs, changed under RTNL. The parameters are module-wide */
+static unsigned int prio_dwrr_qdisc_nr_qdiscs;
+
 /* Release Qdisc resources */
 static void prio_dwrr_qdisc_destroy(struct Qdisc *sch)
 {
@@ -620,35 +725,45 @@ static void prio_dwrr_qdisc_destroy(struct Qdisc *sch)
 	}
 
 	qdisc_watchdog_cancel(&q->watchdog);
+	prio_dwrr_qdisc_nr_qdiscs--;
 }
 
-static const struct nla_policy prio_dwrr_qdisc_policy[TCA_TBF_MAX + 1] = {
-	[TCA_TBF_PARMS] = { .len = sizeof(struct tc_tbf_qopt) },
-	[TCA_TBF_RTAB]	= { .type = NLA_BINARY, .len = TC_RTAB_SIZE },
-	[TCA_TBF_PTAB]	= { .type = NLA_BINARY, .len = TC_RTAB_SIZE },
+static const struct nla_policy prio_dwrr_qdisc_policy[TCA_MQ_ECN_MAX + 1] = {
+	[TCA_MQ_ECN_RATE]	= { .type = NLA_U64 },
+	[TCA_MQ_ECN_PARAMS]	= { .type = NLA_NESTED },
 };
 
-/* We only leverage TC netlink interface to configure rate */
+/*
+ * Configure the rate and, optionally, module parameters through TC netlink.
+ * The parameters are module-wide, so they can only change while this is the
+ * only prio_dwrr qdisc. Use the sysctls to change them for all ports.
+ */
 static int prio_dwrr_qdisc_change(struct Qdisc *sch, struct nlattr *opt)
 {
 	int err;
 	struct prio_dwrr_sched_data *q = qdisc_priv(sch);
-	struct nlattr *tb[TCA_TBF_PTAB + 1];
-	struct tc_tbf_qopt *qopt;
-	__u32 rate;
+	struct nlattr *tb[TCA_MQ_ECN_MAX + 1];
 
-	err = nla_parse_nested(tb, TCA_TBF_PTAB, opt, prio_dwrr_qdisc_policy);
+	err = nla_parse_nested(tb, TCA_MQ_ECN_MAX, opt, prio_dwrr_qdisc_policy);
 	if(err < 0)
 		return err;
 
+	/* The rate is mandatory when the qdisc is created */
 	err = -EINVAL;
-	if (tb[TCA_TBF_PARMS] == NULL)
+	if (!tb[TCA_MQ_ECN_RATE] && !q->rate.rate_bps)
 		goto done;
 
-	qopt = nla_data(tb[TCA_TBF_PARMS]);
-	rate = qopt->rate.rate;
+	if (tb[TCA_MQ_ECN_PARAMS])
+	{
+		err = prio_dwrr_qdisc_params_set(tb[TCA_MQ_ECN_PARAMS],
+						 prio_dwrr_qdisc_nr_qdiscs > 1);
+		if (err < 0)
+			goto done;
+	}
+
 	/* convert from bytes/s to b/s */
-	q->rate.rate_bps = (u64)rate << 3;
+	if (tb[TCA_MQ_ECN_RATE])
+		q->rate.rate_bps = nla_get_u64(tb[TCA_MQ_ECN_RATE]) << 3;
 	prio_dwrr_qdisc_precompute_ratedata(&q->rate);
 	err = 0;
 	printk(KERN_INFO "sch_prio_dwrr: rate %llu Mbps\n", q->rate.rate_bps/1000000);
@@ -660,13 +775,15 @@ static int prio_dwrr_qdisc_change(struct Qdisc *sch, struct nlattr *opt)
 /* Initialize Qdisc */
 static int prio_dwrr_qdisc_init(struct Qdisc *sch, struct nlattr *opt)
 {
-	int i;
+	int i, err = -ENOMEM;
 	struct prio_dwrr_sched_data *q = qdisc_priv(sch);
 	struct Qdisc *child;
 
 	if(sch->parent != TC_H_ROOT)
 		return -EOPNOTSUPP;
 
+	/* From here on, prio_dwrr_qdisc_destroy() undoes a failed init */
+	prio_dwrr_qdisc_nr_qdiscs++;
 	q->tokens = 0;
 	q->time_ns = ktime_get_ns();
 	q->last_idle_time_ns = ktime_get_ns();
@@ -682,7 +799,7 @@ static int prio_dwrr_qdisc_init(struct Qdisc *sch, struct nlattr *opt)
 	q->prio_queues = kcalloc(PRIO_DWRR_QDISC_MAX_PRIO_QUEUES, sizeof(struct prio_class), GFP_KERNEL);
 	q->dwrr_queues = kcalloc(PRIO_DWRR_QDISC_MAX_DWRR_QUEUES, sizeof(struct dwrr_class), GFP_KERNEL);
 	if (!(q->dwrr_queues) || !(q->prio_queues))
-		return -ENOMEM;
+		goto err;
 
 	/* Initialize priority queues */
 	for (i = 0; i < PRIO_DWRR_QDISC_MAX_PRIO_QUEUES; i++)
@@ -696,6 +813,7 @@ static int prio_dwrr_qdisc_init(struct Qdisc *sch, struct nlattr *opt)
 
 		(q->prio_queues[i]).id = i;
 		(q->prio_queues[i]).len_bytes = 0;
+		mq_ecn_dq_rate_init(&(q->prio_queues[i]).dq_rate);
 	}
 
 	/* Initialize DWRR queues */
@@ -719,18 +837,21 @@ static int prio_dwrr_qdisc_init(struct Qdisc *sch, struct nlattr *opt)
 		(q->dwrr_queues[i]).last_pkt_time_ns = ktime_get_ns();
 		(q->dwrr_queues[i]).last_pkt_len_ns = 0;
 		(q->dwrr_queues[i]).quantum = 0;
+		mq_ecn_dq_rate_init(&(q->dwrr_queues[i]).dq_rate);
 	}
 
-	return prio_dwrr_qdisc_change(sch,opt);
+	err = prio_dwrr_qdisc_change(sch, opt);
+	if (likely(!err))
+		return 0;
 err:
 	prio_dwrr_qdisc_destroy(sch);
-	return -ENOMEM;
+	return err;
 }
 
 static struct Qdisc_ops prio_dwrr_qdisc_ops __read_mostly = {
 	.next = NULL,
 	.cl_ops = NULL,
-	.id = "tbf",
+	.id = "prio_dwrr",
 	.priv_size = sizeof(struct prio_dwrr_sched_data),
 	.init = prio_dwrr_qdisc_init,
 	.destroy = prio_dwrr_qdisc_destroy,
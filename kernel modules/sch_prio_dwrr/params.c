@@ -20,19 +20,31 @@ int PRIO_DWRR_QDISC_QUANTUM_ALPHA = 750;
 int PRIO_DWRR_QDISC_ROUND_ALPHA = 750;
 /* Idle time slot. It is 12us by default */
 int PRIO_DWRR_QDISC_IDLE_INTERVAL_NS = 12000;
+/* Classifier key. By default, we classify packets by DSCP. */
+int PRIO_DWRR_QDISC_CLASSIFY_KEY = PRIO_DWRR_QDISC_CLASSIFY_DSCP;
+/* Queue length to start a departure rate measurement. It is 10KB by default. */
+int PRIO_DWRR_QDISC_DQ_THRESH_BYTES = 10000;
+/* Alpha for departure rate estimation. It is 0.875 by default. */
+int PRIO_DWRR_QDISC_DQ_RATE_ALPHA = MQ_ECN_DQ_RATE_ALPHA;
 
 int PRIO_DWRR_QDISC_DEBUG_MODE_MIN = PRIO_DWRR_QDISC_DEBUG_OFF;
 int PRIO_DWRR_QDISC_DEBUG_MODE_MAX = PRIO_DWRR_QDISC_DEBUG_ON;
 int PRIO_DWRR_QDISC_BUFFER_MODE_MIN = PRIO_DWRR_QDISC_SHARED_BUFFER;
 int PRIO_DWRR_QDISC_BUFFER_MODE_MAX = PRIO_DWRR_QDISC_STATIC_BUFFER;
 int PRIO_DWRR_QDISC_ECN_SCHEME_MIN = PRIO_DWRR_QDISC_DISABLE_ECN;
-int PRIO_DWRR_QDISC_ECN_SCHEME_MAX = PRIO_DWRR_QDISC_DEQUE_ECN;
+int PRIO_DWRR_QDISC_ECN_SCHEME_MAX = PRIO_DWRR_QDISC_PIE_ECN;
 int PRIO_DWRR_QDISC_QUANTUM_ALPHA_MIN = 0;
 int PRIO_DWRR_QDISC_QUANTUM_ALPHA_MAX = 1000;
 int PRIO_DWRR_QDISC_ROUND_ALPHA_MIN = 0;
 int PRIO_DWRR_QDISC_ROUND_ALPHA_MAX = 1000;
+int PRIO_DWRR_QDISC_CLASSIFY_KEY_MIN = PRIO_DWRR_QDISC_CLASSIFY_DSCP;
+int PRIO_DWRR_QDISC_CLASSIFY_KEY_MAX = PRIO_DWRR_QDISC_CLASSIFY_PCP;
 int PRIO_DWRR_QDISC_DSCP_MIN = 0;
 int PRIO_DWRR_QDISC_DSCP_MAX = 63;
+int PRIO_DWRR_QDISC_DQ_THRESH_BYTES_MIN = 1;
+int PRIO_DWRR_QDISC_DQ_THRESH_BYTES_MAX = PRIO_DWRR_QDISC_MAX_BUFFER_BYTES;
+int PRIO_DWRR_QDISC_DQ_RATE_ALPHA_MIN = 0;
+int PRIO_DWRR_QDISC_DQ_RATE_ALPHA_MAX = MQ_ECN_DQ_RATE_ALPHA_MAX;
 int PRIO_DWRR_QDISC_QUANTUM_MIN = PRIO_DWRR_QDISC_MTU_BYTES;
 int PRIO_DWRR_QDISC_QUANTUM_MAX = 200*1024;
 
@@ -45,8 +57,8 @@ int PRIO_DWRR_QDISC_QUEUE_BUFFER_BYTES[PRIO_DWRR_QDISC_MAX_QUEUES];
 /* Quantum for different queues*/
 int PRIO_DWRR_QDISC_QUEUE_QUANTUM[PRIO_DWRR_QDISC_MAX_DWRR_QUEUES];
 
-/* All parameters that can be configured through sysctl. We have 9+3*PRIO_DWRR_QDISC_MAX_QUEUES+PRIO_DWRR_QDISC_MAX_DWRR_QUEUESS parameters in total. */
-struct PRIO_DWRR_QDISC_Param PRIO_DWRR_QDISC_Params[9 + 3 * PRIO_DWRR_QDISC_MAX_QUEUES + PRIO_DWRR_QDISC_MAX_DWRR_QUEUES + 1] =
+/* All parameters that can be configured through sysctl. We have 12+3*PRIO_DWRR_QDISC_MAX_QUEUES+PRIO_DWRR_QDISC_MAX_DWRR_QUEUESS parameters in total. */
+struct PRIO_DWRR_QDISC_Param PRIO_DWRR_QDISC_Params[12 + 3 * PRIO_DWRR_QDISC_MAX_QUEUES + PRIO_DWRR_QDISC_MAX_DWRR_QUEUES + 1] =
 {
 	{"debug_mode", &PRIO_DWRR_QDISC_DEBUG_MODE},
 	{"buffer_mode", &PRIO_DWRR_QDISC_BUFFER_MODE},
@@ -57,9 +69,12 @@ struct PRIO_DWRR_QDISC_Param PRIO_DWRR_QDISC_Params[9 + 3 * PRIO_DWRR_QDISC_MAX_
 	{"quantum_alpha", &PRIO_DWRR_QDISC_QUANTUM_ALPHA},
 	{"round_alpha", &PRIO_DWRR_QDISC_ROUND_ALPHA},
 	{"idle_interval_ns", &PRIO_DWRR_QDISC_IDLE_INTERVAL_NS},
+	{"classify_key", &PRIO_DWRR_QDISC_CLASSIFY_KEY},
+	{"dq_thresh_bytes", &PRIO_DWRR_QDISC_DQ_THRESH_BYTES},
+	{"dq_rate_alpha", &PRIO_DWRR_QDISC_DQ_RATE_ALPHA},
 };
 
-struct ctl_table PRIO_DWRR_QDISC_Params_table[9 + 3 * PRIO_DWRR_QDISC_MAX_QUEUES + PRIO_DWRR_QDISC_MAX_DWRR_QUEUES + 1];
+struct ctl_table PRIO_DWRR_QDISC_Params_table[12 + 3 * PRIO_DWRR_QDISC_MAX_QUEUES + PRIO_DWRR_QDISC_MAX_DWRR_QUEUES + 1];
 
 struct ctl_path PRIO_DWRR_QDISC_Params_path[] =
 {
@@ -78,33 +93,33 @@ int prio_dwrr_qdisc_params_init()
 	for (i = 0; i < PRIO_DWRR_QDISC_MAX_QUEUES; i++)
 	{
 		/* Initialize per-queue ECN marking thresholds */
-		snprintf(PRIO_DWRR_QDISC_Params[9 + i].name, 63, "queue_thresh_bytes_%d", i);
-		PRIO_DWRR_QDISC_Params[9 + i].ptr = &PRIO_DWRR_QDISC_QUEUE_THRESH_BYTES[i];
+		snprintf(PRIO_DWRR_QDISC_Params[12 + i].name, 63, "queue_thresh_bytes_%d", i);
+		PRIO_DWRR_QDISC_Params[12 + i].ptr = &PRIO_DWRR_QDISC_QUEUE_THRESH_BYTES[i];
 		PRIO_DWRR_QDISC_QUEUE_THRESH_BYTES[i] = PRIO_DWRR_QDISC_PORT_THRESH_BYTES;
 
 		/* Initialize per-queue DSCP values */
-		snprintf(PRIO_DWRR_QDISC_Params[9 + i + PRIO_DWRR_QDISC_MAX_QUEUES].name, 63, "queue_dscp_%d", i);
-		PRIO_DWRR_QDISC_Params[9 + i + PRIO_DWRR_QDISC_MAX_QUEUES].ptr = &PRIO_DWRR_QDISC_QUEUE_DSCP[i];
+		snprintf(PRIO_DWRR_QDISC_Params[12 + i + PRIO_DWRR_QDISC_MAX_QUEUES].name, 63, "queue_dscp_%d", i);
+		PRIO_DWRR_QDISC_Params[12 + i + PRIO_DWRR_QDISC_MAX_QUEUES].ptr = &PRIO_DWRR_QDISC_QUEUE_DSCP[i];
 		PRIO_DWRR_QDISC_QUEUE_DSCP[i] = i;
 
 		/* Initialize per-queue buffer sizes */
-		snprintf(PRIO_DWRR_QDISC_Params[9 + i + 2 * PRIO_DWRR_QDISC_MAX_QUEUES].name, 63, "queue_buffer_bytes_%d", i);
-		PRIO_DWRR_QDISC_Params[9 + i + 2 * PRIO_DWRR_QDISC_MAX_QUEUES].ptr = &PRIO_DWRR_QDISC_QUEUE_BUFFER_BYTES[i];
+		snprintf(PRIO_DWRR_QDISC_Params[12 + i + 2 * PRIO_DWRR_QDISC_MAX_QUEUES].name, 63, "queue_buffer_bytes_%d", i);
+		PRIO_DWRR_QDISC_Params[12 + i + 2 * PRIO_DWRR_QDISC_MAX_QUEUES].ptr = &PRIO_DWRR_QDISC_QUEUE_BUFFER_BYTES[i];
 		PRIO_DWRR_QDISC_QUEUE_BUFFER_BYTES[i] = PRIO_DWRR_QDISC_MAX_BUFFER_BYTES;
 	}
 
 	/* Initialize per-dwrr-queue quantum */
 	for (i = 0; i < PRIO_DWRR_QDISC_MAX_DWRR_QUEUES; i++)
 	{
-		snprintf(PRIO_DWRR_QDISC_Params[9 + i + 3 * PRIO_DWRR_QDISC_MAX_QUEUES].name, 63, "queue_quantum_%d", i + PRIO_DWRR_QDISC_MAX_PRIO_QUEUES);
-		PRIO_DWRR_QDISC_Params[9 + i + 3 * PRIO_DWRR_QDISC_MAX_QUEUES].ptr = &PRIO_DWRR_QDISC_QUEUE_QUANTUM[i];
+		snprintf(PRIO_DWRR_QDISC_Params[12 + i + 3 * PRIO_DWRR_QDISC_MAX_QUEUES].name, 63, "queue_quantum_%d", i + PRIO_DWRR_QDISC_MAX_PRIO_QUEUES);
+		PRIO_DWRR_QDISC_Params[12 + i + 3 * PRIO_DWRR_QDISC_MAX_QUEUES].ptr = &PRIO_DWRR_QDISC_QUEUE_QUANTUM[i];
 		PRIO_DWRR_QDISC_QUEUE_QUANTUM[i] = PRIO_DWRR_QDISC_MTU_BYTES;
 	}
 
 	/* End of the parameters */
-	PRIO_DWRR_QDISC_Params[9 + 3 * PRIO_DWRR_QDISC_MAX_QUEUES + PRIO_DWRR_QDISC_MAX_DWRR_QUEUES].ptr = NULL;
+	PRIO_DWRR_QDISC_Params[12 + 3 * PRIO_DWRR_QDISC_MAX_QUEUES + PRIO_DWRR_QDISC_MAX_DWRR_QUEUES].ptr = NULL;
 
-	for (i = 0; i < 9 + 3 * PRIO_DWRR_QDISC_MAX_QUEUES + PRIO_DWRR_QDISC_MAX_DWRR_QUEUES + 1; i++)
+	for (i = 0; i < 12 + 3 * PRIO_DWRR_QDISC_MAX_QUEUES + PRIO_DWRR_QDISC_MAX_DWRR_QUEUES + 1; i++)
 	{
 		struct ctl_table *entry = &PRIO_DWRR_QDISC_Params_table[i];
 
@@ -152,15 +167,36 @@ int prio_dwrr_qdisc_params_init()
 			entry->extra1 = &PRIO_DWRR_QDISC_ROUND_ALPHA_MIN;
 			entry->extra2 = &PRIO_DWRR_QDISC_ROUND_ALPHA_MAX;
 		}
+		/* classifier key */
+		else if (i == 9)
+		{
+			entry->proc_handler = &proc_dointvec_minmax;
+			entry->extra1 = &PRIO_DWRR_QDISC_CLASSIFY_KEY_MIN;
+			entry->extra2 = &PRIO_DWRR_QDISC_CLASSIFY_KEY_MAX;
+		}
+		/* departure rate measurement threshold */
+		else if (i == 10)
+		{
+			entry->proc_handler = &proc_dointvec_minmax;
+			entry->extra1 = &PRIO_DWRR_QDISC_DQ_THRESH_BYTES_MIN;
+			entry->extra2 = &PRIO_DWRR_QDISC_DQ_THRESH_BYTES_MAX;
+		}
+		/* departure rate alpha */
+		else if (i == 11)
+		{
+			entry->proc_handler = &proc_dointvec_minmax;
+			entry->extra1 = &PRIO_DWRR_QDISC_DQ_RATE_ALPHA_MIN;
+			entry->extra2 = &PRIO_DWRR_QDISC_DQ_RATE_ALPHA_MAX;
+		}
 		/* per-queue DSCP */
-		else if (i >= 9 + PRIO_DWRR_QDISC_MAX_QUEUES && i < 9 + 2 * PRIO_DWRR_QDISC_MAX_QUEUES)
+		else if (i >= 12 + PRIO_DWRR_QDISC_MAX_QUEUES && i < 12 + 2 * PRIO_DWRR_QDISC_MAX_QUEUES)
 		{
 			entry->proc_handler = &proc_dointvec_minmax;
 			entry->extra1 = &PRIO_DWRR_QDISC_DSCP_MIN;
 			entry->extra2 = &PRIO_DWRR_QDISC_DSCP_MAX;
 		}
 		/* per-dwrr-queue quantums */
-		else if (i >= 9 + 3 * PRIO_DWRR_QDISC_MAX_QUEUES)
+		else if (i >= 12 + 3 * PRIO_DWRR_QDISC_MAX_QUEUES)
 		{
 			entry->proc_handler = &proc_dointvec_minmax;
 			entry->extra1 = &PRIO_DWRR_QDISC_QUANTUM_MIN;
@@ -188,3 +224,88 @@ void prio_dwrr_qdisc_params_exit()
 	if (likely(PRIO_DWRR_QDISC_Sysctl))
 		unregister_sysctl_table(PRIO_DWRR_QDISC_Sysctl);
 }
+
+/* Look up a parameter and check the value against the range of its sysctl */
+static int prio_dwrr_qdisc_param_find(const struct tc_mq_ecn_param *p)
+{
+	struct ctl_table *entry;
+	int i;
+
+	if (strnlen(p->name, TC_MQ_ECN_NAMSIZ) == TC_MQ_ECN_NAMSIZ)
+		return -EINVAL;
+
+	for (i = 0; PRIO_DWRR_QDISC_Params_table[i].procname; i++)
+	{
+		entry = &PRIO_DWRR_QDISC_Params_table[i];
+		if (strcmp(entry->procname, p->name))
+			continue;
+
+		if (entry->extra1 && p->value < *(int *)entry->extra1)
+			return -EINVAL;
+		if (entry->extra2 && p->value > *(int *)entry->extra2)
+			return -EINVAL;
+		return i;
+	}
+
+	return -EINVAL;
+}
+
+int prio_dwrr_qdisc_params_set(const struct nlattr *nla, bool shared)
+{
+	const struct nlattr *attr;
+	const struct tc_mq_ecn_param *p;
+	int rem, i;
+
+	/* Validate every parameter before changing any */
+	nla_for_each_nested(attr, nla, rem)
+	{
+		if (nla_type(attr) != TCA_MQ_ECN_PARAM ||
+		    nla_len(attr) < (int)sizeof(*p))
+			return -EINVAL;
+
+		p = nla_data(attr);
+		i = prio_dwrr_qdisc_param_find(p);
+		if (i < 0)
+			return -EINVAL;
+		/* Do not reconfigure the other qdiscs behind their back */
+		if (shared && p->value != *(PRIO_DWRR_QDISC_Params[i].ptr))
+		{
+			printk(KERN_INFO "sch_prio_dwrr: %s is shared by all prio_dwrr "
+			       "qdiscs, set it in /proc/sys/prio_dwrr\n", p->name);
+			return -EBUSY;
+		}
+	}
+
+	nla_for_each_nested(attr, nla, rem)
+	{
+		p = nla_data(attr);
+		i = prio_dwrr_qdisc_param_find(p);
+		*(PRIO_DWRR_QDISC_Params[i].ptr) = p->value;
+	}
+
+	return 0;
+}
+
+int prio_dwrr_qdisc_params_dump(struct sk_buff *skb)
+{
+	struct nlattr *nest = nla_nest_start(skb, TCA_MQ_ECN_PARAMS);
+	struct tc_mq_ecn_param p;
+	int i;
+
+	if (!nest)
+		return -EMSGSIZE;
+
+	for (i = 0; PRIO_DWRR_QDISC_Params[i].ptr; i++)
+	{
+		memset(&p, 0, sizeof(p));
+		strlcpy(p.name, PRIO_DWRR_QDISC_Params[i].name, sizeof(p.name));
+		p.value = *(PRIO_DWRR_QDISC_Params[i].ptr);
+		if (nla_put(skb, TCA_MQ_ECN_PARAM, sizeof(p), &p))
+		{
+			nla_nest_cancel(skb, nest);
+			return -EMSGSIZE;
+		}
+	}
+
+	return nla_nest_end(skb, nest);
+}
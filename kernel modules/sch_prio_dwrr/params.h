@@ -2,6 +2,10 @@
 #define __PARAMS_H__
 
 #include <linux/types.h>
+#include <net/netlink.h>
+
+#include "../include/pkt_sched_mq_ecn.h"
+#include "../include/mq_ecn_dq_rate.h"
 
 /* Our module has 1 high priority queue(s) */
 #define PRIO_DWRR_QDISC_MAX_PRIO_QUEUES 1
@@ -38,6 +42,13 @@
 #define PRIO_DWRR_QDISC_MQ_ECN_RR 4
 /* Dequeue latency-based ECN marking. This is a general ECN marking approach for any packet scheduler */
 #define PRIO_DWRR_QDISC_DEQUE_ECN 5
+/* PIE-like ECN marking: the threshold scales with the departure rate of the queue */
+#define PRIO_DWRR_QDISC_PIE_ECN 6
+
+/* Classify packets by DSCP (IPv4 TOS or IPv6 traffic class) */
+#define PRIO_DWRR_QDISC_CLASSIFY_DSCP 0
+/* Classify packets by VLAN priority code point (PCP) */
+#define PRIO_DWRR_QDISC_CLASSIFY_PCP 1
 
 #define PRIO_DWRR_QDISC_MAX_ITERATION 10
 
@@ -59,6 +70,12 @@ extern int PRIO_DWRR_QDISC_QUANTUM_ALPHA;
 extern int PRIO_DWRR_QDISC_ROUND_ALPHA;
 /* Idle time interval */
 extern int PRIO_DWRR_QDISC_IDLE_INTERVAL_NS;
+/* Classifier key: DSCP (0) or VLAN PCP (1) */
+extern int PRIO_DWRR_QDISC_CLASSIFY_KEY;
+/* Queue length (bytes) to start a departure rate measurement */
+extern int PRIO_DWRR_QDISC_DQ_THRESH_BYTES;
+/* Alpha for departure rate estimation (out of 1 << MQ_ECN_DQ_RATE_SHIFT) */
+extern int PRIO_DWRR_QDISC_DQ_RATE_ALPHA;
 
 /* Per queue ECN marking threshold (bytes) */
 extern int PRIO_DWRR_QDISC_QUEUE_THRESH_BYTES[PRIO_DWRR_QDISC_MAX_QUEUES];
@@ -75,11 +92,19 @@ struct PRIO_DWRR_QDISC_Param
 	int *ptr;
 };
 
-extern struct PRIO_DWRR_QDISC_Param PRIO_DWRR_QDISC_Params[9 + 3 * PRIO_DWRR_QDISC_MAX_QUEUES + PRIO_DWRR_QDISC_MAX_DWRR_QUEUES + 1];
+extern struct PRIO_DWRR_QDISC_Param PRIO_DWRR_QDISC_Params[12 + 3 * PRIO_DWRR_QDISC_MAX_QUEUES + PRIO_DWRR_QDISC_MAX_DWRR_QUEUES + 1];
 
 /* Intialize parameters and register sysctl */
 int prio_dwrr_qdisc_params_init(void);
 /* Unregister sysctl */
 void prio_dwrr_qdisc_params_exit(void);
+/*
+ * Apply nested TCA_MQ_ECN_PARAM attributes, all or nothing. The parameters
+ * are module-wide: if shared (other qdiscs of the module exist), a value
+ * that differs from the current one fails with -EBUSY.
+ */
+int prio_dwrr_qdisc_params_set(const struct nlattr *nla, bool shared);
+/* Put every parameter in a TCA_MQ_ECN_PARAMS attribute */
+int prio_dwrr_qdisc_params_dump(struct sk_buff *skb);
 
 #endif
@@ -6,6 +6,8 @@
 #include <net/sch_generic.h>
 #include <net/pkt_sched.h>
 #include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/if_vlan.h>
 #include <net/dsfield.h>
 #include <net/inet_ecn.h>
 
@@ -24,6 +26,7 @@ struct prio_class
 	int id;	//id of this queue
 	struct Qdisc *qdisc;	//inner FIFO queue
 	u32 len_bytes;	//queue length in bytes
+	struct mq_ecn_dq_rate dq_rate;	//departure rate
 };
 
 /* struct of WFQ queue */
@@ -33,6 +36,7 @@ struct wfq_class
     struct Qdisc *qdisc;    //inner FIFO queue
     u64 head_finish_time;   //virtual finish time of the head packet
     u32 len_bytes;  //queue length in bytes
+    struct mq_ecn_dq_rate dq_rate;  //departure rate
 };
 
 struct prio_wfq_sched_data
@@ -104,33 +108,103 @@ static inline u64 l2t_ns(struct prio_wfq_rate_cfg *r, unsigned int len_bytes)
     return ((u64)len_bytes * r->mult) >> r->shift;
 }
 
+/*
+ * Enqueue timestamp for dequeue latency-based ECN marking. It is kept in the
+ * private area of qdisc_skb_cb rather than skb->tstamp, which may carry the
+ * departure time set by the sender.
+ */
+struct prio_wfq_qdisc_skb_cb
+{
+	u64 enqueue_time_ns;	//enqueue time stamp (0 if not recorded)
+};
+
+static inline struct prio_wfq_qdisc_skb_cb *prio_wfq_qdisc_skb_cb(const struct sk_buff *skb)
+{
+	qdisc_cb_private_validate(skb, sizeof(struct prio_wfq_qdisc_skb_cb));
+	return (struct prio_wfq_qdisc_skb_cb *)qdisc_skb_cb(skb)->data;
+}
+
 static inline void prio_wfq_qdisc_ecn(struct sk_buff *skb)
 {
-    if (skb_make_writable(skb, sizeof(struct iphdr)) && ip_hdr(skb))
-        IP_ECN_set_ce(ip_hdr(skb));
+    unsigned int len;
+
+    if (skb->protocol == htons(ETH_P_IP))
+        len = sizeof(struct iphdr);
+    else if (skb->protocol == htons(ETH_P_IPV6))
+        len = sizeof(struct ipv6hdr);
+    else
+        return;
+
+    if (skb_make_writable(skb, skb_network_offset(skb) + len))
+        INET_ECN_set_ce(skb);
+}
+
+/*
+ * Measure the departure rate of a queue. qlen is the queue length before
+ * this packet of len bytes leaves at time now.
+ */
+static void prio_wfq_qdisc_dq_rate_update(struct mq_ecn_dq_rate *r, struct prio_wfq_rate_cfg *rate, u32 qlen, unsigned int len, s64 now)
+{
+	if (mq_ecn_dq_rate_update(r, qlen, len, now, (s64)l2t_ns(rate, len), PRIO_WFQ_QDISC_DQ_THRESH_BYTES, PRIO_WFQ_QDISC_DQ_RATE_ALPHA) && PRIO_WFQ_QDISC_DEBUG_MODE)
+		printk(KERN_INFO "average departure rate %llu\n", r->avg_bps);
+}
+
+/* PIE-like ECN marking threshold: port threshold * departure rate / link rate */
+static u64 prio_wfq_qdisc_pie_thresh(struct mq_ecn_dq_rate *r, struct prio_wfq_rate_cfg *rate)
+{
+	if (r->avg_bps == 0 || rate->rate_bps == 0)
+		return PRIO_WFQ_QDISC_PORT_THRESH_BYTES;
+
+	return div64_u64(min_t(u64, r->avg_bps, rate->rate_bps) * PRIO_WFQ_QDISC_PORT_THRESH_BYTES, rate->rate_bps);
+}
+
+/* Return the classifier key (DSCP or VLAN PCP) of a packet, or -1 if none */
+static int prio_wfq_qdisc_classify_field(struct sk_buff *skb)
+{
+    u16 vlan_tci;
+
+    if (PRIO_WFQ_QDISC_CLASSIFY_KEY == PRIO_WFQ_QDISC_CLASSIFY_PCP)
+    {
+        if (vlan_get_tag(skb, &vlan_tci) < 0)
+            return -1;
+        return (vlan_tci & VLAN_PRIO_MASK) >> VLAN_PRIO_SHIFT;
+    }
+
+    switch (tc_skb_protocol(skb))
+    {
+    case htons(ETH_P_IP):
+        if (!pskb_network_may_pull(skb, sizeof(struct iphdr)))
+            return -1;
+        return ipv4_get_dsfield(ip_hdr(skb)) >> 2;
+    case htons(ETH_P_IPV6):
+        if (!pskb_network_may_pull(skb, sizeof(struct ipv6hdr)))
+            return -1;
+        return ipv6_get_dsfield(ipv6_hdr(skb)) >> 2;
+    default:
+        return -1;
+    }
 }
 
 /* return queue ID (-1 if no matched queue) */
 static int prio_wfq_qdisc_classify(struct sk_buff *skb, struct Qdisc *sch)
 {
-    int i = 0;
+	int i = 0;
 	struct prio_wfq_sched_data *q = qdisc_priv(sch);
-	struct iphdr* iph = ip_hdr(skb);
-	int dscp;
+	int key;
 
-    if (unlikely(!(q->wfq_queues) && !(q->prio_queues)))
+	if (unlikely(!(q->wfq_queues) && !(q->prio_queues)))
 		return -1;
 
-    /* Return 0 by default*/
-    if (unlikely(!iph))
-        return 0;
+	key = prio_wfq_qdisc_classify_field(skb);
 
-	dscp = (const int)(iph->tos >> 2);
+	/* Return 0 by default*/
+	if (unlikely(key < 0))
+		return 0;
 
 	for (i = 0; i < PRIO_WFQ_QDISC_MAX_QUEUES; i++)
-    {
-        if (dscp == PRIO_WFQ_QDISC_QUEUE_DSCP[i])
-            return i;
+	{
+		if (key == PRIO_WFQ_QDISC_QUEUE_DSCP[i])
+			return i;
 	}
 
 	return 0;
@@ -165,7 +239,7 @@ static struct sk_buff* prio_queues_peek(struct Qdisc *sch)
 	return NULL;
 }
 
-static struct sk_buff* prio_queues_dequeue_peeked(struct Qdisc *sch)
+static struct sk_buff* prio_queues_dequeue_peeked(struct Qdisc *sch, s64 now)
 {
 	struct prio_wfq_sched_data *q = qdisc_priv(sch);
 	struct Qdisc *qdisc = NULL;
@@ -181,6 +255,8 @@ static struct sk_buff* prio_queues_dequeue_peeked(struct Qdisc *sch)
 			skb = qdisc_dequeue_peeked(qdisc);
 			if (skb)
 			{
+				if (PRIO_WFQ_QDISC_ECN_SCHEME == PRIO_WFQ_QDISC_PIE_ECN)
+					prio_wfq_qdisc_dq_rate_update(&q->prio_queues[i].dq_rate, &q->rate, q->prio_queues[i].len_bytes, skb_size(skb), now);
 				q->prio_queues[i].len_bytes -= skb_size(skb);	//update per-queue buffer occupancy
 				return skb;
 			}
@@ -208,7 +284,7 @@ static struct sk_buff* prio_queues_dequeue(struct Qdisc *sch)
 		//If we have enough tokens to release this packet
 		if (toks >= 0)
 		{
-			skb = prio_queues_dequeue_peeked(sch);
+			skb = prio_queues_dequeue_peeked(sch, now);
 			if (unlikely(!skb))
 				return NULL;
 
@@ -222,9 +298,9 @@ static struct sk_buff* prio_queues_dequeue(struct Qdisc *sch)
 			if (q->tokens > PRIO_WFQ_QDISC_BUCKET_NS)
 				q->tokens = PRIO_WFQ_QDISC_BUCKET_NS;
 
-			if (PRIO_WFQ_QDISC_ECN_SCHEME == PRIO_WFQ_QDISC_DEQUE_ECN && skb->tstamp.tv64 > 0)
+			if (PRIO_WFQ_QDISC_ECN_SCHEME == PRIO_WFQ_QDISC_DEQUE_ECN && prio_wfq_qdisc_skb_cb(skb)->enqueue_time_ns > 0)
 			{
-				s64 sojourn_ns = now - skb->tstamp.tv64;
+				s64 sojourn_ns = now - prio_wfq_qdisc_skb_cb(skb)->enqueue_time_ns;
 				s64 thresh_ns = (s64)l2t_ns(&q->rate, PRIO_WFQ_QDISC_PORT_THRESH_BYTES);
 
 				if (sojourn_ns > thresh_ns)
@@ -310,6 +386,9 @@ static struct sk_buff* wfq_queues_dequeue(struct Qdisc *sch)
             printk(KERN_INFO "total buffer occupancy %u\n", q->sum_len_bytes);
             printk(KERN_INFO "queue %d buffer occupancy %u\n", min_index, q->queues[min_index].len_bytes);
         }*/
+        if (PRIO_WFQ_QDISC_ECN_SCHEME == PRIO_WFQ_QDISC_PIE_ECN)
+            prio_wfq_qdisc_dq_rate_update(&q->wfq_queues[min_index].dq_rate, &q->rate, q->wfq_queues[min_index].len_bytes, len, now);
+
         q->sum_len_bytes -= len;
         sch->q.qlen--;
         q->wfq_queues[min_index].len_bytes -= len;
@@ -331,9 +410,9 @@ static struct sk_buff* wfq_queues_dequeue(struct Qdisc *sch)
         }
 
         /* Dequeue latency-based ECN marking */
-        if (PRIO_WFQ_QDISC_ECN_SCHEME == PRIO_WFQ_QDISC_DEQUE_ECN && skb->tstamp.tv64 > 0)
+        if (PRIO_WFQ_QDISC_ECN_SCHEME == PRIO_WFQ_QDISC_DEQUE_ECN && prio_wfq_qdisc_skb_cb(skb)->enqueue_time_ns > 0)
         {
-            s64 sojourn_ns = ktime_get().tv64 - skb->tstamp.tv64;
+            s64 sojourn_ns = ktime_get_ns() - prio_wfq_qdisc_skb_cb(skb)->enqueue_time_ns;
             s64 thresh_ns = (s64)l2t_ns(&q->rate, PRIO_WFQ_QDISC_PORT_THRESH_BYTES);
 
             if (sojourn_ns > thresh_ns)
@@ -384,6 +463,9 @@ static int prio_wfq_qdisc_enqueue(struct sk_buff *skb, struct Qdisc *sch)
     int id = 0;
 	int ret;
 
+	/* No enqueue time stamp unless dequeue latency-based ECN marking needs it */
+	prio_wfq_qdisc_skb_cb(skb)->enqueue_time_ns = 0;
+
 	id = prio_wfq_qdisc_classify(skb, sch);
     if (id >= 0)
 	{
@@ -429,7 +511,10 @@ static int prio_wfq_qdisc_enqueue(struct sk_buff *skb, struct Qdisc *sch)
                 prio_wfq_qdisc_ecn(skb);
 			else if (PRIO_WFQ_QDISC_ECN_SCHEME == PRIO_WFQ_QDISC_DEQUE_ECN)
                 //Get enqueue time stamp
-                skb->tstamp = ktime_get();
+                prio_wfq_qdisc_skb_cb(skb)->enqueue_time_ns = ktime_get_ns();
+            /* PIE-like ECN marking */
+            else if (PRIO_WFQ_QDISC_ECN_SCHEME == PRIO_WFQ_QDISC_PIE_ECN && prio_queue->len_bytes > prio_wfq_qdisc_pie_thresh(&prio_queue->dq_rate, &q->rate))
+                prio_wfq_qdisc_ecn(skb);
 		}
 		else if (net_xmit_drop_count(ret))
 		{
@@ -465,7 +550,10 @@ static int prio_wfq_qdisc_enqueue(struct sk_buff *skb, struct Qdisc *sch)
                 prio_wfq_qdisc_ecn(skb);
 			else if (PRIO_WFQ_QDISC_ECN_SCHEME == PRIO_WFQ_QDISC_DEQUE_ECN)
                 //Get enqueue time stamp
-                skb->tstamp = ktime_get();
+                prio_wfq_qdisc_skb_cb(skb)->enqueue_time_ns = ktime_get_ns();
+            /* PIE-like ECN marking */
+            else if (PRIO_WFQ_QDISC_ECN_SCHEME == PRIO_WFQ_QDISC_PIE_ECN && wfq_queue->len_bytes > prio_wfq_qdisc_pie_thresh(&wfq_queue->dq_rate, &q->rate))
+                prio_wfq_qdisc_ecn(skb);
 		}
 		else
 		{
@@ -485,12 +573,29 @@ static unsigned int prio_wfq_qdisc_drop(struct Qdisc *sch)
     return 0;
 }
 
-/* We don't need this */
+/* Report the rate and all module parameters */
 static int prio_wfq_qdisc_dump(struct Qdisc *sch, struct sk_buff *skb)
 {
-    return 0;
+	struct prio_wfq_sched_data *q = qdisc_priv(sch);
+	struct nlattr *opts = nla_nest_start(skb, TCA_OPTIONS);
+
+	if (!opts)
+		goto nla_put_failure;
+
+	if (nla_put_u64(skb, TCA_MQ_ECN_RATE, q->rate.rate_bps >> 3) ||
+	    prio_wfq_qdisc_params_dump(skb) < 0)
+		goto nla_put_failure;
+
+	return nla_nest_end(skb, opts);
+
+nla_put_failure:
+	nla_nest_cancel(skb, opts);
+	return -1;
 }
 
+/* Number of prio_wfq qdiscs, changed under RTNL. The parameters are module-wide */
+static unsigned int prio_wfq_qdisc_nr_qdiscs;
+
 /* Release Qdisc resources */
 static void prio_wfq_qdisc_destroy(struct Qdisc *sch)
 {
@@ -514,35 +619,45 @@ static void prio_wfq_qdisc_destroy(struct Qdisc *sch)
 	}
 
 	qdisc_watchdog_cancel(&q->watchdog);
+	prio_wfq_qdisc_nr_qdiscs--;
 }
 
-static const struct nla_policy prio_wfq_qdisc_policy[TCA_TBF_MAX + 1] = {
-	[TCA_TBF_PARMS] = { .len = sizeof(struct tc_tbf_qopt) },
-	[TCA_TBF_RTAB]	= { .type = NLA_BINARY, .len = TC_RTAB_SIZE },
-	[TCA_TBF_PTAB]	= { .type = NLA_BINARY, .len = TC_RTAB_SIZE },
+static const struct nla_policy prio_wfq_qdisc_policy[TCA_MQ_ECN_MAX + 1] = {
+	[TCA_MQ_ECN_RATE]	= { .type = NLA_U64 },
+	[TCA_MQ_ECN_PARAMS]	= { .type = NLA_NESTED },
 };
 
-/* We only leverage TC netlink interface to configure rate */
+/*
+ * Configure the rate and, optionally, module parameters through TC netlink.
+ * The parameters are module-wide, so they can only change while this is the
+ * only prio_wfq qdisc. Use the sysctls to change them for all ports.
+ */
 static int prio_wfq_qdisc_change(struct Qdisc *sch, struct nlattr *opt)
 {
 	int err;
 	struct prio_wfq_sched_data *q = qdisc_priv(sch);
-	struct nlattr *tb[TCA_TBF_PTAB + 1];
-	struct tc_tbf_qopt *qopt;
-	__u32 rate;
+	struct nlattr *tb[TCA_MQ_ECN_MAX + 1];
 
-	err = nla_parse_nested(tb, TCA_TBF_PTAB, opt, prio_wfq_qdisc_policy);
+	err = nla_parse_nested(tb, TCA_MQ_ECN_MAX, opt, prio_wfq_qdisc_policy);
 	if(err < 0)
 		return err;
 
+	/* The rate is mandatory when the qdisc is created */
 	err = -EINVAL;
-	if (tb[TCA_TBF_PARMS] == NULL)
+	if (!tb[TCA_MQ_ECN_RATE] && !q->rate.rate_bps)
 		goto done;
 
-	qopt = nla_data(tb[TCA_TBF_PARMS]);
-	rate = qopt->rate.rate;
+	if (tb[TCA_MQ_ECN_PARAMS])
+	{
+		err = prio_wfq_qdisc_params_set(tb[TCA_MQ_ECN_PARAMS],
+						 prio_wfq_qdisc_nr_qdiscs > 1);
+		if (err < 0)
+			goto done;
+	}
+
 	/* convert from bytes/s to b/s */
-	q->rate.rate_bps = (u64)rate << 3;
+	if (tb[TCA_MQ_ECN_RATE])
+		q->rate.rate_bps = nla_get_u64(tb[TCA_MQ_ECN_RATE]) << 3;
 	prio_wfq_qdisc_precompute_ratedata(&q->rate);
 	err = 0;
 	printk(KERN_INFO "sch_prio_wfq: rate %llu Mbps\n", q->rate.rate_bps/1000000);
@@ -554,13 +669,15 @@ static int prio_wfq_qdisc_change(struct Qdisc *sch, struct nlattr *opt)
 /* Initialize Qdisc */
 static int prio_wfq_qdisc_init(struct Qdisc *sch, struct nlattr *opt)
 {
-	int i;
+	int i, err = -ENOMEM;
 	struct prio_wfq_sched_data *q = qdisc_priv(sch);
 	struct Qdisc *child;
 
 	if(sch->parent != TC_H_ROOT)
 		return -EOPNOTSUPP;
 
+	/* From here on, prio_wfq_qdisc_destroy() undoes a failed init */
+	prio_wfq_qdisc_nr_qdiscs++;
 	q->tokens = 0;
 	q->time_ns = ktime_get_ns();
     q->virtual_time = 0;
@@ -572,7 +689,7 @@ static int prio_wfq_qdisc_init(struct Qdisc *sch, struct nlattr *opt)
     q->prio_queues = kcalloc(PRIO_WFQ_QDISC_MAX_PRIO_QUEUES, sizeof(struct prio_class), GFP_KERNEL);
 	q->wfq_queues = kcalloc(PRIO_WFQ_QDISC_MAX_WFQ_QUEUES, sizeof(struct wfq_class), GFP_KERNEL);
 	if (!(q->wfq_queues) || !(q->prio_queues))
-		return -ENOMEM;
+		goto err;
 
     /* Initialize priority queues */
     for (i = 0; i < PRIO_WFQ_QDISC_MAX_PRIO_QUEUES; i++)
@@ -586,6 +703,7 @@ static int prio_wfq_qdisc_init(struct Qdisc *sch, struct nlattr *opt)
 
     	(q->prio_queues[i]).id = i;
     	(q->prio_queues[i]).len_bytes = 0;
+    	mq_ecn_dq_rate_init(&(q->prio_queues[i]).dq_rate);
     }
 
 	/* Initialize WFQ queues */
@@ -602,17 +720,20 @@ static int prio_wfq_qdisc_init(struct Qdisc *sch, struct nlattr *opt)
         (q->wfq_queues[i]).id = i + PRIO_WFQ_QDISC_MAX_PRIO_QUEUES;
 		(q->wfq_queues[i]).head_finish_time = 0;
         (q->wfq_queues[i]).len_bytes = 0;
+        mq_ecn_dq_rate_init(&(q->wfq_queues[i]).dq_rate);
 	}
-	return prio_wfq_qdisc_change(sch, opt);
+	err = prio_wfq_qdisc_change(sch, opt);
+	if (likely(!err))
+		return 0;
 err:
 	prio_wfq_qdisc_destroy(sch);
-	return -ENOMEM;
+	return err;
 }
 
 static struct Qdisc_ops prio_wfq_qdisc_ops __read_mostly = {
 	.next = NULL,
 	.cl_ops = NULL,
-	.id = "tbf",
+	.id = "prio_wfq",
 	.priv_size = sizeof(struct prio_wfq_sched_data),
 	.init = prio_wfq_qdisc_init,
 	.destroy = prio_wfq_qdisc_destroy,
@@ -15,15 +15,27 @@ int PRIO_WFQ_QDISC_BUCKET_NS = 25000;
 int PRIO_WFQ_QDISC_PORT_THRESH_BYTES = 32000;
 /* ECN marking scheme. By default, we use per queue ECN. */
 int PRIO_WFQ_QDISC_ECN_SCHEME = PRIO_WFQ_QDISC_QUEUE_ECN;
+/* Classifier key. By default, we classify packets by DSCP. */
+int PRIO_WFQ_QDISC_CLASSIFY_KEY = PRIO_WFQ_QDISC_CLASSIFY_DSCP;
+/* Queue length to start a departure rate measurement. It is 10KB by default. */
+int PRIO_WFQ_QDISC_DQ_THRESH_BYTES = 10000;
+/* Alpha for departure rate estimation. It is 0.875 by default. */
+int PRIO_WFQ_QDISC_DQ_RATE_ALPHA = MQ_ECN_DQ_RATE_ALPHA;
 
 int PRIO_WFQ_QDISC_DEBUG_MODE_MIN = PRIO_WFQ_QDISC_DEBUG_OFF;
 int PRIO_WFQ_QDISC_DEBUG_MODE_MAX = PRIO_WFQ_QDISC_DEBUG_ON;
 int PRIO_WFQ_QDISC_BUFFER_MODE_MIN = PRIO_WFQ_QDISC_SHARED_BUFFER;
 int PRIO_WFQ_QDISC_BUFFER_MODE_MAX = PRIO_WFQ_QDISC_STATIC_BUFFER;
 int PRIO_WFQ_QDISC_ECN_SCHEME_MIN = PRIO_WFQ_QDISC_DISABLE_ECN;
-int PRIO_WFQ_QDISC_ECN_SCHEME_MAX = PRIO_WFQ_QDISC_DEQUE_ECN;
+int PRIO_WFQ_QDISC_ECN_SCHEME_MAX = PRIO_WFQ_QDISC_PIE_ECN;
+int PRIO_WFQ_QDISC_CLASSIFY_KEY_MIN = PRIO_WFQ_QDISC_CLASSIFY_DSCP;
+int PRIO_WFQ_QDISC_CLASSIFY_KEY_MAX = PRIO_WFQ_QDISC_CLASSIFY_PCP;
 int PRIO_WFQ_QDISC_DSCP_MIN = 0;
 int PRIO_WFQ_QDISC_DSCP_MAX = 63;
+int PRIO_WFQ_QDISC_DQ_THRESH_BYTES_MIN = 1;
+int PRIO_WFQ_QDISC_DQ_THRESH_BYTES_MAX = PRIO_WFQ_QDISC_MAX_BUFFER_BYTES;
+int PRIO_WFQ_QDISC_DQ_RATE_ALPHA_MIN = 0;
+int PRIO_WFQ_QDISC_DQ_RATE_ALPHA_MAX = MQ_ECN_DQ_RATE_ALPHA_MAX;
 int PRIO_WFQ_QDISC_WEIGHT_MIN = 1;
 int PRIO_WFQ_QDISC_WEIGHT_MAX = PRIO_WFQ_QDISC_MIN_PKT_BYTES;
 
@@ -37,8 +49,8 @@ int PRIO_WFQ_QDISC_QUEUE_BUFFER_BYTES[PRIO_WFQ_QDISC_MAX_QUEUES];
 int PRIO_WFQ_QDISC_QUEUE_WEIGHT[PRIO_WFQ_QDISC_MAX_WFQ_QUEUES];
 
 
-/* All parameters that can be configured through sysctl. We have 6 + 3 * PRIO_WFQ_QDISC_MAX_QUEUES + PRIO_WFQ_QDISC_MAX_WFQ_QUEUES in total. */
-struct PRIO_WFQ_QDISC_Param PRIO_WFQ_QDISC_Params[6 + 3 * PRIO_WFQ_QDISC_MAX_QUEUES + PRIO_WFQ_QDISC_MAX_WFQ_QUEUES + 1] =
+/* All parameters that can be configured through sysctl. We have 9 + 3 * PRIO_WFQ_QDISC_MAX_QUEUES + PRIO_WFQ_QDISC_MAX_WFQ_QUEUES in total. */
+struct PRIO_WFQ_QDISC_Param PRIO_WFQ_QDISC_Params[9 + 3 * PRIO_WFQ_QDISC_MAX_QUEUES + PRIO_WFQ_QDISC_MAX_WFQ_QUEUES + 1] =
 {
 	{"debug_mode", &PRIO_WFQ_QDISC_DEBUG_MODE},
 	{"buffer_mode",&PRIO_WFQ_QDISC_BUFFER_MODE},
@@ -46,9 +58,12 @@ struct PRIO_WFQ_QDISC_Param PRIO_WFQ_QDISC_Params[6 + 3 * PRIO_WFQ_QDISC_MAX_QUE
 	{"bucket_ns", &PRIO_WFQ_QDISC_BUCKET_NS},
 	{"port_thresh_bytes", &PRIO_WFQ_QDISC_PORT_THRESH_BYTES},
 	{"ecn_scheme", &PRIO_WFQ_QDISC_ECN_SCHEME},
+	{"classify_key", &PRIO_WFQ_QDISC_CLASSIFY_KEY},
+	{"dq_thresh_bytes", &PRIO_WFQ_QDISC_DQ_THRESH_BYTES},
+	{"dq_rate_alpha", &PRIO_WFQ_QDISC_DQ_RATE_ALPHA},
 };
 
-struct ctl_table PRIO_WFQ_QDISC_Params_table[6 + 3 * PRIO_WFQ_QDISC_MAX_QUEUES + PRIO_WFQ_QDISC_MAX_WFQ_QUEUES + 1];
+struct ctl_table PRIO_WFQ_QDISC_Params_table[9 + 3 * PRIO_WFQ_QDISC_MAX_QUEUES + PRIO_WFQ_QDISC_MAX_WFQ_QUEUES + 1];
 
 struct ctl_path PRIO_WFQ_QDISC_Params_path[] =
 {
@@ -67,32 +82,32 @@ int prio_wfq_qdisc_params_init()
 	for (i = 0; i < PRIO_WFQ_QDISC_MAX_QUEUES; i++)
 	{
 		/* Initialize per-queue ECN marking thresholds */
-		snprintf(PRIO_WFQ_QDISC_Params[6 + i].name, 63, "queue_thresh_bytes_%d", i);
-		PRIO_WFQ_QDISC_Params[6 + i].ptr = &PRIO_WFQ_QDISC_QUEUE_THRESH_BYTES[i];
+		snprintf(PRIO_WFQ_QDISC_Params[9 + i].name, 63, "queue_thresh_bytes_%d", i);
+		PRIO_WFQ_QDISC_Params[9 + i].ptr = &PRIO_WFQ_QDISC_QUEUE_THRESH_BYTES[i];
 		PRIO_WFQ_QDISC_QUEUE_THRESH_BYTES[i] = PRIO_WFQ_QDISC_PORT_THRESH_BYTES;
 
 		/* Initialize per-queue DSCP values */
-		snprintf(PRIO_WFQ_QDISC_Params[6 + i + PRIO_WFQ_QDISC_MAX_QUEUES].name, 63, "queue_dscp_%d", i);
-		PRIO_WFQ_QDISC_Params[6 + i + PRIO_WFQ_QDISC_MAX_QUEUES].ptr = &PRIO_WFQ_QDISC_QUEUE_DSCP[i];
+		snprintf(PRIO_WFQ_QDISC_Params[9 + i + PRIO_WFQ_QDISC_MAX_QUEUES].name, 63, "queue_dscp_%d", i);
+		PRIO_WFQ_QDISC_Params[9 + i + PRIO_WFQ_QDISC_MAX_QUEUES].ptr = &PRIO_WFQ_QDISC_QUEUE_DSCP[i];
 		PRIO_WFQ_QDISC_QUEUE_DSCP[i] = i;
 
 		/* Initialize per-queue buffer sizes */
-		snprintf(PRIO_WFQ_QDISC_Params[6 + i + 2 * PRIO_WFQ_QDISC_MAX_QUEUES].name, 63, "queue_buffer_bytes_%d", i);
-		PRIO_WFQ_QDISC_Params[6 + i + 2 * PRIO_WFQ_QDISC_MAX_QUEUES].ptr = &PRIO_WFQ_QDISC_QUEUE_BUFFER_BYTES[i];
+		snprintf(PRIO_WFQ_QDISC_Params[9 + i + 2 * PRIO_WFQ_QDISC_MAX_QUEUES].name, 63, "queue_buffer_bytes_%d", i);
+		PRIO_WFQ_QDISC_Params[9 + i + 2 * PRIO_WFQ_QDISC_MAX_QUEUES].ptr = &PRIO_WFQ_QDISC_QUEUE_BUFFER_BYTES[i];
 		PRIO_WFQ_QDISC_QUEUE_BUFFER_BYTES[i] = PRIO_WFQ_QDISC_MAX_BUFFER_BYTES;
 	}
 
 	/* Initialize per-wfq-queue weight */
 	for (i = 0; i < PRIO_WFQ_QDISC_MAX_WFQ_QUEUES; i++)
 	{
-		snprintf(PRIO_WFQ_QDISC_Params[6 + i + 3 * PRIO_WFQ_QDISC_MAX_QUEUES].name, 63, "queue_weight_%d", i + PRIO_WFQ_QDISC_MAX_PRIO_QUEUES);
-		PRIO_WFQ_QDISC_Params[6 + i + 3 * PRIO_WFQ_QDISC_MAX_QUEUES].ptr = &PRIO_WFQ_QDISC_QUEUE_WEIGHT[i];
+		snprintf(PRIO_WFQ_QDISC_Params[9 + i + 3 * PRIO_WFQ_QDISC_MAX_QUEUES].name, 63, "queue_weight_%d", i + PRIO_WFQ_QDISC_MAX_PRIO_QUEUES);
+		PRIO_WFQ_QDISC_Params[9 + i + 3 * PRIO_WFQ_QDISC_MAX_QUEUES].ptr = &PRIO_WFQ_QDISC_QUEUE_WEIGHT[i];
 		PRIO_WFQ_QDISC_QUEUE_WEIGHT[i] = 1;
 	}
 	/* End of the parameters */
-	PRIO_WFQ_QDISC_Params[6 + 3 * PRIO_WFQ_QDISC_MAX_QUEUES + PRIO_WFQ_QDISC_MAX_WFQ_QUEUES].ptr = NULL;
+	PRIO_WFQ_QDISC_Params[9 + 3 * PRIO_WFQ_QDISC_MAX_QUEUES + PRIO_WFQ_QDISC_MAX_WFQ_QUEUES].ptr = NULL;
 
-    for (i = 0; i < 6 + 3 * PRIO_WFQ_QDISC_MAX_QUEUES + PRIO_WFQ_QDISC_MAX_WFQ_QUEUES; i++)
+    for (i = 0; i < 9 + 3 * PRIO_WFQ_QDISC_MAX_QUEUES + PRIO_WFQ_QDISC_MAX_WFQ_QUEUES; i++)
     {
         struct ctl_table *entry = &PRIO_WFQ_QDISC_Params_table[i];
 
@@ -122,15 +137,36 @@ int prio_wfq_qdisc_params_init()
             entry->extra1 = &PRIO_WFQ_QDISC_ECN_SCHEME_MIN;
             entry->extra2 = &PRIO_WFQ_QDISC_ECN_SCHEME_MAX;
         }
+		/* classifier key */
+		else if (i == 6)
+		{
+			entry->proc_handler = &proc_dointvec_minmax;
+			entry->extra1 = &PRIO_WFQ_QDISC_CLASSIFY_KEY_MIN;
+			entry->extra2 = &PRIO_WFQ_QDISC_CLASSIFY_KEY_MAX;
+		}
+		/* departure rate measurement threshold */
+		else if (i == 7)
+		{
+			entry->proc_handler = &proc_dointvec_minmax;
+			entry->extra1 = &PRIO_WFQ_QDISC_DQ_THRESH_BYTES_MIN;
+			entry->extra2 = &PRIO_WFQ_QDISC_DQ_THRESH_BYTES_MAX;
+		}
+		/* departure rate alpha */
+		else if (i == 8)
+		{
+			entry->proc_handler = &proc_dointvec_minmax;
+			entry->extra1 = &PRIO_WFQ_QDISC_DQ_RATE_ALPHA_MIN;
+			entry->extra2 = &PRIO_WFQ_QDISC_DQ_RATE_ALPHA_MAX;
+		}
 		/* per-queue DSCP */
-		else if (i >= 6 + PRIO_WFQ_QDISC_MAX_QUEUES && i < 6 + 2 * PRIO_WFQ_QDISC_MAX_QUEUES)
+		else if (i >= 9 + PRIO_WFQ_QDISC_MAX_QUEUES && i < 9 + 2 * PRIO_WFQ_QDISC_MAX_QUEUES)
 		{
 			entry->proc_handler = &proc_dointvec_minmax;
 			entry->extra1 = &PRIO_WFQ_QDISC_DSCP_MIN;
 			entry->extra2 = &PRIO_WFQ_QDISC_DSCP_MAX;
 		}
 		/* per-wfq-queue weight */
-		else if (i >= 6 + 3 * PRIO_WFQ_QDISC_MAX_QUEUES)
+		else if (i >= 9 + 3 * PRIO_WFQ_QDISC_MAX_QUEUES)
 		{
 			entry->proc_handler = &proc_dointvec_minmax;
 			entry->extra1 = &PRIO_WFQ_QDISC_WEIGHT_MIN;
@@ -157,3 +193,88 @@ void prio_wfq_qdisc_params_exit()
 	if (likely(PRIO_WFQ_QDISC_Sysctl))
 		unregister_sysctl_table(PRIO_WFQ_QDISC_Sysctl);
 }
+
+/* Look up a parameter and check the value against the range of its sysctl */
+static int prio_wfq_qdisc_param_find(const struct tc_mq_ecn_param *p)
+{
+	struct ctl_table *entry;
+	int i;
+
+	if (strnlen(p->name, TC_MQ_ECN_NAMSIZ) == TC_MQ_ECN_NAMSIZ)
+		return -EINVAL;
+
+	for (i = 0; PRIO_WFQ_QDISC_Params_table[i].procname; i++)
+	{
+		entry = &PRIO_WFQ_QDISC_Params_table[i];
+		if (strcmp(entry->procname, p->name))
+			continue;
+
+		if (entry->extra1 && p->value < *(int *)entry->extra1)
+			return -EINVAL;
+		if (entry->extra2 && p->value > *(int *)entry->extra2)
+			return -EINVAL;
+		return i;
+	}
+
+	return -EINVAL;
+}
+
+int prio_wfq_qdisc_params_set(const struct nlattr *nla, bool shared)
+{
+	const struct nlattr *attr;
+	const struct tc_mq_ecn_param *p;
+	int rem, i;
+
+	/* Validate every parameter before changing any */
+	nla_for_each_nested(attr, nla, rem)
+	{
+		if (nla_type(attr) != TCA_MQ_ECN_PARAM ||
+		    nla_len(attr) < (int)sizeof(*p))
+			return -EINVAL;
+
+		p = nla_data(attr);
+		i = prio_wfq_qdisc_param_find(p);
+		if (i < 0)
+			return -EINVAL;
+		/* Do not reconfigure the other qdiscs behind their back */
+		if (shared && p->value != *(PRIO_WFQ_QDISC_Params[i].ptr))
+		{
+			printk(KERN_INFO "sch_prio_wfq: %s is shared by all prio_wfq "
+			       "qdiscs, set it in /proc/sys/prio_wfq\n", p->name);
+			return -EBUSY;
+		}
+	}
+
+	nla_for_each_nested(attr, nla, rem)
+	{
+		p = nla_data(attr);
+		i = prio_wfq_qdisc_param_find(p);
+		*(PRIO_WFQ_QDISC_Params[i].ptr) = p->value;
+	}
+
+	return 0;
+}
+
+int prio_wfq_qdisc_params_dump(struct sk_buff *skb)
+{
+	struct nlattr *nest = nla_nest_start(skb, TCA_MQ_ECN_PARAMS);
+	struct tc_mq_ecn_param p;
+	int i;
+
+	if (!nest)
+		return -EMSGSIZE;
+
+	for (i = 0; PRIO_WFQ_QDISC_Params[i].ptr; i++)
+	{
+		memset(&p, 0, sizeof(p));
+		strlcpy(p.name, PRIO_WFQ_QDISC_Params[i].name, sizeof(p.name));
+		p.value = *(PRIO_WFQ_QDISC_Params[i].ptr);
+		if (nla_put(skb, TCA_MQ_ECN_PARAM, sizeof(p), &p))
+		{
+			nla_nest_cancel(skb, nest);
+			return -EMSGSIZE;
+		}
+	}
+
+	return nla_nest_end(skb, nest);
+}
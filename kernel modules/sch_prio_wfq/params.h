@@ -2,6 +2,10 @@
 #define __PARAMS_H__
 
 #include <linux/types.h>
+#include <net/netlink.h>
+
+#include "../include/pkt_sched_mq_ecn.h"
+#include "../include/mq_ecn_dq_rate.h"
 
 /* Our module has 1 high priority queue(s) */
 #define PRIO_WFQ_QDISC_MAX_PRIO_QUEUES 1
@@ -34,6 +38,13 @@
 #define PRIO_WFQ_QDISC_PORT_ECN 2
 /* Dequeue latency-based ECN marking. This is a general ECN marking approach for any packet scheduler */
 #define PRIO_WFQ_QDISC_DEQUE_ECN 5
+/* PIE-like ECN marking: the threshold scales with the departure rate of the queue */
+#define PRIO_WFQ_QDISC_PIE_ECN 6
+
+/* Classify packets by DSCP (IPv4 TOS or IPv6 traffic class) */
+#define PRIO_WFQ_QDISC_CLASSIFY_DSCP 0
+/* Classify packets by VLAN priority code point (PCP) */
+#define PRIO_WFQ_QDISC_CLASSIFY_PCP 1
 
 /* Debug mode or not */
 extern int PRIO_WFQ_QDISC_DEBUG_MODE;
@@ -47,6 +58,12 @@ extern int PRIO_WFQ_QDISC_BUCKET_NS;
 extern int PRIO_WFQ_QDISC_PORT_THRESH_BYTES;
 /* ECN marking scheme */
 extern int PRIO_WFQ_QDISC_ECN_SCHEME;
+/* Classifier key: DSCP (0) or VLAN PCP (1) */
+extern int PRIO_WFQ_QDISC_CLASSIFY_KEY;
+/* Queue length (bytes) to start a departure rate measurement */
+extern int PRIO_WFQ_QDISC_DQ_THRESH_BYTES;
+/* Alpha for departure rate estimation (out of 1 << MQ_ECN_DQ_RATE_SHIFT) */
+extern int PRIO_WFQ_QDISC_DQ_RATE_ALPHA;
 
 /* Per queue ECN marking threshold (bytes) */
 extern int PRIO_WFQ_QDISC_QUEUE_THRESH_BYTES[PRIO_WFQ_QDISC_MAX_QUEUES];
@@ -64,11 +81,19 @@ struct PRIO_WFQ_QDISC_Param
 	int *ptr;
 };
 
-extern struct PRIO_WFQ_QDISC_Param PRIO_WFQ_QDISC_Params[6 + 3 * PRIO_WFQ_QDISC_MAX_QUEUES + PRIO_WFQ_QDISC_MAX_WFQ_QUEUES + 1];
+extern struct PRIO_WFQ_QDISC_Param PRIO_WFQ_QDISC_Params[9 + 3 * PRIO_WFQ_QDISC_MAX_QUEUES + PRIO_WFQ_QDISC_MAX_WFQ_QUEUES + 1];
 
 /* Intialize parameters and register sysctl */
 int prio_wfq_qdisc_params_init(void);
 /* Unregister sysctl */
 void prio_wfq_qdisc_params_exit(void);
+/*
+ * Apply nested TCA_MQ_ECN_PARAM attributes, all or nothing. The parameters
+ * are module-wide: if shared (other qdiscs of the module exist), a value
+ * that differs from the current one fails with -EBUSY.
+ */
+int prio_wfq_qdisc_params_set(const struct nlattr *nla, bool shared);
+/* Put every parameter in a TCA_MQ_ECN_PARAMS attribute */
+int prio_wfq_qdisc_params_dump(struct sk_buff *skb);
 
 #endif
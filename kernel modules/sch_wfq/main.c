@@ -1,13 +1,17 @@
 #include <linux/module.h>
 #include <linux/types.h>
 #include <linux/kernel.h>
+#include <linux/percpu.h>
 #include <net/netlink.h>
 #include <linux/pkt_sched.h>
 #include <net/sch_generic.h>
 #include <net/pkt_sched.h>
 #include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/if_vlan.h>
 #include <net/dsfield.h>
 #include <net/inet_ecn.h>
+#include <net/sock.h>
 
 #include "params.h"
 
@@ -18,16 +22,28 @@ struct wfq_rate_cfg
         u32     shift;
 };
 
+/* Per-CPU sojourn time histograms of all queues */
+struct wfq_hist
+{
+        u64     bins[wfq_max_queues][wfq_hist_buckets];
+};
+
 /**
  *      struct wfq_class - a Class of Service (CoS) queue
  *      @id: queue ID
  *      @prio: queue priority (0 is the highest)
  *      @len_bytes: queue length in bytes
+ *      @bp_bytes: bytes of the queue admitted over the buffer limit (backpressure)
  *      @qdisc: FIFO queue to store sk_buff
  *
  *      For WFQ scheduling
  *      @head_fin_time: virtual finish time of the head packet
  *
+ *      For PIE-like marking
+ *      @dq_tstamp: start time of the current departure rate measurement
+ *      @dq_count: bytes dequeued in the current measurement, -1 if none
+ *      @avg_dq_rate: smooth departure rate (bps), 0 if unknown
+ *
  *      For CoDel
  *      @count: how many marks since the last time we entered marking state
  *      @lastcount: count at entry to marking/dropping state
@@ -42,10 +58,15 @@ struct wfq_class
         u8		id;
 	u8		prio;
         u32             len_bytes;
+        u32             bp_bytes;
         struct Qdisc    *qdisc;
 
         u64             head_fin_time;
 
+        s64             dq_tstamp;
+        s32             dq_count;
+        u64             avg_dq_rate;
+
         u32             count;
         u32             lastcount;
         bool            marking;
@@ -67,6 +88,9 @@ struct wfq_class
  *      @prio_len_bytes: buffer occupancy (in bytes) for different priorities
  *      @virtual_time: virtual system time of WFQ scheduler. We maintain a
  *      virtual system time for each priority.
+ *
+ *      @hist: per-CPU sojourn time histograms of all queues
+ *      @xstats: sojourn time histograms summed over all CPUs for dump
  */
 struct wfq_sched_data
 {
@@ -79,6 +103,9 @@ struct wfq_sched_data
         u32     sum_len_bytes;
         u32	prio_len_bytes[wfq_max_prio];
         u64     virtual_time[wfq_max_prio];
+
+        struct wfq_hist __percpu        *hist;
+        struct tc_wfq_xstats            xstats;
 };
 
 static inline void print_wfq_sched_data(struct Qdisc *sch)
@@ -122,6 +149,52 @@ static inline bool wfq_time_before(u64 time1, u64 time2)
         return false;
 }
 
+/*
+ * Per-packet state kept in the private area of qdisc_skb_cb. We don't touch
+ * skb->tstamp since it may carry the departure time set by the sender.
+ */
+struct wfq_skb_cb
+{
+        u64     enqueue_time;   /* enqueue timestamp (ns), 0 if not recorded */
+        bool    throttled;      /* admitted over the buffer limit (backpressure) */
+};
+
+static inline struct wfq_skb_cb *wfq_skb_cb(const struct sk_buff *skb)
+{
+        qdisc_cb_private_validate(skb, sizeof(struct wfq_skb_cb));
+        return (struct wfq_skb_cb *)qdisc_skb_cb(skb)->data;
+}
+
+/* Do we need the enqueue timestamp of packets? */
+static inline bool wfq_need_tstamp(void)
+{
+        return wfq_ecn_scheme == wfq_tcn ||
+               wfq_ecn_scheme == wfq_codel ||
+               wfq_enable_hist == wfq_enable;
+}
+
+/* Account the sojourn time of a dequeued packet to its queue's histogram */
+static inline void wfq_hist_update(struct wfq_sched_data *q,
+                                   struct wfq_class *cl,
+                                   struct sk_buff *skb,
+                                   s64 now)
+{
+        u64 enqueue_time = wfq_skb_cb(skb)->enqueue_time;
+        s64 sojourn = now - enqueue_time;
+        int bucket = 0;
+
+        /* The packet was enqueued before histograms were enabled */
+        if (unlikely(enqueue_time == 0))
+                return;
+
+        if (likely(sojourn > 0))
+                bucket = min_t(int,
+                               fls64((u64)sojourn >> wfq_hist_shift),
+                               wfq_hist_buckets - 1);
+
+        this_cpu_inc(q->hist->bins[cl->id][bucket]);
+}
+
 /* nanosecond to codel time (1 << wfq_codel_shift ns) */
 static inline codel_time_t ns_to_codel_time(s64 ns)
 {
@@ -159,7 +232,72 @@ static inline u64 l2t_ns(struct wfq_rate_cfg *r, unsigned int len_bytes)
     return ((u64)len_bytes * r->mult) >> r->shift;
 }
 
-/* Queue length based ECN marking: per-queue abd  per-port */
+/* Exponential Weighted Moving Average (EWMA) for u64 */
+static inline u64 u64_ewma(u64 smooth, u64 sample, int weight, int shift)
+{
+        u64 val = smooth * weight;
+        val += sample * ((1 << shift) - weight);
+        return val >> shift;
+}
+
+/*
+ * Measure the departure rate of a queue before it sends a packet of len bytes.
+ * Borrow from pie_process_dequeue in Linux kernel: a measurement starts once
+ * the queue holds wfq_dq_thresh_bytes and ends after that many bytes left.
+ */
+static void wfq_dq_rate_update(struct wfq_sched_data *q,
+                               struct wfq_class *cl,
+                               unsigned int len,
+                               s64 now)
+{
+        s64 interval;
+        u64 sample;
+
+        if (cl->len_bytes >= wfq_dq_thresh_bytes && cl->dq_count < 0)
+        {
+                cl->dq_tstamp = now;
+                cl->dq_count = 0;
+        }
+
+        if (cl->dq_count < 0)
+                return;
+
+        cl->dq_count += len;
+        if (cl->dq_count < wfq_dq_thresh_bytes)
+                return;
+
+        /* The measurement ends when this packet leaves the wire */
+        interval = now + (s64)l2t_ns(&q->rate, len) - cl->dq_tstamp;
+        if (likely(interval > 0))
+        {
+                sample = div64_u64((u64)cl->dq_count * 8 * NSEC_PER_SEC,
+                                   interval);
+                if (cl->avg_dq_rate == 0)
+                        cl->avg_dq_rate = sample;
+                else
+                        cl->avg_dq_rate = u64_ewma(cl->avg_dq_rate, sample,
+                                                   wfq_dq_rate_alpha,
+                                                   wfq_dq_rate_shift);
+
+                if (wfq_enable_debug == wfq_enable)
+                        printk(KERN_INFO "queue %d departure rate sample %llu "
+                               "average %llu\n",
+                               cl->id, sample, cl->avg_dq_rate);
+        }
+
+        /* Start the next measurement only if enough bytes are left */
+        if (cl->len_bytes - len < wfq_dq_thresh_bytes)
+        {
+                cl->dq_count = -1;
+        }
+        else
+        {
+                cl->dq_count = 0;
+                cl->dq_tstamp = now + l2t_ns(&q->rate, len);
+        }
+}
+
+/* Queue length based ECN marking: per-queue, per-port and PIE-like */
 void wfq_qlen_marking(struct sk_buff *skb,
                       struct wfq_sched_data *q,
 		      struct wfq_class *cl)
@@ -180,6 +318,23 @@ void wfq_qlen_marking(struct sk_buff *skb,
 				INET_ECN_set_ce(skb);
 			break;
 		}
+		/*
+		 * PIE-like marking: scale the port threshold by the measured
+		 * departure rate of the queue
+		 */
+		case wfq_pie:
+		{
+			u64 thresh = wfq_port_thresh_bytes;
+
+			if (cl->avg_dq_rate > 0)
+				thresh = div64_u64(min_t(u64, cl->avg_dq_rate,
+							 q->rate.rate_bps) *
+						   wfq_port_thresh_bytes,
+						   q->rate.rate_bps);
+			if (cl->len_bytes > thresh)
+				INET_ECN_set_ce(skb);
+			break;
+		}
 		default:
 		{
 			break;
@@ -191,7 +346,12 @@ void wfq_qlen_marking(struct sk_buff *skb,
 static inline void tcn_marking(struct sk_buff *skb)
 {
         codel_time_t delay;
-        delay = ns_to_codel_time(ktime_get_ns() - skb->tstamp.tv64);
+
+        /* The packet was enqueued before TCN was enabled */
+        if (unlikely(wfq_skb_cb(skb)->enqueue_time == 0))
+                return;
+
+        delay = ns_to_codel_time(ktime_get_ns() - wfq_skb_cb(skb)->enqueue_time);
 
         if (codel_time_after(delay, (codel_time_t)wfq_tcn_thresh))
                 INET_ECN_set_ce(skb);
@@ -205,7 +365,11 @@ static bool codel_should_mark(const struct sk_buff *skb,
         bool ok_to_mark;
         codel_time_t now = ns_to_codel_time(now_ns);
 
-        cl->ldelay = ns_to_codel_time(now_ns - skb->tstamp.tv64);
+        /* The packet was enqueued before CoDel was enabled */
+        if (unlikely(wfq_skb_cb(skb)->enqueue_time == 0))
+                return false;
+
+        cl->ldelay = ns_to_codel_time(now_ns - wfq_skb_cb(skb)->enqueue_time);
 
 	if (codel_time_before(cl->ldelay, (codel_time_t)wfq_codel_target) ||
 	    cl->len_bytes <= wfq_max_pkt_bytes)
@@ -325,24 +489,50 @@ static void codel_marking(struct sk_buff *skb, struct wfq_class *cl)
 }
 
 
+/* Return the classifier key (DSCP or VLAN PCP) of a packet, or -1 if none */
+static int wfq_classify_field(struct sk_buff *skb)
+{
+	u16 vlan_tci;
+
+	if (wfq_classify_key == wfq_classify_pcp)
+	{
+		if (vlan_get_tag(skb, &vlan_tci) < 0)
+			return -1;
+		return (vlan_tci & VLAN_PRIO_MASK) >> VLAN_PRIO_SHIFT;
+	}
+
+	switch (tc_skb_protocol(skb))
+	{
+	case htons(ETH_P_IP):
+		if (!pskb_network_may_pull(skb, sizeof(struct iphdr)))
+			return -1;
+		return ipv4_get_dsfield(ip_hdr(skb)) >> 2;
+	case htons(ETH_P_IPV6):
+		if (!pskb_network_may_pull(skb, sizeof(struct ipv6hdr)))
+			return -1;
+		return ipv6_get_dsfield(ipv6_hdr(skb)) >> 2;
+	default:
+		return -1;
+	}
+}
+
 static struct wfq_class *wfq_classify(struct sk_buff *skb, struct Qdisc *sch)
 {
-        int i, dscp;
+        int i, key;
 	struct wfq_sched_data *q = qdisc_priv(sch);
-	struct iphdr* iph = ip_hdr(skb);
 
         if (unlikely(!(q->queues)))
                 return NULL;
 
+	key = wfq_classify_field(skb);
+
         /* Return queue[0] by default*/
-        if (unlikely(!iph))
+        if (unlikely(key < 0))
                 return &(q->queues[0]);
 
-	dscp = iph->tos >> 2;
-
 	for (i = 0; i < wfq_max_queues; i++)
 	{
-                if(dscp == wfq_queue_dscp[i])
+                if(key == wfq_queue_dscp[i])
                         return &(q->queues[i]);
 	}
 
@@ -436,9 +626,14 @@ static struct sk_buff *wfq_dequeue(struct Qdisc *sch)
         if (unlikely(!skb))
                 return NULL;
 
+        if (wfq_ecn_scheme == wfq_pie)
+                wfq_dq_rate_update(q, cl, len, now);
+
         q->sum_len_bytes -= len;
         sch->q.qlen--;
         cl->len_bytes -= len;
+        if (wfq_skb_cb(skb)->throttled)
+                cl->bp_bytes -= len;
         q->prio_len_bytes[prio] -= len;
 
         /* Set the head_fin_time for the remaining head packet */
@@ -463,6 +658,9 @@ static struct sk_buff *wfq_dequeue(struct Qdisc *sch)
         qdisc_unthrottled(sch);
         qdisc_bstats_update(sch, skb);
 
+        if (wfq_enable_hist == wfq_enable)
+                wfq_hist_update(q, cl, skb, now);
+
         /* TCN */
         if (wfq_ecn_scheme == wfq_tcn)
                 tcn_marking(skb);
@@ -492,24 +690,59 @@ static bool wfq_buffer_overfill(unsigned int len,
 		return false;
 }
 
+/*
+ * Keep a packet that overfills the buffer and throttle its sender instead?
+ * Only local TCP senders can be throttled: NET_XMIT_CN makes TCP reduce its
+ * window and TSQ stops the socket until its packets leave the qdisc, while
+ * UDP and raw sockets take it as success. Each queue holds at most
+ * wfq_bp_headroom_bytes over its limit, so one class can not take the
+ * headroom of the others, and the port never holds more than
+ * wfq_max_buffer_bytes.
+ */
+static inline bool wfq_backpressure(struct sk_buff *skb,
+				    unsigned int len,
+				    struct wfq_class *cl,
+				    struct wfq_sched_data *q)
+{
+	return wfq_enable_backpressure == wfq_enable &&
+	       skb->sk && sk_fullsock(skb->sk) &&
+	       skb->sk->sk_protocol == IPPROTO_TCP &&
+	       cl->bp_bytes + len <= wfq_bp_headroom_bytes &&
+	       q->sum_len_bytes + len <= wfq_max_buffer_bytes;
+}
+
 static int wfq_enqueue(struct sk_buff *skb, struct Qdisc *sch)
 {
         struct wfq_class *cl = NULL;
 	unsigned int len = skb_size(skb);
 	struct wfq_sched_data *q = qdisc_priv(sch);
 	int ret, weight;
-
+	bool throttle = false;
 
 	cl = wfq_classify(skb, sch);
-	/* No appropriate queue or the switch buffer is overfilled */
-	if (unlikely(!cl) || wfq_buffer_overfill(len, cl, q))
+	/* No appropriate queue */
+	if (unlikely(!cl))
 	{
 		qdisc_qstats_drop(sch);
-		qdisc_qstats_drop(cl->qdisc);
 		kfree_skb(skb);
 		return NET_XMIT_DROP;
 	}
 
+	/* The switch buffer is overfilled */
+	if (wfq_buffer_overfill(len, cl, q))
+	{
+		if (!wfq_backpressure(skb, len, cl, q))
+		{
+			qdisc_qstats_drop(sch);
+			qdisc_qstats_drop(cl->qdisc);
+			kfree_skb(skb);
+			return NET_XMIT_DROP;
+		}
+
+		qdisc_qstats_overlimit(sch);
+		throttle = true;
+	}
+
 	ret = qdisc_enqueue(skb, cl->qdisc);
 	if (unlikely(ret != NET_XMIT_SUCCESS))
 	{
@@ -542,15 +775,20 @@ static int wfq_enqueue(struct sk_buff *skb, struct Qdisc *sch)
 	q->sum_len_bytes += len;
 	cl->len_bytes += len;
         q->prio_len_bytes[cl->prio] += len;
+	wfq_skb_cb(skb)->throttled = throttle;
+	if (throttle)
+		cl->bp_bytes += len;
+
+	/* sojourn time based ECN marking (TCN and CoDel) and histograms */
+	wfq_skb_cb(skb)->enqueue_time = wfq_need_tstamp() ? ktime_get_ns() : 0;
 
-	/* sojourn time based ECN marking: TCN and CoDel */
-	if (wfq_ecn_scheme == wfq_tcn || wfq_ecn_scheme == wfq_codel)
-		skb->tstamp = ktime_get();
 	/* enqueue queue length based ECN marking */
-	else if (wfq_enable_dequeue_ecn == wfq_disable)
+	if (wfq_ecn_scheme != wfq_tcn &&
+	    wfq_ecn_scheme != wfq_codel &&
+	    wfq_enable_dequeue_ecn == wfq_disable)
 		wfq_qlen_marking(skb, q, cl);
 
-	return ret;
+	return throttle ? NET_XMIT_CN : ret;
 }
 
 
@@ -560,12 +798,53 @@ static unsigned int wfq_drop(struct Qdisc *sch)
     return 0;
 }
 
-/* We don't need this */
+/* Report the rate and all module parameters */
 static int wfq_dump(struct Qdisc *sch, struct sk_buff *skb)
 {
-    return 0;
+	struct wfq_sched_data *q = qdisc_priv(sch);
+	struct nlattr *opts = nla_nest_start(skb, TCA_OPTIONS);
+
+	if (!opts)
+		goto nla_put_failure;
+
+	if (nla_put_u64(skb, TCA_MQ_ECN_RATE, q->rate.rate_bps >> 3) ||
+	    wfq_params_dump(skb) < 0)
+		goto nla_put_failure;
+
+	return nla_nest_end(skb, opts);
+
+nla_put_failure:
+	nla_nest_cancel(skb, opts);
+	return -1;
 }
 
+/* Export per-queue sojourn time histograms */
+static int wfq_dump_stats(struct Qdisc *sch, struct gnet_dump *d)
+{
+        struct wfq_sched_data *q = qdisc_priv(sch);
+        int cpu, i, j;
+
+        memset(&q->xstats, 0, sizeof(q->xstats));
+
+        if (likely(q->hist))
+        {
+                for_each_possible_cpu(cpu)
+                {
+                        const struct wfq_hist *h = per_cpu_ptr(q->hist, cpu);
+
+                        for (i = 0; i < wfq_max_queues; i++)
+                                for (j = 0; j < wfq_hist_buckets; j++)
+                                        q->xstats.sojourn_hist[i][j] +=
+                                                h->bins[i][j];
+                }
+        }
+
+        return gnet_stats_copy_app(d, &q->xstats, sizeof(q->xstats));
+}
+
+/* Number of WFQ qdiscs, changed under RTNL. The parameters are module-wide */
+static unsigned int wfq_nr_qdiscs;
+
 /* Release Qdisc resources */
 static void wfq_destroy(struct Qdisc *sch)
 {
@@ -578,37 +857,48 @@ static void wfq_destroy(struct Qdisc *sch)
                         qdisc_destroy((q->queues[i]).qdisc);
 	}
 	qdisc_watchdog_cancel(&q->watchdog);
+        free_percpu(q->hist);
+        q->hist = NULL;
+        wfq_nr_qdiscs--;
         printk(KERN_INFO "destroy sch_wfq on %s\n", sch->dev_queue->dev->name);
         print_wfq_sched_data(sch);
 }
 
-static const struct nla_policy wfq_policy[TCA_TBF_MAX + 1] = {
-	[TCA_TBF_PARMS] = { .len = sizeof(struct tc_tbf_qopt) },
-	[TCA_TBF_RTAB]	= { .type = NLA_BINARY, .len = TC_RTAB_SIZE },
-	[TCA_TBF_PTAB]	= { .type = NLA_BINARY, .len = TC_RTAB_SIZE },
+static const struct nla_policy wfq_policy[TCA_MQ_ECN_MAX + 1] = {
+	[TCA_MQ_ECN_RATE]	= { .type = NLA_U64 },
+	[TCA_MQ_ECN_PARAMS]	= { .type = NLA_NESTED },
 };
 
-/* We only leverage TC netlink interface to configure rate */
+/*
+ * Configure the rate and, optionally, module parameters through TC netlink.
+ * The parameters are module-wide, so they can only change while this is the
+ * only WFQ qdisc. Use the sysctls to change them for all ports.
+ */
 static int wfq_change(struct Qdisc *sch, struct nlattr *opt)
 {
         int err;
 	struct wfq_sched_data *q = qdisc_priv(sch);
-	struct nlattr *tb[TCA_TBF_PTAB + 1];
-	struct tc_tbf_qopt *qopt;
-	__u32 rate;
+	struct nlattr *tb[TCA_MQ_ECN_MAX + 1];
 
-	err = nla_parse_nested(tb, TCA_TBF_PTAB, opt, wfq_policy);
+	err = nla_parse_nested(tb, TCA_MQ_ECN_MAX, opt, wfq_policy);
 	if(err < 0)
 		return err;
 
+	/* The rate is mandatory when the qdisc is created */
 	err = -EINVAL;
-	if (tb[TCA_TBF_PARMS] == NULL)
+	if (!tb[TCA_MQ_ECN_RATE] && !q->rate.rate_bps)
 		goto done;
 
-	qopt = nla_data(tb[TCA_TBF_PARMS]);
-	rate = qopt->rate.rate;
+	if (tb[TCA_MQ_ECN_PARAMS])
+	{
+		err = wfq_params_set(tb[TCA_MQ_ECN_PARAMS], wfq_nr_qdiscs > 1);
+		if (err < 0)
+			goto done;
+	}
+
 	/* convert from bytes/s to b/s */
-	q->rate.rate_bps = (u64)rate << 3;
+	if (tb[TCA_MQ_ECN_RATE])
+		q->rate.rate_bps = nla_get_u64(tb[TCA_MQ_ECN_RATE]) << 3;
         precompute_ratedata(&q->rate);
 	err = 0;
 
@@ -621,18 +911,24 @@ static int wfq_change(struct Qdisc *sch, struct nlattr *opt)
 /* Initialize Qdisc */
 static int wfq_init(struct Qdisc *sch, struct nlattr *opt)
 {
-	int i;
+	int i, err = -ENOMEM;
 	struct wfq_sched_data *q = qdisc_priv(sch);
 	struct Qdisc *child;
 
 	if(sch->parent != TC_H_ROOT)
 		return -EOPNOTSUPP;
 
+	/* From here on, wfq_destroy() undoes a failed init */
+	wfq_nr_qdiscs++;
         q->tokens = 0;
         q->time_ns = ktime_get_ns();
         q->sum_len_bytes = 0;
 	qdisc_watchdog_init(&q->watchdog, sch);
 
+        q->hist = alloc_percpu(struct wfq_hist);
+        if (unlikely(!q->hist))
+                goto err;
+
         /* Initialize per-priority variables */
 	for (i = 0; i < wfq_max_prio; i++)
 	{
@@ -655,6 +951,7 @@ static int wfq_init(struct Qdisc *sch, struct nlattr *opt)
                 (q->queues[i]).id = i;
 		(q->queues[i]).head_fin_time = 0;
                 (q->queues[i]).len_bytes = 0;
+                (q->queues[i]).bp_bytes = 0;
                 (q->queues[i]).count = 0;
                 (q->queues[i]).lastcount = 0;
                 (q->queues[i]).marking = false;
@@ -662,18 +959,23 @@ static int wfq_init(struct Qdisc *sch, struct nlattr *opt)
                 (q->queues[i]).first_above_time = 0;
                 (q->queues[i]).mark_next = 0;
                 (q->queues[i]).ldelay = 0;
+                (q->queues[i]).dq_tstamp = q->time_ns;
+                (q->queues[i]).dq_count = -1;
+                (q->queues[i]).avg_dq_rate = 0;
 	}
 
-	return wfq_change(sch, opt);
+	err = wfq_change(sch, opt);
+	if (likely(!err))
+		return 0;
 err:
 	wfq_destroy(sch);
-	return -ENOMEM;
+	return err;
 }
 
 static struct Qdisc_ops wfq_ops __read_mostly = {
 	.next          =       NULL,
 	.cl_ops        =       NULL,
-	.id            =       "tbf",
+	.id            =       "wfq",
 	.priv_size     =       sizeof(struct wfq_sched_data),
 	.init          =       wfq_init,
 	.destroy       =       wfq_destroy,
@@ -683,6 +985,7 @@ static struct Qdisc_ops wfq_ops __read_mostly = {
 	.drop          =       wfq_drop,
 	.change        =       wfq_change,
 	.dump          =       wfq_dump,
+	.dump_stats    =       wfq_dump_stats,
 	.owner         =       THIS_MODULE,
 };
 
@@ -29,6 +29,16 @@ int wfq_tcn_thresh = 250;
 int wfq_codel_target = 100;
 /* CoDel interval (1024 nanoseconds) */
 int wfq_codel_interval = 2000;
+/* By default, we disable per-queue sojourn time histograms */
+int wfq_enable_hist = wfq_disable;
+/* By default, we classify packets by DSCP */
+int wfq_classify_key = wfq_classify_dscp;
+/* Measure the departure rate every 10KB, like PIE */
+int wfq_dq_thresh_bytes = 10000;
+/* Alpha for departure rate estimation. It is 0.875 by default. */
+int wfq_dq_rate_alpha = MQ_ECN_DQ_RATE_ALPHA;
+/* By default, we drop packets of local senders when the buffer is full */
+int wfq_enable_backpressure = wfq_disable;
 
 int wfq_enable_min = wfq_disable;
 int wfq_enable_max = wfq_enable;
@@ -37,11 +47,17 @@ int wfq_prio_max = wfq_max_prio - 1;
 int wfq_buffer_mode_min = wfq_shared_buffer;
 int wfq_buffer_mode_max = wfq_static_buffer;
 int wfq_ecn_scheme_min = wfq_disable_ecn;
-int wfq_ecn_scheme_max = wfq_codel;
+int wfq_ecn_scheme_max = wfq_pie;
+int wfq_classify_key_min = wfq_classify_dscp;
+int wfq_classify_key_max = wfq_classify_pcp;
 int wfq_dscp_min = 0;
 int wfq_dscp_max = (1 << 6) - 1;
 int wfq_weight_min = 1;
 int wfq_weight_max = wfq_min_pkt_bytes;
+int wfq_dq_thresh_bytes_min = wfq_max_pkt_bytes;
+int wfq_dq_thresh_bytes_max = wfq_max_buffer_bytes;
+int wfq_dq_rate_alpha_min = 0;
+int wfq_dq_rate_alpha_max = MQ_ECN_DQ_RATE_ALPHA_MAX;
 
 /* Per queue ECN marking threshold (bytes) */
 int wfq_queue_thresh_bytes[wfq_max_queues];
@@ -70,6 +86,11 @@ struct wfq_param wfq_params[wfq_total_params + 1] =
 	{"tcn_thresh",		&wfq_tcn_thresh},
 	{"codel_target",	&wfq_codel_target},
 	{"codel_interval",	&wfq_codel_interval},
+	{"enable_hist",		&wfq_enable_hist},
+	{"classify_key",	&wfq_classify_key},
+	{"dq_thresh",		&wfq_dq_thresh_bytes},
+	{"dq_rate_alpha",	&wfq_dq_rate_alpha},
+	{"enable_backpressure",	&wfq_enable_backpressure},
 };
 
 struct ctl_table wfq_params_table[wfq_total_params + 1];
@@ -132,8 +153,11 @@ bool wfq_params_init(void)
 		entry->data = wfq_params[i].ptr;
 		entry->mode = 0644;
 
-		/* enable_debug and enable_dequeue_ecn */
-		if (i == 0 || i == 6)
+		/*
+		 * enable_debug, enable_dequeue_ecn, enable_hist and
+		 * enable_backpressure
+		 */
+		if (i == 0 || i == 6 || i == 10 || i == 14)
 		{
 			entry->proc_handler = &proc_dointvec_minmax;
 			entry->extra1 = &wfq_enable_min;
@@ -153,6 +177,27 @@ bool wfq_params_init(void)
 			entry->extra1 = &wfq_ecn_scheme_min;
 			entry->extra2 = &wfq_ecn_scheme_max;
 		}
+		/* classify_key */
+		else if (i == 11)
+		{
+			entry->proc_handler = &proc_dointvec_minmax;
+			entry->extra1 = &wfq_classify_key_min;
+			entry->extra2 = &wfq_classify_key_max;
+		}
+		/* dq_thresh */
+		else if (i == 12)
+		{
+			entry->proc_handler = &proc_dointvec_minmax;
+			entry->extra1 = &wfq_dq_thresh_bytes_min;
+			entry->extra2 = &wfq_dq_thresh_bytes_max;
+		}
+		/* dq_rate_alpha */
+		else if (i == 13)
+		{
+			entry->proc_handler = &proc_dointvec_minmax;
+			entry->extra1 = &wfq_dq_rate_alpha_min;
+			entry->extra2 = &wfq_dq_rate_alpha_max;
+		}
 		/* Per-queue DSCP */
 		else if (i >= wfq_global_params + wfq_max_queues &&
 			 i < wfq_global_params + 2 * wfq_max_queues)
@@ -197,3 +242,88 @@ void wfq_params_exit()
 	if (likely(wfq_sysctl))
 		unregister_sysctl_table(wfq_sysctl);
 }
+
+/* Look up a parameter and check the value against the range of its sysctl */
+static int wfq_param_find(const struct tc_mq_ecn_param *p)
+{
+	struct ctl_table *entry;
+	int i;
+
+	if (strnlen(p->name, TC_MQ_ECN_NAMSIZ) == TC_MQ_ECN_NAMSIZ)
+		return -EINVAL;
+
+	for (i = 0; wfq_params_table[i].procname; i++)
+	{
+		entry = &wfq_params_table[i];
+		if (strcmp(entry->procname, p->name))
+			continue;
+
+		if (entry->extra1 && p->value < *(int *)entry->extra1)
+			return -EINVAL;
+		if (entry->extra2 && p->value > *(int *)entry->extra2)
+			return -EINVAL;
+		return i;
+	}
+
+	return -EINVAL;
+}
+
+int wfq_params_set(const struct nlattr *nla, bool shared)
+{
+	const struct nlattr *attr;
+	const struct tc_mq_ecn_param *p;
+	int rem, i;
+
+	/* Validate every parameter before changing any */
+	nla_for_each_nested(attr, nla, rem)
+	{
+		if (nla_type(attr) != TCA_MQ_ECN_PARAM ||
+		    nla_len(attr) < (int)sizeof(*p))
+			return -EINVAL;
+
+		p = nla_data(attr);
+		i = wfq_param_find(p);
+		if (i < 0)
+			return -EINVAL;
+		/* Do not reconfigure the other qdiscs behind their back */
+		if (shared && p->value != *(wfq_params[i].ptr))
+		{
+			printk(KERN_INFO "sch_wfq: %s is shared by all wfq "
+			       "qdiscs, set it in /proc/sys/wfq\n", p->name);
+			return -EBUSY;
+		}
+	}
+
+	nla_for_each_nested(attr, nla, rem)
+	{
+		p = nla_data(attr);
+		i = wfq_param_find(p);
+		*(wfq_params[i].ptr) = p->value;
+	}
+
+	return 0;
+}
+
+int wfq_params_dump(struct sk_buff *skb)
+{
+	struct nlattr *nest = nla_nest_start(skb, TCA_MQ_ECN_PARAMS);
+	struct tc_mq_ecn_param p;
+	int i;
+
+	if (!nest)
+		return -EMSGSIZE;
+
+	for (i = 0; wfq_params[i].ptr; i++)
+	{
+		memset(&p, 0, sizeof(p));
+		strlcpy(p.name, wfq_params[i].name, sizeof(p.name));
+		p.value = *(wfq_params[i].ptr);
+		if (nla_put(skb, TCA_MQ_ECN_PARAM, sizeof(p), &p))
+		{
+			nla_nest_cancel(skb, nest);
+			return -EMSGSIZE;
+		}
+	}
+
+	return nla_nest_end(skb, nest);
+}
@@ -2,6 +2,10 @@
 #define __PARAMS_H__
 
 #include <linux/types.h>
+#include <net/netlink.h>
+
+#include "../include/pkt_sched_mq_ecn.h"
+#include "../include/mq_ecn_dq_rate.h"
 
 /*
  * CoDel uses a 1024 nsec clock, encoded in u32
@@ -44,6 +48,8 @@ typedef s32 codel_tdiff_t;
 #define wfq_min_pkt_bytes 64
 /* Maximum (per queue/per port shared) buffer size (2MB) */
 #define wfq_max_buffer_bytes 2000000
+/* Bytes a queue may hold over its buffer limit to throttle local TCP senders */
+#define wfq_bp_headroom_bytes (wfq_max_buffer_bytes / wfq_max_queues)
 /* Per port shared buffer management policy */
 #define	wfq_shared_buffer 0
 /* Per port static buffer management policy */
@@ -61,15 +67,28 @@ typedef s32 codel_tdiff_t;
 #define wfq_tcn 4
 /* CoDel */
 #define wfq_codel 5
+/* PIE-like marking on the measured departure rate of each queue */
+#define wfq_pie 6
 
 /* For CoDel timestamp */
 #define wfq_codel_shift 10
+/* For departure rate estimation Alpha parameter: wfq_dq_rate_alpha */
+#define wfq_dq_rate_shift MQ_ECN_DQ_RATE_SHIFT
+
+/* Sojourn time histogram: log2 buckets in units of (1 << wfq_hist_shift) ns */
+#define wfq_hist_buckets 16
+#define wfq_hist_shift 10
+
+/* Classify packets by DSCP (IPv4 TOS or IPv6 traffic class) */
+#define wfq_classify_dscp 0
+/* Classify packets by VLAN priority code point (PCP) */
+#define wfq_classify_pcp 1
 
 #define wfq_disable 0
 #define wfq_enable 1
 
 /* The number of global (rather than 'per-queue') parameters */
-#define wfq_global_params 10
+#define wfq_global_params 15
 /* The number of parameters for each queue */
 #define wfq_queue_params 5
 /* The total number of parameters (per-queue and global parameters) */
@@ -96,6 +115,16 @@ extern int wfq_tcn_thresh;
 extern int wfq_codel_target;
 /* CoDel interval (1024 nanoseconds) */
 extern int wfq_codel_interval;
+/* Enable per-queue sojourn time histograms or not */
+extern int wfq_enable_hist;
+/* Classifier key: DSCP (0) or VLAN PCP (1) */
+extern int wfq_classify_key;
+/* Bytes dequeued in each departure rate measurement */
+extern int wfq_dq_thresh_bytes;
+/* Alpha for departure rate estimation */
+extern int wfq_dq_rate_alpha;
+/* Throttle local senders (NET_XMIT_CN) instead of dropping or not */
+extern int wfq_enable_backpressure;
 
 /* Per-queue parameters */
 /* Per queue ECN marking threshold (bytes) */
@@ -109,6 +138,18 @@ extern int wfq_queue_buffer_bytes[wfq_max_queues];
 /* Per queue priority (0 to wfq_max_prio - 1) */
 extern int wfq_queue_prio[wfq_max_queues];
 
+/*
+ * Per-queue sojourn time histograms exported through the qdisc statistics
+ * dump (TCA_STATS_APP). Bucket 0 counts packets that stayed less than
+ * (1 << wfq_hist_shift) ns and bucket i (i > 0) counts packets that stayed
+ * in [2^(i - 1), 2^i) of that unit. The last bucket also absorbs all larger
+ * sojourn times.
+ */
+struct tc_wfq_xstats
+{
+	__u64 sojourn_hist[wfq_max_queues][wfq_hist_buckets];
+};
+
 struct wfq_param
 {
 	char name[64];
@@ -121,5 +162,13 @@ extern struct wfq_param wfq_params[wfq_total_params + 1];
 bool wfq_params_init(void);
 /* Unregister sysctl */
 void wfq_params_exit(void);
+/*
+ * Apply nested TCA_MQ_ECN_PARAM attributes, all or nothing. The parameters
+ * are module-wide: if shared (other qdiscs of the module exist), a value
+ * that differs from the current one fails with -EBUSY.
+ */
+int wfq_params_set(const struct nlattr *nla, bool shared);
+/* Put every parameter in a TCA_MQ_ECN_PARAMS attribute */
+int wfq_params_dump(struct sk_buff *skb);
 
 #endif
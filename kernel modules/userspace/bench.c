@@ -0,0 +1,621 @@
+/*
+ * Replay a packet trace through one of the qdisc modules on a virtual clock
+ * and report the CPU cost per packet, ECN marks, drops, delay and fairness.
+ *
+ * Traces are synthetic (Poisson arrivals over a set of DSCP classes), CSV
+ * ("time_ns,bytes,dscp[,gso_segs[,flow]]" per line) or classic pcap (Ethernet
+ * or raw IP). The class of a packet is its DSCP. Synthetic traffic of a class
+ * comes from a few long-lived flows (elephants) and, optionally, from
+ * single-packet flows (mice), which are reported separately.
+ */
+#include <kshim.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+
+#include "../include/pkt_sched_mq_ecn.h"
+
+#define BENCH_MAX_CLASSES 64
+#define BENCH_MAX_PARAMS 32
+#define BENCH_HDR_BYTES 64
+/* Watchdog wakeups in a row without a dequeued packet before giving up */
+#define BENCH_MAX_WAKEUPS 1000000
+
+struct bench_pkt
+{
+	s64 time_ns;
+	unsigned int len;
+	unsigned int dscp;
+	unsigned int gso_segs;
+	bool ipv6;
+	u16 vlan_tci;
+	u32 hash;
+	bool mouse;
+};
+
+struct bench_class
+{
+	u64 pkts_in;
+	u64 bytes_in;
+	u64 pkts_out;
+	u64 bytes_out;
+	/* bytes dequeued before the last arrival, for fairness */
+	u64 bytes_busy;
+	u64 marks;
+	u64 drops;
+	s64 delay_sum_ns;
+	s64 delay_max_ns;
+};
+
+/* Packets of mice or elephants over all classes */
+struct bench_flows
+{
+	u64 pkts;
+	u64 marks;
+	s64 delay_sum_ns;
+};
+
+struct bench_trace
+{
+	/* synthetic */
+	u64 remaining;
+	double mean_gap_ns;
+	unsigned int classes;
+	unsigned int pkt_bytes;
+	unsigned int gso_segs;
+	unsigned int elephants;
+	unsigned int mice_pct;
+	bool ipv6;
+	s64 now_ns;
+	/* CSV or pcap */
+	FILE *fp;
+	bool pcap;
+	bool pcap_swap;
+	bool pcap_nsec;
+	u32 pcap_linktype;
+	s64 pcap_base_ns;
+};
+
+static struct bench_class classes[BENCH_MAX_CLASSES];
+static struct bench_flows mice, elephants;
+static u64 next_id = 0;
+/* The socket of all packets when they come from local senders (-L or -U) */
+static struct sock local_sk = { .local = 1, .sk_protocol = IPPROTO_TCP };
+static bool local_senders = false;
+
+static double bench_uniform(void)
+{
+	return (random() + 1.0) / ((double)RAND_MAX + 2.0);
+}
+
+/* Flow hash of a flow ID, like skb_get_hash() would give for a 5-tuple */
+static u32 bench_flow_hash(u32 flow)
+{
+	flow = (flow ^ (flow >> 16)) * 0x45d9f3b;
+	flow = (flow ^ (flow >> 16)) * 0x45d9f3b;
+	return flow ^ (flow >> 16);
+}
+
+static int trace_next_synthetic(struct bench_trace *t, struct bench_pkt *p)
+{
+	if (t->remaining == 0)
+		return 0;
+
+	t->remaining--;
+	t->now_ns += (s64)(-log(bench_uniform()) * t->mean_gap_ns);
+	p->time_ns = t->now_ns;
+	p->dscp = random() % t->classes;
+	p->gso_segs = t->gso_segs;
+	p->len = t->pkt_bytes * t->gso_segs;
+	p->ipv6 = t->ipv6;
+	p->vlan_tci = 0;
+	p->mouse = (unsigned int)(random() % 100) < t->mice_pct;
+	if (p->mouse)
+		p->hash = ((u32)random() << 16) ^ (u32)random();
+	else
+		p->hash = bench_flow_hash(p->dscp * t->elephants +
+					  random() % t->elephants);
+	return 1;
+}
+
+static int trace_next_csv(struct bench_trace *t, struct bench_pkt *p)
+{
+	char line[256];
+	long long time_ns;
+	unsigned int len, dscp, segs, flow;
+	int n;
+
+	while (fgets(line, sizeof(line), t->fp))
+	{
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		segs = 1;
+		flow = 0;
+		n = sscanf(line, "%lld,%u,%u,%u,%u", &time_ns, &len, &dscp, &segs,
+			   &flow);
+		if (n < 3)
+		{
+			fprintf(stderr, "bad trace line: %s", line);
+			continue;
+		}
+
+		p->time_ns = time_ns;
+		p->len = len;
+		p->dscp = dscp & 0x3f;
+		p->gso_segs = segs ? segs : 1;
+		p->ipv6 = false;
+		p->vlan_tci = 0;
+		p->hash = bench_flow_hash(flow);
+		p->mouse = false;
+		return 1;
+	}
+
+	return 0;
+}
+
+static u32 pcap_u32(const struct bench_trace *t, u32 v)
+{
+	return t->pcap_swap ? __builtin_bswap32(v) : v;
+}
+
+static int trace_open_pcap(struct bench_trace *t)
+{
+	u32 hdr[6];
+
+	if (fread(hdr, sizeof(hdr), 1, t->fp) != 1)
+		return -1;
+
+	switch (hdr[0])
+	{
+	case 0xa1b2c3d4: t->pcap_swap = false; t->pcap_nsec = false; break;
+	case 0xd4c3b2a1: t->pcap_swap = true; t->pcap_nsec = false; break;
+	case 0xa1b23c4d: t->pcap_swap = false; t->pcap_nsec = true; break;
+	case 0x4d3cb2a1: t->pcap_swap = true; t->pcap_nsec = true; break;
+	default: return -1;
+	}
+
+	t->pcap_linktype = pcap_u32(t, hdr[5]);
+	/* Ethernet or raw IP */
+	if (t->pcap_linktype != 1 && t->pcap_linktype != 101)
+		return -1;
+
+	t->pcap = true;
+	t->pcap_base_ns = -1;
+	return 0;
+}
+
+static int trace_next_pcap(struct bench_trace *t, struct bench_pkt *p)
+{
+	unsigned char buf[BENCH_HDR_BYTES + 18];
+	u32 rec[4], caplen, off, ver, hash, i;
+	u16 ethertype;
+	s64 ts;
+
+	while (fread(rec, sizeof(rec), 1, t->fp) == 1)
+	{
+		caplen = pcap_u32(t, rec[2]);
+		memset(buf, 0, sizeof(buf));
+		if (fread(buf, 1, min_t(u32, caplen, sizeof(buf)), t->fp) !=
+		    min_t(u32, caplen, sizeof(buf)))
+			return 0;
+		if (caplen > sizeof(buf))
+			fseek(t->fp, caplen - sizeof(buf), SEEK_CUR);
+
+		ts = (s64)pcap_u32(t, rec[0]) * NSEC_PER_SEC +
+		     (s64)pcap_u32(t, rec[1]) * (t->pcap_nsec ? 1 : 1000);
+		if (t->pcap_base_ns < 0)
+			t->pcap_base_ns = ts;
+
+		p->time_ns = ts - t->pcap_base_ns;
+		p->len = pcap_u32(t, rec[3]);
+		p->gso_segs = 1;
+		p->vlan_tci = 0;
+
+		off = 0;
+		if (t->pcap_linktype == 1)
+		{
+			off = 12;
+			ethertype = (buf[off] << 8) | buf[off + 1];
+			if (ethertype == ETH_P_8021Q)
+			{
+				p->vlan_tci = ((buf[off + 2] << 8) | buf[off + 3]) |
+					      VLAN_TAG_PRESENT;
+				off += 4;
+			}
+			off += 2;
+		}
+
+		ver = buf[off] >> 4;
+		if (ver == 4)
+		{
+			p->ipv6 = false;
+			p->dscp = buf[off + 1] >> 2;
+		}
+		else if (ver == 6)
+		{
+			p->ipv6 = true;
+			p->dscp = (((buf[off] & 0x0f) << 4) | (buf[off + 1] >> 4)) >> 2;
+		}
+		else
+		{
+			continue;
+		}
+
+		/* Flows are told apart by their addresses (FNV-1a) */
+		hash = 2166136261U;
+		for (i = p->ipv6 ? 8 : 12; i < (p->ipv6 ? 40U : 20U); i++)
+			hash = (hash ^ buf[off + i]) * 16777619U;
+		p->hash = hash;
+		p->mouse = false;
+		return 1;
+	}
+
+	return 0;
+}
+
+static int trace_next(struct bench_trace *t, struct bench_pkt *p)
+{
+	if (!t->fp)
+		return trace_next_synthetic(t, p);
+	if (t->pcap)
+		return trace_next_pcap(t, p);
+	return trace_next_csv(t, p);
+}
+
+/* Build an ECN-capable IPv4/IPv6 packet. Only the network header is stored */
+static struct sk_buff *bench_build_skb(const struct bench_pkt *p)
+{
+	struct sk_buff *skb = shim_alloc_skb(BENCH_HDR_BYTES);
+	unsigned int hdr_len = p->ipv6 ? sizeof(struct ipv6hdr) : sizeof(struct iphdr);
+
+	if (!skb)
+		return NULL;
+
+	if (p->ipv6)
+	{
+		__be32 *w = (__be32 *)skb->head;
+
+		*w = htonl((6U << 28) | (((p->dscp << 2) | INET_ECN_ECT_0) << 20));
+		skb->protocol = htons(ETH_P_IPV6);
+	}
+	else
+	{
+		struct iphdr *iph = (struct iphdr *)skb->head;
+
+		iph->version = 4;
+		iph->ihl = 5;
+		iph->tos = (p->dscp << 2) | INET_ECN_ECT_0;
+		skb->protocol = htons(ETH_P_IP);
+	}
+
+	skb->network_header = 0;
+	skb->tail = hdr_len;
+	skb->len = max_t(unsigned int, p->len, hdr_len);
+	skb->vlan_tci = p->vlan_tci;
+	skb->shim_id = next_id++;
+	skb->shim_class = p->dscp;
+	skb->shim_mouse = p->mouse;
+	skb->hash = p->hash;
+	skb->shim_arrival_ns = p->time_ns;
+	skb->sk = local_senders ? &local_sk : NULL;
+	qdisc_skb_cb(skb)->pkt_len = skb->len;
+
+	if (p->gso_segs > 1)
+	{
+		skb->shinfo.gso_segs = p->gso_segs;
+		skb->shinfo.gso_size = DIV_ROUND_UP(skb->len - hdr_len, p->gso_segs);
+		/* Like qdisc_pkt_len_init(): count IP and TCP headers of all segments */
+		qdisc_skb_cb(skb)->pkt_len += (p->gso_segs - 1) * (hdr_len + 20);
+	}
+
+	return skb;
+}
+
+static bool bench_is_marked(const struct sk_buff *skb)
+{
+	if (skb->protocol == htons(ETH_P_IPV6))
+		return ((ntohl(*(__be32 *)skb->head) >> 20) & INET_ECN_MASK) == INET_ECN_CE;
+
+	return (ip_hdr(skb)->tos & INET_ECN_MASK) == INET_ECN_CE;
+}
+
+static s64 bench_clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (s64)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -r rate      rate in Mbps (default 1000)\n"
+		"  -n packets   synthetic packets (default 1000000)\n"
+		"  -c classes   synthetic DSCP classes 0..c-1 (default 8)\n"
+		"  -l load      synthetic offered load / rate (default 1.2)\n"
+		"  -s bytes     synthetic packet size (default 1500)\n"
+		"  -g segs      synthetic GSO segments per packet (default 1)\n"
+		"  -6           synthetic IPv6 packets\n"
+		"  -e flows     synthetic long-lived flows per class (default 1)\n"
+		"  -m percent   synthetic packets of single-packet flows (default 0)\n"
+		"  -t file      CSV trace: time_ns,bytes,dscp[,gso_segs[,flow]]\n"
+		"  -p file      pcap trace (Ethernet or raw IP)\n"
+		"  -L           packets come from local TCP sockets\n"
+		"  -U           packets come from local UDP sockets\n"
+		"  -o name=val  set a module parameter through netlink (repeatable)\n"
+		"  -S seed      random seed (default 1)\n"
+		"  -C           print a one-line CSV summary\n"
+		"  -v           print module messages\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_trace trace = { .remaining = 1000000, .classes = 8,
+				     .pkt_bytes = 1500, .gso_segs = 1,
+				     .elephants = 1 };
+	char *params[BENCH_MAX_PARAMS];
+	int nr_params = 0;
+	double rate_mbps = 1000, load = 1.2;
+	bool csv = false;
+	unsigned int seed = 1;
+	struct Qdisc_ops *ops;
+	struct Qdisc *sch;
+	struct sk_buff *opt_skb, *skb;
+	struct nlattr *opt, *nest;
+	struct tc_mq_ecn_param param;
+	struct bench_pkt pkt;
+	struct bench_flows *flows;
+	bool have_pkt;
+	s64 t0, enq_ns = 0, deq_ns = 0, last_arrival = 0, delay;
+	u64 enq_calls = 0, deq_calls = 0, pkts_out = 0, marks = 0, drops = 0;
+	u64 throttled = 0;
+	u64 bytes_out = 0, wakeups = 0;
+	double sum = 0, sum_sq = 0, jain;
+	int active = 0, ret, i, c;
+	char *eq;
+
+	while ((c = getopt(argc, argv, "r:n:c:l:s:g:6e:m:t:p:LUo:S:Cv")) != -1)
+	{
+		switch (c)
+		{
+		case 'r': rate_mbps = atof(optarg); break;
+		case 'n': trace.remaining = strtoull(optarg, NULL, 10); break;
+		case 'c': trace.classes = atoi(optarg); break;
+		case 'l': load = atof(optarg); break;
+		case 's': trace.pkt_bytes = atoi(optarg); break;
+		case 'g': trace.gso_segs = atoi(optarg); break;
+		case '6': trace.ipv6 = true; break;
+		case 'e': trace.elephants = atoi(optarg); break;
+		case 'm': trace.mice_pct = atoi(optarg); break;
+		case 't':
+		case 'p':
+			trace.fp = fopen(optarg, "rb");
+			if (!trace.fp)
+			{
+				perror(optarg);
+				return 1;
+			}
+			if (c == 'p' && trace_open_pcap(&trace) < 0)
+			{
+				fprintf(stderr, "%s: unsupported pcap file\n", optarg);
+				return 1;
+			}
+			break;
+		case 'o':
+			if (nr_params == BENCH_MAX_PARAMS || !strchr(optarg, '='))
+				usage(argv[0]);
+			params[nr_params++] = optarg;
+			break;
+		case 'L': local_senders = true; break;
+		case 'U':
+			local_senders = true;
+			local_sk.sk_protocol = IPPROTO_UDP;
+			break;
+		case 'S': seed = atoi(optarg); break;
+		case 'C': csv = true; break;
+		case 'v': shim_verbose = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+
+	if (rate_mbps <= 0 || load <= 0 ||
+	    trace.classes == 0 || trace.classes > BENCH_MAX_CLASSES ||
+	    trace.pkt_bytes == 0 || trace.gso_segs == 0 ||
+	    trace.elephants == 0 || trace.mice_pct > 100)
+		usage(argv[0]);
+
+	srandom(seed);
+	trace.mean_gap_ns = trace.pkt_bytes * trace.gso_segs * 8 * 1e3 /
+			    (rate_mbps * load);
+
+	/* Load the module */
+	if (shim_module_init() < 0 || !(ops = shim_registered_ops()))
+	{
+		fprintf(stderr, "failed to load the module\n");
+		return 1;
+	}
+
+	/* tc qdisc add dev shim0 root <module> rate <rate> [name value]... */
+	opt_skb = shim_alloc_skb(4096);
+	opt = nla_nest_start(opt_skb, TCA_OPTIONS);
+	nla_put_u64(opt_skb, TCA_MQ_ECN_RATE, (u64)(rate_mbps * 1e6 / 8));
+	nest = nla_nest_start(opt_skb, TCA_MQ_ECN_PARAMS);
+	for (i = 0; i < nr_params; i++)
+	{
+		eq = strchr(params[i], '=');
+		memset(&param, 0, sizeof(param));
+		snprintf(param.name, sizeof(param.name), "%.*s",
+			 (int)(eq - params[i]), params[i]);
+		param.value = atoi(eq + 1);
+		nla_put(opt_skb, TCA_MQ_ECN_PARAM, sizeof(param), &param);
+	}
+	nla_nest_end(opt_skb, nest);
+	nla_nest_end(opt_skb, opt);
+
+	sch = shim_qdisc_alloc(ops, NULL, 0);
+	ret = sch ? ops->init(sch, opt) : -ENOMEM;
+	if (ret < 0)
+	{
+		fprintf(stderr, "failed to initialize the qdisc: %s\n",
+			strerror(-ret));
+		return 1;
+	}
+
+	/* Replay: dequeue as soon as the qdisc allows, enqueue on arrivals */
+	have_pkt = trace_next(&trace, &pkt);
+	while (have_pkt || sch->q.qlen > 0)
+	{
+		if (have_pkt &&
+		    (sch->q.qlen == 0 || shim_watchdog_ns == 0 ||
+		     pkt.time_ns <= shim_watchdog_ns))
+		{
+			/* Next event: an arrival */
+			shim_now_ns = max_t(s64, shim_now_ns, pkt.time_ns);
+			last_arrival = shim_now_ns;
+			skb = bench_build_skb(&pkt);
+			if (!skb)
+				break;
+
+			c = pkt.dscp % BENCH_MAX_CLASSES;
+			classes[c].pkts_in++;
+			classes[c].bytes_in += skb->len;
+
+			t0 = bench_clock_ns();
+			ret = ops->enqueue(skb, sch);
+			enq_ns += bench_clock_ns() - t0;
+			enq_calls++;
+
+			if (ret == NET_XMIT_CN)
+				throttled++;
+			else if (ret != NET_XMIT_SUCCESS)
+			{
+				classes[c].drops++;
+				drops++;
+			}
+			have_pkt = trace_next(&trace, &pkt);
+		}
+		else if (shim_watchdog_ns)
+		{
+			/* Next event: the watchdog fires, at least 1ns later */
+			shim_now_ns = max_t(s64, shim_watchdog_ns, shim_now_ns + 1);
+			if (++wakeups > BENCH_MAX_WAKEUPS)
+			{
+				fprintf(stderr, "qdisc throttled forever with %u packets\n",
+					sch->q.qlen);
+				break;
+			}
+		}
+		else if (!have_pkt && shim_watchdog_ns == 0)
+		{
+			/* The qdisc holds packets but never asks to be woken up */
+			fprintf(stderr, "qdisc stalled with %u packets\n", sch->q.qlen);
+			break;
+		}
+
+		shim_watchdog_ns = 0;
+		while (sch->q.qlen > 0)
+		{
+			t0 = bench_clock_ns();
+			skb = ops->dequeue(sch);
+			deq_ns += bench_clock_ns() - t0;
+			deq_calls++;
+			if (!skb)
+				break;
+
+			wakeups = 0;
+			c = skb->shim_class % BENCH_MAX_CLASSES;
+			delay = shim_now_ns - skb->shim_arrival_ns;
+			classes[c].pkts_out++;
+			classes[c].bytes_out += skb->len;
+			if (have_pkt)
+				classes[c].bytes_busy += skb->len;
+			classes[c].delay_sum_ns += delay;
+			classes[c].delay_max_ns = max_t(s64, classes[c].delay_max_ns, delay);
+			if (bench_is_marked(skb))
+			{
+				classes[c].marks++;
+				marks++;
+			}
+			flows = skb->shim_mouse ? &mice : &elephants;
+			flows->pkts++;
+			flows->delay_sum_ns += delay;
+			flows->marks += bench_is_marked(skb);
+			pkts_out++;
+			bytes_out += skb->len;
+			kfree_skb(skb);
+		}
+	}
+
+	/* Jain's fairness index over the throughput of classes with traffic */
+	for (i = 0; i < BENCH_MAX_CLASSES; i++)
+	{
+		if (!classes[i].pkts_in)
+			continue;
+		active++;
+		sum += classes[i].bytes_busy;
+		sum_sq += (double)classes[i].bytes_busy * classes[i].bytes_busy;
+	}
+	jain = sum_sq > 0 ? sum * sum / (active * sum_sq) : 0;
+
+	if (csv)
+	{
+		printf("module,packets,dequeued,drops,marks,enqueue_ns_per_pkt,"
+		       "dequeue_ns_per_pkt,goodput_mbps,jain\n");
+		printf("%s,%llu,%llu,%llu,%llu,%.1f,%.1f,%.1f,%.4f\n",
+		       argv[0], enq_calls, pkts_out, drops, marks,
+		       enq_calls ? (double)enq_ns / enq_calls : 0,
+		       pkts_out ? (double)deq_ns / pkts_out : 0,
+		       shim_now_ns ? bytes_out * 8e3 / shim_now_ns : 0, jain);
+	}
+	else
+	{
+		printf("packets %llu dequeued %llu drops %llu throttled %llu marks %llu\n",
+		       enq_calls, pkts_out, drops, throttled, marks);
+		printf("enqueue %.1f ns/pkt, dequeue %.1f ns/pkt (%llu calls)\n",
+		       enq_calls ? (double)enq_ns / enq_calls : 0,
+		       pkts_out ? (double)deq_ns / pkts_out : 0, deq_calls);
+		printf("virtual time %.3f ms, goodput %.1f Mbps, Jain index %.4f\n",
+		       shim_now_ns / 1e6,
+		       shim_now_ns ? bytes_out * 8e3 / shim_now_ns : 0, jain);
+		printf("%5s %10s %10s %8s %8s %12s %12s %12s\n", "dscp", "pkts_in",
+		       "pkts_out", "drops", "marks", "busy_mbps", "avg_delay_us",
+		       "max_delay_us");
+		for (i = 0; i < BENCH_MAX_CLASSES; i++)
+		{
+			if (!classes[i].pkts_in)
+				continue;
+			printf("%5d %10llu %10llu %8llu %8llu %12.1f %12.1f %12.1f\n", i,
+			       classes[i].pkts_in, classes[i].pkts_out,
+			       classes[i].drops, classes[i].marks,
+			       last_arrival ? classes[i].bytes_busy * 8e3 / last_arrival : 0,
+			       classes[i].pkts_out ?
+			       classes[i].delay_sum_ns / 1e3 / classes[i].pkts_out : 0,
+			       classes[i].delay_max_ns / 1e3);
+		}
+		if (mice.pkts)
+		{
+			printf("%9s %10s %8s %12s\n", "flows", "pkts_out", "marks",
+			       "avg_delay_us");
+			printf("%9s %10llu %8llu %12.1f\n", "mice", mice.pkts,
+			       mice.marks, mice.delay_sum_ns / 1e3 / mice.pkts);
+			printf("%9s %10llu %8llu %12.1f\n", "elephants",
+			       elephants.pkts, elephants.marks,
+			       elephants.pkts ?
+			       elephants.delay_sum_ns / 1e3 / elephants.pkts : 0);
+		}
+	}
+
+	ops->destroy(sch);
+	free(sch);
+	kfree_skb(opt_skb);
+	if (shim_module_exit)
+		shim_module_exit();
+	if (trace.fp)
+		fclose(trace.fp);
+
+	return 0;
+}
@@ -0,0 +1,619 @@
+/*
+ * Minimal userspace stand-ins for the kernel APIs used by the MQ-ECN
+ * qdiscs. Only what the schedulers touch is provided, so the unmodified
+ * main.c/params.c of each module can be built and driven from a trace.
+ */
+#ifndef __KSHIM_H__
+#define __KSHIM_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+#include <linux/types.h>
+#include <linux/if_ether.h>
+#include <linux/pkt_sched.h>
+#include <linux/gen_stats.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+
+/* Like the kernel, htons() of a constant must be usable as a case label */
+#undef htons
+#define htons(x) ((__be16)__builtin_bswap16(x))
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef long long s64;
+
+#define __init
+#define __exit
+#define __read_mostly
+#define __percpu
+#define __rcu
+#define __user
+#define __force
+
+#define likely(x)	__builtin_expect(!!(x), 1)
+#define unlikely(x)	__builtin_expect(!!(x), 0)
+
+#define THIS_MODULE	NULL
+#define MODULE_LICENSE(x)
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+#define EXPORT_SYMBOL(x)
+
+/* Each module registers exactly one init/exit pair */
+#define module_init(fn)	int (*shim_module_init)(void) = fn
+#define module_exit(fn)	void (*shim_module_exit)(void) = fn
+
+#define BUILD_BUG_ON(cond) ((void)sizeof(char[1 - 2 * !!(cond)]))
+#define WARN_ON(cond) ({ int __c = !!(cond); if (__c) fprintf(stderr, "WARN_ON %s:%d\n", __FILE__, __LINE__); __c; })
+#define WARN_ON_ONCE(cond) WARN_ON(cond)
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define typecheck(type, x) \
+({	type __dummy; \
+	typeof(x) __dummy2; \
+	(void)(&__dummy == &__dummy2); \
+	1; \
+})
+
+#define min_t(type, x, y) ({ type __x = (x); type __y = (y); __x < __y ? __x : __y; })
+#define max_t(type, x, y) ({ type __x = (x); type __y = (y); __x > __y ? __x : __y; })
+#define min(x, y) ({ typeof(x) _x = (x); typeof(y) _y = (y); (void)(&_x == &_y); _x < _y ? _x : _y; })
+#define max(x, y) ({ typeof(x) _x = (x); typeof(y) _y = (y); (void)(&_x == &_y); _x > _y ? _x : _y; })
+#define clamp_t(type, val, lo, hi) min_t(type, max_t(type, val, lo), hi)
+#define swap(a, b) do { typeof(a) __tmp = (a); (a) = (b); (b) = __tmp; } while (0)
+#define U32_MAX ((u32)~0U)
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define NSEC_PER_SEC	1000000000LL
+#define NSEC_PER_USEC	1000LL
+#define BITS_PER_LONG	(8 * (int)sizeof(long))
+
+static inline u64 div64_u64(u64 a, u64 b) { return a / b; }
+static inline s64 div64_s64(s64 a, s64 b) { return a / b; }
+static inline u64 div_u64(u64 a, u32 b) { return a / b; }
+static inline s64 div_s64(s64 a, s32 b) { return a / b; }
+static inline u32 reciprocal_scale(u32 val, u32 ep_ro)
+{
+	return (u32)(((u64)val * ep_ro) >> 32);
+}
+static inline int fls(unsigned int x) { return x ? 32 - __builtin_clz(x) : 0; }
+static inline int fls64(u64 x) { return x ? 64 - __builtin_clzll(x) : 0; }
+static inline unsigned long __ffs(unsigned long x) { return __builtin_ctzl(x); }
+#define ilog2(n) (fls64(n) - 1)
+#define rounddown_pow_of_two(n) (1UL << ilog2(n))
+#define BIT(nr) (1UL << (nr))
+
+/* printk */
+extern int shim_verbose;
+#define KERN_INFO	""
+#define KERN_WARNING	""
+#define KERN_ERR	""
+#define printk(fmt, ...) \
+	do { if (shim_verbose) printf(fmt, ##__VA_ARGS__); } while (0)
+#define pr_info(fmt, ...) printk(fmt, ##__VA_ARGS__)
+#define net_warn_ratelimited(fmt, ...) printk(fmt, ##__VA_ARGS__)
+
+/* memory */
+typedef unsigned int gfp_t;
+#define GFP_KERNEL	0
+#define GFP_ATOMIC	1
+#define __GFP_NOWARN	0
+static inline void *kmalloc(size_t n, gfp_t f) { (void)f; return malloc(n); }
+static inline void *kzalloc(size_t n, gfp_t f) { (void)f; return calloc(1, n); }
+static inline void *kcalloc(size_t n, size_t s, gfp_t f) { (void)f; return calloc(n, s); }
+static inline void kfree(const void *p) { free((void *)p); }
+#define kvfree kfree
+
+/* per-CPU data: the shim runs on a single CPU */
+#define alloc_percpu(type)		((type *)calloc(1, sizeof(type)))
+#define free_percpu(p)			free(p)
+#define per_cpu_ptr(p, cpu)		((void)(cpu), (p))
+#define this_cpu_ptr(p)			(p)
+#define this_cpu_inc(x)			((x)++)
+#define this_cpu_add(x, v)		((x) += (v))
+#define for_each_possible_cpu(cpu)	for ((cpu) = 0; (cpu) < 1; (cpu)++)
+
+/* RCU: the shim is single threaded */
+#define rcu_read_lock()
+#define rcu_read_unlock()
+#define rcu_read_lock_bh()
+#define rcu_read_unlock_bh()
+#define rcu_dereference(p)		(p)
+#define rcu_dereference_bh(p)		(p)
+#define rcu_dereference_protected(p, c)	(p)
+#define rcu_access_pointer(p)		(p)
+#define rcu_assign_pointer(p, v)	((p) = (v))
+#define RCU_INIT_POINTER(p, v)		((p) = (v))
+#define synchronize_rcu()
+struct rcu_head { void *next; };
+#define kfree_rcu(p, field)		kfree(p)
+
+/* locking */
+typedef struct { int dummy; } spinlock_t;
+#define DEFINE_SPINLOCK(x)	spinlock_t x
+#define spin_lock_init(l)
+#define spin_lock(l)
+#define spin_unlock(l)
+#define spin_lock_bh(l)
+#define spin_unlock_bh(l)
+#define DEFINE_MUTEX(x)		int x __attribute__((unused))
+#define mutex_lock(m)
+#define mutex_unlock(m)
+#define lockdep_is_held(m)	1
+#define READ_ONCE(x)		(x)
+#define WRITE_ONCE(x, v)	((x) = (v))
+
+/* time: a virtual clock driven by the trace replayer */
+typedef union { s64 tv64; } ktime_t;
+extern s64 shim_now_ns;
+static inline s64 ktime_get_ns(void) { return shim_now_ns; }
+static inline ktime_t ktime_get(void) { ktime_t t = { shim_now_ns }; return t; }
+static inline s64 ktime_to_ns(ktime_t t) { return t.tv64; }
+static inline ktime_t ns_to_ktime(s64 ns) { ktime_t t = { ns }; return t; }
+
+/* linked lists */
+struct list_head { struct list_head *next, *prev; };
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+#define LIST_HEAD(name) struct list_head name = LIST_HEAD_INIT(name)
+static inline void INIT_LIST_HEAD(struct list_head *l) { l->next = l; l->prev = l; }
+static inline void __list_add(struct list_head *n, struct list_head *prev,
+			      struct list_head *next)
+{
+	next->prev = n; n->next = next; n->prev = prev; prev->next = n;
+}
+static inline void list_add(struct list_head *n, struct list_head *h) { __list_add(n, h, h->next); }
+static inline void list_add_tail(struct list_head *n, struct list_head *h) { __list_add(n, h->prev, h); }
+static inline void __list_del(struct list_head *prev, struct list_head *next) { next->prev = prev; prev->next = next; }
+static inline void list_del(struct list_head *e) { __list_del(e->prev, e->next); e->next = e->prev = NULL; }
+static inline void list_del_init(struct list_head *e) { __list_del(e->prev, e->next); INIT_LIST_HEAD(e); }
+static inline void list_move_tail(struct list_head *e, struct list_head *h) { __list_del(e->prev, e->next); list_add_tail(e, h); }
+static inline void list_move(struct list_head *e, struct list_head *h) { __list_del(e->prev, e->next); list_add(e, h); }
+static inline int list_empty(const struct list_head *h) { return h->next == h; }
+static inline int list_is_singular(const struct list_head *h) { return !list_empty(h) && h->next == h->prev; }
+static inline int list_is_last(const struct list_head *e, const struct list_head *h) { return e->next == h; }
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member) list_entry((ptr)->next, type, member)
+#define list_next_entry(pos, member) list_entry((pos)->member.next, typeof(*(pos)), member)
+#define list_for_each_entry(pos, head, member) \
+	for (pos = list_first_entry(head, typeof(*pos), member); \
+	     &pos->member != (head); pos = list_next_entry(pos, member))
+#define list_for_each_entry_safe(pos, n, head, member) \
+	for (pos = list_first_entry(head, typeof(*pos), member), \
+	     n = list_next_entry(pos, member); &pos->member != (head); \
+	     pos = n, n = list_next_entry(n, member))
+
+/* sockets: only identity and state matter to the qdiscs */
+struct sock { int sk_state; int local; u16 sk_protocol; };
+static inline bool sk_fullsock(const struct sock *sk) { return sk->local; }
+
+/* sk_buff */
+#define MAX_SKB_FRAGS 17
+struct skb_shared_info {
+	unsigned short gso_size;
+	unsigned short gso_segs;
+	unsigned int gso_type;
+};
+
+struct sk_buff {
+	struct sk_buff		*next;
+	struct sk_buff		*prev;
+	struct sock		*sk;
+	ktime_t			tstamp;
+	char			cb[48] __attribute__((aligned(8)));
+	unsigned int		len;
+	__be16			protocol;
+	__be16			vlan_proto;
+	__u16			vlan_tci;
+	__u16			network_header;
+	unsigned char		*head;
+	unsigned char		*data;
+	unsigned int		tail;
+	unsigned int		end;
+	u32			hash;
+	struct skb_shared_info	shinfo;
+	/* shim only: set by the trace replayer */
+	u64			shim_id;
+	unsigned int		shim_class;
+	bool			shim_mouse;
+	s64			shim_arrival_ns;
+};
+
+/* Allocate an skb with a zeroed linear buffer of size bytes */
+extern struct sk_buff *shim_alloc_skb(unsigned int size);
+
+#define VLAN_TAG_PRESENT	0x1000
+#define VLAN_PRIO_MASK		0xe000
+#define VLAN_PRIO_SHIFT		13
+#define VLAN_VID_MASK		0x0fff
+#define skb_vlan_tag_present(skb)	((skb)->vlan_tci & VLAN_TAG_PRESENT)
+#define skb_vlan_tag_get(skb)		((skb)->vlan_tci & ~VLAN_TAG_PRESENT)
+static inline int vlan_get_tag(const struct sk_buff *skb, u16 *tci)
+{
+	if (!skb_vlan_tag_present(skb))
+		return -EINVAL;
+	*tci = skb_vlan_tag_get(skb);
+	return 0;
+}
+
+static inline struct skb_shared_info *skb_shinfo_fn(const struct sk_buff *skb)
+{
+	return (struct skb_shared_info *)&skb->shinfo;
+}
+#define skb_shinfo(skb) skb_shinfo_fn(skb)
+static inline bool skb_is_gso(const struct sk_buff *skb) { return skb->shinfo.gso_size != 0; }
+static inline unsigned char *skb_network_header(const struct sk_buff *skb) { return skb->head + skb->network_header; }
+static inline unsigned char *skb_tail_pointer(const struct sk_buff *skb) { return skb->head + skb->tail; }
+static inline int skb_network_offset(const struct sk_buff *skb) { return skb_network_header(skb) - skb->data; }
+static inline struct iphdr *ip_hdr(const struct sk_buff *skb) { return (struct iphdr *)skb_network_header(skb); }
+static inline struct ipv6hdr *ipv6_hdr(const struct sk_buff *skb) { return (struct ipv6hdr *)skb_network_header(skb); }
+static inline int skb_make_writable(struct sk_buff *skb, unsigned int len) { (void)skb; (void)len; return 1; }
+static inline int skb_try_make_writable(struct sk_buff *skb, unsigned int len) { (void)skb; (void)len; return 0; }
+static inline bool pskb_network_may_pull(struct sk_buff *skb, unsigned int len)
+{
+	return skb->network_header + len <= skb->tail;
+}
+static inline __be16 tc_skb_protocol(const struct sk_buff *skb) { return skb->protocol; }
+static inline u32 skb_get_hash(struct sk_buff *skb) { return skb->hash; }
+
+extern void shim_free_skb(struct sk_buff *skb);
+static inline void kfree_skb(struct sk_buff *skb) { if (skb) shim_free_skb(skb); }
+static inline void consume_skb(struct sk_buff *skb) { if (skb) shim_free_skb(skb); }
+
+struct sk_buff_head {
+	struct sk_buff	*next;
+	struct sk_buff	*prev;
+	u32		qlen;
+};
+static inline void __skb_queue_head_init(struct sk_buff_head *l)
+{
+	l->next = l->prev = (struct sk_buff *)l;
+	l->qlen = 0;
+}
+#define skb_queue_head_init __skb_queue_head_init
+static inline struct sk_buff *skb_peek(const struct sk_buff_head *l)
+{
+	struct sk_buff *skb = l->next;
+	return skb == (struct sk_buff *)l ? NULL : skb;
+}
+static inline void __skb_queue_tail(struct sk_buff_head *l, struct sk_buff *skb)
+{
+	struct sk_buff *prev = l->prev;
+	skb->next = (struct sk_buff *)l;
+	skb->prev = prev;
+	prev->next = skb;
+	l->prev = skb;
+	l->qlen++;
+}
+static inline void __skb_unlink(struct sk_buff *skb, struct sk_buff_head *l)
+{
+	l->qlen--;
+	skb->next->prev = skb->prev;
+	skb->prev->next = skb->next;
+	skb->next = skb->prev = NULL;
+}
+static inline struct sk_buff *__skb_dequeue(struct sk_buff_head *l)
+{
+	struct sk_buff *skb = skb_peek(l);
+	if (skb)
+		__skb_unlink(skb, l);
+	return skb;
+}
+static inline u32 skb_queue_len(const struct sk_buff_head *l) { return l->qlen; }
+static inline int skb_queue_empty(const struct sk_buff_head *l) { return l->next == (struct sk_buff *)l; }
+static inline void __skb_queue_purge(struct sk_buff_head *l)
+{
+	struct sk_buff *skb;
+	while ((skb = __skb_dequeue(l)) != NULL)
+		kfree_skb(skb);
+}
+
+/* GSO: segments are produced by the trace replayer */
+typedef u64 netdev_features_t;
+#define NETIF_F_GSO_MASK	0xffff0000ULL
+#define IS_ERR_OR_NULL(p)	(!(p) || (unsigned long)(p) >= (unsigned long)-4095)
+#define IS_ERR(p)		((unsigned long)(p) >= (unsigned long)-4095)
+static inline netdev_features_t netif_skb_features(struct sk_buff *skb) { (void)skb; return 0; }
+extern struct sk_buff *shim_gso_segment(struct sk_buff *skb);
+#define skb_gso_segment(skb, features) ((void)(features), shim_gso_segment(skb))
+
+#ifndef __constant_htons
+#define __constant_htons(x) ((__be16)__builtin_bswap16(x))
+#endif
+
+/* ECN and DS field helpers */
+#define INET_ECN_NOT_ECT	0
+#define INET_ECN_ECT_1		1
+#define INET_ECN_ECT_0		2
+#define INET_ECN_CE		3
+#define INET_ECN_MASK		3
+
+static inline __u8 ipv4_get_dsfield(const struct iphdr *iph) { return iph->tos; }
+static inline __u8 ipv6_get_dsfield(const struct ipv6hdr *ipv6h)
+{
+	return ntohs(*(const __be16 *)ipv6h) >> 4;
+}
+static inline int IP_ECN_set_ce(struct iphdr *iph)
+{
+	if (!((iph->tos + 1) & INET_ECN_ECT_0))
+		return !(iph->tos & INET_ECN_MASK) ? 0 : 1;
+	iph->tos |= INET_ECN_CE;
+	return 1;
+}
+static inline int IP6_ECN_set_ce(struct sk_buff *skb, struct ipv6hdr *iph)
+{
+	__be32 *p = (__be32 *)iph;
+	u32 from = ntohl(*p);
+	(void)skb;
+	if (!((from >> 20) & INET_ECN_MASK))
+		return 0;
+	*p = htonl(from | (INET_ECN_CE << 20));
+	return 1;
+}
+static inline int INET_ECN_set_ce(struct sk_buff *skb)
+{
+	switch (skb->protocol) {
+	case __constant_htons(ETH_P_IP):
+		if (skb_network_header(skb) + sizeof(struct iphdr) <= skb_tail_pointer(skb))
+			return IP_ECN_set_ce(ip_hdr(skb));
+		break;
+	case __constant_htons(ETH_P_IPV6):
+		if (skb_network_header(skb) + sizeof(struct ipv6hdr) <= skb_tail_pointer(skb))
+			return IP6_ECN_set_ce(skb, ipv6_hdr(skb));
+		break;
+	}
+	return 0;
+}
+
+/* netlink attributes */
+#define NLA_UNSPEC	0
+#define NLA_U8		1
+#define NLA_U16		2
+#define NLA_U32		3
+#define NLA_U64		4
+#define NLA_STRING	5
+#define NLA_FLAG	6
+#define NLA_MSECS	7
+#define NLA_NESTED	8
+#define NLA_BINARY	11
+struct nla_policy { u16 type; u16 len; };
+static inline void *nla_data(const struct nlattr *nla) { return (char *)nla + NLA_HDRLEN; }
+static inline int nla_len(const struct nlattr *nla) { return nla->nla_len - NLA_HDRLEN; }
+static inline int nla_type(const struct nlattr *nla) { return nla->nla_type & NLA_TYPE_MASK; }
+static inline u32 nla_get_u32(const struct nlattr *nla) { return *(u32 *)nla_data(nla); }
+static inline u64 nla_get_u64(const struct nlattr *nla) { u64 v; memcpy(&v, nla_data(nla), sizeof(v)); return v; }
+#define nla_for_each_attr(pos, head, len, rem) \
+	for (pos = head, rem = len; \
+	     rem >= (int)sizeof(*pos) && pos->nla_len >= sizeof(*pos) && pos->nla_len <= rem; \
+	     rem -= NLA_ALIGN(pos->nla_len), \
+	     pos = (struct nlattr *)((char *)pos + NLA_ALIGN(pos->nla_len)))
+#define nla_for_each_nested(pos, nla, rem) \
+	nla_for_each_attr(pos, (struct nlattr *)nla_data(nla), nla_len(nla), rem)
+extern int nla_parse_nested(struct nlattr **tb, int maxtype,
+			    const struct nlattr *nla,
+			    const struct nla_policy *policy);
+extern struct nlattr *nla_nest_start(struct sk_buff *skb, int attrtype);
+extern int nla_nest_end(struct sk_buff *skb, struct nlattr *start);
+extern void nla_nest_cancel(struct sk_buff *skb, struct nlattr *start);
+extern int nla_put(struct sk_buff *skb, int attrtype, int attrlen, const void *data);
+static inline int nla_put_u32(struct sk_buff *skb, int t, u32 v) { return nla_put(skb, t, sizeof(v), &v); }
+static inline int nla_put_u64(struct sk_buff *skb, int t, u64 v) { return nla_put(skb, t, sizeof(v), &v); }
+#define nla_put_u64_64bit(skb, t, v, pad) nla_put_u64(skb, t, v)
+
+/* lib/string.c */
+static inline size_t shim_strlcpy(char *dest, const char *src, size_t size)
+{
+	size_t len = strlen(src);
+
+	if (size)
+	{
+		size_t n = len >= size ? size - 1 : len;
+
+		memcpy(dest, src, n);
+		dest[n] = '\0';
+	}
+	return len;
+}
+#define strlcpy shim_strlcpy
+
+/* sysctl */
+struct ctl_table;
+typedef int proc_handler(struct ctl_table *ctl, int write, void *buffer,
+			 size_t *lenp, loff_t *ppos);
+struct ctl_table {
+	const char	*procname;
+	void		*data;
+	int		maxlen;
+	unsigned short	mode;
+	proc_handler	*proc_handler;
+	void		*extra1;
+	void		*extra2;
+};
+struct ctl_path { const char *procname; };
+struct ctl_table_header { struct ctl_table *table; };
+extern proc_handler proc_dointvec;
+extern proc_handler proc_dointvec_minmax;
+extern struct ctl_table_header *register_sysctl_paths(const struct ctl_path *path,
+						      struct ctl_table *table);
+extern void unregister_sysctl_table(struct ctl_table_header *header);
+
+/* Qdisc */
+#define NET_XMIT_SUCCESS	0x00
+#define NET_XMIT_DROP		0x01
+#define NET_XMIT_CN		0x02
+#define NET_XMIT_POLICED	0x03
+#define NET_XMIT_MASK		0x0f
+#define __NET_XMIT_STOLEN	0x00010000
+#define __NET_XMIT_BYPASS	0x00020000
+#define net_xmit_drop_count(e)	((e) & __NET_XMIT_STOLEN ? 0 : 1)
+#define net_xmit_eval(e)	((e) == NET_XMIT_CN ? 0 : (e))
+#define TC_H_ROOT		(0xFFFFFFFFU)
+#define TC_RTAB_SIZE		1024
+#define QDISC_CB_PRIV_LEN	20
+
+struct qdisc_skb_cb {
+	unsigned int		pkt_len;
+	u16			slave_dev_queue_mapping;
+	u16			tc_classid;
+	unsigned char		data[QDISC_CB_PRIV_LEN];
+};
+static inline struct qdisc_skb_cb *qdisc_skb_cb(const struct sk_buff *skb)
+{
+	return (struct qdisc_skb_cb *)skb->cb;
+}
+static inline void qdisc_cb_private_validate(const struct sk_buff *skb, int sz)
+{
+	(void)skb;
+	BUILD_BUG_ON(sizeof(((struct sk_buff *)0)->cb) <
+		     sizeof(struct qdisc_skb_cb));
+	if (sz > QDISC_CB_PRIV_LEN)
+		abort();
+}
+static inline unsigned int qdisc_pkt_len(const struct sk_buff *skb)
+{
+	return qdisc_skb_cb(skb)->pkt_len;
+}
+
+struct net_device { char name[16]; };
+struct netdev_queue { struct net_device *dev; };
+struct gnet_dump { void *app; int app_len; };
+extern int gnet_stats_copy_app(struct gnet_dump *d, void *st, int len);
+
+struct Qdisc;
+struct Qdisc_ops {
+	struct Qdisc_ops	*next;
+	const void		*cl_ops;
+	char			id[16];
+	int			priv_size;
+	int			(*enqueue)(struct sk_buff *skb, struct Qdisc *sch);
+	struct sk_buff		*(*dequeue)(struct Qdisc *);
+	struct sk_buff		*(*peek)(struct Qdisc *);
+	unsigned int		(*drop)(struct Qdisc *);
+	int			(*init)(struct Qdisc *sch, struct nlattr *arg);
+	void			(*reset)(struct Qdisc *);
+	void			(*destroy)(struct Qdisc *);
+	int			(*change)(struct Qdisc *sch, struct nlattr *arg);
+	int			(*dump)(struct Qdisc *, struct sk_buff *);
+	int			(*dump_stats)(struct Qdisc *, struct gnet_dump *);
+	void			*owner;
+};
+
+struct Qdisc {
+	const struct Qdisc_ops	*ops;
+	u32			parent;
+	u32			limit;
+	struct netdev_queue	*dev_queue;
+	struct sk_buff		*gso_skb;
+	struct sk_buff_head	q;
+	struct gnet_stats_basic	bstats;
+	struct gnet_stats_queue	qstats;
+	long			privdata[] __attribute__((aligned(64)));
+};
+static inline void *qdisc_priv(struct Qdisc *q) { return q->privdata; }
+static inline int qdisc_enqueue(struct sk_buff *skb, struct Qdisc *sch)
+{
+	return sch->ops->enqueue(skb, sch);
+}
+static inline struct sk_buff *qdisc_peek_dequeued(struct Qdisc *sch)
+{
+	if (!sch->gso_skb)
+		sch->gso_skb = sch->ops->dequeue(sch);
+	return sch->gso_skb;
+}
+static inline struct sk_buff *qdisc_dequeue_peeked(struct Qdisc *sch)
+{
+	struct sk_buff *skb = sch->gso_skb;
+
+	if (skb)
+		sch->gso_skb = NULL;
+	else
+		skb = sch->ops->dequeue(sch);
+	return skb;
+}
+static inline void qdisc_qstats_drop(struct Qdisc *sch) { sch->qstats.drops++; }
+static inline void qdisc_qstats_overlimit(struct Qdisc *sch) { sch->qstats.overlimits++; }
+static inline void qdisc_qstats_backlog_inc(struct Qdisc *sch, const struct sk_buff *skb) { sch->qstats.backlog += skb->len; }
+static inline void qdisc_qstats_backlog_dec(struct Qdisc *sch, const struct sk_buff *skb) { sch->qstats.backlog -= skb->len; }
+static inline void qdisc_bstats_update(struct Qdisc *sch, const struct sk_buff *skb)
+{
+	sch->bstats.bytes += skb->len;
+	sch->bstats.packets++;
+}
+static inline void qdisc_unthrottled(struct Qdisc *sch) { (void)sch; }
+static inline void qdisc_throttled(struct Qdisc *sch) { (void)sch; }
+static inline void sch_tree_lock(const struct Qdisc *sch) { (void)sch; }
+static inline void sch_tree_unlock(const struct Qdisc *sch) { (void)sch; }
+static inline void qdisc_tree_reduce_backlog(struct Qdisc *sch, int n, int len) { (void)sch; (void)n; (void)len; }
+static inline int qdisc_reshape_fail(struct sk_buff *skb, struct Qdisc *sch)
+{
+	qdisc_qstats_drop(sch);
+	kfree_skb(skb);
+	return NET_XMIT_DROP;
+}
+static inline int qdisc_drop(struct sk_buff *skb, struct Qdisc *sch)
+{
+	kfree_skb(skb);
+	qdisc_qstats_drop(sch);
+	return NET_XMIT_DROP;
+}
+static inline void qdisc_warn_nonwc(const char *txt, struct Qdisc *qdisc) { (void)txt; (void)qdisc; }
+extern struct Qdisc_ops bfifo_qdisc_ops;
+extern struct Qdisc_ops pfifo_qdisc_ops;
+extern struct Qdisc *fifo_create_dflt(struct Qdisc *sch, struct Qdisc_ops *ops,
+				      unsigned int limit);
+extern void qdisc_destroy(struct Qdisc *sch);
+extern int register_qdisc(struct Qdisc_ops *ops);
+extern int unregister_qdisc(struct Qdisc_ops *ops);
+
+/* The latest time the root qdisc asked to be dequeued again, 0 if none */
+extern s64 shim_watchdog_ns;
+
+struct qdisc_watchdog {
+	struct Qdisc	*qdisc;
+	s64		expires;
+	bool		armed;
+};
+static inline void qdisc_watchdog_init(struct qdisc_watchdog *wd, struct Qdisc *sch)
+{
+	wd->qdisc = sch;
+	wd->expires = 0;
+	wd->armed = false;
+}
+static inline void qdisc_watchdog_schedule_ns(struct qdisc_watchdog *wd, u64 expires,
+					      bool throttle)
+{
+	(void)throttle;
+	wd->expires = expires;
+	wd->armed = true;
+	shim_watchdog_ns = expires;
+}
+static inline void qdisc_watchdog_cancel(struct qdisc_watchdog *wd)
+{
+	wd->armed = false;
+	shim_watchdog_ns = 0;
+}
+
+/* Driver side: the module under test and the qdiscs built from it */
+extern int (*shim_module_init)(void);
+extern void (*shim_module_exit)(void);
+extern struct Qdisc_ops *shim_registered_ops(void);
+extern struct Qdisc *shim_qdisc_alloc(const struct Qdisc_ops *ops,
+				      struct Qdisc *parent, u32 limit);
+
+#endif
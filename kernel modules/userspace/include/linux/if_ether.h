@@ -0,0 +1,3 @@
+/* userspace shim: uapi definitions plus kernel-only helpers */
+#include_next <linux/if_ether.h>
+#include <kshim.h>
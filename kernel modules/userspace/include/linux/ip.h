@@ -0,0 +1,3 @@
+/* userspace shim: uapi definitions plus kernel-only helpers */
+#include_next <linux/ip.h>
+#include <kshim.h>
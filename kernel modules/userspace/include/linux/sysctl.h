@@ -0,0 +1,2 @@
+/* userspace shim */
+#include <kshim.h>
@@ -0,0 +1,369 @@
+/*
+ * Userspace implementations of the kernel services declared in kshim.h:
+ * skb allocation, GSO segmentation, netlink attributes, sysctl tables,
+ * byte/packet FIFOs and qdisc registration.
+ */
+#include <kshim.h>
+
+int shim_verbose = 0;
+s64 shim_now_ns = 0;
+s64 shim_watchdog_ns = 0;
+
+static struct Qdisc_ops *shim_ops = NULL;
+
+struct sk_buff *shim_alloc_skb(unsigned int size)
+{
+	struct sk_buff *skb = calloc(1, sizeof(*skb));
+
+	if (!skb)
+		return NULL;
+
+	skb->head = calloc(1, size ? size : 1);
+	if (!skb->head)
+	{
+		free(skb);
+		return NULL;
+	}
+
+	skb->data = skb->head;
+	skb->end = size;
+	return skb;
+}
+
+void shim_free_skb(struct sk_buff *skb)
+{
+	free(skb->head);
+	free(skb);
+}
+
+/*
+ * Split a GSO packet into gso_segs packets. The linear buffer only holds
+ * headers, so each segment gets a copy of them and its share of the payload.
+ */
+struct sk_buff *shim_gso_segment(struct sk_buff *skb)
+{
+	struct sk_buff *segs = NULL, **tail = &segs, *nskb;
+	unsigned int hdr_len = skb->tail - skb->network_header;
+	unsigned int payload = skb->len - hdr_len;
+	unsigned int seg;
+
+	if (!skb_is_gso(skb))
+		return NULL;
+
+	while (payload > 0)
+	{
+		seg = min_t(unsigned int, payload, skb->shinfo.gso_size);
+		nskb = shim_alloc_skb(skb->end);
+		if (!nskb)
+			break;
+
+		memcpy(nskb->head, skb->head, skb->end);
+		memcpy(nskb->cb, skb->cb, sizeof(skb->cb));
+		nskb->data = nskb->head + (skb->data - skb->head);
+		nskb->tail = skb->tail;
+		nskb->network_header = skb->network_header;
+		nskb->protocol = skb->protocol;
+		nskb->vlan_proto = skb->vlan_proto;
+		nskb->vlan_tci = skb->vlan_tci;
+		nskb->sk = skb->sk;
+		nskb->hash = skb->hash;
+		nskb->shim_id = skb->shim_id;
+		nskb->shim_class = skb->shim_class;
+		nskb->shim_mouse = skb->shim_mouse;
+		nskb->shim_arrival_ns = skb->shim_arrival_ns;
+		nskb->len = hdr_len + seg;
+
+		*tail = nskb;
+		tail = &nskb->next;
+		payload -= seg;
+	}
+
+	return segs;
+}
+
+/* netlink */
+int nla_parse_nested(struct nlattr **tb, int maxtype,
+		     const struct nlattr *nla,
+		     const struct nla_policy *policy)
+{
+	const struct nlattr *pos;
+	int rem, type;
+
+	memset(tb, 0, sizeof(struct nlattr *) * (maxtype + 1));
+	if (!nla)
+		return 0;
+
+	nla_for_each_nested(pos, nla, rem)
+	{
+		type = nla_type(pos);
+		if (type <= 0 || type > maxtype)
+			continue;
+
+		if (policy)
+		{
+			const struct nla_policy *pt = &policy[type];
+
+			if (pt->type == NLA_BINARY && pt->len && nla_len(pos) > pt->len)
+				return -ERANGE;
+			if (pt->type == NLA_U32 && nla_len(pos) < (int)sizeof(u32))
+				return -ERANGE;
+			if (pt->type == NLA_U64 && nla_len(pos) < (int)sizeof(u64))
+				return -ERANGE;
+			if (pt->type == NLA_UNSPEC && nla_len(pos) < pt->len)
+				return -ERANGE;
+		}
+		tb[type] = (struct nlattr *)pos;
+	}
+
+	if (rem > 0)
+		fprintf(stderr, "netlink: %d bytes leftover after parsing attributes\n", rem);
+
+	return 0;
+}
+
+int nla_put(struct sk_buff *skb, int attrtype, int attrlen, const void *data)
+{
+	struct nlattr *nla;
+	unsigned int size = NLA_ALIGN(NLA_HDRLEN + attrlen);
+
+	if (skb->tail + size > skb->end)
+		return -EMSGSIZE;
+
+	nla = (struct nlattr *)skb_tail_pointer(skb);
+	nla->nla_type = attrtype;
+	nla->nla_len = NLA_HDRLEN + attrlen;
+	memset((char *)nla + NLA_HDRLEN, 0, size - NLA_HDRLEN);
+	if (data)
+		memcpy(nla_data(nla), data, attrlen);
+
+	skb->tail += size;
+	skb->len += size;
+	return 0;
+}
+
+struct nlattr *nla_nest_start(struct sk_buff *skb, int attrtype)
+{
+	struct nlattr *start = (struct nlattr *)skb_tail_pointer(skb);
+
+	if (nla_put(skb, attrtype, 0, NULL) < 0)
+		return NULL;
+
+	return start;
+}
+
+int nla_nest_end(struct sk_buff *skb, struct nlattr *start)
+{
+	start->nla_len = skb_tail_pointer(skb) - (unsigned char *)start;
+	return skb->len;
+}
+
+void nla_nest_cancel(struct sk_buff *skb, struct nlattr *start)
+{
+	unsigned int removed = skb_tail_pointer(skb) - (unsigned char *)start;
+
+	skb->tail -= removed;
+	skb->len -= removed;
+}
+
+/* sysctl */
+#define SHIM_MAX_SYSCTL_TABLES 4
+static struct ctl_table_header shim_sysctl[SHIM_MAX_SYSCTL_TABLES];
+
+static int shim_proc_write(struct ctl_table *ctl, void *buffer, size_t *lenp,
+			   bool minmax)
+{
+	char *end;
+	long v = strtol(buffer, &end, 10);
+
+	if (end == buffer || ctl->maxlen != sizeof(int))
+		return -EINVAL;
+
+	if (minmax)
+	{
+		if (ctl->extra1 && v < *(int *)ctl->extra1)
+			return -EINVAL;
+		if (ctl->extra2 && v > *(int *)ctl->extra2)
+			return -EINVAL;
+	}
+
+	*(int *)ctl->data = (int)v;
+	*lenp = end - (char *)buffer;
+	return 0;
+}
+
+int proc_dointvec(struct ctl_table *ctl, int write, void *buffer,
+		  size_t *lenp, loff_t *ppos)
+{
+	(void)ppos;
+	if (!write)
+	{
+		*lenp = snprintf(buffer, *lenp, "%d\n", *(int *)ctl->data);
+		return 0;
+	}
+	return shim_proc_write(ctl, buffer, lenp, false);
+}
+
+int proc_dointvec_minmax(struct ctl_table *ctl, int write, void *buffer,
+			 size_t *lenp, loff_t *ppos)
+{
+	(void)ppos;
+	if (!write)
+		return proc_dointvec(ctl, write, buffer, lenp, ppos);
+	return shim_proc_write(ctl, buffer, lenp, true);
+}
+
+struct ctl_table_header *register_sysctl_paths(const struct ctl_path *path,
+					       struct ctl_table *table)
+{
+	int i;
+
+	(void)path;
+	for (i = 0; i < SHIM_MAX_SYSCTL_TABLES; i++)
+	{
+		if (!shim_sysctl[i].table)
+		{
+			shim_sysctl[i].table = table;
+			return &shim_sysctl[i];
+		}
+	}
+
+	return NULL;
+}
+
+void unregister_sysctl_table(struct ctl_table_header *header)
+{
+	header->table = NULL;
+}
+
+int gnet_stats_copy_app(struct gnet_dump *d, void *st, int len)
+{
+	d->app = st;
+	d->app_len = len;
+	return 0;
+}
+
+/* Byte and packet FIFOs (sch_fifo.c) */
+static int bfifo_enqueue(struct sk_buff *skb, struct Qdisc *sch)
+{
+	if (likely(sch->qstats.backlog + skb->len <= sch->limit))
+	{
+		__skb_queue_tail(&sch->q, skb);
+		qdisc_qstats_backlog_inc(sch, skb);
+		return NET_XMIT_SUCCESS;
+	}
+
+	return qdisc_drop(skb, sch);
+}
+
+static int pfifo_enqueue(struct sk_buff *skb, struct Qdisc *sch)
+{
+	if (likely(skb_queue_len(&sch->q) < sch->limit))
+	{
+		__skb_queue_tail(&sch->q, skb);
+		qdisc_qstats_backlog_inc(sch, skb);
+		return NET_XMIT_SUCCESS;
+	}
+
+	return qdisc_drop(skb, sch);
+}
+
+static struct sk_buff *fifo_dequeue(struct Qdisc *sch)
+{
+	struct sk_buff *skb = __skb_dequeue(&sch->q);
+
+	if (likely(skb))
+	{
+		qdisc_qstats_backlog_dec(sch, skb);
+		qdisc_bstats_update(sch, skb);
+	}
+
+	return skb;
+}
+
+static struct sk_buff *fifo_peek(struct Qdisc *sch)
+{
+	return skb_peek(&sch->q);
+}
+
+static void fifo_reset(struct Qdisc *sch)
+{
+	__skb_queue_purge(&sch->q);
+	sch->qstats.backlog = 0;
+}
+
+struct Qdisc_ops bfifo_qdisc_ops = {
+	.id		=	"bfifo",
+	.enqueue	=	bfifo_enqueue,
+	.dequeue	=	fifo_dequeue,
+	.peek		=	fifo_peek,
+	.reset		=	fifo_reset,
+};
+
+struct Qdisc_ops pfifo_qdisc_ops = {
+	.id		=	"pfifo",
+	.enqueue	=	pfifo_enqueue,
+	.dequeue	=	fifo_dequeue,
+	.peek		=	fifo_peek,
+	.reset		=	fifo_reset,
+};
+
+struct Qdisc *shim_qdisc_alloc(const struct Qdisc_ops *ops,
+			       struct Qdisc *parent, u32 limit)
+{
+	static struct net_device dev = { .name = "shim0" };
+	static struct netdev_queue dev_queue = { .dev = &dev };
+	struct Qdisc *sch = calloc(1, sizeof(*sch) + ops->priv_size);
+
+	if (!sch)
+		return NULL;
+
+	sch->ops = ops;
+	sch->parent = parent ? 1 : TC_H_ROOT;
+	sch->limit = limit;
+	sch->dev_queue = &dev_queue;
+	__skb_queue_head_init(&sch->q);
+	return sch;
+}
+
+struct Qdisc *fifo_create_dflt(struct Qdisc *sch, struct Qdisc_ops *ops,
+			       unsigned int limit)
+{
+	return shim_qdisc_alloc(ops, sch, limit);
+}
+
+void qdisc_destroy(struct Qdisc *sch)
+{
+	if (!sch)
+		return;
+
+	if (sch->gso_skb)
+		kfree_skb(sch->gso_skb);
+	if (sch->ops->reset)
+		sch->ops->reset(sch);
+	if (sch->ops->destroy)
+		sch->ops->destroy(sch);
+	free(sch);
+}
+
+int register_qdisc(struct Qdisc_ops *ops)
+{
+	if (shim_ops)
+		return -EEXIST;
+
+	shim_ops = ops;
+	return 0;
+}
+
+int unregister_qdisc(struct Qdisc_ops *ops)
+{
+	if (shim_ops != ops)
+		return -ENOENT;
+
+	shim_ops = NULL;
+	return 0;
+}
+
+struct Qdisc_ops *shim_registered_ops(void)
+{
+	return shim_ops;
+}